@@ -0,0 +1,87 @@
+#include "agg.h"
+#include <string.h>
+#include <stdint.h>
+
+
+static size_t
+prefix_len(size_t len)
+{
+    if (len < 0x80) return 1;
+    if (len < 0x4000) return 2;
+    return 3;
+}
+
+
+static void
+put_prefix(uint8_t *o, size_t len, size_t n)
+{
+    switch(n) {
+    case 1:
+        o[0] = len;
+        break;
+    case 2:
+        o[0] = 0x80 | len >> 8;
+        o[1] = len;
+        break;
+    default:
+        o[0] = 0xc0 | len >> 16;
+        o[1] = len >> 8;
+        o[2] = len;
+        break;
+    }
+}
+
+
+int
+agg_start(struct pbuf *p)
+{
+    size_t len = p->len, n = prefix_len(len);
+
+    if (pbuf_prepend(p, n) == NULL) return -1;
+    put_prefix((uint8_t *)p->data, len, n);
+    return 0;
+}
+
+
+int
+agg_add(struct pbuf *agg, const struct pbuf *p, size_t limit)
+{
+    size_t n = prefix_len(p->len);
+    char *o;
+
+    if (agg->len + n + p->len > limit) return -1;
+    if ((o = pbuf_append(agg, n + p->len)) == NULL) return -1;
+    put_prefix((uint8_t *)o, p->len, n);
+    memcpy(o + n, p->data, p->len);
+    return 0;
+}
+
+
+int
+agg_next(const char **pos, const char *end, const char **data, size_t *len)
+{
+    const uint8_t *p = (const uint8_t *)*pos;
+    size_t n;
+
+    if (*pos >= end) return 0;
+
+    if (p[0] < 0x80) {
+        n = 1;
+        *len = p[0];
+    } else if (p[0] < 0xc0) {
+        n = 2;
+        if (end - *pos < n) return -1;
+        *len = (p[0] & 0x3f) << 8 | p[1];
+    } else if (p[0] < 0xe0) {
+        n = 3;
+        if (end - *pos < n) return -1;
+        *len = (p[0] & 0x1f) << 16 | p[1] << 8 | p[2];
+    } else {
+        return -1;
+    }
+
+    if (*len > end - *pos - n) return -1;
+    *data = *pos + n;
+    *pos = *data + *len;
+    return 1;
+}
@@ -0,0 +1,37 @@
+#ifndef _AGG_H_
+#define _AGG_H_
+
+#include <stdlib.h>
+
+#include "pbuf.h"
+
+/* Packet aggregation. Several compressed packets go over the link in
+ * one frame (a superframe) and share its flags, FCS and ARQ and FEC
+ * headers. Every packet in a frame has its length in front:
+ *
+ *   0xxxxxxx                       Up to 127 bytes
+ *   10xxxxxx xxxxxxxx              Up to 16383 bytes
+ *   110xxxxx xxxxxxxx xxxxxxxx     Up to 2^21 - 1 bytes
+ *
+ * A frame with a single packet is a superframe too, both ends of a link
+ * must enable aggregation. */
+
+/* The most bytes the length of a packet takes */
+#define AGG_MAX_PREFIX 3
+
+/* Start a superframe with the packet in p. Returns 0 on success and -1
+ * if there is not enough headroom. */
+int agg_start(struct pbuf *p);
+
+/* Add the packet in p to the superframe in agg, unless the superframe
+ * would grow beyond limit bytes. Returns 0 if the packet was added and
+ * -1 if it was not. */
+int agg_add(struct pbuf *agg, const struct pbuf *p, size_t limit);
+
+/* Take the next packet from a received superframe at *pos, which ends
+ * at end. The packet is stored in *data and *len, *pos is advanced.
+ * Returns 1 if a packet was found, 0 at the end of the superframe and
+ * -1 if the superframe is malformed. */
+int agg_next(const char **pos, const char *end, const char **data, size_t *len);
+
+#endif /* _AGG_H_ */
@@ -0,0 +1,568 @@
+#include "arq.h"
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "utils.h"
+#include "hdlc.h"
+#include "handover.h"
+
+#define DATA 0x80
+#define ACK  0x40
+#define SACK 0x20
+#define BASE 0x10
+#define SYN  0x08
+
+/* The longest header: flags, sequence number, ACK, SACK, BASE and SYN */
+#define FCS_LEN 2
+#define HDR_MAX (ARQ_MAX_OVERHEAD - FCS_LEN)
+
+#define MASK    (ARQ_MAX_WINDOW - 1)
+
+/* Times in nanoseconds. The retransmission timeout starts at one
+ * second as in RFC 6298 and doubles with every attempt. The peer may
+ * hold an acknowledgement back for ACK_DELAY, the timeout leaves room
+ * for that on top of the variation of the round-trip time, which is at
+ * least CLOCK_G. */
+#define ACK_DELAY   5000000ULL
+#define CLOCK_G     1000000ULL
+#define INITIAL_RTO 1000000000ULL
+#define MIN_RTO     20000000ULL
+#define MAX_RTO     60000000000ULL
+#define MAX_TRIES   6
+
+struct txslot {
+    struct pbuf *p;     /* NULL once acknowledged or given up on */
+    uint64_t sent;
+    uint8_t  hlen;      /* Header in front of the payload        */
+    uint8_t  tries;
+    uint8_t  lost;      /* A frame sent later got through        */
+};
+
+struct rxslot {
+    struct pbuf *p;
+    uint8_t  seq;
+};
+
+struct arq {
+    int      window;
+    struct stats *stats;
+
+    /* Sender: frames una up to (but not including) nxt are in flight */
+    uint8_t  una;
+    uint8_t  nxt;
+    uint8_t  epoch;
+    int      syn;       /* Send SYN until the peer acknowledges      */
+    int      heard;     /* The peer sent data, control frames go
+                         * without SYN                                */
+    int      skip;      /* Send BASE until the peer acknowledges     */
+    uint64_t ctl_due;   /* When to send BASE in a frame of its own   */
+    uint64_t srtt;      /* Zero until the first sample               */
+    uint64_t rttvar;
+    uint64_t rto;
+    struct txslot tx[ARQ_MAX_WINDOW];
+
+    /* Receiver: rcv_nxt is expected next, the frames received behind a
+     * gap wait in rx. Frames before rcv_base are not coming anymore. */
+    uint8_t  rcv_nxt;
+    uint8_t  rcv_base;
+    uint8_t  peer;      /* SYN number of the peer                    */
+    int      synced;
+    int      ack_owed;
+    uint64_t ack_due;
+    struct rxslot rx[ARQ_MAX_WINDOW];
+};
+
+
+/* Distance from a to b in sequence number space */
+static inline uint8_t
+dist(uint8_t a, uint8_t b)
+{
+    return b - a;
+}
+
+
+struct arq *
+arq_new(int window, struct stats *stats)
+{
+    struct arq *a;
+
+    a = xcalloc(1, sizeof(*a));
+    a->window = window < 1 ? 1 : window > ARQ_MAX_WINDOW ? ARQ_MAX_WINDOW : window;
+    a->stats = stats;
+    a->rto = INITIAL_RTO;
+    a->epoch = (now_ns() ^ getpid()) % 255 + 1;
+    a->syn = 1;
+    return a;
+}
+
+
+void
+arq_free(struct arq *a)
+{
+    int i;
+
+    if (a == NULL) return;
+    for(i = 0; i < ARQ_MAX_WINDOW; i++) {
+        if (a->tx[i].p) pbuf_free(a->tx[i].p);
+        if (a->rx[i].p) pbuf_free(a->rx[i].p);
+    }
+    xfree(a);
+}
+
+
+/* Frames received behind the gap at rcv_nxt */
+static uint32_t
+sack_bits(const struct arq *a)
+{
+    const struct rxslot *s;
+    uint32_t bits = 0;
+    uint8_t seq;
+    int i;
+
+    for(i = 0; i < ARQ_MAX_WINDOW - 1; i++) {
+        seq = a->rcv_nxt + 1 + i;
+        s = &a->rx[seq & MASK];
+        if (s->p && s->seq == seq) bits |= 0x80000000U >> i;
+    }
+    return bits;
+}
+
+
+/* Write the header of the frame with sequence number seq, or of a frame
+ * without payload if seq is negative, into hdr. Returns its length. A
+ * side that only receives never gets an acknowledgement, its control
+ * frames stop carrying SYN once the peer has sent data. */
+static size_t
+header(struct arq *a, uint8_t *hdr, int seq)
+{
+    uint32_t sack;
+    size_t n = 1;
+    int syn = a->syn && (seq >= 0 || !a->heard);
+
+    hdr[0] = 0;
+    if (seq >= 0) {
+        hdr[0] |= DATA;
+        hdr[n++] = seq;
+    }
+    if (a->ack_owed || seq < 0) {
+        hdr[0] |= ACK;
+        hdr[n++] = a->rcv_nxt;
+        if ((sack = sack_bits(a)) != 0) {
+            hdr[0] |= SACK;
+            hdr[n++] = sack >> 24;
+            hdr[n++] = sack >> 16;
+            hdr[n++] = sack >> 8;
+            hdr[n++] = sack;
+        }
+        a->ack_owed = 0;
+    }
+    if (a->skip || syn) {
+        hdr[0] |= BASE;
+        hdr[n++] = a->una;
+    }
+    if (syn) {
+        hdr[0] |= SYN;
+        hdr[n++] = a->epoch;
+    }
+    return n;
+}
+
+
+static void
+put_fcs(uint8_t *end, const void *data, size_t len)
+{
+    uint16_t fcs = ~hdlc_fcs16(HDLC_FCS_INIT, data, len);
+
+    end[0] = fcs;
+    end[1] = fcs >> 8;
+}
+
+
+static void
+frame(struct arq *a, struct txslot *s, uint8_t seq)
+{
+    uint8_t hdr[HDR_MAX];
+    struct pbuf *p = s->p;
+
+    s->hlen = header(a, hdr, seq);
+    memcpy(pbuf_prepend(p, s->hlen), hdr, s->hlen);
+    put_fcs((uint8_t *)pbuf_append(p, FCS_LEN), p->data, p->len);
+}
+
+
+int
+arq_send(struct arq *a, struct pbuf *p, uint64_t now)
+{
+    struct txslot *s;
+
+    if (dist(a->una, a->nxt) >= a->window) return -1;
+    if (pbuf_headroom(p) < HDR_MAX || pbuf_tailroom(p) < FCS_LEN) return -1;
+
+    s = &a->tx[a->nxt & MASK];
+    s->p = pbuf_ref(p);
+    s->sent = now;
+    s->tries = 1;
+    s->lost = 0;
+    frame(a, s, a->nxt++);
+    return 0;
+}
+
+
+static uint64_t
+timeout(const struct arq *a, const struct txslot *s)
+{
+    uint64_t t = a->rto << (s->tries - 1);
+
+    return t > MAX_RTO ? MAX_RTO : t;
+}
+
+
+/* Move una past the frames that are done with */
+static void
+advance(struct arq *a)
+{
+    while (a->una != a->nxt && a->tx[a->una & MASK].p == NULL)
+        a->una++;
+}
+
+
+struct pbuf *
+arq_resend(struct arq *a, uint64_t now)
+{
+    struct txslot *s;
+    uint8_t seq;
+
+    for(seq = a->una; seq != a->nxt; seq++) {
+        s = &a->tx[seq & MASK];
+        if (s->p == NULL) continue;
+        if (!s->lost && now < s->sent + timeout(a, s)) continue;
+
+        if (s->tries == MAX_TRIES) {
+            /* The peer learns from BASE not to wait for the frame */
+            DBG("Giving up on frame %u", seq);
+            a->stats->tx.drops++;
+            pbuf_free(s->p);
+            s->p = NULL;
+            a->skip = 1;
+            a->ctl_due = now;
+            continue;
+        }
+
+        /* Nobody else holds a reference, the frame has been sent */
+        pbuf_pull(s->p, s->hlen);
+        s->p->len -= FCS_LEN;
+        frame(a, s, seq);
+        s->sent = now;
+        s->tries++;
+        s->lost = 0;
+        a->stats->tx.retransmits++;
+        advance(a);
+        return pbuf_ref(s->p);
+    }
+    advance(a);
+    return NULL;
+}
+
+
+size_t
+arq_ctl(struct arq *a, char *buf, uint64_t now)
+{
+    size_t n;
+
+    if (!(a->ack_owed && now >= a->ack_due) && !(a->skip && now >= a->ctl_due))
+        return 0;
+    if (a->skip) a->ctl_due = now + a->rto;
+
+    n = header(a, (uint8_t *)buf, -1);
+    put_fcs((uint8_t *)buf + n, buf, n);
+    return n + FCS_LEN;
+}
+
+
+uint64_t
+arq_deadline(const struct arq *a)
+{
+    const struct txslot *s;
+    uint64_t t = ARQ_NEVER, d;
+    uint8_t seq;
+
+    if (a->ack_owed) t = a->ack_due;
+    if (a->skip && a->ctl_due < t) t = a->ctl_due;
+    for(seq = a->una; seq != a->nxt; seq++) {
+        s = &a->tx[seq & MASK];
+        if (s->p == NULL) continue;
+        d = s->lost ? 0 : s->sent + timeout(a, s);
+        if (d < t) t = d;
+    }
+    return t;
+}
+
+
+/* Round-trip time estimate of RFC 6298. Only frames sent once are
+ * sampled (Karn's algorithm). A sample may include the delay of the
+ * acknowledgement, or not. */
+static void
+sample(struct arq *a, const struct txslot *s, uint64_t now)
+{
+    uint64_t r, d;
+
+    if (s->tries != 1 || now < s->sent) return;
+    r = now - s->sent;
+    if (a->srtt == 0) {
+        a->srtt = r;
+        a->rttvar = r / 2;
+    } else {
+        d = a->srtt > r ? a->srtt - r : r - a->srtt;
+        a->rttvar = (3 * a->rttvar + d) / 4;
+        a->srtt = (7 * a->srtt + r) / 8;
+    }
+    a->rto = a->srtt + ACK_DELAY + (4 * a->rttvar > CLOCK_G ? 4 * a->rttvar : CLOCK_G);
+    if (a->rto < MIN_RTO) a->rto = MIN_RTO;
+    if (a->rto > MAX_RTO) a->rto = MAX_RTO;
+}
+
+
+static void
+done(struct arq *a, struct txslot *s, uint64_t now)
+{
+    if (s->p == NULL) return;
+    sample(a, s, now);
+    pbuf_free(s->p);
+    s->p = NULL;
+}
+
+
+static void
+take_ack(struct arq *a, uint8_t ack, uint32_t sack, uint64_t now)
+{
+    struct txslot *s;
+    uint64_t last = 0;
+    uint8_t seq, gap = ack;
+    int i;
+
+    /* Ignore acknowledgements from the past */
+    if (dist(a->una, ack) > dist(a->una, a->nxt)) return;
+    a->syn = a->skip = 0;
+
+    for(seq = a->una; seq != ack; seq++)
+        done(a, &a->tx[seq & MASK], now);
+
+    for(i = 0; i < ARQ_MAX_WINDOW - 1; i++) {
+        seq = ack + 1 + i;
+        if (dist(ack, seq) >= dist(ack, a->nxt)) break;
+        if (!(sack & (0x80000000U >> i))) continue;
+        s = &a->tx[seq & MASK];
+        if (s->p && s->sent > last) last = s->sent;
+        done(a, s, now);
+        gap = seq;
+    }
+
+    /* Frames sent before one that got through are lost */
+    for(seq = ack; seq != gap; seq++) {
+        s = &a->tx[seq & MASK];
+        if (s->p && s->sent <= last) s->lost = 1;
+    }
+    advance(a);
+}
+
+
+/* The peer started over with new sequence numbers */
+static void
+resync(struct arq *a, uint8_t base, uint8_t epoch)
+{
+    int i;
+
+    DBG("Peer %u starts at frame %u", epoch, base);
+    for(i = 0; i < ARQ_MAX_WINDOW; i++) {
+        if (a->rx[i].p) pbuf_free(a->rx[i].p);
+        a->rx[i].p = NULL;
+    }
+    a->rcv_nxt = a->rcv_base = base;
+    a->peer = epoch;
+    a->synced = 1;
+}
+
+
+int
+arq_input(struct arq *a, struct pbuf *p, uint64_t now)
+{
+    const uint8_t *d = (const uint8_t *)p->data;
+    uint8_t flags, seq = 0, ack = 0, base = 0, epoch = 0;
+    uint32_t sack = 0;
+    struct rxslot *s;
+    size_t n = 1;
+
+    if (p->len < 1 + FCS_LEN || hdlc_fcs16(HDLC_FCS_INIT, d, p->len) != HDLC_FCS_GOOD) {
+        DBG("Bad FCS, dropping frame");
+        a->stats->rx.frame_errors++;
+        pbuf_free(p);
+        return -1;
+    }
+    p->len -= FCS_LEN;
+
+    flags = d[0];
+    if (p->len < 1 + !!(flags & DATA) + !!(flags & ACK) + (flags & SACK ? 4 : 0)
+        + !!(flags & BASE) + !!(flags & SYN)) {
+        a->stats->rx.frame_errors++;
+        pbuf_free(p);
+        return -1;
+    }
+    if (flags & DATA) seq = d[n++];
+    if (flags & ACK) ack = d[n++];
+    if (flags & SACK) {
+        sack = (uint32_t)d[n] << 24 | d[n + 1] << 16 | d[n + 2] << 8 | d[n + 3];
+        n += 4;
+    }
+    if (flags & BASE) base = d[n++];
+    if (flags & SYN) epoch = d[n++];
+    pbuf_pull(p, n);
+
+    if (flags & ACK) take_ack(a, ack, sack, now);
+
+    /* The sender is at most a window behind us unless it gave up on
+     * frames. If it gave up on more than a window, start over at BASE. */
+    if ((flags & (SYN | BASE)) == (SYN | BASE) && (!a->synced || epoch != a->peer)) {
+        resync(a, base, epoch);
+    } else if (flags & BASE && a->synced && dist(a->rcv_nxt, base) < ARQ_MAX_WINDOW) {
+        if (dist(a->rcv_nxt, base) > dist(a->rcv_nxt, a->rcv_base)) {
+            a->rcv_base = base;
+            a->ack_owed = 1;
+            a->ack_due = now;
+        }
+    } else if (flags & BASE && a->synced && dist(base, a->rcv_nxt) > ARQ_MAX_WINDOW) {
+        a->stats->rx.drops += dist(a->rcv_nxt, base);
+        resync(a, base, a->peer);
+        a->ack_owed = 1;
+        a->ack_due = now;
+    }
+
+    if (!(flags & DATA)) {
+        pbuf_free(p);
+        return 0;
+    }
+
+    a->heard = 1;
+
+    /* Pick up where the peer is if we started after it did */
+    if (!a->synced) {
+        a->rcv_nxt = a->rcv_base = seq;
+        a->synced = 1;
+    }
+
+    if (!a->ack_owed) a->ack_due = now + ACK_DELAY;
+    a->ack_owed = 1;
+
+    if (dist(a->rcv_nxt, seq) >= ARQ_MAX_WINDOW) {
+        /* Our acknowledgement did not make it */
+        a->stats->rx.retransmits++;
+        a->ack_due = now;
+        pbuf_free(p);
+        return 0;
+    }
+
+    s = &a->rx[seq & MASK];
+    if (s->p) {
+        if (s->seq == seq) a->stats->rx.retransmits++;
+        pbuf_free(s->p);
+    }
+    s->p = p;
+    s->seq = seq;
+
+    /* Let the peer know about a gap, or that one has been filled */
+    if (seq != a->rcv_nxt || sack_bits(a)) a->ack_due = now;
+    return 0;
+}
+
+
+struct pbuf *
+arq_deliver(struct arq *a)
+{
+    struct rxslot *s;
+    struct pbuf *p;
+
+    for(;;) {
+        s = &a->rx[a->rcv_nxt & MASK];
+        p = s->p && s->seq == a->rcv_nxt ? s->p : NULL;
+        if (p == NULL && a->rcv_nxt == a->rcv_base) return NULL;
+
+        if (p) s->p = NULL;
+        else a->stats->rx.drops++;
+        if (a->rcv_nxt++ == a->rcv_base) a->rcv_base = a->rcv_nxt;
+        if (p) return p;
+    }
+}
+
+
+void
+arq_save(const struct arq *a, sbuf *b)
+{
+    int i;
+
+    HANDOVER_PUT(b, a->window);
+    HANDOVER_PUT(b, a->una);
+    HANDOVER_PUT(b, a->nxt);
+    HANDOVER_PUT(b, a->epoch);
+    HANDOVER_PUT(b, a->syn);
+    HANDOVER_PUT(b, a->skip);
+    HANDOVER_PUT(b, a->ctl_due);
+    HANDOVER_PUT(b, a->srtt);
+    HANDOVER_PUT(b, a->rttvar);
+    HANDOVER_PUT(b, a->rto);
+    HANDOVER_PUT(b, a->rcv_nxt);
+    HANDOVER_PUT(b, a->rcv_base);
+    HANDOVER_PUT(b, a->peer);
+    HANDOVER_PUT(b, a->synced);
+    HANDOVER_PUT(b, a->ack_owed);
+    HANDOVER_PUT(b, a->ack_due);
+
+    for(i = 0; i < ARQ_MAX_WINDOW; i++) {
+        handover_put_pbuf(b, a->tx[i].p);
+        HANDOVER_PUT(b, a->tx[i].sent);
+        HANDOVER_PUT(b, a->tx[i].hlen);
+        HANDOVER_PUT(b, a->tx[i].tries);
+        HANDOVER_PUT(b, a->tx[i].lost);
+        handover_put_pbuf(b, a->rx[i].p);
+        HANDOVER_PUT(b, a->rx[i].seq);
+    }
+}
+
+
+int
+arq_load(struct arq *a, str *s, struct pbuf_pool *pool)
+{
+    int i, window;
+
+    if (HANDOVER_GET(s, window) < 0 || window != a->window) return -1;
+    if (HANDOVER_GET(s, a->una) < 0
+        || HANDOVER_GET(s, a->nxt) < 0
+        || HANDOVER_GET(s, a->epoch) < 0
+        || HANDOVER_GET(s, a->syn) < 0
+        || HANDOVER_GET(s, a->skip) < 0
+        || HANDOVER_GET(s, a->ctl_due) < 0
+        || HANDOVER_GET(s, a->srtt) < 0
+        || HANDOVER_GET(s, a->rttvar) < 0
+        || HANDOVER_GET(s, a->rto) < 0
+        || HANDOVER_GET(s, a->rcv_nxt) < 0
+        || HANDOVER_GET(s, a->rcv_base) < 0
+        || HANDOVER_GET(s, a->peer) < 0
+        || HANDOVER_GET(s, a->synced) < 0
+        || HANDOVER_GET(s, a->ack_owed) < 0
+        || HANDOVER_GET(s, a->ack_due) < 0)
+        return -1;
+
+    /* Buffers restored before an error are released by arq_free */
+    for(i = 0; i < ARQ_MAX_WINDOW; i++) {
+        if (handover_get_pbuf(s, pool, &a->tx[i].p) < 0
+            || HANDOVER_GET(s, a->tx[i].sent) < 0
+            || HANDOVER_GET(s, a->tx[i].hlen) < 0
+            || HANDOVER_GET(s, a->tx[i].tries) < 0
+            || HANDOVER_GET(s, a->tx[i].lost) < 0
+            || handover_get_pbuf(s, pool, &a->rx[i].p) < 0
+            || HANDOVER_GET(s, a->rx[i].seq) < 0)
+            return -1;
+        if (a->tx[i].p && (a->tx[i].tries == 0 || a->tx[i].tries > MAX_TRIES))
+            return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,92 @@
+#ifndef _ARQ_H_
+#define _ARQ_H_
+
+#include <stdint.h>
+
+#include "stats.h"
+#include "pbuf.h"
+#include "str.h"
+
+/* The most frames a sender keeps in flight, and the most frames a
+ * receiver holds back while it waits for a missing one. */
+#define ARQ_MAX_WINDOW 32
+
+/* Room for the largest frame built by arq_ctl */
+#define ARQ_CTL_MAX    16
+
+/* The most bytes arq_send adds to a payload, the longest header and the
+ * FCS. They go into the headroom and tailroom of the buffer. */
+#define ARQ_MAX_OVERHEAD 11
+
+/* No timer needed, see arq_deadline */
+#define ARQ_NEVER      UINT64_MAX
+
+/* Selective-repeat ARQ for lossy links. The ARQ layer sits between
+ * compression and framing: every frame sent over the link gets a short
+ * header and an FCS-16 (see hdlc.h), frames with a bad FCS are dropped.
+ * The header starts with a flags byte, followed by the fields the flags
+ * call for, in this order:
+ *
+ *   0x80  DATA  Sequence number (1 byte) of the payload that follows
+ *   0x40  ACK   Sequence number the receiver expects next (1 byte)
+ *   0x20  SACK  Frames received behind a gap (4 bytes, bit i for
+ *               ACK + 1 + i, most significant bit first)
+ *   0x10  BASE  Oldest frame the sender has not given up on (1 byte)
+ *   0x08  SYN   Random number (1 byte) that identifies the sender, it
+ *               has (re)started its sequence numbers at BASE
+ *
+ * Acknowledgements ride on frames going the other way. If there are
+ * none, a frame without payload is sent after a short delay, or right
+ * away when a gap or a duplicate shows that the peer needs to know.
+ * Frames are sent again when the retransmission timeout derived from
+ * the measured round-trip time (RFC 6298) expires, or as soon as a
+ * frame sent after them has been acknowledged. A frame is given up on
+ * after a few attempts. The receiver hands payloads over in order. */
+struct arq;
+
+/* A new ARQ state for one link that keeps at most window (up to
+ * ARQ_MAX_WINDOW) frames in flight. Retransmissions, duplicates and
+ * frames given up on are counted in the statistics. */
+struct arq *arq_new(int window, struct stats *stats);
+
+/* Release the state and drop the buffers it holds. */
+void arq_free(struct arq *a);
+
+/* Put the header and the FCS around the payload in p, which becomes
+ * the next frame to be sent. The ARQ layer keeps a reference to p for
+ * retransmissions, the caller must not modify p and must drop its own
+ * reference once the frame has been sent. Returns 0 on success and -1
+ * if the window is full or there is not enough room in p. */
+int arq_send(struct arq *a, struct pbuf *p, uint64_t now);
+
+/* The next frame due to be sent again, with a fresh header, or NULL.
+ * The caller sends the frame and drops the reference. */
+struct pbuf *arq_resend(struct arq *a, uint64_t now);
+
+/* Build a frame without payload into buf if an acknowledgement or the
+ * BASE of the sender is due. Returns the length of the frame, or 0. */
+size_t arq_ctl(struct arq *a, char *buf, uint64_t now);
+
+/* When arq_resend or arq_ctl need to be called next (see now_ns), or
+ * ARQ_NEVER. */
+uint64_t arq_deadline(const struct arq *a);
+
+/* Process a frame received from the link. The acknowledgements are
+ * taken and the payload is kept for arq_deliver. The frame is consumed.
+ * Returns 0 on success and -1 if the frame is malformed. */
+int arq_input(struct arq *a, struct pbuf *p, uint64_t now);
+
+/* The next payload in sequence, or NULL. */
+struct pbuf *arq_deliver(struct arq *a);
+
+/* Save the sequence numbers and the frames held by the ARQ layer for a
+ * hitless upgrade (see handover.h), so that the new process carries on
+ * where this one left off without the peer noticing. */
+void arq_save(const struct arq *a, sbuf *b);
+
+/* Restore the state saved with arq_save into a new ARQ state with the
+ * same window. The frames go into buffers from pool. Returns 0 on
+ * success and -1 if the state is malformed. */
+int arq_load(struct arq *a, str *s, struct pbuf_pool *pool);
+
+#endif /* _ARQ_H_ */
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "chord.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,6 +7,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
@@ -13,53 +15,278 @@
 #include <signal.h>
 #include <linux/if.h>
 #include <linux/if_tun.h>
+#include <linux/if_ether.h>
 #include <termios.h>
+#include <linux/serial.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
 
 #include "log.h"
 #include "utils.h"
 #include "comp.h"
+#include "stats.h"
+#include "hdlc.h"
+#include "cobs.h"
+#include "cmdq.h"
+#include "ring.h"
+#include "pbuf.h"
+#include "lpm.h"
+#include "transport.h"
+#include "eth.h"
+#include "arq.h"
+#include "fec.h"
+#include "dedup.h"
+#include "agg.h"
+#include "txq.h"
+#include "ip.h"
+#include "handover.h"
+#include "flows.h"
+
+
+/* Number of bits on the wire per byte with 8N1 framing (start bit,
+ * eight data bits, stop bit). */
+#define BITS_PER_CHAR 10
+
+/* Number of control commands that can be queued for a link */
+#define CMDQ_SIZE 64
+
+/* Pipeline mode: buffers per ring and per hand-over */
+#define PIPE_RING_SIZE 256
+#define PIPE_BATCH     32
+
+/* Buffers read from a transport in one go outside pipeline mode */
+#define RX_BATCH       8
+
+/* Packet buffers per link. Buffers are only held while a packet is on
+ * its way through the link: the chunks read and the result of
+ * compression or decompression, plus the frame being decoded by each
+ * serial link of a hub. In pipeline mode, the rings and the batches
+ * taken off them by the stage threads come on top of that, so that the
+ * pool cannot run dry. */
+#define POOL_SIZE      (RX_BATCH + 8)
+#define PIPE_POOL_SIZE (POOL_SIZE + 2 * (PIPE_RING_SIZE + PIPE_BATCH))
+
+/* Room in a packet buffer, for a packet or a compressed packet with its
+ * protocol identifier */
+#define PBUF_SIZE      (MAX_PACKET_SIZE + 1)
+
+/* The largest payload the framer is handed. A packet may grow into the
+ * headroom and tailroom of its buffer, with the ARQ header and FCS (up
+ * to ARQ_MAX_OVERHEAD bytes) or deduplication, so the framer takes the
+ * whole buffer, with FEC the encoded frame of it (see fec_new below). */
+#define PBUF_BYTES     (PBUF_HEADROOM + PBUF_SIZE + PBUF_TAILROOM)
+#define FRAME_MTU(fec) ((fec) ? FEC_MAX_ENCODED(PBUF_BYTES) : PBUF_BYTES)
+
+/* Throughput I/O profile: the number of bytes the tty layer collects
+ * before it reports the port readable (at most 255). The bytes of a
+ * burst that do not fill a chunk are picked up by a timer that fires
+ * after the time it takes to receive a chunk at the current baud rate,
+ * but not more often than every FLUSH_MIN seconds. */
+#define THROUGHPUT_VMIN 64
+#define FLUSH_MIN       0.001
+
+/* How long a superframe waits for more packets by default, in
+ * microseconds */
+#define AGG_DELAY       1000
+
+/* The shortest wait for the tty output queue to drain with byte queue
+ * limits */
+#define TXQ_WAIT_MIN    0.0005
+
+/* How long the old process waits for the new one to take the link
+ * over, in seconds */
+#define HANDOVER_TIMEOUT 10
+
+/* Settings that both processes of a handover must agree on */
+#define HANDOVER_CONF   8
+
+struct stage {
+    struct chord *c;
+    const char   *name;
+    pthread_t     thread;
+    int           running;
+    int           stop;
+    int           efd;      /* Wakes up the thread               */
+    int           sleeping; /* The thread waits on efd           */
+    int           stalled;  /* The event loop waits for room     */
+    ev_io        *watcher;  /* Stopped while the ring is full    */
+    int           comp_gen; /* Compression settings last applied */
+    struct ring   ring;     /* From the event loop to the thread */
+};
+
+/* A serial link. In hub mode, a link carries the traffic for the
+ * remote prefixes routed to it. Every link has its own framer and ROHC
+ * contexts, flows on different links do not share compression state.
+ * The bytes are carried by a transport, a serial port unless the name
+ * of the port is the URI of another transport, see transport.h. */
+struct port {
+    struct chord *c;
+    char  *serial;
+    char  *routes;
+    struct transport *t;
+    ev_io  watcher;
+    ev_io  accept_watcher; /* Listening transports only */
+    struct hdlc *hdlc;     /* NULL with COBS framing */
+    struct cobs *cobs;     /* NULL with HDLC framing */
+    struct comp *comp;
+    struct eth  *eth;      /* TAP mode only */
+    struct arq  *arq;      /* NULL without ARQ */
+    struct fec  *fec;      /* NULL without FEC */
+    struct dedup *dedup;   /* NULL without deduplication */
+    struct pbuf *agg;      /* Superframe being filled, or NULL */
+    struct txq  *txq;      /* NULL without byte queue limits */
+    ev_timer arq_watcher;
+    ev_timer txq_watcher;
+    ev_timer agg_watcher;
+
+    /* Serial I/O profile, see set_io_profile. The VMIN and VTIME
+     * settings and the low latency flag (-1 if the driver has none)
+     * are those found when the port was opened. */
+    int      io_profile;
+    ev_timer flush_watcher;
+    cc_t     vmin;
+    cc_t     vtime;
+    int      low_latency;
+};
+
+struct chord {
+    struct ev_loop *loop;
+    int    retval;
+
+    char  *ifname;
+    char  *config;
+    int    tap;
+    int    framing;
+    int    arq;  /* ARQ window, 0 without ARQ */
+    int    fec;
+    int    dedup;
+    int    agg;       /* Superframe size, 0 without aggregation */
+    int    agg_delay; /* Microseconds */
+    int    bql;
+    int    ack_filter;
+    int    mru;  /* 0 without MSS clamping */
+    int    flows;  /* Flows tracked per direction, 0 without accounting */
+    int    baud;
+    int    tun_batch;
+    int    tty_batch;
+
+    int    tunfd;
+    ev_io  tun_watcher;
+    ev_io  sig_watcher;
+
+    /* Serial links. With more than one link (hub mode), packets read
+     * from the TUN interface are routed by their destination address,
+     * see route. */
+    struct port *ports;
+    int    nports;
+    struct lpm *routes4;
+    struct lpm *routes6;
+
+    /* Control channel, see chord_stop and the chord_set functions. */
+    ev_async    ctl_watcher;
+    struct cmdq cmdq;
+    int    stop;
+    int    stop_rv;
+
+    /* Points either to the shared memory segment of the link or, if the
+     * segment could not be created, to private memory, so that the
+     * counters can be updated unconditionally from the data path. */
+    struct stats *stats;
+    int    stats_shm;
+
+    /* Per-flow accounting, NULL without it */
+    struct flows *tx_flows;
+    struct flows *rx_flows;
+
+    struct pbuf_pool *pool;
+    int    hugepages;  /* The pool was asked for huge pages */
+    int    mlock;      /* and to be locked in memory */
+
+    /* The link belongs to a new process now, see chord_handover */
+    int    handed_over;
+
+    /* Pipeline mode, see run_stage. The compressor belongs to the tx
+     * stage, the event loop passes compression settings to it through
+     * want_compression and want_profiles and bumps comp_gen. */
+    int    pipeline;
+    int    cpu;
+    struct stage tx;
+    struct stage rx;
+    ev_async wake_watcher;
+    int    comp_gen;
+    int    want_compression;
+    unsigned int want_profiles;
+};
+
+
+static const struct {
+    int    baud;
+    speed_t speed;
+} speeds[] = {
+    {1200, B1200}, {2400, B2400}, {4800, B4800}, {9600, B9600},
+    {19200, B19200}, {38400, B38400}, {57600, B57600},
+    {115200, B115200}, {230400, B230400}, {460800, B460800},
+    {500000, B500000}, {576000, B576000}, {921600, B921600},
+    {1000000, B1000000}, {1152000, B1152000}, {1500000, B1500000},
+    {2000000, B2000000}, {2500000, B2500000}, {3000000, B3000000},
+    {3500000, B3500000}, {4000000, B4000000}
+};
+
+
+static const char *io_profiles[] = {
+    [CHORD_IO_DEFAULT]    = "default",
+    [CHORD_IO_LATENCY]    = "latency",
+    [CHORD_IO_THROUGHPUT] = "throughput"
+};
+
+
+static const char *framings[] = {
+    [CHORD_FRAMING_HDLC] = "hdlc",
+    [CHORD_FRAMING_COBS] = "cobs"
+};
 
 
+static int
+find_speed(int rate)
+{
+    int i;
 
-#define FRAME_BOUNDARY 0x7E
-#define CONTROL_ESCAPE 0x7D
-#define ABORT          0x7D 0x7E
-#define INVERT_BIT5(v) ((v) ^ (uint8_t)(1UL << 5))
-
-
-typedef enum hdlc_state {
-    HDLC_START = 0,
-    HDLC_DATA = 1,
-    HDLC_ESCAPE = 2
-} hdlc_state_t;
-
-
-static int   init;
-static int   retval;
-static ev_io sigfd;
-static int   tunfd = -1;
-static int   serfd = -1;
-
-static ev_io tun_watcher;
-static ev_io ser_watcher;
+    for(i = 0; i < ARRAY_SIZE(speeds); i++)
+        if (speeds[i].baud == rate) return i;
+    return -1;
+}
 
 
-char *ifname = NULL;
-char *serial = NULL;
+/* Stop the event loop from within the event loop thread. */
+static void
+fail(chord_t *c, int rv)
+{
+    c->retval = rv;
+    ev_break(c->loop, EVBREAK_ALL);
+}
 
 
+/* Configure the serial port for raw 8N1 operation at the given baud
+ * rate. The argument when is passed to tcsetattr. */
 static int
-configure_tty(int fd, int speed)
+configure_tty(int fd, int rate, int when)
 {
     struct termios tty;
+    int i;
+
+    if ((i = find_speed(rate)) < 0) {
+        ERR("Unsupported baud rate %d", rate);
+        return -1;
+    }
 
     if (tcgetattr(fd, &tty) < 0) {
         ERR("tcgetattr: %s\n", strerror(errno));
         return -1;
     }
 
-    cfsetospeed(&tty, (speed_t)speed);
-    cfsetispeed(&tty, (speed_t)speed);
+    cfsetospeed(&tty, speeds[i].speed);
+    cfsetispeed(&tty, speeds[i].speed);
 
     tty.c_cflag |= (CLOCAL | CREAD);
     tty.c_cflag &= ~CSIZE;
@@ -72,7 +299,7 @@ configure_tty(int fd, int speed)
     tty.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
     tty.c_oflag &= ~OPOST;
 
-    if (tcsetattr(fd, TCSAFLUSH, &tty) != 0) {
+    if (tcsetattr(fd, when, &tty) != 0) {
         ERR("tcsetattr: %s\n", strerror(errno));
         return -1;
     }
@@ -80,359 +307,2381 @@ configure_tty(int fd, int speed)
 }
 
 
+/* Remember the tty settings that the default I/O profile goes back to. */
 static int
-decode_hdlc_frame(char **packet, size_t *plen, char *data, size_t len)
+save_tty(struct port *port)
 {
-    int i;
-    static hdlc_state_t state = HDLC_START;
-    static char buf[MAX_PACKET_SIZE];
-    static size_t l = 0;
-
-    for(i = 0; i < len; i++) {
-        switch(state) {
-        case HDLC_START:
-            switch(data[i]) {
-            case FRAME_BOUNDARY:
-                state = HDLC_DATA;
-                break;
-            default:
-                break;
-            }
-            break;
+    struct serial_struct ss;
+    struct termios tty;
 
-        case HDLC_DATA:
-            switch(data[i]) {
-            case CONTROL_ESCAPE:
-                state = HDLC_ESCAPE;
-                break;
+    if (tcgetattr(port->t->fd, &tty) < 0) {
+        ERR("tcgetattr: %s\n", strerror(errno));
+        return -1;
+    }
+    port->vmin = tty.c_cc[VMIN];
+    port->vtime = tty.c_cc[VTIME];
+
+    /* Not every tty driver supports TIOCGSERIAL, e.g., USB serial
+     * adapters and pseudo terminals often do not. */
+    if (ioctl(port->t->fd, TIOCGSERIAL, &ss) < 0)
+        port->low_latency = -1;
+    else
+        port->low_latency = !!(ss.flags & ASYNC_LOW_LATENCY);
+    return 0;
+}
 
-            case FRAME_BOUNDARY:
-                *packet = buf;
-                *plen = l;
-                state = HDLC_START;
-                l = 0;
-                return i + 1;
 
-            default:
-                buf[l++] = data[i];
-                break;
-            }
-            break;
+static void
+set_low_latency(struct port *port, int on)
+{
+    struct serial_struct ss;
 
-        case HDLC_ESCAPE:
-            buf[l++] = INVERT_BIT5(data[i]);
-            state = HDLC_DATA;
-            break;
-        }
+    if (port->low_latency < 0) {
+        if (on) DBG("Serial port %s has no low latency mode", port->serial);
+        return;
     }
+    if (ioctl(port->t->fd, TIOCGSERIAL, &ss) < 0) {
+        WRN("TIOCGSERIAL on %s: %s", port->serial, strerror(errno));
+        return;
+    }
+    if (on) ss.flags |= ASYNC_LOW_LATENCY;
+    else ss.flags &= ~ASYNC_LOW_LATENCY;
+    if (ioctl(port->t->fd, TIOCSSERIAL, &ss) < 0)
+        WRN("TIOCSSERIAL on %s: %s", port->serial, strerror(errno));
+}
+
 
-    *packet = NULL;
-    return i;
+/* (Re)start the timer that picks up what is left in the tty input
+ * buffer in the throughput profile. Called again when the baud rate
+ * changes. */
+static void
+arm_flush(struct port *port)
+{
+    chord_t *c = port->c;
+    ev_tstamp iv;
+
+    ev_timer_stop(c->loop, &port->flush_watcher);
+    if (port->io_profile != CHORD_IO_THROUGHPUT) return;
+
+    iv = (ev_tstamp)THROUGHPUT_VMIN * BITS_PER_CHAR / c->baud;
+    if (iv < FLUSH_MIN) iv = FLUSH_MIN;
+    ev_timer_set(&port->flush_watcher, iv, iv);
+    ev_timer_start(c->loop, &port->flush_watcher);
 }
 
 
+/* The read callback does not care whether it was called because the
+ * port is readable. It is not called while the pipeline is stalled. */
 static void
-tty2tun(EV_P_ ev_io *w, int revents)
+flush_tty(EV_P_ ev_timer *w, int revents)
 {
-    char *comp, *packet, *p;
-    size_t clen, plen;
-    static char buf[1 + MAX_PACKET_SIZE * 2 + 1];
-    ssize_t rv, left;
+    struct port *port = w->data;
 
-    rv = read(w->fd, buf, sizeof(buf));
-    if (rv <= 0) {
-        if (errno == EAGAIN || errno == EINTR) return;
-        ERR("tty read: %s", (rv < 0 ? strerror(errno) : "empty packet"));
-        chord_stop(rv < 0 ? rv : -1);
-        return;
+    if (ev_is_active(&port->watcher))
+        ev_invoke(EV_A_ &port->watcher, EV_READ);
+}
+
+
+/* Apply a serial I/O profile. With VTIME set to zero, poll on a tty in
+ * non-canonical mode reports the tty readable only once VMIN bytes are
+ * in the input buffer, which is what the throughput profile relies on
+ * to coalesce wakeups. */
+static int
+set_io_profile(struct port *port, int profile)
+{
+    struct termios tty;
+
+    if (tcgetattr(port->t->fd, &tty) < 0) {
+        ERR("tcgetattr: %s\n", strerror(errno));
+        return -1;
     }
 
-    p = buf;
-    left = rv;
+    switch(profile) {
+    case CHORD_IO_LATENCY:
+        tty.c_cc[VMIN] = 1;
+        tty.c_cc[VTIME] = 0;
+        break;
+    case CHORD_IO_THROUGHPUT:
+        tty.c_cc[VMIN] = THROUGHPUT_VMIN;
+        tty.c_cc[VTIME] = 0;
+        break;
+    default:
+        tty.c_cc[VMIN] = port->vmin;
+        tty.c_cc[VTIME] = port->vtime;
+        break;
+    }
 
-    do {
-        rv = decode_hdlc_frame(&comp, &clen, p, left);
-        p += rv;
-        left -= rv;
+    if (tcsetattr(port->t->fd, TCSANOW, &tty) != 0) {
+        ERR("tcsetattr: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (profile == CHORD_IO_LATENCY) set_low_latency(port, 1);
+    else if (port->low_latency >= 0) set_low_latency(port, profile == CHORD_IO_DEFAULT
+                                                     ? port->low_latency : 0);
 
-        if (comp == NULL) continue;
+    port->io_profile = profile;
+    arm_flush(port);
+    DBG("Serial port %s uses the %s I/O profile", port->serial, io_profiles[profile]);
+    return 0;
+}
 
-        DBG("TTY: Got %lu bytes", clen);
 
-        if (comp_expand(&packet, &plen, comp, clen) < 0) {
-            ERR("Error while decompressing");
-            chord_stop(-1);
-            return;
-        }
+/* Compress a packet read from the TUN interface. In TAP mode, the
+ * Ethernet header is replaced with its compressed form and only IP
+ * payloads go through ROHC, other payloads are sent as they are. The
+ * return values are those of comp_shrink. */
+static int
+shrink(struct port *port, struct pbuf **p)
+{
+    uint16_t type;
+    int idx, rv;
 
-        if (plen != clen)
-            DBG("Expanded to %lu bytes", plen);
+    if (!port->c->tap) return comp_shrink(port->comp, p);
 
-        rv = write(tunfd, packet, plen);
-        if (rv < 0) {
-            ERR("Error while writing packet: %s", strerror(errno));
-            chord_stop(-1);
-        } else if (rv < plen) {
-            ERR("Incomplete packet written (%lu < %lu)", rv, plen);
-        }
-    } while(left);
+    idx = eth_strip(port->eth, *p, &type);
+    if (type == ETH_P_IP || type == ETH_P_IPV6) {
+        rv = comp_shrink(port->comp, p);
+    } else if (pbuf_prepend(*p, 1) != NULL) {
+        (*p)->data[0] = PROTO_ETH;
+        rv = 2;
+    } else {
+        rv = -1;
+    }
+    if (rv >= 0 && eth_tag(port->eth, *p, idx) < 0) rv = -1;
+    return rv;
 }
 
 
-static void
-build_hdlc_frame(char **frame, size_t *flen, char *packet, size_t plen)
+/* The reverse of shrink. Returns 0 on success and -1 if the frame
+ * cannot be decompressed. */
+static int
+expand(struct port *port, struct pbuf **p)
 {
-    static char buf[1 + MAX_PACKET_SIZE * 2 + 1];
-    int j;
+    int idx;
 
-    j = 0;
-    buf[j++] = FRAME_BOUNDARY;
+    if (!port->c->tap) return comp_expand(port->comp, p);
 
-    for(int i = 0; i < plen; i++) {
-        switch(packet[i]) {
-        case FRAME_BOUNDARY:
-        case CONTROL_ESCAPE:
-            buf[j++] = CONTROL_ESCAPE;
-            buf[j++] = INVERT_BIT5(packet[i]);
-            break;
+    if ((idx = eth_untag(port->eth, *p)) < 0) return -1;
+    if ((*p)->len && (uint8_t)(*p)->data[0] == PROTO_ETH)
+        pbuf_pull(*p, 1);
+    else if (comp_expand(port->comp, p) < 0)
+        return -1;
+    return eth_restore(port->eth, *p, idx);
+}
 
-        default:
-            buf[j++] = packet[i];
-            break;
-        }
+
+/* Lower the MSS of a TCP SYN to fit the MRU of the link. In TAP mode,
+ * the packet starts with an Ethernet header. */
+static void
+clamp_mss(chord_t *c, struct pbuf *p)
+{
+    size_t off = 0;
+    uint16_t type;
+
+    if (c->tap) {
+        if (p->len < ETH_HDR_LEN) return;
+        type = (uint8_t)p->data[12] << 8 | (uint8_t)p->data[13];
+        if (type != ETH_P_IP && type != ETH_P_IPV6) return;
+        off = ETH_HDR_LEN;
     }
+    if (ip_clamp_mss(p->data + off, p->len - off, c->mru))
+        DBG("Clamped TCP MSS to the MRU of %d bytes", c->mru);
+}
+
 
-    buf[j++] = FRAME_BOUNDARY;
-    *frame = buf;
-    *flen = j;
+/* Build the frame for a payload that must not be framed in place:
+ * FEC, if enabled, and HDLC or COBS framing. The frame remains valid
+ * until the next call. Returns -1 if the payload is too large for the
+ * framer. */
+static int
+frame_copy(struct port *port, char *data, size_t len, char **frame, size_t *flen)
+{
+    if (port->fec) data = fec_encode(port->fec, data, len, &len);
+    if (port->cobs) return build_cobs_frame(port->cobs, frame, flen, data, len);
+    return build_hdlc_frame(port->hdlc, frame, flen, data, len);
 }
 
 
+/* Frame and send a frame built by the ARQ layer. A frame that cannot
+ * be written is left to the ARQ layer to send again. */
 static void
-tun2tty(EV_P_ ev_io *w, int revents)
+send_arq(struct port *port, char *data, size_t len)
 {
-    char *comp;
-    static char packet[MAX_PACKET_SIZE];
+    struct stats *stats = port->c->stats;
     char *frame;
-    size_t plen, flen, clen;
-
+    size_t flen;
     ssize_t rv;
 
-    rv = read(w->fd, packet, sizeof(packet));
-    if (rv <= 0) {
-        if (errno == EAGAIN || errno == EINTR) return;
-        ERR("tun read: %s", (rv < 0 ? strerror(errno) : "empty packet"));
-        chord_stop(rv < 0 ? rv : -1);
+    if (frame_copy(port, data, len, &frame, &flen) < 0) {
+        DBG("ARQ frame of %zu bytes too large for the framer", len);
+        stats->tx.drops++;
+        return;
+    }
+    if ((rv = transport_write(port->t, frame, flen)) < 0) {
+        DBG("Error while writing ARQ frame: %s", strerror(errno));
         return;
     }
+    stats->tx.wire_bytes += rv;
+    stats->tx.frames++;
+}
 
-    plen = rv;
-    DBG("TUN: Got %lu bytes", plen);
 
-    if (comp_shrink(&comp, &clen, packet, plen) < 0) {
-        ERR("Error while compressing");
-        chord_stop(-1);
+/* Set the ARQ timer for whatever the ARQ layer has to do next. A timer
+ * that fires early does no harm. */
+static void
+arm_arq(struct port *port, uint64_t now)
+{
+    chord_t *c = port->c;
+    uint64_t next = arq_deadline(port->arq);
+    ev_tstamp after;
+
+    if (next == ARQ_NEVER) {
+        ev_timer_stop(c->loop, &port->arq_watcher);
         return;
     }
+    after = next > now ? (next - now) / 1e9 : 0;
+    if (ev_is_active(&port->arq_watcher)
+        && ev_timer_remaining(c->loop, &port->arq_watcher) <= after)
+        return;
+    ev_timer_stop(c->loop, &port->arq_watcher);
+    ev_timer_set(&port->arq_watcher, after, 0);
+    ev_timer_start(c->loop, &port->arq_watcher);
+}
 
-    if (clen != plen)
-        DBG("Compressed away %ld bytes", plen - clen);
-
-    build_hdlc_frame(&frame, &flen, comp, clen);
 
-    rv = write(serfd, frame, flen);
-    if (rv < 0) {
-        ERR("Error while writing frame: %s", strerror(errno));
-        chord_stop(-1);
-    } else if (rv < flen) {
-        ERR("Incomplete frame written (%lu < %lu)", rv, flen);
+/* Send the retransmissions that are due and an acknowledgement that
+ * found no frame to ride on. */
+static void
+service_arq(struct port *port)
+{
+    char ctl[ARQ_CTL_MAX];
+    struct pbuf *p;
+    uint64_t now = now_ns();
+    size_t len;
+
+    while ((p = arq_resend(port->arq, now)) != NULL) {
+        send_arq(port, p->data, p->len);
+        pbuf_free(p);
     }
+    if ((len = arq_ctl(port->arq, ctl, now)) > 0)
+        send_arq(port, ctl, len);
+    port->c->stats->tx.drops += transport_flush(port->t);
+    arm_arq(port, now);
 }
 
 
+static void
+arq_timeout(EV_P_ ev_timer *w, int revents)
+{
+    service_arq(w->data);
+}
+
 
+/* Decompress a frame received over the link and write the packet to
+ * the TUN interface. The frame is freed. Returns 0 on success and -1 if
+ * the TUN interface cannot be written to anymore. */
 static int
-open_tun(char *name)
+deliver(struct port *port, struct pbuf *packet)
 {
-    static char *dev = "/dev/net/tun";
-    struct ifreq ifr;
-    int fd, err;
+    chord_t *c = port->c;
+    struct stats *stats = c->stats;
+    struct flow_key key;
+    size_t clen = packet->len, plen;
+    uint64_t t0 = packet->ts, t1, t2 = now_ns(), t3;
+    ssize_t rv;
+    int drop = 1;
 
-    if ((fd = open(dev, O_RDWR | O_NONBLOCK)) < 0) {
-        ERR("Error while opening %s: %s", dev, strerror(errno));
-        return fd;
-    }
+    stats->rx.comp_bytes += clen;
 
-    memset(&ifr, 0, sizeof(ifr));
-    ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+    /* A frame that cannot be decompressed is most likely damaged,
+     * drop it and keep the link running. */
+    if (port->dedup && dedup_decode(port->dedup, packet) < 0) {
+        DBG("Error while expanding references, dropping frame");
+        stats->rx.drops++;
+        pbuf_free(packet);
+        return 0;
+    }
+    if (packet->len == 0) {
+        pbuf_free(packet);
+        return 0;
+    }
+    if (packet->len == 1 && packet->data[0] == PROTO_RESYNC) {
+        INF("%s: Peer on %s lost its ROHC contexts", c->ifname, port->serial);
+        comp_resync(port->comp);
+        pbuf_free(packet);
+        return 0;
+    }
+    if (expand(port, &packet) < 0) {
+        DBG("Error while decompressing, dropping frame");
+        if (port->fec) fec_damaged(port->fec);
+        stats->rx.drops++;
+        pbuf_free(packet);
+        return 0;
+    }
+    t3 = now_ns();
+    hist_record(&stats->rx_lat.comp, t3 - t2);
+
+    plen = packet->len;
+    if (plen != clen)
+        DBG("Expanded to %lu bytes", plen);
+    if (c->mru) clamp_mss(c, packet);
+    if (c->rx_flows) flows_key(packet->data, plen, c->tap, &key);
+
+    rv = write(c->tunfd, packet->data, plen);
+    pbuf_free(packet);
+    t1 = now_ns();
+    if (rv < 0 && errno == EAGAIN) {
+        /* A packet file descriptor whose reader cannot keep up, a
+         * TUN interface drops such packets itself */
+        DBG("Packet file descriptor full, dropping packet");
+        stats->rx.drops++;
+    } else if (rv < 0) {
+        ERR("Error while writing packet: %s", strerror(errno));
+        stats->rx.drops++;
+        return -1;
+    } else if (rv < plen) {
+        ERR("Incomplete packet written (%lu < %lu)", rv, plen);
+        stats->rx.drops++;
+    } else {
+        stats->rx.packets++;
+        stats->rx.bytes += plen;
+        hist_record(&stats->rx_lat.write, t1 - t3);
+        hist_record(&stats->rx_lat.total, t1 - t0);
+        drop = 0;
+    }
+    if (c->rx_flows) flows_add(c->rx_flows, &key, plen, clen, drop, t1);
+    return 0;
+}
 
-    if (name && *name) strncpy(ifr.ifr_name, name, IFNAMSIZ);
 
-    if ((err = ioctl(fd, TUNSETIFF, (void *)&ifr)) < 0) {
-        close(fd);
-        ERR("Error in TUN/TAP ioctl: %s", strerror(errno));
-        return err;
+/* Deliver the packets in a frame received over the link, which is a
+ * superframe with aggregation. The frame is freed. Returns 0 on success
+ * and -1 if the TUN interface cannot be written to anymore. */
+static int
+unpack(struct port *port, struct pbuf *frame)
+{
+    chord_t *c = port->c;
+    const char *pos = frame->data, *end = frame->data + frame->len, *data;
+    struct pbuf *p;
+    size_t len;
+    int rv;
+
+    if (!c->agg) return deliver(port, frame);
+
+    while ((rv = agg_next(&pos, end, &data, &len)) > 0) {
+        /* The last packet stays where it is */
+        if (pos == end) {
+            pbuf_pull(frame, data - frame->data);
+            frame->len = len;
+            return deliver(port, frame);
+        }
+        if ((p = pbuf_alloc(c->pool)) == NULL) {
+            DBG("Out of buffers, dropping packet from superframe");
+            c->stats->rx.drops++;
+            continue;
+        }
+        memcpy(p->data, data, len);
+        p->len = len;
+        p->ts = frame->ts;
+        if (deliver(port, p) < 0) {
+            pbuf_free(frame);
+            return -1;
+        }
     }
 
-    if ((err = ioctl(fd, TUNSETPERSIST, 1)) < 0) {
-        close(fd);
-        ERR("Error in TUN/TAP ioctl: %s", strerror(errno));
-        return err;
+    if (rv < 0) {
+        DBG("Malformed superframe");
+        c->stats->rx.frame_errors++;
     }
-
-    DBG("Opened TUN interface '%s'", ifr.ifr_name);
-    return fd;
+    pbuf_free(frame);
+    return 0;
 }
 
 
-
-static void
-read_signal(EV_P_ ev_io *w, int revents)
+/* Pass all frames found in a chunk of bytes read from the serial port
+ * to the TUN interface. With ARQ, the frames go through the ARQ layer
+ * which hands them over in sequence. The chunk is freed. Returns 0 on
+ * success and -1 if the TUN interface cannot be written to anymore. */
+static int
+receive(struct port *port, struct pbuf *chunk)
 {
-    int s, rv;
-    ssize_t rc;
+    chord_t *c = port->c;
+    struct stats *stats = c->stats;
+    struct pbuf *packet;
+    char *p = chunk->data;
+    size_t left = chunk->len;
+    ssize_t rv;
+    uint64_t t1 = chunk->ts, t2;
 
-    rc = safe_read(w->fd, &s, sizeof(s));
-    if (rc < 0) {
-        if (errno == EAGAIN || errno == EINTR) return;
-        ERR("Error while receiving signal: %s", strerror(errno));
-        rv = -1;
-    } else if (rc != sizeof(s)) {
-        ERR("Not enough data received on signal file descriptor.");
-        rv = -1;
-    } else {
-        DBG("Signal %d received", s);
-        rv = 0;
-    }
-    chord_stop(rv);
+    do {
+        if (port->cobs) rv = decode_cobs_frame(port->cobs, &packet, p, left);
+        else rv = decode_hdlc_frame(port->hdlc, &packet, p, left);
+        p += rv;
+        left -= rv;
+
+        if (packet == NULL) continue;
+        t2 = now_ns();
+        hist_record(&stats->rx_lat.frame, t2 - t1);
+
+        DBG("TTY: Got %lu bytes", packet->len);
+        stats->rx.frames++;
+        packet->ts = chunk->ts;
+
+        /* A frame FEC cannot repair is dropped, ARQ (if enabled) sends
+         * it again */
+        if (port->fec && fec_decode(port->fec, packet) < 0) {
+            pbuf_free(packet);
+            t1 = now_ns();
+            continue;
+        }
+
+        if (port->arq) {
+            if (arq_input(port->arq, packet, t2) < 0 && port->fec)
+                fec_damaged(port->fec);
+            while ((packet = arq_deliver(port->arq)) != NULL) {
+                if (unpack(port, packet) < 0) goto error;
+            }
+        } else if (unpack(port, packet) < 0) {
+            goto error;
+        }
+        t1 = now_ns();
+    } while(left);
+
+    pbuf_free(chunk);
+    if (port->arq) service_arq(port);
+    return 0;
+
+error:
+    pbuf_free(chunk);
+    return -1;
 }
 
 
-int
-chord_init(int fd)
+/* Pick the link for a packet read from the TUN interface by longest
+ * prefix match on its destination address. Returns NULL if there is no
+ * route. With a single link, all packets go over that link. */
+static struct port *
+route(chord_t *c, const struct pbuf *p)
 {
-    /* Initialization is done when we get here. Report to the parent
-     * process that we're starting and log the event into the system
-     * log. */
-    INF("%s version %s (%s-%s-%s) built on %s", NAME,
-        VERSION, ARCH, OS, PLATFORM, BUILT);
-    DBG("Using libev %d.%d", EV_VERSION_MAJOR, EV_VERSION_MINOR);
+    const uint8_t *ip = (const uint8_t *)p->data;
+    int i = -1;
 
-    /* Block the SIGPIPE signal so that we don't get killed when we
-     * write to a socket that received RST from the remote peer. We
-     * check for EPIPE in errno instead. */
-    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
-        ERR("Could not block SIGPIPE");
-        return -1;
+    if (c->nports == 1) return c->ports;
+
+    switch(ip[0] >> 4) {
+    case 4: if (p->len >= 20) i = lpm_lookup(c->routes4, ip + 16); break;
+    case 6: if (p->len >= 40) i = lpm_lookup(c->routes6, ip + 24); break;
     }
+    return i < 0 ? NULL : &c->ports[i];
+}
 
-    /* Initialize all variables used by chord_cleanup to determine
-     * what cleanup functions to run. This is to ensure that
-     * chord_cleanup can be run in case of an error in chord_init.*/
-    sigfd.fd = -1;
-    retval = 0;
-    init = 0;
 
-    if (ev_default_loop(0) == NULL) {
-        ERR("Could not initialize the main event loop");
-        return -1;
-    }
+/* Frame and send a compressed packet, or a superframe, over the serial
+ * link. The packet is freed. Returns 0 if the frame was sent or dropped
+ * and -1 if the link cannot continue. */
+static int
+send_frame(struct port *port, struct pbuf *p)
+{
+    chord_t *c = port->c;
+    struct stats *stats = c->stats;
+    char *frame;
+    size_t flen;
+    uint64_t t0 = p->ts, t1 = now_ns(), t2, t3;
+    int outq;
 
-    /* If we were given a signal file descriptor, make it non-blocking
-     * and set up a reader for it. */
-    if (fd >= 0) {
-        if (make_nonblocking(fd) < 0) {
-            ERR("Can't make signal file descriptor non-blocking");
-            return -1;
+    ssize_t rv;
+    int err;
+
+    /* The ARQ layer keeps the frame for retransmissions, it must not
+     * be framed in place */
+    if (port->arq) {
+        if (arq_send(port->arq, p, t1) < 0) {
+            DBG("ARQ window full, dropping packet");
+            stats->tx.drops++;
+            if (port->dedup) dedup_abort(port->dedup);
+            pbuf_free(p);
+            return 0;
         }
-        ev_io_init(&sigfd, read_signal, fd, EV_READ);
-        ev_io_start(EV_DEFAULT_UC_ &sigfd);
+        /* The frame goes out sooner or later */
+        if (port->dedup) dedup_commit(port->dedup);
+        err = frame_copy(port, p->data, p->len, &frame, &flen);
+        arm_arq(port, t1);
+    } else if (port->fec) {
+        err = frame_copy(port, p->data, p->len, &frame, &flen);
+    } else if (port->cobs) {
+        err = build_cobs_frame_pbuf(port->cobs, p, &frame, &flen);
+    } else {
+        err = build_hdlc_frame_pbuf(port->hdlc, p, &frame, &flen);
     }
-
-    if (serial == NULL) {
-        ERR("Please configure serial port name");
+    if (err < 0) {
+        DBG("Frame of %zu bytes too large for the framer", p->len);
+        stats->tx.drops++;
+        if (port->dedup && !port->arq) dedup_abort(port->dedup);
+        pbuf_free(p);
+        return 0;
+    }
+    t2 = now_ns();
+    hist_record(&stats->tx_lat.frame, t2 - t1);
+
+    rv = transport_write(port->t, frame, flen);
+    t3 = now_ns();
+    pbuf_free(p);
+    if (port->dedup && !port->arq) {
+        if (rv < (ssize_t)flen) dedup_abort(port->dedup);
+        else dedup_commit(port->dedup);
+    }
+    if (rv < 0) {
+        stats->tx.drops++;
+        /* The tty output queue is full, the link cannot keep up with
+         * the offered load. Drop the frame. The same goes for a
+         * listening transport without a peer, the read side notices
+         * when a peer goes away. */
+        if (errno == EAGAIN || port->t->lfd >= 0) return 0;
+        ERR("Error while writing frame: %s", strerror(errno));
         return -1;
     }
 
-    serfd = open(serial, O_RDWR | O_NOCTTY | O_NONBLOCK | O_NDELAY);
-    if (serfd < 0) {
-        ERR("Could not open serial port %s: %s", serial, strerror(errno));
-        return -1;
+    stats->tx.wire_bytes += rv;
+    if (rv < flen) {
+        ERR("Incomplete frame written (%lu < %lu)", rv, flen);
+        stats->tx.drops++;
+        return 0;
+    }
+    stats->tx.frames++;
+    hist_record(&stats->tx_lat.write, t3 - t2);
+
+    /* The last byte of the frame leaves the UART once everything in
+     * the tty output queue (which includes the frame) has been sent.
+     * Estimate that time from the queue length and the baud rate. The
+     * baud rate is changed by the event loop thread. Sockets have no
+     * baud rate, the frame is done once it has been handed over. */
+    if (!port->t->tty) {
+        hist_record(&stats->tx_lat.total, t3 - t0);
+        return 0;
     }
-    DBG("Opened serial port %s", serial);
+    if (ioctl(port->t->fd, TIOCOUTQ, &outq) < 0) outq = rv;
+    hist_record(&stats->tx_lat.total, t3 - t0
+                + (uint64_t)outq * BITS_PER_CHAR * 1000000000ULL
+                / __atomic_load_n(&c->baud, __ATOMIC_RELAXED));
+    return 0;
+}
 
-    if (configure_tty(serfd, 9600) < 0) return -1;
 
-    ev_io_init(&ser_watcher, tty2tun, serfd, EV_READ);
-    ev_io_start(EV_DEFAULT_UC_ &ser_watcher);
+/* Send the superframe being filled. Returns 0 if the frame was sent or
+ * dropped and -1 if the link cannot continue. */
+static int
+flush_agg(struct port *port)
+{
+    struct pbuf *p = port->agg;
 
-    if ((tunfd = open_tun(ifname)) < 0)
-        return -1;
+    port->agg = NULL;
+    ev_timer_stop(port->c->loop, &port->agg_watcher);
+    return send_frame(port, p);
+}
 
-    ev_io_init(&tun_watcher, tun2tty, tunfd, EV_READ);
-    ev_io_start(EV_DEFAULT_UC_ &tun_watcher);
 
+static void
+agg_timeout(EV_P_ ev_timer *w, int revents)
+{
+    struct port *port = w->data;
 
-    if (comp_init() < 0)
-        return -1;
+    if (flush_agg(port) < 0) fail(port->c, -1);
+    port->c->stats->tx.drops += transport_flush(port->t);
+}
 
-    init = 1;
+
+/* Add a compressed packet to the superframe being filled, or start a
+ * new one. The packet is freed. The superframe is sent once it is full,
+ * or by the timer. Returns 0 on success and -1 if the link cannot
+ * continue. */
+static int
+aggregate(struct port *port, struct pbuf *p)
+{
+    chord_t *c = port->c;
+
+    if (port->agg && agg_add(port->agg, p, c->agg) == 0) {
+        pbuf_free(p);
+    } else {
+        if (port->agg && flush_agg(port) < 0) {
+            pbuf_free(p);
+            return -1;
+        }
+        if (agg_start(p) < 0) {
+            DBG("No room for the length of the packet, dropping");
+            c->stats->tx.drops++;
+            if (port->dedup) dedup_abort(port->dedup);
+            pbuf_free(p);
+            return 0;
+        }
+        port->agg = p;
+        ev_timer_set(&port->agg_watcher, c->agg_delay / 1e6, 0);
+        ev_timer_start(c->loop, &port->agg_watcher);
+    }
+
+    if (port->agg->len >= c->agg) return flush_agg(port);
     return 0;
 }
 
 
-void
-chord_cleanup(void)
+/* Replace chunks of a compressed packet that the peer has seen with
+ * references. The chunks of the packet must not be stored along with
+ * those of a superframe that it does not go out in (see dedup_commit),
+ * the superframe being filled is sent first if the packet may not fit.
+ * Returns 0 on success, 1 if the packet was dropped and -1 if the link
+ * cannot continue. The packet is freed unless it succeeded. */
+static int
+deduplicate(struct port *port, struct pbuf *p)
 {
-    if (init != 0) INF("Shutting down Chord");
-    init = 0;
+    chord_t *c = port->c;
 
-    comp_cleanup();
-
-    if (serfd >= 0) {
-        DBG("Closing serial port");
-        ev_io_stop(EV_DEFAULT_UC_ &ser_watcher);
-        close(serfd);
+    if (port->agg && port->agg->len + AGG_MAX_PREFIX + p->len + DEDUP_MAX_GROWTH > c->agg
+        && flush_agg(port) < 0) {
+        pbuf_free(p);
+        return -1;
     }
-    if (serial) xfree(serial);
-
-    if (tunfd >= 0) {
-        DBG("Closing TUN/TAP interface");
-        ev_io_stop(EV_DEFAULT_UC_ &tun_watcher);
-        close(tunfd);
+    if (dedup_encode(port->dedup, p) < 0) {
+        DBG("No room for the deduplication header, dropping packet");
+        c->stats->tx.drops++;
+        pbuf_free(p);
+        return 1;
     }
-    if (ifname) xfree(ifname);
+    return 0;
+}
 
-    if (sigfd.fd >= 0) {
-        ev_io_stop(EV_DEFAULT_UC_ &sigfd);
-        close(sigfd.fd);
-    }
 
-    /* Destroy the default event loop and call any ev_cleanup handlers
-     * that might have been registered. */
-    ev_loop_destroy(EV_DEFAULT_UC);
+/* Send a message of the link itself, it goes the way of a compressed
+ * packet. The message is freed. Returns 0 on success, 1 if it was
+ * dropped and -1 if the link cannot continue. */
+static int
+send_ctl(struct port *port, struct pbuf *p)
+{
+    int rv;
+
+    p->ts = now_ns();
+    if (port->dedup && (rv = deduplicate(port, p)) != 0) return rv;
+    if (port->c->agg) return aggregate(port, p);
+    return send_frame(port, p);
 }
 
 
-/* FIXME: This should use ev_async to signal the main loop, otherwise
- * the function will not work when called outside of ev_run, e.g.,
- * from another thread of execution. */
-void
-chord_stop(int rv)
+/* Report the chunks that references were not found for, in an empty
+ * packet rather than with the next packet sent. Returns 0 on success
+ * and -1 if the link cannot continue. */
+static int
+send_nack(struct port *port)
 {
-    retval = rv;
-    ev_break(EV_DEFAULT_UC_ EVBREAK_ALL);
+    struct pbuf *p;
+
+    if (!dedup_nack_pending(port->dedup)) return 0;
+    if ((p = pbuf_alloc(port->c->pool)) == NULL) return 0;
+    p->len = 0;
+    return send_ctl(port, p) < 0 ? -1 : 0;
 }
 
 
-int
-chord_run(void)
+/* Compress a packet read from the TUN interface and send it over the
+ * serial link, in a frame of its own or in a superframe. The packet is
+ * freed, its compressed length is stored in *clen. Returns 0 if the
+ * packet was sent or dropped and -1 if the link cannot continue. */
+static int
+forward(struct port *port, struct pbuf *p, size_t *clen)
 {
-    if (!init) {
-        ERR("Did you forget to call chord_init before calling chord_run?");
+    chord_t *c = port->c;
+    struct stats *stats = c->stats;
+    size_t plen = p->len;
+    uint64_t t0 = p->ts, t1;
+    int rv;
+
+    if (shrink(port, &p) < 0) {
+        ERR("Error while compressing");
+        stats->tx.drops++;
+        pbuf_free(p);
         return -1;
     }
+    if (port->dedup && (rv = deduplicate(port, p)) != 0)
+        return rv < 0 ? -1 : 0;
+    *clen = p->len;
+    stats->tx.comp_bytes += *clen;
+    t1 = now_ns();
+    hist_record(&stats->tx_lat.comp, t1 - t0);
+
+    if (*clen != plen)
+        DBG("Compressed away %ld bytes", plen - *clen);
+
+    if (c->agg) return aggregate(port, p);
+    return send_frame(port, p);
+}
+
+
+/* Send a packet with forward and count it in its flow. A drop anywhere
+ * on the way is charged to the packet. */
+static int
+send_packet(struct port *port, struct pbuf *p)
+{
+    chord_t *c = port->c;
+    struct flow_key key;
+    uint64_t drops = c->stats->tx.drops;
+    size_t clen = 0, plen = p->len;
+    int rv;
+
+    if (c->tx_flows == NULL) return forward(port, p, &clen);
+
+    flows_key(p->data, plen, c->tap, &key);
+    rv = forward(port, p, &clen);
+    flows_add(c->tx_flows, &key, plen, clen, c->stats->tx.drops != drops, now_ns());
+    return rv;
+}
+
+
+/* Wait for the tty output queue that holds outq bytes to drain down to
+ * the low mark of the transmit queue. */
+static void
+arm_txq(struct port *port, int outq)
+{
+    chord_t *c = port->c;
+    ev_tstamp after;
+
+    after = (ev_tstamp)(outq - txq_low(port->txq)) * BITS_PER_CHAR / c->baud;
+    if (after < TXQ_WAIT_MIN) after = TXQ_WAIT_MIN;
+    ev_timer_stop(c->loop, &port->txq_watcher);
+    ev_timer_set(&port->txq_watcher, after, 0);
+    ev_timer_start(c->loop, &port->txq_watcher);
+}
+
+
+/* Send packets from the transmit queue for as long as the tty output
+ * queue is below the limit. Returns 0 on success and -1 if the link
+ * cannot continue. */
+static int
+drain(struct port *port)
+{
+    struct pbuf *p;
+    int outq;
+
+    if (ev_is_active(&port->txq_watcher)) return 0;
+
+    while (txq_len(port->txq) > 0) {
+        if (ioctl(port->t->fd, TIOCOUTQ, &outq) < 0) outq = 0;
+        if (!txq_room(port->txq, outq)) {
+            arm_txq(port, outq);
+            break;
+        }
+        p = txq_pop(port->txq);
+        if (send_packet(port, p) < 0) return -1;
+    }
+    return 0;
+}
+
+
+static void
+txq_ready(EV_P_ ev_timer *w, int revents)
+{
+    struct port *port = w->data;
+    int outq;
+
+    if (ioctl(port->t->fd, TIOCOUTQ, &outq) == 0)
+        txq_refill(port->txq, outq, now_ns());
+    if (drain(port) < 0) fail(port->c, -1);
+}
+
+
+/* Count a packet dropped before compression in its flow */
+static void
+count_drop(chord_t *c, const struct pbuf *p)
+{
+    struct flow_key key;
+
+    if (c->tx_flows == NULL) return;
+    flows_key(p->data, p->len, c->tap, &key);
+    flows_add(c->tx_flows, &key, p->len, 0, 1, now_ns());
+}
+
+
+/* Send a packet read from the TUN interface over the link it is routed
+ * to, through the transmit queue of the link if there is one. The
+ * packet is freed. Returns 0 if the packet was sent, queued or dropped
+ * and -1 if the link cannot continue. */
+static int
+transmit(chord_t *c, struct pbuf *p)
+{
+    struct stats *stats = c->stats;
+    struct port *port;
+    struct pbuf *drop;
+
+    if ((port = route(c, p)) == NULL) {
+        DBG("No route for packet, dropping");
+        stats->tx.drops++;
+        count_drop(c, p);
+        pbuf_free(p);
+        return 0;
+    }
+
+    if (c->tap && p->len < ETH_HDR_LEN) {
+        DBG("Runt Ethernet frame, dropping");
+        stats->tx.drops++;
+        count_drop(c, p);
+        pbuf_free(p);
+        return 0;
+    }
+
+    if (c->mru) clamp_mss(c, p);
+    if (port->txq == NULL) return send_packet(port, p);
+
+    if ((drop = txq_push(port->txq, p, txq_class(p, c->tap))) != NULL) {
+        DBG("Transmit queue full, dropping packet");
+        stats->tx.drops++;
+        count_drop(c, drop);
+        pbuf_free(drop);
+    }
+    return drain(port);
+}
+
+
+/* The peer of a listening transport went away, wait for the next. */
+static void
+hangup(struct port *port)
+{
+    chord_t *c = port->c;
+
+    INF("%s: Peer on %s went away", c->ifname, port->serial);
+    ev_io_stop(c->loop, &port->watcher);
+    transport_hangup(port->t);
+}
+
+
+static void
+accept_peer(EV_P_ ev_io *w, int revents)
+{
+    struct port *port = w->data;
+
+    ev_io_stop(EV_A_ &port->watcher);
+    if (transport_accept(port->t) == 0)
+        INF("%s: Peer connected on %s", port->c->ifname, port->serial);
+    if (port->t->fd >= 0) {
+        ev_io_set(&port->watcher, port->t->fd, EV_READ);
+        ev_io_start(EV_A_ &port->watcher);
+    }
+}
+
+
+/* Read up to limit chunks of bytes (datagrams for a UDP transport) from
+ * the serial link and pass all frames found in them to the TUN
+ * interface. Returns the number of chunks read, 0 if there was nothing
+ * to read, and -1 if the link was stopped. */
+static int
+tty2tun(struct port *port, int limit)
+{
+    chord_t *c = port->c;
+    struct pbuf *batch[RX_BATCH];
+    int i, n, rv;
+
+    if (limit > RX_BATCH) limit = RX_BATCH;
+    if (!port->t->ops->dgram) limit = 1;
+    for(n = 0; n < limit && (batch[n] = pbuf_alloc(c->pool)) != NULL; n++);
+    if (n == 0) return 0;
+
+    rv = transport_read(port->t, batch, n);
+    for(i = rv > 0 ? rv : 0; i < n; i++)
+        pbuf_free(batch[i]);
+    if (rv < 0) {
+        if (port->t->lfd >= 0) {
+            hangup(port);
+            return 0;
+        }
+        ERR("%s read: %s", port->serial, strerror(errno));
+        fail(c, -1);
+        return -1;
+    }
+
+    for(i = 0; i < rv; i++) {
+        batch[i]->ts = now_ns();
+        c->stats->rx.wire_bytes += batch[i]->len;
+    }
+    for(i = 0; i < rv; i++) {
+        if (receive(port, batch[i]) < 0) {
+            while (++i < rv) pbuf_free(batch[i]);
+            fail(c, -1);
+            return -1;
+        }
+    }
+    return rv;
+}
+
+
+/* Read one packet from the TUN interface and send it over the serial
+ * port. Returns 1 if a packet was read, 0 if there was nothing to read,
+ * and -1 if the link was stopped. */
+static int
+tun2tty(chord_t *c)
+{
+    struct pbuf *p;
+    ssize_t rv;
+
+    if ((p = pbuf_alloc(c->pool)) == NULL) return 0;
+    rv = read(c->tunfd, p->data, pbuf_room(p));
+    if (rv <= 0) {
+        pbuf_free(p);
+        if (errno == EAGAIN || errno == EINTR) return 0;
+        ERR("tun read: %s", (rv < 0 ? strerror(errno) : "empty packet"));
+        fail(c, rv < 0 ? rv : -1);
+        return -1;
+    }
+    p->len = rv;
+    p->ts = now_ns();
+
+    DBG("TUN: Got %lu bytes", rv);
+    c->stats->tx.packets++;
+    c->stats->tx.bytes += rv;
+
+    if (transmit(c, p) < 0) {
+        fail(c, -1);
+        return -1;
+    }
+    return 1;
+}
+
+
+/* The scheduler limits bound the work done for one direction before
+ * the event loop gets to the other direction and to control commands. */
+static void
+ser_readable(EV_P_ ev_io *w, int revents)
+{
+    struct port *port = w->data;
+    int i, rv;
+
+    for(i = 0; i < port->c->tty_batch; i += rv)
+        if ((rv = tty2tun(port, port->c->tty_batch - i)) <= 0) break;
+
+    /* Misses go out now rather than with the next packet. The rx thread
+     * of pipeline mode cannot send, there they have to wait. */
+    if (port->dedup) {
+        if (send_nack(port) < 0) fail(port->c, -1);
+        port->c->stats->tx.drops += transport_flush(port->t);
+    }
+}
+
+
+/* Send the frames that transports batch up, e.g., UDP. */
+static void
+flush(chord_t *c)
+{
+    int i;
+
+    for(i = 0; i < c->nports; i++)
+        c->stats->tx.drops += transport_flush(c->ports[i].t);
+}
+
+
+static void
+tun_readable(EV_P_ ev_io *w, int revents)
+{
+    chord_t *c = w->data;
+    int i;
+
+    for(i = 0; i < c->tun_batch; i++)
+        if (tun2tty(c) <= 0) break;
+    flush(c);
+}
+
+
+/* Pipeline mode. The event loop thread only reads from the TUN
+ * interface and from the serial port. Each chunk of data is read into a
+ * packet buffer and handed over to a stage thread through an SPSC ring:
+ * the tx stage compresses, frames and writes to the serial port, the rx
+ * stage decodes, decompresses and writes to the TUN interface.
+ *
+ * A stage thread with nothing to do sleeps on its eventfd. It sets
+ * "sleeping" and checks the ring once more before it blocks, the event
+ * loop writes to the eventfd only if it finds the flag set after a push.
+ * When a ring is full, the event loop stops reading from the file
+ * descriptor and sets "stalled"; the stage thread wakes the event loop
+ * up once it has made room. Both handshakes rely on the sequentially
+ * consistent fences on either side. */
+
+static void
+pin(pthread_t thread, int cpu, const char *name)
+{
+    cpu_set_t set;
+    int rv;
+
+    if (cpu < 0) return;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if ((rv = pthread_setaffinity_np(thread, sizeof(set), &set)) != 0)
+        WRN("Could not pin %s thread to CPU %d: %s", name, cpu, strerror(rv));
+}
+
+
+static void
+wake_stage(struct stage *s)
+{
+    uint64_t one = 1;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_exchange_n(&s->sleeping, 0, __ATOMIC_SEQ_CST)) return;
+    if (write(s->efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        ERR("Could not wake up %s thread: %s", s->name, strerror(errno));
+}
+
+
+static void
+stall(chord_t *c, struct stage *s)
+{
+    ev_io_stop(c->loop, s->watcher);
+    __atomic_store_n(&s->stalled, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    /* The stage thread may have made room before it saw the flag */
+    if (ring_room(&s->ring) && __atomic_exchange_n(&s->stalled, 0, __ATOMIC_SEQ_CST))
+        ev_io_start(c->loop, s->watcher);
+}
+
+
+/* Read a packet from the TUN interface, with the return values of
+ * transport_read. */
+static int
+read_tun(chord_t *c, struct pbuf *p)
+{
+    ssize_t rv;
+
+    rv = read(c->tunfd, p->data, pbuf_room(p));
+    if (rv < 0) return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    if (rv == 0) {
+        errno = EIO;
+        return -1;
+    }
+    p->len = rv;
+    return 1;
+}
+
+
+/* Read up to limit chunks of data from the transport t, or packets from
+ * the TUN interface if t is NULL, and hand them over to the stage.
+ * Returns the number of chunks, their total size is added to *bytes. */
+static int
+feed(chord_t *c, struct stage *s, struct transport *t, int limit, uint64_t *bytes)
+{
+    struct pbuf *batch[PIPE_BATCH];
+    unsigned long room;
+    int i, m, rv, n = 0;
+
+    if ((room = ring_room(&s->ring)) == 0) {
+        stall(c, s);
+        return 0;
+    }
+    if (limit > room) limit = room;
+    if (limit > PIPE_BATCH) limit = PIPE_BATCH;
+
+    for(m = 0; m < limit && (batch[m] = pbuf_alloc(c->pool)) != NULL; m++);
+    while (n < m) {
+        if (t) rv = transport_read(t, batch + n, t->ops->dgram ? m - n : 1);
+        else rv = read_tun(c, batch[n]);
+        if (rv < 0) {
+            ERR("%s read: %s", s->name, strerror(errno));
+            fail(c, -1);
+        }
+        if (rv <= 0) break;
+        for(i = n; i < n + rv; i++) {
+            batch[i]->ts = now_ns();
+            *bytes += batch[i]->len;
+        }
+        n += rv;
+    }
+    for(i = n; i < m; i++)
+        pbuf_free(batch[i]);
+
+    if (n) {
+        ring_push(&s->ring, (void **)batch, n);
+        wake_stage(s);
+    }
+    return n;
+}
+
+
+static void
+tun_feed(EV_P_ ev_io *w, int revents)
+{
+    chord_t *c = w->data;
+    struct stats *stats = c->stats;
+
+    stats->tx.packets += feed(c, &c->tx, NULL, c->tun_batch, &stats->tx.bytes);
+}
+
+
+static void
+ser_feed(EV_P_ ev_io *w, int revents)
+{
+    struct port *port = w->data;
+    chord_t *c = port->c;
+
+    feed(c, &c->rx, port->t, c->tty_batch, &c->stats->rx.wire_bytes);
+}
+
+
+/* A stage thread has made room in a full ring, resume reading. */
+static void
+resume(EV_P_ ev_async *w, int revents)
+{
+    chord_t *c = w->data;
+
+    if (!ev_is_active(c->tx.watcher)) ev_io_start(c->loop, c->tx.watcher);
+    if (!ev_is_active(c->rx.watcher)) ev_io_start(c->loop, c->rx.watcher);
+}
+
+
+/* Apply compression settings changed by the event loop thread. Only the
+ * tx stage thread touches the compressor while the pipeline runs. */
+static void
+update_comp(chord_t *c, struct stage *s)
+{
+    unsigned int profiles;
+    int gen;
+
+    gen = __atomic_load_n(&c->comp_gen, __ATOMIC_ACQUIRE);
+    if (gen == s->comp_gen) return;
+    s->comp_gen = gen;
+
+    comp_set_enabled(c->ports[0].comp, __atomic_load_n(&c->want_compression, __ATOMIC_RELAXED));
+    profiles = __atomic_load_n(&c->want_profiles, __ATOMIC_RELAXED);
+    if (profiles && comp_set_profiles(c->ports[0].comp, profiles) == 0)
+        INF("%s: ROHC profiles set to 0x%x", c->ifname, profiles);
+}
+
+
+static void *
+run_stage(void *arg)
+{
+    struct stage *s = arg;
+    chord_t *c = s->c;
+    struct pbuf *batch[PIPE_BATCH];
+    unsigned int i, n;
+    uint64_t v;
+    int rv;
+
+    DBG("%s thread started", s->name);
+
+    while (!__atomic_load_n(&s->stop, __ATOMIC_ACQUIRE)) {
+        n = ring_pop(&s->ring, (void **)batch, PIPE_BATCH);
+        if (!n) {
+            __atomic_store_n(&s->sleeping, 1, __ATOMIC_SEQ_CST);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (!ring_count(&s->ring) && !__atomic_load_n(&s->stop, __ATOMIC_ACQUIRE)
+                && read(s->efd, &v, sizeof(v)) < 0 && errno != EINTR) {
+                ERR("%s thread: eventfd read: %s", s->name, strerror(errno));
+                chord_stop(c, -1);
+                break;
+            }
+            __atomic_store_n(&s->sleeping, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_exchange_n(&s->stalled, 0, __ATOMIC_SEQ_CST))
+            ev_async_send(c->loop, &c->wake_watcher);
+
+        if (s == &c->tx) update_comp(c, s);
+
+        for(i = 0, rv = 0; i < n; i++) {
+            if (rv < 0)
+                pbuf_free(batch[i]);
+            else if (s == &c->tx)
+                rv = transmit(c, batch[i]);
+            else
+                rv = receive(&c->ports[0], batch[i]);
+        }
+        if (s == &c->tx) flush(c);
+
+        /* The link cannot continue, let the event loop shut it down */
+        if (rv < 0) {
+            chord_stop(c, -1);
+            break;
+        }
+    }
+
+    DBG("%s thread finished", s->name);
+    return NULL;
+}
+
+
+static int
+start_stage(chord_t *c, struct stage *s, const char *name, ev_io *watcher, int cpu)
+{
+    int rv;
+
+    s->c = c;
+    s->name = name;
+    s->watcher = watcher;
+    ring_init(&s->ring, PIPE_RING_SIZE);
+
+    if ((s->efd = eventfd(0, EFD_CLOEXEC)) < 0) {
+        ERR("Could not create eventfd: %s", strerror(errno));
+        return -1;
+    }
+
+    if ((rv = pthread_create(&s->thread, NULL, run_stage, s)) != 0) {
+        ERR("Could not start %s thread: %s", name, strerror(rv));
+        return -1;
+    }
+    s->running = 1;
+    pin(s->thread, cpu, name);
+    return 0;
+}
+
+
+static void
+stop_stage(struct stage *s)
+{
+    struct pbuf *p;
+    uint64_t one = 1;
+
+    if (s->running) {
+        __atomic_store_n(&s->stop, 1, __ATOMIC_RELEASE);
+        if (write(s->efd, &one, sizeof(one)) < 0)
+            ERR("Could not wake up %s thread: %s", s->name, strerror(errno));
+        pthread_join(s->thread, NULL);
+        s->running = 0;
+    }
+
+    if (s->ring.slots) {
+        while (ring_pop(&s->ring, (void **)&p, 1))
+            pbuf_free(p);
+        ring_free(&s->ring);
+    }
+    if (s->efd >= 0) close(s->efd);
+}
+
+
+
+/* Open the TUN interface. If *name is NULL or empty, the kernel picks
+ * the name of the interface. Upon success *name is updated to contain
+ * the actual name of the interface. */
+static int
+open_tun(char **name, int tap)
+{
+    static char *dev = "/dev/net/tun";
+    struct ifreq ifr;
+    int fd, err;
+
+    if ((fd = open(dev, O_RDWR | O_NONBLOCK)) < 0) {
+        ERR("Error while opening %s: %s", dev, strerror(errno));
+        return fd;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = (tap ? IFF_TAP : IFF_TUN) | IFF_NO_PI;
+
+    if (*name && **name) strncpy(ifr.ifr_name, *name, IFNAMSIZ - 1);
+
+    if ((err = ioctl(fd, TUNSETIFF, (void *)&ifr)) < 0) {
+        close(fd);
+        ERR("Error in TUN/TAP ioctl: %s", strerror(errno));
+        return err;
+    }
+
+    if ((err = ioctl(fd, TUNSETPERSIST, 1)) < 0) {
+        close(fd);
+        ERR("Error in TUN/TAP ioctl: %s", strerror(errno));
+        return err;
+    }
+
+    if (*name == NULL || strcmp(*name, ifr.ifr_name)) {
+        if (*name) xfree(*name);
+        *name = xstrdup(ifr.ifr_name);
+    }
+
+    DBG("Opened %s interface '%s'", tap ? "TAP" : "TUN", ifr.ifr_name);
+    return fd;
+}
+
+
+
+/* Set the MTU of the interface name. */
+static int
+set_mtu(const char *name, int mtu)
+{
+    struct ifreq ifr;
+    int fd, rv;
+
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        ERR("socket: %s", strerror(errno));
+        return -1;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+    ifr.ifr_mtu = mtu;
+    if ((rv = ioctl(fd, SIOCSIFMTU, &ifr)) < 0)
+        ERR("Could not set the MTU of %s to %d: %s", name, mtu, strerror(errno));
+    else
+        DBG("MTU of %s set to %d", name, mtu);
+    close(fd);
+    return rv;
+}
+
+
+/* Add the comma or space separated prefixes in routes to the routing
+ * tables of the hub, pointing to link number i. */
+static int
+add_routes(chord_t *c, int i, const char *routes)
+{
+    char *buf, *prefix, *save;
+    uint8_t addr[16];
+    unsigned int len;
+    int af, rv = 0;
+
+    buf = xstrdup(routes);
+    for(prefix = strtok_r(buf, ", \t", &save); prefix;
+        prefix = strtok_r(NULL, ", \t", &save)) {
+        af = lpm_parse_prefix(prefix, addr, &len);
+        if (af < 0) {
+            ERR("Invalid prefix '%s' for serial port %s", prefix, c->ports[i].serial);
+            rv = -1;
+            break;
+        }
+        lpm_insert(af == AF_INET ? c->routes4 : c->routes6, addr, len, i);
+        DBG("Route %s via %s", prefix, c->ports[i].serial);
+    }
+    xfree(buf);
+    return rv;
+}
+
+
+/* Set up the serial links from either the serial port or the hub links
+ * of the configuration. */
+static int
+init_ports(chord_t *c, const struct chord_conf *conf)
+{
+    int i;
+
+    if (conf->serial && conf->nlinks) {
+        ERR("Please configure either a serial port or hub links, not both");
+        return -1;
+    }
+    if (conf->serial == NULL && conf->nlinks == 0) {
+        ERR("Please configure serial port name");
+        return -1;
+    }
+    if (c->pipeline && conf->nlinks > 1) {
+        ERR("Pipeline mode supports a single serial port");
+        return -1;
+    }
+    if (c->tap && conf->nlinks > 1) {
+        ERR("TAP mode supports a single serial port");
+        return -1;
+    }
+
+    c->nports = conf->serial ? 1 : conf->nlinks;
+    c->ports = xcalloc(c->nports, sizeof(*c->ports));
+    for(i = 0; i < c->nports; i++) {
+        c->ports[i].c = c;
+    }
+
+    if (conf->serial) {
+        c->ports[0].serial = xstrdup(conf->serial);
+        c->ports[0].io_profile = conf->io_profile;
+        return 0;
+    }
+
+    c->routes4 = lpm_new(4);
+    c->routes6 = lpm_new(16);
+    for(i = 0; i < c->nports; i++) {
+        c->ports[i].serial = xstrdup(conf->links[i].serial);
+        c->ports[i].routes = xstrdup(conf->links[i].routes);
+        c->ports[i].io_profile = conf->links[i].io_profile >= 0
+            ? conf->links[i].io_profile : conf->io_profile;
+        if (add_routes(c, i, conf->links[i].routes) < 0) return -1;
+    }
+    if (c->nports > 1) INF("Hub mode with %d serial links", c->nports);
+    return 0;
+}
+
+
+static void
+log_stats(const struct stats *s, void *data)
+{
+    chord_t *c = data;
+
+    INF("%s: tx %llu packets %llu bytes %llu on the wire, %llu drops; "
+        "rx %llu packets %llu bytes %llu on the wire, %llu drops",
+        c->ifname,
+        (unsigned long long)s->tx.packets, (unsigned long long)s->tx.bytes,
+        (unsigned long long)s->tx.wire_bytes, (unsigned long long)s->tx.drops,
+        (unsigned long long)s->rx.packets, (unsigned long long)s->rx.bytes,
+        (unsigned long long)s->rx.wire_bytes, (unsigned long long)s->rx.drops);
+}
+
+
+static void
+read_signal(EV_P_ ev_io *w, int revents)
+{
+    chord_t *c = w->data;
+    int s, rv;
+    ssize_t rc;
+
+    rc = safe_read(w->fd, &s, sizeof(s));
+    if (rc < 0) {
+        if (errno == EAGAIN || errno == EINTR) return;
+        ERR("Error while receiving signal: %s", strerror(errno));
+        rv = -1;
+    } else if (rc != sizeof(s)) {
+        ERR("Not enough data received on signal file descriptor.");
+        rv = -1;
+    } else {
+        DBG("Signal %d received", s);
+        switch(s) {
+        case SIGHUP:  chord_reload(c);                 return;
+        case SIGUSR1: chord_snapshot(c, log_stats, c); return;
+        case SIGUSR2:
+            if (c->pipeline) {
+                WRN("%s: Pipeline mode does not support upgrades", c->ifname);
+                return;
+            }
+            rv = CHORD_UPGRADE;
+            break;
+        default:
+            rv = 0;
+        }
+    }
+    fail(c, rv);
+}
+
+
+static void
+apply(chord_t *c, const struct cmd *cmd)
+{
+    int i, rv;
+
+    switch(cmd->type) {
+    case CMD_SNAPSHOT:
+        cmd->cb(c->stats, cmd->data);
+        break;
+
+    case CMD_BAUD:
+        if (cmd->value == c->baud) break;
+        /* Let the frames already in the output queue go out at the old
+         * rate before switching. */
+        for(i = 0, rv = 0; i < c->nports; i++)
+            if (c->ports[i].t->tty)
+                rv |= configure_tty(c->ports[i].t->fd, cmd->value, TCSADRAIN);
+        if (rv < 0) break;
+        INF("%s: Baud rate changed from %d to %d", c->ifname, c->baud, cmd->value);
+        __atomic_store_n(&c->baud, cmd->value, __ATOMIC_RELAXED);
+        c->stats->baud = c->baud;
+        for(i = 0; i < c->nports; i++) {
+            arm_flush(&c->ports[i]);
+            if (c->ports[i].txq) txq_set_rate(c->ports[i].txq, c->baud / BITS_PER_CHAR);
+        }
+        break;
+
+    case CMD_COMPRESS:
+        INF("%s: Compression %s", c->ifname, cmd->value ? "enabled" : "disabled");
+        if (c->pipeline) {
+            __atomic_store_n(&c->want_compression, cmd->value, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&c->comp_gen, 1, __ATOMIC_RELEASE);
+        } else {
+            for(i = 0; i < c->nports; i++)
+                comp_set_enabled(c->ports[i].comp, cmd->value);
+        }
+        break;
+
+    case CMD_PROFILES:
+        if (c->pipeline) {
+            __atomic_store_n(&c->want_profiles, cmd->value, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&c->comp_gen, 1, __ATOMIC_RELEASE);
+        } else {
+            for(i = 0, rv = 0; i < c->nports; i++)
+                rv |= comp_set_profiles(c->ports[i].comp, cmd->value);
+            if (rv == 0) INF("%s: ROHC profiles set to 0x%x", c->ifname, cmd->value);
+        }
+        break;
+
+    case CMD_LIMIT:
+        switch(cmd->arg) {
+        case CHORD_TUN_BATCH: c->tun_batch = cmd->value; break;
+        case CHORD_TTY_BATCH: c->tty_batch = cmd->value; break;
+        }
+        DBG("%s: Limit %d set to %d", c->ifname, cmd->arg, cmd->value);
+        break;
+
+    case CMD_IO_PROFILE:
+        for(i = 0; i < c->nports; i++) {
+            if (cmd->arg >= 0 && cmd->arg != i) continue;
+            if (!c->ports[i].t->tty || c->ports[i].io_profile == cmd->value) continue;
+            if (set_io_profile(&c->ports[i], cmd->value) == 0)
+                INF("%s: Serial port %s switched to the %s I/O profile", c->ifname,
+                    c->ports[i].serial, io_profiles[cmd->value]);
+        }
+        break;
+
+    default:
+        ERR("Unknown command %d", cmd->type);
+        break;
+    }
+}
+
+
+/* Runs in the event loop thread whenever another thread (or the loop
+ * itself) has queued commands or asked the loop to stop. */
+static void
+control(EV_P_ ev_async *w, int revents)
+{
+    chord_t *c = w->data;
+    struct cmd cmd;
+
+    while (cmdq_pop(&c->cmdq, &cmd))
+        apply(c, &cmd);
+
+    if (__atomic_exchange_n(&c->stop, 0, __ATOMIC_ACQUIRE))
+        fail(c, c->stop_rv);
+}
+
+
+static int
+send_cmd(chord_t *c, const struct cmd *cmd)
+{
+    if (cmdq_push(&c->cmdq, cmd) < 0) {
+        WRN("%s: Control queue full, command %d dropped", c->ifname, cmd->type);
+        return -1;
+    }
+    ev_async_send(c->loop, &c->ctl_watcher);
+    return 0;
+}
+
+
+/* Hitless upgrades, see handover.h. The state of a link starts with the
+ * settings that must match, the TUN interface and the transports,
+ * followed by the counters and the state of the modules of each link.
+ * The ROHC contexts cannot be exported from the ROHC library, the new
+ * process starts with fresh contexts and asks the peer to do the same,
+ * see send_resync. */
+
+static void
+conf_header(const chord_t *c, int32_t *v)
+{
+    v[0] = c->tap;
+    v[1] = c->framing;
+    v[2] = c->arq;
+    v[3] = c->fec;
+    v[4] = c->dedup;
+    v[5] = c->agg;
+    v[6] = c->bql;
+    v[7] = c->nports;
+}
+
+
+static void
+put_string(sbuf *b, const char *s)
+{
+    uint32_t len = strlen(s);
+
+    HANDOVER_PUT(b, len);
+    handover_put(b, s, len);
+}
+
+
+static int
+get_string(str *s, char **dst)
+{
+    uint32_t len;
+
+    if (HANDOVER_GET(s, len) < 0 || len > s->len) return -1;
+    *dst = xmalloc(len + 1);
+    memcpy(*dst, s->s, len);
+    (*dst)[len] = '\0';
+    s->s += len;
+    s->len -= len;
+    return 0;
+}
+
+
+static void
+save_stats(const struct stats *st, sbuf *b)
+{
+    uint32_t version = STATS_VERSION;
+    uint64_t len = sizeof(st->started) + sizeof(st->tx) + sizeof(st->rx)
+        + sizeof(st->tx_lat) + sizeof(st->rx_lat);
+
+    HANDOVER_PUT(b, version);
+    HANDOVER_PUT(b, len);
+    HANDOVER_PUT(b, st->started);
+    HANDOVER_PUT(b, st->tx);
+    HANDOVER_PUT(b, st->rx);
+    HANDOVER_PUT(b, st->tx_lat);
+    HANDOVER_PUT(b, st->rx_lat);
+}
+
+
+/* Counters of another version start over */
+static int
+load_stats(struct stats *st, str *s)
+{
+    uint32_t version;
+    uint64_t len;
+
+    if (HANDOVER_GET(s, version) < 0 || HANDOVER_GET(s, len) < 0 || len > s->len)
+        return -1;
+    if (version != STATS_VERSION) {
+        WRN("Statistics of version %u are not carried over", version);
+        s->s += len;
+        s->len -= len;
+        return 0;
+    }
+    if (HANDOVER_GET(s, st->started) < 0 || HANDOVER_GET(s, st->tx) < 0
+        || HANDOVER_GET(s, st->rx) < 0 || HANDOVER_GET(s, st->tx_lat) < 0
+        || HANDOVER_GET(s, st->rx_lat) < 0)
+        return -1;
+    return 0;
+}
+
+
+static void
+save_state(chord_t *c, sbuf *b)
+{
+    int32_t v[HANDOVER_CONF];
+    struct port *port;
+    uint8_t has_txq;
+    int i;
+
+    conf_header(c, v);
+    HANDOVER_PUT(b, v);
+    put_string(b, c->ifname);
+
+    for(i = 0; i < c->nports; i++) {
+        port = &c->ports[i];
+        put_string(b, port->serial);
+        v[0] = port->t->fd >= 0;
+        v[1] = port->t->lfd >= 0;
+        v[2] = port->vmin;
+        v[3] = port->vtime;
+        v[4] = port->low_latency;
+        handover_put(b, v, 5 * sizeof(*v));
+    }
+
+    save_stats(c->stats, b);
+
+    for(i = 0; i < c->nports; i++) {
+        port = &c->ports[i];
+        if (port->cobs) cobs_save(port->cobs, b);
+        else hdlc_save(port->hdlc, b);
+        if (port->eth) eth_save(port->eth, b);
+        if (port->arq) arq_save(port->arq, b);
+        if (port->fec) fec_save(port->fec, b);
+        if (port->dedup) dedup_save(port->dedup, b);
+        has_txq = port->txq != NULL;
+        HANDOVER_PUT(b, has_txq);
+        if (port->txq) txq_save(port->txq, b);
+    }
+}
+
+
+/* Load the state of the modules of a link, once they exist */
+static int
+load_port(struct port *port, str *s)
+{
+    chord_t *c = port->c;
+    uint8_t has_txq;
+
+    if (port->cobs ? cobs_load(port->cobs, s) < 0 : hdlc_load(port->hdlc, s) < 0)
+        return -1;
+    if (port->eth && eth_load(port->eth, s) < 0) return -1;
+    if (port->arq && arq_load(port->arq, s, c->pool) < 0) return -1;
+    if (port->fec && fec_load(port->fec, s) < 0) return -1;
+    if (port->dedup && dedup_load(port->dedup, s) < 0) return -1;
+
+    /* Packets queued for a port that has no queue now go out directly */
+    if (HANDOVER_GET(s, has_txq) < 0) return -1;
+    if (has_txq && port->txq) return txq_load(port->txq, s, c->pool);
+    if (has_txq) {
+        ERR("%s: Byte queue limits are enabled on the running link", port->serial);
+        return -1;
+    }
+    return 0;
+}
+
+
+/* Take the TUN interface and the transports over from the process on
+ * the other end of sock. The state of the link is received into
+ * *state, with s pointing to what is left of it. The settings of the
+ * tty were made by the other process, only the baud rate is changed if
+ * it differs. */
+static int
+adopt(chord_t *c, int sock, sbuf **state, str *s)
+{
+    int fds[HANDOVER_MAX_FDS], nfds, next = 0, fd, lfd, i, k;
+    int32_t v[HANDOVER_CONF], want[HANDOVER_CONF];
+    struct termios tty;
+    struct port *port;
+    char *name;
+
+    if (handover_recv(sock, fds, &nfds, state) < 0) return -1;
+    *s = (*state)->data;
+
+    conf_header(c, want);
+    if (HANDOVER_GET(s, v) < 0 || get_string(s, &name) < 0) goto malformed;
+    if (memcmp(v, want, sizeof(v))) {
+        ERR("The configuration does not match that of the running link");
+        xfree(name);
+        goto error;
+    }
+    if (c->ifname) xfree(c->ifname);
+    c->ifname = name;
+
+    if (next == nfds) goto malformed;
+    c->tunfd = fds[next++];
+
+    for(i = 0; i < c->nports; i++) {
+        port = &c->ports[i];
+        if (get_string(s, &name) < 0) goto malformed;
+        if (strcmp(name, port->serial)) {
+            ERR("Serial port %s is not used by the running link", port->serial);
+            xfree(name);
+            goto error;
+        }
+        xfree(name);
+        if (handover_get(s, v, 5 * sizeof(*v)) < 0 || nfds - next < !!v[0] + !!v[1])
+            goto malformed;
+        fd = v[0] ? fds[next++] : -1;
+        lfd = v[1] ? fds[next++] : -1;
+        port->vmin = v[2];
+        port->vtime = v[3];
+        port->low_latency = v[4];
+
+        if ((port->t = transport_adopt(port->serial, fd, lfd)) == NULL) {
+            if (fd >= 0) close(fd);
+            if (lfd >= 0) close(lfd);
+            goto error;
+        }
+        if (!port->t->tty || (tcgetattr(fd, &tty) == 0 && (k = find_speed(c->baud)) >= 0
+                              && cfgetospeed(&tty) == speeds[k].speed))
+            continue;
+        if (configure_tty(fd, c->baud, TCSADRAIN) < 0) goto error;
+    }
+
+    if (next != nfds) goto malformed;
+    INF("%s: Taking the link over", c->ifname);
+    return 0;
+
+malformed:
+    ERR("Malformed link state");
+error:
+    while (next < nfds)
+        close(fds[next++]);
+    return -1;
+}
+
+
+/* Ask the peer to start its compressor over, the frame goes the way of
+ * a compressed packet */
+static int
+send_resync(struct port *port)
+{
+    struct pbuf *p;
+
+    if ((p = pbuf_alloc(port->c->pool)) == NULL) return 1;
+    p->data[0] = PROTO_RESYNC;
+    p->len = 1;
+    return send_ctl(port, p);
+}
+
+
+/* The link has been taken over: let the old process go, get the peer to
+ * resend its ROHC contexts and pick up where the old process left
+ * off. */
+static int
+resume_link(chord_t *c, int sock)
+{
+    struct port *port;
+    uint64_t now = now_ns();
+    int i;
+
+    if (handover_ack(sock) < 0) return -1;
+
+    for(i = 0; i < c->nports; i++) {
+        port = &c->ports[i];
+        if (port->t->fd >= 0 && send_resync(port) != 0)
+            WRN("%s: Could not ask the peer to resend its ROHC contexts", port->serial);
+        if (port->arq) arm_arq(port, now);
+        if (port->txq && drain(port) < 0) return -1;
+        c->stats->tx.drops += transport_flush(port->t);
+    }
+    INF("%s: Took the link over", c->ifname);
+    return 0;
+}
+
+
+chord_t *
+chord_new(const struct chord_conf *conf)
+{
+    struct port *port;
+    sbuf *state = NULL;
+    char name[64];
+    chord_t *c;
+    str s;
+    int i;
+
+    INF("%s version %s (%s-%s-%s) built on %s", NAME,
+        VERSION, ARCH, OS, PLATFORM, BUILT);
+    DBG("Using libev %d.%d", EV_VERSION_MAJOR, EV_VERSION_MINOR);
+
+    /* Block the SIGPIPE signal so that we don't get killed when we
+     * write to a socket that received RST from the remote peer. We
+     * check for EPIPE in errno instead. */
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+        ERR("Could not block SIGPIPE");
+        return NULL;
+    }
+
+    /* Initialize all members used by chord_free to determine what
+     * cleanup functions to run. This is to ensure that chord_free can
+     * be run in case of an error in chord_new. */
+    c = xcalloc(1, sizeof(*c));
+    c->tunfd = conf->packetfd;
+    c->sig_watcher.fd = conf->sigfd;
+    c->baud = conf->baud;
+    c->tap = conf->tap;
+    c->framing = conf->framing;
+    c->arq = conf->arq;
+    c->fec = conf->fec;
+    c->dedup = conf->dedup;
+    c->agg = conf->agg;
+    c->agg_delay = conf->agg_delay > 0 ? conf->agg_delay : AGG_DELAY;
+    c->bql = conf->bql;
+    c->ack_filter = conf->ack_filter;
+    c->mru = conf->mru;
+    c->flows = conf->flows;
+    c->tun_batch = conf->tun_batch > 0 ? conf->tun_batch : 1;
+    c->tty_batch = conf->tty_batch > 0 ? conf->tty_batch : 1;
+    c->pipeline = conf->pipeline;
+    c->hugepages = conf->hugepages;
+    c->mlock = conf->mlock;
+    c->cpu = conf->cpus[0];
+    c->tx.efd = c->rx.efd = -1;
+    if (conf->ifname) c->ifname = xstrdup(conf->ifname);
+    if (conf->config) c->config = xstrdup(conf->config);
+    cmdq_init(&c->cmdq, CMDQ_SIZE);
+
+    if (!c->pipeline && (conf->cpus[1] >= 0 || conf->cpus[2] >= 0)) {
+        ERR("Pinning the tx and rx threads requires pipeline mode");
+        goto error;
+    }
+
+    if (c->arq < 0 || c->arq > ARQ_MAX_WINDOW) {
+        ERR("The ARQ window must be at most %d frames", ARQ_MAX_WINDOW);
+        goto error;
+    }
+    if (c->pipeline && c->arq) {
+        ERR("Pipeline mode does not support ARQ");
+        goto error;
+    }
+    if (c->pipeline && c->agg) {
+        ERR("Pipeline mode does not support aggregation");
+        goto error;
+    }
+    if (c->pipeline && c->bql) {
+        ERR("Pipeline mode does not support byte queue limits");
+        goto error;
+    }
+    if (c->ack_filter && !c->bql) {
+        ERR("The ACK filter requires byte queue limits");
+        goto error;
+    }
+    if (c->mru && (c->mru < 68 || c->mru > MAX_PACKET_SIZE)) {
+        ERR("The MRU must be between 68 and %d bytes", MAX_PACKET_SIZE);
+        goto error;
+    }
+    if (c->mru && c->mru < 1280)
+        WRN("An MRU of %d bytes is too small for IPv6", c->mru);
+    if (conf->handover >= 0 && (c->pipeline || c->tunfd >= 0)) {
+        ERR("Taking a link over is not supported in pipeline mode or with a packet fd");
+        goto error;
+    }
+
+    if (init_ports(c, conf) < 0) goto error;
+
+    /* Each link runs its own event loop so that links can be run in
+     * different threads. */
+    if ((c->loop = ev_loop_new(EVFLAG_AUTO)) == NULL) {
+        ERR("Could not initialize the main event loop");
+        goto error;
+    }
+
+    ev_async_init(&c->ctl_watcher, control);
+    c->ctl_watcher.data = c;
+    ev_async_start(c->loop, &c->ctl_watcher);
+
+    /* If we were given a signal file descriptor, make it non-blocking
+     * and set up a reader for it. */
+    if (conf->sigfd >= 0) {
+        ev_io_init(&c->sig_watcher, read_signal, conf->sigfd, EV_READ);
+        c->sig_watcher.data = c;
+        if (make_nonblocking(conf->sigfd) < 0) {
+            ERR("Can't make signal file descriptor non-blocking");
+            goto error;
+        }
+        ev_io_start(c->loop, &c->sig_watcher);
+    }
+
+    /* A link taken over keeps the tty settings and whatever is in the
+     * buffers of the ports and the TUN interface */
+    if (conf->handover >= 0) {
+        if (adopt(c, conf->handover, &state, &s) < 0) goto error;
+    } else for(i = 0; i < c->nports; i++) {
+        port = &c->ports[i];
+        if ((port->t = transport_open(port->serial)) == NULL) goto error;
+        if (c->pipeline && port->t->lfd >= 0) {
+            ERR("Pipeline mode does not support listening transports");
+            goto error;
+        }
+        if (!port->t->tty) continue;
+
+        if (configure_tty(port->t->fd, c->baud, TCSAFLUSH) < 0) goto error;
+        if (save_tty(port) < 0) goto error;
+    }
+
+    if (state) {
+        if (c->mru && set_mtu(c->ifname, c->mru) < 0) goto error;
+    } else if (c->tunfd >= 0) {
+        if (make_nonblocking(c->tunfd) < 0) {
+            ERR("Can't make packet file descriptor non-blocking");
+            goto error;
+        }
+        if (c->ifname == NULL) c->ifname = xstrdup("fd");
+        DBG("Using packet file descriptor %d", c->tunfd);
+    } else if ((c->tunfd = open_tun(&c->ifname, c->tap)) < 0
+               || (c->mru && set_mtu(c->ifname, c->mru) < 0)) {
+        goto error;
+    }
+
+    /* The statistics segment is named after the TUN interface, so that
+     * several links can run side by side. A missing segment is not
+     * fatal, the link merely loses its external counters. */
+    if (c->nports > 1)
+        snprintf(name, sizeof(name), "%d links", c->nports);
+    if ((c->stats = stats_open(c->ifname, c->nports > 1 ? name : c->ports[0].serial)) != NULL) {
+        c->stats_shm = 1;
+    } else {
+        WRN("Live statistics will not be available");
+        c->stats = xcalloc(1, sizeof(*c->stats));
+    }
+    c->stats->baud = c->baud;
+    if (state && load_stats(c->stats, &s) < 0) {
+        ERR("Malformed link state");
+        goto error;
+    }
+    if (c->flows > 0) {
+        c->tx_flows = flows_new(c->flows, &c->stats->tx, &c->stats->tx_flows);
+        c->rx_flows = flows_new(c->flows, &c->stats->rx, &c->stats->rx_flows);
+    }
+
+    /* With ARQ, every link holds a window of frames on either side,
+     * with byte queue limits a full transmit queue, with aggregation
+     * the superframes being filled and taken apart */
+    if ((c->pool = pbuf_pool_new((c->pipeline ? PIPE_POOL_SIZE : POOL_SIZE)
+                                 + c->nports * (1 + (c->arq ? 2 * ARQ_MAX_WINDOW : 0)
+                                                + (c->bql ? TXQ_LEN : 0)
+                                                + (c->agg ? 2 : 0)),
+                                 PBUF_SIZE, (c->hugepages ? PBUF_HUGEPAGES : 0)
+                                 | (c->mlock ? PBUF_MLOCK : 0))) == NULL)
+        goto error;
+
+    for(i = 0; i < c->nports; i++) {
+        port = &c->ports[i];
+        if (c->framing == CHORD_FRAMING_COBS) port->cobs = cobs_new(c->stats, c->pool, FRAME_MTU(c->fec));
+        else port->hdlc = hdlc_new(c->stats, c->pool, FRAME_MTU(c->fec));
+        if (c->tap) port->eth = eth_new();
+        if (c->arq) port->arq = arq_new(c->arq, c->stats);
+        if (c->fec) port->fec = fec_new(c->stats, PBUF_BYTES);
+        if (c->dedup) port->dedup = dedup_new(c->stats, PBUF_HEADROOM + PBUF_SIZE + PBUF_TAILROOM);
+        if (c->bql && port->t->tty)
+            port->txq = txq_new(c->baud / BITS_PER_CHAR, (c->tap ? TXQ_ETH : 0)
+                                | (c->ack_filter ? TXQ_ACK_FILTER : 0), c->stats);
+        ev_init(&port->arq_watcher, arq_timeout);
+        port->arq_watcher.data = port;
+        ev_init(&port->txq_watcher, txq_ready);
+        port->txq_watcher.data = port;
+        ev_init(&port->agg_watcher, agg_timeout);
+        port->agg_watcher.data = port;
+        if ((port->comp = comp_new(c->stats)) == NULL)
+            goto error;
+        comp_set_enabled(port->comp, conf->compression);
+        if (conf->profiles && comp_set_profiles(port->comp, conf->profiles) < 0)
+            goto error;
+        if (state && load_port(port, &s) < 0) {
+            ERR("%s: Malformed link state", port->serial);
+            goto error;
+        }
+
+        ev_io_init(&port->watcher, c->pipeline ? ser_feed : ser_readable, port->t->fd, EV_READ);
+        port->watcher.data = port;
+        if (port->t->fd >= 0) ev_io_start(c->loop, &port->watcher);
+
+        if (port->t->lfd >= 0) {
+            ev_io_init(&port->accept_watcher, accept_peer, port->t->lfd, EV_READ);
+            port->accept_watcher.data = port;
+            ev_io_start(c->loop, &port->accept_watcher);
+        }
+
+        ev_init(&port->flush_watcher, flush_tty);
+        port->flush_watcher.data = port;
+        if (port->t->tty && (port->io_profile != CHORD_IO_DEFAULT || state)
+            && set_io_profile(port, port->io_profile) < 0)
+            goto error;
+    }
+
+    ev_io_init(&c->tun_watcher, c->pipeline ? tun_feed : tun_readable, c->tunfd, EV_READ);
+    c->tun_watcher.data = c;
+    ev_io_start(c->loop, &c->tun_watcher);
+
+    if (c->pipeline) {
+        /* The rx thread decompresses while the tx thread compresses,
+         * feedback for the local compressor must not be delivered from
+         * the rx thread. */
+        comp_defer_feedback(c->ports[0].comp, 1);
+        c->want_compression = conf->compression;
+
+        ev_async_init(&c->wake_watcher, resume);
+        c->wake_watcher.data = c;
+        ev_async_start(c->loop, &c->wake_watcher);
+
+        if (start_stage(c, &c->tx, "tx", &c->tun_watcher, conf->cpus[1]) < 0
+            || start_stage(c, &c->rx, "rx", &c->ports[0].watcher, conf->cpus[2]) < 0)
+            goto error;
+        INF("%s: Pipeline mode", c->ifname);
+    }
+
+    if (state) {
+        if (s.len) {
+            ERR("Malformed link state");
+            goto error;
+        }
+        str_free(state);
+        state = NULL;
+        if (resume_link(c, conf->handover) < 0) goto error;
+    }
+    return c;
+
+error:
+    if (state) str_free(state);
+    chord_free(c);
+    return NULL;
+}
+
+
+void
+chord_free(chord_t *c)
+{
+    struct port *port;
+    int i;
+
+    if (c == NULL) return;
+    INF("Shutting down link %s", c->ifname ? c->ifname : "");
+
+    /* The stage threads use everything below */
+    stop_stage(&c->tx);
+    stop_stage(&c->rx);
+
+    for(i = 0; i < c->nports; i++) {
+        port = &c->ports[i];
+        comp_free(port->comp);
+        hdlc_free(port->hdlc);
+        cobs_free(port->cobs);
+        eth_free(port->eth);
+        arq_free(port->arq);
+        fec_free(port->fec);
+        dedup_free(port->dedup);
+        if (port->agg) pbuf_free(port->agg);
+        txq_free(port->txq);
+
+        if (port->t) {
+            DBG("Closing serial port %s", port->serial);
+            if (c->loop) {
+                ev_io_stop(c->loop, &port->watcher);
+                ev_io_stop(c->loop, &port->accept_watcher);
+                ev_timer_stop(c->loop, &port->flush_watcher);
+                ev_timer_stop(c->loop, &port->arq_watcher);
+                ev_timer_stop(c->loop, &port->txq_watcher);
+                ev_timer_stop(c->loop, &port->agg_watcher);
+            }
+            /* The socket file belongs to the new process */
+            if (c->handed_over && port->t->path) {
+                xfree(port->t->path);
+                port->t->path = NULL;
+            }
+            transport_close(port->t);
+        }
+        xfree(port->serial);
+        if (port->routes) xfree(port->routes);
+    }
+    if (c->ports) xfree(c->ports);
+    lpm_free(c->routes4);
+    lpm_free(c->routes6);
+    pbuf_pool_free(c->pool);
+
+    if (c->tunfd >= 0) {
+        DBG("Closing TUN/TAP interface");
+        if (c->loop) ev_io_stop(c->loop, &c->tun_watcher);
+        close(c->tunfd);
+    }
+
+    flows_free(c->tx_flows);
+    flows_free(c->rx_flows);
+    if (c->stats_shm && c->handed_over) stats_unmap(c->stats);
+    else if (c->stats_shm) stats_close(c->stats);
+    else if (c->stats) xfree(c->stats);
+    if (c->ifname) xfree(c->ifname);
+    if (c->config) xfree(c->config);
+
+    if (c->sig_watcher.fd >= 0) {
+        if (c->loop) ev_io_stop(c->loop, &c->sig_watcher);
+        close(c->sig_watcher.fd);
+    }
+
+    /* Destroy the event loop and call any ev_cleanup handlers that
+     * might have been registered. */
+    if (c->loop) {
+        ev_async_stop(c->loop, &c->ctl_watcher);
+        ev_async_stop(c->loop, &c->wake_watcher);
+        ev_loop_destroy(c->loop);
+    }
+    cmdq_free(&c->cmdq);
+    xfree(c);
+}
+
+
+const char *
+chord_ifname(const chord_t *c)
+{
+    return c->ifname;
+}
+
+
+/* Stopping must not fail, so it does not go through the command queue.
+ * Only the most recent return value is kept. */
+void
+chord_stop(chord_t *c, int rv)
+{
+    __atomic_store_n(&c->stop_rv, rv, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->stop, 1, __ATOMIC_RELEASE);
+    ev_async_send(c->loop, &c->ctl_watcher);
+}
+
+
+int
+chord_run(chord_t *c)
+{
+    pin(pthread_self(), c->cpu, "event loop");
+    ev_run(c->loop, 0);
+    return c->retval;
+}
+
+
+int
+chord_handover(chord_t *c, int sock)
+{
+    int fds[HANDOVER_MAX_FDS], nfds = 0, i, rv;
+    struct port *port;
+    sbuf *b;
+
+    if (c->pipeline) {
+        ERR("Pipeline mode does not support upgrades");
+        return -1;
+    }
+
+    /* The new process starts with empty superframes */
+    for(i = 0; i < c->nports; i++) {
+        port = &c->ports[i];
+        if (port->agg && flush_agg(port) < 0) return -1;
+        c->stats->tx.drops += transport_flush(port->t);
+    }
+
+    fds[nfds++] = c->tunfd;
+    for(i = 0; i < c->nports; i++) {
+        port = &c->ports[i];
+        if (port->t->fd >= 0) fds[nfds++] = port->t->fd;
+        if (port->t->lfd >= 0) fds[nfds++] = port->t->lfd;
+    }
+
+    b = str_new(4096);
+    save_state(c, b);
+    INF("%s: Handing the link over, %lu bytes of state", c->ifname,
+        (unsigned long)str_len(b));
+    rv = handover_send(sock, fds, nfds, b);
+    str_free(b);
+    if (rv < 0 || handover_wait(sock, HANDOVER_TIMEOUT) < 0) return -1;
+
+    c->handed_over = 1;
+    INF("%s: Link handed over to the new process", c->ifname);
+    return 0;
+}
+
+
+int
+chord_snapshot(chord_t *c, void (*cb)(const struct stats *stats, void *data),
+               void *data)
+{
+    struct cmd cmd = { .type = CMD_SNAPSHOT, .cb = cb, .data = data };
+    return send_cmd(c, &cmd);
+}
+
+
+int
+chord_set_baud(chord_t *c, int baud)
+{
+    struct cmd cmd = { .type = CMD_BAUD, .value = baud };
+
+    if (find_speed(baud) < 0) {
+        ERR("Unsupported baud rate %d", baud);
+        return -1;
+    }
+    return send_cmd(c, &cmd);
+}
+
+
+int
+chord_set_compression(chord_t *c, int on)
+{
+    struct cmd cmd = { .type = CMD_COMPRESS, .value = !!on };
+    return send_cmd(c, &cmd);
+}
+
+
+int
+chord_set_profiles(chord_t *c, unsigned int mask)
+{
+    struct cmd cmd = { .type = CMD_PROFILES, .value = mask };
+
+    if (!mask) return -1;
+    return send_cmd(c, &cmd);
+}
+
+
+int
+chord_set_limit(chord_t *c, enum chord_limit limit, int value)
+{
+    struct cmd cmd = { .type = CMD_LIMIT, .arg = limit, .value = value };
+
+    if (value < 1 || (limit != CHORD_TUN_BATCH && limit != CHORD_TTY_BATCH))
+        return -1;
+    return send_cmd(c, &cmd);
+}
+
+
+int
+chord_set_io_profile(chord_t *c, int link, enum chord_io_profile profile)
+{
+    struct cmd cmd = { .type = CMD_IO_PROFILE, .arg = link, .value = profile };
+
+    if (link < -1 || link >= c->nports
+        || profile < CHORD_IO_DEFAULT || profile > CHORD_IO_THROUGHPUT)
+        return -1;
+    return send_cmd(c, &cmd);
+}
+
+
+int
+chord_io_profile_id(const char *name)
+{
+    int i;
+
+    for(i = 0; i < ARRAY_SIZE(io_profiles); i++)
+        if (!strcmp(io_profiles[i], name)) return i;
+    return -1;
+}
+
+
+int
+chord_framing_id(const char *name)
+{
+    int i;
+
+    for(i = 0; i < ARRAY_SIZE(framings); i++)
+        if (!strcmp(framings[i], name)) return i;
+    return -1;
+}
+
+
+static int
+same_links(chord_t *c, const struct chord_conf *conf)
+{
+    int i;
+
+    if (conf->nlinks != c->nports) return 0;
+    for(i = 0; i < c->nports; i++) {
+        if (c->ports[i].routes == NULL
+            || strcmp(conf->links[i].serial, c->ports[i].serial)
+            || strcmp(conf->links[i].routes, c->ports[i].routes))
+            return 0;
+    }
+    return 1;
+}
+
+
+/* Settings that are not present in the file are left alone, so that a
+ * reload does not revert settings given on the command line or changed
+ * through the control functions. */
+int
+chord_reload(chord_t *c)
+{
+    struct chord_conf conf;
+    int i, profile, links = 0, rv = 0;
+
+    if (c->config == NULL) {
+        WRN("%s: No configuration file to reload", c->ifname);
+        return -1;
+    }
+
+    memset(&conf, 0, sizeof(conf));
+    conf.baud = conf.compression = conf.tun_batch = conf.tty_batch = -1;
+    conf.pipeline = conf.hugepages = conf.mlock = conf.io_profile = conf.tap = conf.framing = -1;
+    conf.arq = conf.fec = conf.dedup = conf.agg = conf.agg_delay = conf.bql = conf.ack_filter = conf.mru = -1;
+    conf.flows = -1;
+    if (chord_conf_load(&conf, c->config) < 0)
+        return -1;
+    INF("%s: Reloading configuration from %s", c->ifname, c->config);
+
+    if ((conf.ifname && strcmp(conf.ifname, c->ifname))
+        || (conf.tap != -1 && conf.tap != c->tap)
+        || (conf.framing != -1 && conf.framing != c->framing)
+        || (conf.arq != -1 && conf.arq != c->arq)
+        || (conf.fec != -1 && conf.fec != c->fec)
+        || (conf.dedup != -1 && conf.dedup != c->dedup)
+        || (conf.agg != -1 && conf.agg != c->agg)
+        || (conf.bql != -1 && conf.bql != c->bql)
+        || (conf.ack_filter != -1 && conf.ack_filter != c->ack_filter)
+        || (conf.mru != -1 && conf.mru != c->mru)
+        || (conf.flows != -1 && conf.flows != c->flows)
+        || (conf.serial && (c->nports != 1 || strcmp(conf.serial, c->ports[0].serial))))
+        WRN("%s: Interface, serial port, framing, ARQ, FEC, deduplication, aggregation, "
+            "BQL, ACK filter, MRU or flow accounting changes require a restart", c->ifname);
+    if (conf.nlinks && !same_links(c, &conf))
+        WRN("%s: Hub link and route changes require a restart", c->ifname);
+    else
+        links = conf.nlinks;
+    if ((conf.pipeline != -1 && conf.pipeline != c->pipeline)
+        || (conf.hugepages != -1 && conf.hugepages != c->hugepages)
+        || (conf.mlock != -1 && conf.mlock != c->mlock))
+        WRN("%s: Pipeline mode and packet buffer changes require a restart", c->ifname);
+
+    if (conf.baud != -1 && chord_set_baud(c, conf.baud) < 0) rv = -1;
+    if (conf.compression != -1 && chord_set_compression(c, conf.compression) < 0) rv = -1;
+    if (conf.profiles && chord_set_profiles(c, conf.profiles) < 0) rv = -1;
+    if (conf.tun_batch != -1 && chord_set_limit(c, CHORD_TUN_BATCH, conf.tun_batch) < 0) rv = -1;
+    if (conf.tty_batch != -1 && chord_set_limit(c, CHORD_TTY_BATCH, conf.tty_batch) < 0) rv = -1;
+
+    /* Taken by the next superframe, aggregation runs on this thread */
+    if (conf.agg_delay != -1 && conf.agg_delay != c->agg_delay) {
+        INF("%s: Aggregation delay set to %d microseconds", c->ifname, conf.agg_delay);
+        c->agg_delay = conf.agg_delay;
+    }
+
+    /* A link without a profile of its own follows the hub */
+    for(i = 0; i < c->nports; i++) {
+        profile = i < links && conf.links[i].io_profile >= 0
+            ? conf.links[i].io_profile : conf.io_profile;
+        if (profile != -1 && chord_set_io_profile(c, i, profile) < 0) rv = -1;
+    }
 
-    ev_run(EV_DEFAULT_UC_ 0);
-    return retval;
+    chord_conf_free(&conf);
+    return rv;
 }
@@ -6,34 +6,302 @@
 extern int   log_threshold;
 extern int   log_syslog;
 
-extern char *ifname;
-extern char *serial;
-
-/* Initialize the daemon to the point that chord_run can be called.
- * The parameter fd is an optional file descriptor (-1 if not used)
- * for the main loop to watch for incoming signals. Signals can be
- * sent over the fd as 4-byte integer numbers in host order. The
- * function returnts 0 on success and a negative number on error. */
-int chord_init(int fd);
-
-/* Start the main loop of the daemon. This function does not return
- * until a signal is received over the fd configured in chord_init or
- * until another thread of execution calls chord_stop. The function
- * returns 0 if it was terminated explicitly and a negative number on
- * error. The function can be called repeatedly (after chord_stop). */
-int chord_run(void);
-
-/* Stop the main loop of the running daemon and indicate to chord_run
- * to return the value in argument rv. This function can be used to
- * stop the main loop running in one thread from another thread of
- * execution. */
-void chord_stop(int rv);
-
-/* Shut down the whole application. This function deactivates all
- * internal subsystems an releases and resources held. This function
- * can only be called after chord_run has returned. The only function
- * that can be called after chord_cleanup is chord_init. */
-void chord_cleanup(void);
+/* A single link between a TUN interface and a serial port. All state of
+ * a link (file descriptors, event loop, framer, buffers, ROHC contexts
+ * and statistics) is kept in its chord_t handle, so that a process can
+ * run several links side by side, e.g., one per thread. */
+typedef struct chord chord_t;
+
+struct stats;
+
+/* Maximum number of serial links of a hub */
+#define CHORD_MAX_LINKS 32
+
+/* Serial I/O profiles, see chord_conf.io_profile */
+enum chord_io_profile {
+    CHORD_IO_DEFAULT,    /* Leave the tty settings of the port alone    */
+    CHORD_IO_LATENCY,    /* Hand every byte over as soon as it arrives  */
+    CHORD_IO_THROUGHPUT  /* Let the tty layer coalesce input            */
+};
+
+/* Framing of the byte stream, see chord_conf.framing */
+enum chord_framing {
+    CHORD_FRAMING_HDLC,  /* HDLC-like byte stuffing, see hdlc.h         */
+    CHORD_FRAMING_COBS   /* Consistent overhead byte stuffing, cobs.h   */
+};
+
+/* A serial link of a hub and the remote prefixes routed over it */
+struct chord_link {
+    const char *serial; /* Serial port or transport URI               */
+    const char *routes; /* IPv4 or IPv6 prefixes, separated by commas */
+    int  io_profile;    /* -1 to use the io_profile of the hub        */
+};
+
+/* Configuration of a link, see chord_conf_init for default values. */
+struct chord_conf {
+    /* Name of the TUN interface. If NULL, the kernel picks a name. */
+    const char *ifname;
+
+    /* Carry Ethernet frames over a TAP interface (1) instead of IP
+     * packets over a TUN interface (0, the default). The Ethernet
+     * headers are replaced by a one-byte index into a table kept on
+     * both ends of the link (see eth.h) and ROHC runs on the IP packets
+     * inside the frames. TAP mode supports a single serial link. */
+    int         tap;
+
+    /* Serial port special file, or the URI of another transport to
+     * carry the link, e.g., udp://192.0.2.1:5000, see transport.h. The
+     * baud rate and I/O profile only apply to serial ports. */
+    const char *serial;
+    int         baud;
+
+    /* How the serial port hands received bytes over to the link. The
+     * latency profile sets the low latency flag of the driver (if it
+     * has one) and VMIN to 1, so that every byte is processed as soon
+     * as it arrives. The throughput profile sets VMIN so that the port
+     * is not reported readable before a chunk of bytes has arrived and
+     * picks up the rest with a timer, which trades some latency for far
+     * fewer wakeups on a busy link. The default profile keeps the
+     * settings the port had when it was opened. */
+    int         io_profile;
+
+    /* How frames are delimited on the link: HDLC byte stuffing (the
+     * default) or COBS, see cobs.h. HDLC doubles every flag and escape
+     * byte in the payload, COBS adds at most one byte per 254 whatever
+     * the payload. Both ends of a link must use the same framing. */
+    int         framing;
+
+    /* Selective-repeat ARQ between compression and framing, for links
+     * that lose or damage frames (see arq.h): the number of frames in
+     * flight (up to 32), or 0 (the default) to send every frame only
+     * once. A lost frame is then recovered on the link within a round
+     * trip instead of by TCP. Both ends of a link must enable ARQ. Not
+     * supported in pipeline mode. */
+    int         arq;
+
+    /* Reed-Solomon forward error correction (1) or none (0, the
+     * default), for links with steady bit errors. Damaged frames are
+     * repaired without a round trip. The strength adapts to the error
+     * rate each end sees, see fec.h. Both ends of a link must enable
+     * FEC. */
+    int         fec;
+
+    /* Payload deduplication (1) or none (0, the default): chunks of
+     * payload that were sent before go over the link as references to
+     * a cache that both ends keep in step, see dedup.h. Pays off for
+     * traffic that repeats the same blocks of data. Both ends of a link
+     * must enable deduplication. */
+    int         dedup;
+
+    /* Packet aggregation: the most bytes of compressed packets sent in
+     * one frame, or 0 (the default) to send every packet in a frame of
+     * its own. A frame goes out once it is full or agg_delay
+     * microseconds (default 1000) after its first packet, see agg.h.
+     * Saves the per-frame overhead for bursts of small packets. Both
+     * ends of a link must enable aggregation. Not supported in pipeline
+     * mode. */
+    int         agg;
+    int         agg_delay;
+
+    /* Byte queue limits (1) or none (0, the default): packets wait in a
+     * queue of the link, ordered by their DSCP, and only as many bytes
+     * as it takes to keep the UART busy are written to the serial port,
+     * see txq.h. Without it, a packet waits behind everything already
+     * in the tty output queue, seconds at low baud rates. Applies to
+     * serial ports only, not supported in pipeline mode. */
+    int         bql;
+
+    /* TCP ACK filter (1) or none (0, the default): a pure ACK queued
+     * behind the byte queue limit replaces an older ACK of the same
+     * flow that it makes redundant, see txq_push. Frees the slow
+     * direction of a link for data when a bulk transfer runs the other
+     * way. Requires byte queue limits. */
+    int         ack_filter;
+
+    /* The largest IP packet the link carries (MRU), or 0 (the default)
+     * to leave the MTU of the TUN interface alone. The MTU of the TUN
+     * interface is set to the MRU, and the MSS option of TCP SYNs in
+     * either direction is lowered to fit, so that endpoints size their
+     * segments for the link. At least 68, IPv6 needs 1280. */
+    int         mru;
+
+    /* Per-flow accounting: the number of flows tracked per direction,
+     * or 0 (the default) to track none. Packets, bytes before and after
+     * compression, a share of the bytes on the wire and drops are
+     * counted per 5-tuple, and the flows with the most wire bytes are
+     * published in the statistics (see chordstat), see flows.h. */
+    int         flows;
+
+    /* Hub mode, used instead of serial: one TUN interface with several
+     * serial links. A packet read from the TUN interface goes over the
+     * link with the longest prefix that matches its destination, and is
+     * dropped if there is none. Every link has its own ROHC contexts.
+     * The baud rate and compression settings apply to all links. See
+     * chord_conf_add_link. */
+    struct chord_link links[CHORD_MAX_LINKS];
+    int         nlinks;
+
+    /* An already open file descriptor to be used instead of a TUN
+     * interface, or -1 (the default) to open a TUN interface. The file
+     * descriptor must preserve packet boundaries, e.g., one end of a
+     * SOCK_SEQPACKET socket pair. The link takes ownership of the file
+     * descriptor. This makes it possible to attach an in-process packet
+     * source and sink. */
+    int         packetfd;
+
+    /* An optional file descriptor (-1 if not used) for the event loop
+     * to watch for incoming signals. Signals can be sent over the fd as
+     * 4-byte integer numbers in host order. The link takes ownership of
+     * the file descriptor. */
+    int         sigfd;
+
+    /* Send packets compressed (1, the default) or uncompressed (0). */
+    int         compression;
+
+    /* Bit mask of the ROHC profiles enabled on the compressor, see
+     * COMP_PROFILE in comp.h. Zero keeps the default profiles. */
+    unsigned int profiles;
+
+    /* Scheduler limits: the maximum number of packets read from the
+     * TUN interface and the maximum number of reads from the serial
+     * port in one iteration of the event loop. */
+    int         tun_batch;
+    int         tty_batch;
+
+    /* Run compression and framing in a thread per direction (1) or
+     * everything on the event loop thread (0, the default). In pipeline
+     * mode the event loop only reads from the TUN interface and the
+     * serial port and hands the data over to the tx and rx threads
+     * through lock-free rings. */
+    int         pipeline;
+
+    /* CPUs to pin the event loop (the thread calling chord_run), tx and
+     * rx threads to, -1 (the default) leaves a thread unpinned. Pinning
+     * the tx and rx threads requires pipeline mode. */
+    int         cpus[3];
+
+    /* Packets are kept in a pool of buffers allocated when the link is
+     * created. Back the pool with huge pages (if available) and lock it
+     * into memory, so that the data path does not take TLB misses or
+     * page faults. Both are off by default. */
+    int         hugepages;
+    int         mlock;
+
+    /* Configuration file to be re-read on SIGHUP, or NULL. */
+    const char *config;
+
+    /* An open Unix socket to take the link over from a running process
+     * (see chord_handover), or -1 (the default) to open the TUN
+     * interface and the serial ports. The TUN interface, the transports
+     * and the state of the link come from the other process, the
+     * configuration must match that of the running link. Not supported
+     * in pipeline mode or with packetfd. The link does not take
+     * ownership of the socket. */
+    int         handover;
+
+    void       *text; /* Private, see chord_conf_load */
+};
+
+/* Fill in the configuration with default values. */
+void chord_conf_init(struct chord_conf *conf);
+
+/* Load settings from a configuration file (see conf.c for the format)
+ * into conf. Settings not present in the file are left unchanged.
+ * String values point into memory owned by conf, which must be
+ * released with chord_conf_free. Returns 0 on success and a negative
+ * number on error, conf must not be used after an error. */
+int chord_conf_load(struct chord_conf *conf, const char *fn);
+
+void chord_conf_free(struct chord_conf *conf);
+
+/* Add a hub link given as "<serial port> <prefix>[,<prefix>...]", e.g.,
+ * "/dev/ttyUSB1 10.1.0.0/16, fd00:1::/48", optionally followed by the
+ * serial I/O profile of the link, e.g., "io=latency". The string is
+ * modified and must remain valid while conf is used. Returns 0 on success and a
+ * negative number if the string is malformed or there are too many
+ * links. */
+int chord_conf_add_link(struct chord_conf *conf, char *spec);
+
+/* Create a new link with its own event loop and initialize it to the
+ * point that chord_run can be called. The configuration is copied and
+ * does not need to remain valid. Returns NULL on error. */
+chord_t *chord_new(const struct chord_conf *conf);
+
+/* Returned by chord_run after SIGUSR2: hand the link over to a new
+ * process, see chord_handover. */
+#define CHORD_UPGRADE 1
+
+/* Run the event loop of the link. This function does not return until
+ * a signal is received over the signal fd or until chord_stop is
+ * called. The function returns 0 if it was terminated explicitly,
+ * CHORD_UPGRADE if SIGUSR2 asked for an upgrade and a negative number
+ * on error. The function can be called repeatedly (after chord_stop). */
+int chord_run(chord_t *c);
+
+/* Hand a stopped link over to a new process that calls chord_new with
+ * the other end of the Unix socket sock in chord_conf.handover, without
+ * losing frames or the state that both ends of the link share. Returns
+ * 0 once the new process has taken the link over, the link must then
+ * only be released with chord_free, which leaves the TUN interface,
+ * the transports and the statistics segment alone. Returns -1 if the
+ * handover failed, the link can be run again. */
+int chord_handover(chord_t *c, int sock);
+
+/* Stop the event loop of the link and indicate to chord_run to return
+ * the value in argument rv. This function can be called from any
+ * thread. */
+void chord_stop(chord_t *c, int rv);
+
+/* Shut down the link and release all resources held by it. This
+ * function can only be called after chord_run has returned. */
+void chord_free(chord_t *c);
+
+/* The name of the TUN interface, as assigned by the kernel. */
+const char *chord_ifname(const chord_t *c);
+
+
+/* Control functions. The functions below can be called from any thread
+ * while the link is running. The request is queued and carried out by
+ * the event loop of the link, the ROHC contexts are kept. The functions
+ * return 0 if the request was queued and a negative number if the
+ * request is invalid or the queue is full. */
+
+enum chord_limit {
+    CHORD_TUN_BATCH,
+    CHORD_TTY_BATCH
+};
+
+/* Call cb from the event loop thread with the statistics of the link.
+ * The statistics do not change while cb runs, except in pipeline mode
+ * where the tx and rx threads keep updating their counters. */
+int chord_snapshot(chord_t *c, void (*cb)(const struct stats *stats, void *data),
+                   void *data);
+
+/* Change the baud rate of the serial port. The change takes effect
+ * once the frames already written to the port have been sent. */
+int chord_set_baud(chord_t *c, int baud);
+
+int chord_set_compression(chord_t *c, int on);
+
+int chord_set_profiles(chord_t *c, unsigned int mask);
+
+int chord_set_limit(chord_t *c, enum chord_limit limit, int value);
+
+/* Switch link number link (in the order the hub links were given, 0
+ * without hub mode) or, with link -1, all links to a serial I/O
+ * profile. */
+int chord_set_io_profile(chord_t *c, int link, enum chord_io_profile profile);
+
+/* The serial I/O profile with the given name ("default", "latency" or
+ * "throughput"), or -1. */
+int chord_io_profile_id(const char *name);
+
+/* The framing with the given name ("hdlc" or "cobs"), or -1. */
+int chord_framing_id(const char *name);
+
+/* Re-read the configuration file of the link and apply the settings
+ * that can be changed at runtime. This is what SIGHUP does. */
+int chord_reload(chord_t *c);
 
 
 #endif /* _CHORD_H_ */
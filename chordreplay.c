@@ -0,0 +1,374 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <stddef.h>
+#include <netinet/in.h>
+#include <rohc/rohc.h>
+
+#include "chord.h"
+#include "log.h"
+#include "utils.h"
+#include "hdlc.h"
+#include "comp.h"
+#include "trace.h"
+#include "ip.h"
+
+/* Offline replay of packet traces. Every IP packet of a pcap or pcapng
+ * file is pushed through the transmit path (comp_shrink and
+ * build_hdlc_frame) and back through the receive path
+ * (decode_hdlc_frame and comp_expand), without a TUN interface or a
+ * serial port. The result must be identical to the original packet.
+ * The program reports throughput, the compression ratio per ROHC
+ * profile and the flows that benefit the most (or the least). */
+
+#define MAX_PROFILES 16
+#define FLOW_BITS    16
+#define FLOW_SLOTS   (1U << FLOW_BITS)
+
+struct counters {
+    uint64_t packets;
+    uint64_t bytes;      /* IP bytes                   */
+    uint64_t comp_bytes; /* After compression          */
+    uint64_t wire_bytes; /* After framing              */
+};
+
+struct flow {
+    uint8_t  used;
+    uint8_t  version;
+    uint8_t  proto;
+    uint8_t  src[16];
+    uint8_t  dst[16];
+    uint16_t sport, dport;
+    struct counters c;
+};
+
+static struct counters total, profiles[MAX_PROFILES + 1];
+static struct flow *flows;
+static uint64_t nflows, flow_overflow;
+static uint64_t mismatches, errors;
+
+/* The framer and the compressor under test, and their counters */
+static struct stats link_stats;
+static struct pbuf_pool *pool;
+static struct hdlc *framer;
+static struct comp *compressor;
+
+static int iterations = 1;
+static int top = 10;
+static int verbose;
+
+
+static void
+print_help(void)
+{
+    static char help_msg[] = "\
+Usage: chordreplay [options] <trace.pcap> [trace.pcap ...]\n\
+Options:\n\
+    -h  This help text\n\
+    -v  Report every packet that does not survive the round trip\n\
+    -n  Replay the traces the given number of times (default 1)\n\
+    -f  Number of flows to list (default 10)\n\
+\n\
+The program exits with status 2 if any packet did not survive the\n\
+round trip bit-exact.\n\
+";
+
+    fprintf(stdout, "%s", help_msg);
+    exit(EXIT_SUCCESS);
+}
+
+
+static void
+count(struct counters *c, size_t len, size_t clen, size_t flen)
+{
+    c->packets++;
+    c->bytes += len;
+    c->comp_bytes += clen;
+    c->wire_bytes += flen;
+}
+
+
+static uint32_t
+hash(const uint8_t *p, size_t len, uint32_t h)
+{
+    while (len--) h = (h ^ *p++) * 16777619;
+    return h;
+}
+
+
+/* Extract the flow key from an IP packet. Ports are only filled in for
+ * TCP and UDP packets that are not later fragments. */
+static void
+flow_key(struct flow *k, const uint8_t *p, size_t len)
+{
+    struct ip_info ip;
+
+    memset(k, 0, sizeof(*k));
+    if (ip_parse(p, len, &ip) < 0) {
+        k->version = p[0] >> 4;
+        return;
+    }
+    k->version = ip.version;
+    k->proto = ip.proto < 0 ? 0 : ip.proto;
+    memcpy(k->src, ip.src, ip.version == 6 ? 16 : 4);
+    memcpy(k->dst, ip.dst, ip.version == 6 ? 16 : 4);
+
+    if (!ip.fragment && (ip.proto == IPPROTO_TCP || ip.proto == IPPROTO_UDP)
+        && len >= ip.hlen + 4) {
+        k->sport = (p[ip.hlen] << 8) | p[ip.hlen + 1];
+        k->dport = (p[ip.hlen + 2] << 8) | p[ip.hlen + 3];
+    }
+}
+
+
+static struct flow *
+flow_find(const uint8_t *p, size_t len)
+{
+    struct flow k, *f;
+    uint32_t h, i;
+
+    flow_key(&k, p, len);
+    h = hash(&k.version, offsetof(struct flow, c) - offsetof(struct flow, version), 2166136261U);
+
+    for(i = 0; i < FLOW_SLOTS; i++) {
+        f = &flows[(h + i) & (FLOW_SLOTS - 1)];
+        if (!f->used) {
+            if (nflows >= FLOW_SLOTS * 3 / 4) return NULL;
+            *f = k;
+            f->used = 1;
+            nflows++;
+            return f;
+        }
+        if (!memcmp(&f->version, &k.version,
+                    offsetof(struct flow, c) - offsetof(struct flow, version)))
+            return f;
+    }
+    return NULL;
+}
+
+
+static void
+replay(const uint8_t *pkt, size_t len)
+{
+    struct pbuf *p, *rx;
+    char *frame;
+    size_t clen, flen;
+    struct flow *f;
+    int profile, rv;
+
+    if (len > MAX_PACKET_SIZE || (p = pbuf_alloc(pool)) == NULL) {
+        errors++;
+        return;
+    }
+    memcpy(p->data, pkt, len);
+    p->len = len;
+
+    if (comp_shrink(compressor, &p) < 0) {
+        pbuf_free(p);
+        errors++;
+        return;
+    }
+    clen = p->len;
+    profile = comp_last_profile(compressor);
+
+    if (build_hdlc_frame_pbuf(framer, p, &frame, &flen) < 0) {
+        pbuf_free(p);
+        errors++;
+        return;
+    }
+
+    rv = decode_hdlc_frame(framer, &rx, frame, flen);
+    pbuf_free(p);
+    if (rx == NULL || rv != flen) {
+        if (verbose) fprintf(stderr, "Frame of packet %llu not decoded\n",
+                             (unsigned long long)total.packets);
+        if (rx) pbuf_free(rx);
+        errors++;
+        return;
+    }
+
+    if (comp_expand(compressor, &rx) < 0) {
+        if (verbose) fprintf(stderr, "Packet %llu not decompressed\n",
+                             (unsigned long long)total.packets);
+        pbuf_free(rx);
+        errors++;
+        return;
+    }
+
+    if (rx->len != len || memcmp(rx->data, pkt, len)) {
+        if (verbose) fprintf(stderr, "Packet %llu differs after round trip "
+                             "(%zu vs %zu bytes)\n",
+                             (unsigned long long)total.packets, rx->len, len);
+        mismatches++;
+    }
+    pbuf_free(rx);
+
+    count(&total, len, clen, flen);
+    if (profile < 0 || profile >= MAX_PROFILES) profile = MAX_PROFILES;
+    count(&profiles[profile], len, clen, flen);
+
+    if ((f = flow_find(pkt, len)) != NULL) count(&f->c, len, clen, flen);
+    else flow_overflow++;
+}
+
+
+static double
+ratio(uint64_t a, uint64_t b)
+{
+    return b ? (double)a / (double)b : 0.0;
+}
+
+
+static int64_t
+saving(const struct flow *f)
+{
+    return (int64_t)f->c.bytes - (int64_t)f->c.wire_bytes;
+}
+
+
+static int
+cmp_saving(const void *a, const void *b)
+{
+    int64_t x = saving(a), y = saving(b);
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+
+static void
+print_flow(const struct flow *f)
+{
+    char src[INET6_ADDRSTRLEN], dst[INET6_ADDRSTRLEN];
+    int af = f->version == 6 ? AF_INET6 : AF_INET;
+
+    inet_ntop(af, f->src, src, sizeof(src));
+    inet_ntop(af, f->dst, dst, sizeof(dst));
+    printf("  %s:%u > %s:%u proto %u: %llu packets, %llu -> %llu bytes, saved %lld (%.1f%%)\n",
+           src, f->sport, dst, f->dport, f->proto,
+           (unsigned long long)f->c.packets, (unsigned long long)f->c.bytes,
+           (unsigned long long)f->c.wire_bytes, (long long)saving(f),
+           f->c.bytes ? 100.0 * saving(f) / f->c.bytes : 0.0);
+}
+
+
+static void
+report(double secs, uint64_t skipped)
+{
+    uint64_t i, n;
+    struct flow *list;
+    const char *name;
+
+    printf("packets      %llu (%llu skipped, %llu errors, %llu mismatches)\n",
+           (unsigned long long)total.packets, (unsigned long long)skipped,
+           (unsigned long long)errors, (unsigned long long)mismatches);
+    printf("bytes        %llu IP, %llu compressed, %llu on the wire\n",
+           (unsigned long long)total.bytes, (unsigned long long)total.comp_bytes,
+           (unsigned long long)total.wire_bytes);
+    printf("ratio        %.3f compressed, %.3f on the wire\n",
+           ratio(total.comp_bytes, total.bytes), ratio(total.wire_bytes, total.bytes));
+    printf("throughput   %.0f packets/s, %.1f Mbit/s\n",
+           secs > 0 ? total.packets / secs : 0.0,
+           secs > 0 ? total.bytes * 8 / secs / 1e6 : 0.0);
+
+    printf("\nper IP version:\n");
+    printf("  %-32s %10llu packets, ratio %.3f\n", "IPv4",
+           (unsigned long long)link_stats.tx.v4_packets,
+           ratio(link_stats.tx.v4_comp_bytes, link_stats.tx.v4_bytes));
+    printf("  %-32s %10llu packets, ratio %.3f\n", "IPv6",
+           (unsigned long long)link_stats.tx.v6_packets,
+           ratio(link_stats.tx.v6_comp_bytes, link_stats.tx.v6_bytes));
+
+    printf("\nper profile:\n");
+    for(i = 0; i <= MAX_PROFILES; i++) {
+        if (!profiles[i].packets) continue;
+        name = i == MAX_PROFILES ? "uncompressed (passthrough)"
+            : rohc_get_profile_descr(i);
+        printf("  %-32s %10llu packets, ratio %.3f, wire %.3f\n", name,
+               (unsigned long long)profiles[i].packets,
+               ratio(profiles[i].comp_bytes, profiles[i].bytes),
+               ratio(profiles[i].wire_bytes, profiles[i].bytes));
+    }
+
+    list = xmalloc(nflows * sizeof(*list) + 1);
+    for(i = 0, n = 0; i < FLOW_SLOTS; i++)
+        if (flows[i].used) list[n++] = flows[i];
+    qsort(list, n, sizeof(*list), cmp_saving);
+
+    printf("\n%llu flows%s, largest savings:\n", (unsigned long long)n,
+           flow_overflow ? " (table full, some packets not attributed)" : "");
+    for(i = 0; i < n && i < top; i++) print_flow(&list[i]);
+
+    if (n > top) {
+        printf("\nsmallest savings:\n");
+        for(i = n > top * 2 ? n - top : top; i < n; i++) print_flow(&list[i]);
+    }
+    xfree(list);
+}
+
+
+int
+main(int argc, char **argv)
+{
+    struct trace t;
+    const uint8_t *pkt;
+    size_t len;
+    uint64_t ts, start, skipped = 0;
+    int opt, i, n, rv;
+
+    log_syslog = 0;
+    log_threshold = L_ERR;
+
+    while((opt = getopt(argc, argv, "hvn:f:")) != -1) {
+        switch(opt) {
+        case 'h': print_help();              break;
+        case 'v': verbose++;                 break;
+        case 'n': iterations = atoi(optarg); break;
+        case 'f': top = atoi(optarg);        break;
+        default:
+            fprintf(stderr, "Use the -h option for list of supported "
+                    "program arguments.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, "Please give at least one trace file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    flows = xcalloc(FLOW_SLOTS, sizeof(*flows));
+    if ((pool = pbuf_pool_new(8, MAX_PACKET_SIZE + 1, 0)) == NULL)
+        exit(EXIT_FAILURE);
+    framer = hdlc_new(&link_stats, pool, MAX_PACKET_SIZE + 1);
+    if ((compressor = comp_new(&link_stats)) == NULL) {
+        fprintf(stderr, "Could not initialize the compressor\n");
+        exit(EXIT_FAILURE);
+    }
+
+    start = now_ns();
+    for(i = optind; i < argc; i++) {
+        if (trace_open(&t, argv[i]) < 0) exit(EXIT_FAILURE);
+        for(n = 0; n < iterations; n++) {
+            trace_rewind(&t);
+            while ((rv = trace_next(&t, &pkt, &len, &ts)) > 0)
+                replay(pkt, len);
+            if (rv < 0) {
+                fprintf(stderr, "%s: Malformed trace\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        skipped += t.skipped;
+        trace_close(&t);
+    }
+
+    report((now_ns() - start) / 1e9, skipped);
+
+    comp_free(compressor);
+    hdlc_free(framer);
+    pbuf_pool_free(pool);
+    xfree(flows);
+    return (mismatches || errors) ? 2 : 0;
+}
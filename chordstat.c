@@ -0,0 +1,304 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "stats.h"
+#include "utils.h"
+
+static int interval;
+static int count = -1;
+
+static void
+print_help(void)
+{
+    static char help_msg[] = "\
+Usage: " NAME "stat [options] [interface]\n\
+Options:\n\
+    -h  This help text\n\
+    -i  Print differences every given number of seconds\n\
+    -c  Stop after given number of intervals\n\
+\n\
+If no interface is given, the first running daemon found is used.\n\
+";
+
+    fprintf(stdout, "%s", help_msg);
+    exit(EXIT_SUCCESS);
+}
+
+
+/* Find the name of the first statistics segment in /dev/shm. */
+static char *
+find_segment(void)
+{
+    DIR *d;
+    struct dirent *e;
+    char *rv = NULL;
+    const char *pfx = STATS_PREFIX + 1;
+
+    if ((d = opendir("/dev/shm")) == NULL) return NULL;
+    while ((e = readdir(d)) != NULL) {
+        if (strncmp(e->d_name, pfx, strlen(pfx))) continue;
+        rv = xstrdup(e->d_name + strlen(pfx));
+        break;
+    }
+    closedir(d);
+    return rv;
+}
+
+
+static double
+ratio(uint64_t a, uint64_t b)
+{
+    return b ? (double)a / (double)b : 0.0;
+}
+
+
+#define ROW(name, field)                                                \
+    printf("%-16s %16llu %16llu\n", name,                               \
+           (unsigned long long)(cur->tx.field - old->tx.field),         \
+           (unsigned long long)(cur->rx.field - old->rx.field))
+
+static void
+print_stats(const struct stats *cur, const struct stats *old)
+{
+    printf("%-16s %16s %16s\n", "", "tx", "rx");
+    ROW("packets", packets);
+    ROW("bytes", bytes);
+    ROW("comp_bytes", comp_bytes);
+    ROW("wire_bytes", wire_bytes);
+    ROW("frames", frames);
+    ROW("compressed", compressed);
+    ROW("passthrough", passthrough);
+    ROW("comp_errors", comp_errors);
+    ROW("frame_errors", frame_errors);
+    ROW("drops", drops);
+    ROW("retransmits", retransmits);
+    ROW("fec_bytes", fec_bytes);
+    ROW("fec_corrected", fec_corrected);
+    ROW("acks_filtered", acks_filtered);
+    ROW("dedup_bytes", dedup_bytes);
+    ROW("dedup_misses", dedup_misses);
+    ROW("v4_packets", v4_packets);
+    ROW("v4_bytes", v4_bytes);
+    ROW("v4_comp_bytes", v4_comp_bytes);
+    ROW("v6_packets", v6_packets);
+    ROW("v6_bytes", v6_bytes);
+    ROW("v6_comp_bytes", v6_comp_bytes);
+
+    /* Compression ratio is the size after compression relative to the
+     * original size. Framing overhead is the size on the wire relative
+     * to the compressed size. Link efficiency combines both. */
+    printf("%-16s %16.3f %16.3f\n", "comp_ratio",
+           ratio(cur->tx.comp_bytes - old->tx.comp_bytes, cur->tx.bytes - old->tx.bytes),
+           ratio(cur->rx.comp_bytes - old->rx.comp_bytes, cur->rx.bytes - old->rx.bytes));
+    printf("%-16s %16.3f %16.3f\n", "v4_comp_ratio",
+           ratio(cur->tx.v4_comp_bytes - old->tx.v4_comp_bytes, cur->tx.v4_bytes - old->tx.v4_bytes),
+           ratio(cur->rx.v4_comp_bytes - old->rx.v4_comp_bytes, cur->rx.v4_bytes - old->rx.v4_bytes));
+    printf("%-16s %16.3f %16.3f\n", "v6_comp_ratio",
+           ratio(cur->tx.v6_comp_bytes - old->tx.v6_comp_bytes, cur->tx.v6_bytes - old->tx.v6_bytes),
+           ratio(cur->rx.v6_comp_bytes - old->rx.v6_comp_bytes, cur->rx.v6_bytes - old->rx.v6_bytes));
+    printf("%-16s %16.3f %16.3f\n", "frame_overhead",
+           ratio(cur->tx.wire_bytes - old->tx.wire_bytes, cur->tx.comp_bytes - old->tx.comp_bytes),
+           ratio(cur->rx.wire_bytes - old->rx.wire_bytes, cur->rx.comp_bytes - old->rx.comp_bytes));
+    printf("%-16s %16.3f %16.3f\n", "efficiency",
+           ratio(cur->tx.bytes - old->tx.bytes, cur->tx.wire_bytes - old->tx.wire_bytes),
+           ratio(cur->rx.bytes - old->rx.bytes, cur->rx.wire_bytes - old->rx.wire_bytes));
+}
+
+
+static void
+print_hist(const char *name, const struct hist *cur, const struct hist *old)
+{
+    struct hist h;
+
+    hist_sub(&h, cur, old);
+    printf("%-16s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+           (unsigned long long)h.count,
+           h.count ? h.sum / 1000.0 / h.count : 0.0,
+           hist_percentile(&h, 50) / 1000.0,
+           hist_percentile(&h, 99) / 1000.0,
+           hist_percentile(&h, 99.9) / 1000.0,
+           h.max / 1000.0);
+}
+
+
+/* Print latency percentiles, all values in microseconds. */
+static void
+print_lat(const struct stats *cur, const struct stats *old)
+{
+    printf("\n%-16s %10s %10s %10s %10s %10s %10s\n", "latency [us]",
+           "count", "avg", "p50", "p99", "p999", "max");
+    print_hist("tx_comp",  &cur->tx_lat.comp,  &old->tx_lat.comp);
+    print_hist("tx_frame", &cur->tx_lat.frame, &old->tx_lat.frame);
+    print_hist("tx_write", &cur->tx_lat.write, &old->tx_lat.write);
+    print_hist("tx_uart",  &cur->tx_lat.total, &old->tx_lat.total);
+    print_hist("rx_frame", &cur->rx_lat.frame, &old->rx_lat.frame);
+    print_hist("rx_comp",  &cur->rx_lat.comp,  &old->rx_lat.comp);
+    print_hist("rx_write", &cur->rx_lat.write, &old->rx_lat.write);
+    print_hist("rx_total", &cur->rx_lat.total, &old->rx_lat.total);
+}
+
+
+/* Copy the top talkers of one direction while the daemon is not in the
+ * middle of updating them, see struct stats_flows */
+static void
+copy_flows(struct stats_flows *dst, const struct stats_flows *src)
+{
+    uint32_t seq;
+    int tries;
+
+    for(tries = 0; tries < 100; tries++) {
+        seq = __atomic_load_n(&src->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            usleep(1000);
+            continue;
+        }
+        memcpy(dst, src, sizeof(*dst));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&src->seq, __ATOMIC_RELAXED) == seq) return;
+    }
+    dst->count = 0;
+}
+
+
+static void
+snapshot(struct stats *dst, const struct stats *src)
+{
+    memcpy(dst, src, sizeof(*dst));
+    copy_flows(&dst->tx_flows, &src->tx_flows);
+    copy_flows(&dst->rx_flows, &src->rx_flows);
+}
+
+
+static const char *
+proto_name(const struct flow_key *k, char *buf, size_t size)
+{
+    if (k->version == 0) return "-";
+    switch(k->proto) {
+    case IPPROTO_TCP:    return "tcp";
+    case IPPROTO_UDP:    return "udp";
+    case IPPROTO_ICMP:   return "icmp";
+    case IPPROTO_ICMPV6: return "icmp6";
+    case IPPROTO_SCTP:   return "sctp";
+    case IPPROTO_ESP:    return "esp";
+    case IPPROTO_GRE:    return "gre";
+    }
+    snprintf(buf, size, "%u", k->proto);
+    return buf;
+}
+
+
+static const char *
+endpoint(const struct flow_key *k, const uint8_t *addr, uint16_t port,
+         char *buf, size_t size)
+{
+    char a[INET6_ADDRSTRLEN];
+
+    if (k->version == 0) return "non-ip";
+    inet_ntop(k->version == 4 ? AF_INET : AF_INET6, addr, a, sizeof(a));
+    if (k->sport == 0 && k->dport == 0) snprintf(buf, size, "%s", a);
+    else if (k->version == 4) snprintf(buf, size, "%s:%u", a, port);
+    else snprintf(buf, size, "[%s]:%u", a, port);
+    return buf;
+}
+
+
+/* Print the flows with the most wire bytes. Unlike the counters above,
+ * the values are totals since a flow was first seen. */
+static void
+print_flows(const char *dir, const struct stats_flows *f)
+{
+    const struct stats_flow *x;
+    char p[8], src[56], dst[56];
+    uint32_t i;
+
+    if (f->tracked == 0) return;
+    printf("\n%s flows: %u active, %u tracked, %llu evicted\n", dir, f->active,
+           f->tracked, (unsigned long long)f->evicted);
+    printf("%-6s %-24s %-24s %10s %12s %10s %12s %8s %6s\n", "proto", "src", "dst",
+           "packets", "bytes", "comp_ratio", "wire_bytes", "drops", "idle");
+    for(i = 0; i < f->count && i < STATS_FLOWS; i++) {
+        x = &f->flow[i];
+        printf("%-6s %-24s %-24s %10llu %12llu %10.3f %12llu %8llu %5us\n",
+               proto_name(&x->key, p, sizeof(p)),
+               endpoint(&x->key, x->key.src, x->key.sport, src, sizeof(src)),
+               endpoint(&x->key, x->key.dst, x->key.dport, dst, sizeof(dst)),
+               (unsigned long long)x->packets, (unsigned long long)x->bytes,
+               ratio(x->comp_bytes, x->bytes), (unsigned long long)x->wire_bytes,
+               (unsigned long long)x->drops, x->idle);
+    }
+}
+
+
+int
+main(int argc, char **argv)
+{
+    int opt;
+    char *name;
+    const struct stats *s;
+    static struct stats cur, old;
+
+    while((opt = getopt(argc, argv, "hi:c:")) != -1) {
+        switch(opt) {
+        case 'h': print_help();              break;
+        case 'i': interval = atoi(optarg);   break;
+        case 'c': count = atoi(optarg);      break;
+        default:
+            fprintf(stderr, "Use the -h option for list of supported "
+                    "program arguments.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind < argc) name = xstrdup(argv[optind]);
+    else name = find_segment();
+
+    if (name == NULL) {
+        fprintf(stderr, "No running daemon found\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((s = stats_map(name)) == NULL) {
+        fprintf(stderr, "Could not open statistics of %s: %s\n", name,
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%s: pid %d, serial port %s at %d baud, up %llds\n", s->ifname,
+           s->pid, s->serial, s->baud, (long long)((now() - s->started) / SEC));
+
+    /* The first report contains absolute values, subsequent reports
+     * contain differences over the interval. */
+    memset(&old, 0, sizeof(old));
+    snapshot(&cur, s);
+    print_stats(&cur, &old);
+    print_lat(&cur, &old);
+    print_flows("tx", &cur.tx_flows);
+    print_flows("rx", &cur.rx_flows);
+
+    while (interval > 0 && count != 0) {
+        sleep(interval);
+        old = cur;
+        snapshot(&cur, s);
+        if (cur.pid != old.pid || cur.started != old.started) {
+            fprintf(stderr, "Daemon restarted\n");
+            break;
+        }
+        printf("\n");
+        print_stats(&cur, &old);
+        print_lat(&cur, &old);
+        print_flows("tx", &cur.tx_flows);
+        print_flows("rx", &cur.rx_flows);
+        if (count > 0) count--;
+    }
+
+    stats_unmap(s);
+    xfree(name);
+    return 0;
+}
@@ -0,0 +1,78 @@
+#include "cmdq.h"
+#include <assert.h>
+
+#include "utils.h"
+
+
+void
+cmdq_init(struct cmdq *q, unsigned long size)
+{
+    unsigned long i;
+
+    assert(size && !(size & (size - 1)));
+
+    q->slots = xmalloc(size * sizeof(*q->slots));
+    for(i = 0; i < size; i++) q->slots[i].seq = i;
+    q->mask = size - 1;
+    q->head = q->tail = 0;
+}
+
+
+void
+cmdq_free(struct cmdq *q)
+{
+    if (q->slots) xfree(q->slots);
+    q->slots = NULL;
+}
+
+
+/* A slot at position pos is free for a producer when its sequence
+ * number equals pos, and holds a command for the consumer when the
+ * sequence number equals pos + 1. The consumer hands the slot back to
+ * producers by advancing the sequence number by the size of the
+ * queue. */
+int
+cmdq_push(struct cmdq *q, const struct cmd *cmd)
+{
+    struct cmdq_slot *s;
+    unsigned long pos, seq;
+    long dif;
+
+    pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    for(;;) {
+        s = &q->slots[pos & q->mask];
+        seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        dif = (long)seq - (long)pos;
+
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (dif < 0) {
+            return -1;
+        } else {
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    s->cmd = *cmd;
+    __atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+int
+cmdq_pop(struct cmdq *q, struct cmd *cmd)
+{
+    struct cmdq_slot *s;
+    unsigned long pos = q->head;
+
+    s = &q->slots[pos & q->mask];
+    if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != pos + 1)
+        return 0;
+
+    *cmd = s->cmd;
+    __atomic_store_n(&s->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+    q->head = pos + 1;
+    return 1;
+}
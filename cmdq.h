@@ -0,0 +1,57 @@
+#ifndef _CMDQ_H_
+#define _CMDQ_H_
+
+#include <stdint.h>
+#include "stats.h"
+
+/* A bounded lock-free queue of control commands for a link. Any number
+ * of threads can push commands, the event loop of the link is the only
+ * consumer. Each slot carries a sequence number that tells producers
+ * and the consumer whose turn it is, so neither side takes a lock. */
+
+enum cmd_type {
+    CMD_SNAPSHOT = 1, /* Call cb with the statistics of the link   */
+    CMD_BAUD,         /* Change the baud rate of the serial port   */
+    CMD_COMPRESS,     /* Enable or disable compression             */
+    CMD_PROFILES,     /* Set the enabled ROHC profiles (bit mask)  */
+    CMD_LIMIT,        /* Change one of the scheduler limits        */
+    CMD_IO_PROFILE,   /* Set the serial I/O profile of a link      */
+};
+
+struct cmd {
+    int type;
+    int arg;
+    int value;
+    void (*cb)(const struct stats *stats, void *data);
+    void *data;
+};
+
+struct cmdq_slot {
+    unsigned long seq;
+    struct cmd    cmd;
+};
+
+struct cmdq {
+    /* Producers and the consumer touch different cache lines. */
+    unsigned long tail __attribute__((aligned(CACHE_LINE)));
+    unsigned long head __attribute__((aligned(CACHE_LINE)));
+    unsigned long mask;
+    struct cmdq_slot *slots;
+};
+
+/* Initialize the queue with room for size commands. The size must be a
+ * power of two. */
+void cmdq_init(struct cmdq *q, unsigned long size);
+
+void cmdq_free(struct cmdq *q);
+
+/* Append a copy of the command. Safe to call from any thread. Returns
+ * 0 on success and -1 if the queue is full. */
+int cmdq_push(struct cmdq *q, const struct cmd *cmd);
+
+/* Remove the oldest command. Must only be called by the consumer.
+ * Returns 1 if a command was stored in cmd and 0 if the queue is
+ * empty. */
+int cmdq_pop(struct cmdq *q, struct cmd *cmd);
+
+#endif /* _CMDQ_H_ */
@@ -0,0 +1,241 @@
+#include "cobs.h"
+#include <stdint.h>
+#include <string.h>
+
+#include "chord.h"
+#include "utils.h"
+#include "handover.h"
+
+
+/* The longest block, with a code byte of 0xff */
+#define BLOCK_MAX 254
+
+
+struct cobs {
+    int           sync;  /* Between delimiters, the frame is kept */
+    unsigned int  code;  /* Code byte of the current block, 0 if none */
+    unsigned int  left;  /* Bytes left in the current block      */
+    size_t        len;   /* Bytes in the frame being decoded     */
+    struct stats *stats;
+    struct pbuf_pool *pool;
+    struct pbuf  *rx;    /* The frame being decoded, or NULL     */
+    size_t        mtu;   /* The largest payload tx has room for  */
+    char         *tx;
+};
+
+
+struct cobs *
+cobs_new(struct stats *stats, struct pbuf_pool *pool, size_t mtu)
+{
+    struct cobs *c;
+
+    c = xcalloc(1, sizeof(*c));
+    c->stats = stats;
+    c->pool = pool;
+    c->mtu = mtu;
+    c->tx = xmalloc(COBS_MAX_FRAME(mtu));
+    return c;
+}
+
+
+void
+cobs_free(struct cobs *c)
+{
+    if (c == NULL) return;
+    if (c->rx) pbuf_free(c->rx);
+    xfree(c->tx);
+    xfree(c);
+}
+
+
+/* Decode COBS frames from the byte stream in data, see cobs.h. The
+ * zero bytes are found with memchr and the blocks are copied with
+ * memcpy, both of which scan and copy a vector register at a time in
+ * any decent C library. Empty frames (back-to-back delimiters) are
+ * skipped. A frame is dropped if there is no buffer for it or if it
+ * does not fit into the buffer. */
+int
+decode_cobs_frame(struct cobs *c, struct pbuf **frame, char *data, size_t len)
+{
+    uint8_t *in = (uint8_t *)data, *end = in + len, *stop, *buf;
+    size_t l = c->len, room = c->pool->room, n;
+
+    *frame = NULL;
+    buf = c->rx ? (uint8_t *)c->rx->data : NULL;
+
+    while (in < end) {
+        if (!c->sync) {
+            /* Wait for a delimiter */
+            if ((stop = memchr(in, COBS_DELIMITER, end - in)) == NULL) break;
+            in = stop + 1;
+            if (c->rx == NULL && (c->rx = pbuf_alloc(c->pool)) == NULL) {
+                c->stats->rx.drops++;
+                continue;
+            }
+            buf = (uint8_t *)c->rx->data;
+            c->sync = 1;
+            c->code = c->left = 0;
+            l = 0;
+            continue;
+        }
+
+        if ((stop = memchr(in, COBS_DELIMITER, end - in)) == NULL) stop = end;
+        while (in < stop) {
+            if (c->left == 0) {
+                /* Every block but the longest and the last stands for a
+                 * zero byte behind it */
+                if (c->code && c->code != BLOCK_MAX + 1) {
+                    if (l == room) goto overflow;
+                    buf[l++] = 0;
+                }
+                c->code = *in++;
+                c->left = c->code - 1;
+                continue;
+            }
+            n = stop - in < c->left ? stop - in : c->left;
+            if (l + n > room) goto overflow;
+            memcpy(buf + l, in, n);
+            l += n;
+            in += n;
+            c->left -= n;
+        }
+        if (stop == end) break;
+
+        in++;
+        if (c->code == 0) continue;
+
+        /* A block cut short is the last block of a COBS/R frame, its
+         * code byte is the last byte of the payload */
+        if (c->left) {
+            if (l == room) goto overflow;
+            buf[l++] = c->code;
+        }
+        c->rx->len = l;
+        *frame = c->rx;
+        c->code = c->left = 0;
+        c->len = 0;
+        /* The delimiter also opens the next frame, which needs a new
+         * buffer */
+        if ((c->rx = pbuf_alloc(c->pool)) == NULL) {
+            c->stats->rx.drops++;
+            c->sync = 0;
+        }
+        return in - (uint8_t *)data;
+
+    overflow:
+        c->stats->rx.frame_errors++;
+        c->sync = 0;
+        l = 0;
+    }
+
+    c->len = l;
+    return in - (uint8_t *)data;
+}
+
+
+/* Encode len bytes at in into out, without delimiters, and return the
+ * number of bytes written. The output may start in front of the input
+ * in the same buffer: a block is moved only after its code byte has
+ * been written, so it is enough that the output starts 1 + len / 254
+ * bytes ahead of the input. */
+static size_t
+encode(uint8_t *out, const uint8_t *in, size_t len)
+{
+    const uint8_t *end = in + len, *z;
+    size_t o = 0, c, run, max;
+
+    for(;;) {
+        max = end - in < BLOCK_MAX ? end - in : BLOCK_MAX;
+        z = memchr(in, 0, max);
+        run = z ? z - in : max;
+
+        c = o;
+        out[o++] = run + 1;
+        memmove(out + o, in, run);
+        o += run;
+        in += run;
+
+        if (z) in++;
+        else if (run < BLOCK_MAX || in == end) break;
+    }
+
+    /* COBS/R */
+    if (run && out[o - 1] > out[c]) out[c] = out[--o];
+    return o;
+}
+
+
+int
+build_cobs_frame(struct cobs *c, char **frame, size_t *flen,
+                 const char *packet, size_t plen)
+{
+    uint8_t *buf = (uint8_t *)c->tx;
+    size_t n;
+
+    if (plen > c->mtu) return -1;
+
+    buf[0] = COBS_DELIMITER;
+    n = encode(buf + 1, (const uint8_t *)packet, plen);
+    buf[n + 1] = COBS_DELIMITER;
+    *frame = c->tx;
+    *flen = n + 2;
+    return 0;
+}
+
+
+int
+build_cobs_frame_pbuf(struct cobs *c, struct pbuf *p, char **frame, size_t *flen)
+{
+    size_t ahead = 1 + 1 + p->len / BLOCK_MAX, n;
+    uint8_t *out;
+
+    if (pbuf_headroom(p) < ahead || pbuf_tailroom(p) < 1)
+        return build_cobs_frame(c, frame, flen, p->data, p->len);
+
+    out = (uint8_t *)p->data - ahead;
+    out[0] = COBS_DELIMITER;
+    n = encode(out + 1, (const uint8_t *)p->data, p->len);
+    out[n + 1] = COBS_DELIMITER;
+    p->data = (char *)out;
+    p->len = n + 2;
+    *frame = p->data;
+    *flen = p->len;
+    return 0;
+}
+
+
+void
+cobs_save(const struct cobs *c, sbuf *b)
+{
+    uint32_t sync = c->sync, code = c->code, left = c->left;
+    uint64_t len = c->len;
+
+    HANDOVER_PUT(b, sync);
+    HANDOVER_PUT(b, code);
+    HANDOVER_PUT(b, left);
+    HANDOVER_PUT(b, len);
+    if (sync) handover_put(b, c->rx->data, len);
+}
+
+
+int
+cobs_load(struct cobs *c, str *s)
+{
+    uint32_t sync, code, left;
+    uint64_t len;
+
+    if (HANDOVER_GET(s, sync) < 0 || HANDOVER_GET(s, code) < 0
+        || HANDOVER_GET(s, left) < 0 || HANDOVER_GET(s, len) < 0
+        || code > BLOCK_MAX + 1 || left >= code + !code || len > c->pool->room)
+        return -1;
+
+    if (sync) {
+        if (c->rx == NULL && (c->rx = pbuf_alloc(c->pool)) == NULL) return -1;
+        if (handover_get(s, c->rx->data, len) < 0) return -1;
+    }
+    c->sync = !!sync;
+    c->code = code;
+    c->left = left;
+    c->len = sync ? len : 0;
+    return 0;
+}
@@ -0,0 +1,65 @@
+#ifndef _COBS_H_
+#define _COBS_H_
+
+#include <stdlib.h>
+#include "stats.h"
+#include "pbuf.h"
+#include "str.h"
+
+#define COBS_DELIMITER 0x00
+
+/* The size of the largest frame that can be built from a payload of n
+ * bytes: a code byte for every 254 bytes of payload and the delimiters
+ * before and after. */
+#define COBS_MAX_FRAME(n) (1 + 1 + (n) + (n) / 254 + 1)
+
+/* Consistent Overhead Byte Stuffing (COBS) framing, the alternative to
+ * HDLC framing (see hdlc.h). The payload is cut at its zero bytes into
+ * blocks of at most 254 bytes, each block goes over the link behind a
+ * code byte that gives its length plus one. A block of 254 bytes ends
+ * without a zero byte, every other block stands for its bytes followed
+ * by a zero byte that is not sent, except for the last block. There are
+ * no zero bytes left, a zero byte delimits frames. Unlike HDLC byte
+ * stuffing, which doubles a payload of flags in the worst case, the
+ * overhead never exceeds one byte per 254 bytes.
+ *
+ * Frames are built with the COBS/R reduction: if the last byte of the
+ * payload is larger than the code byte of the last block, it takes the
+ * place of the code byte, which often saves the overhead of short
+ * frames altogether. The decoder takes both COBS and COBS/R frames. */
+struct cobs;
+
+/* Allocate a new framer for payloads of up to mtu bytes. Decoded
+ * frames are stored in buffers from the given pool. Frame errors are
+ * counted in the statistics given in argument. */
+struct cobs *cobs_new(struct stats *stats, struct pbuf_pool *pool, size_t mtu);
+
+void cobs_free(struct cobs *c);
+
+/* Decode COBS frames from the byte stream in data. Returns the number of
+ * bytes consumed. If a complete frame was found, frame is set to a
+ * buffer with its payload which then belongs to the caller, otherwise
+ * frame is set to NULL. */
+int decode_cobs_frame(struct cobs *c, struct pbuf **frame, char *data, size_t len);
+
+/* Build a COBS frame with the payload in packet. The frame is returned
+ * in a buffer owned by the framer that remains valid until the next
+ * call. Returns 0 on success and -1 if the payload is larger than the
+ * mtu of the framer. */
+int build_cobs_frame(struct cobs *c, char **frame, size_t *flen,
+                     const char *packet, size_t plen);
+
+/* Build a COBS frame with the payload in p, in place if there is enough
+ * headroom. The frame remains valid until p is freed or until the next
+ * call. Returns 0 on success and -1 if the frame does not fit. */
+int build_cobs_frame_pbuf(struct cobs *c, struct pbuf *p, char **frame, size_t *flen);
+
+/* Save the state of the decoder, with the frame being decoded, for a
+ * hitless upgrade, see handover.h. */
+void cobs_save(const struct cobs *c, sbuf *b);
+
+/* Restore the state saved with cobs_save. Returns 0 on success and -1
+ * if the state is malformed. */
+int cobs_load(struct cobs *c, str *s);
+
+#endif /* _COBS_H_ */
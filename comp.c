@@ -8,18 +8,48 @@
 #include <rohc/rohc_decomp.h>
 #include <rohc/rohc_comp.h>
 #include <rohc/rohc_buf.h> /* for the rohc_buf_*() functions */
-#include <netinet/ip.h> /* for the IPv4 header */
+#include <netinet/in.h>
+#include "log.h"
+#include "stats.h"
+#include "utils.h"
+#include "ring.h"
+#include "ip.h"
 #define BUFFER_SIZE 2048
+#define FEEDBACK_RING_SIZE 64
 
-static struct rohc_comp *compressor; /*the ROHC compressor */
-static struct rohc_decomp *decompressor;  /* the ROHC decompressor */
-static char compressedPacket[MAX_PACKET_SIZE]; //MAXPACKETSIZE defined in chord.h
-static char unCompressedPacket[MAX_PACKET_SIZE];
+//everything the compressor of one link needs, so that several links
+//can be compressed independently within one process
+struct comp
+{
+    struct rohc_comp *compressor; /*the ROHC compressor */
+    struct rohc_decomp *decompressor;  /* the ROHC decompressor */
+    struct stats *stats;
+    int enabled; //0 if all packets are to be sent uncompressed
+    unsigned int profiles; //bit mask of the enabled compression profiles
+    int last_profile; //-1 if the last packet was sent uncompressed
+    unsigned char rcvd_feedback_buffer[BUFFER_SIZE];
+    unsigned char feedback_send_buffer[BUFFER_SIZE];
+
+    //feedback for the compressor received by a decompressor that runs
+    //in another thread, see comp_defer_feedback
+    int defer_feedback;
+    struct ring feedback;
+
+    //set by comp_resync, possibly from another thread
+    int resync;
+};
+
+//a copy of received feedback on its way to the compressor
+struct feedback
+{
+    size_t len;
+    uint8_t data[];
+};
 
 //print a packet byte by byte to stderr
 void dump_packet(const struct rohc_buf packet)
 {
-    fprintf(stderr, "here's your packet.len: %ld\n",packet.len );
+    fprintf(stderr, "here's your packet.len: %zu\n",packet.len );
     size_t i;
 
     for(i = 0; i < packet.len; i++)
@@ -45,155 +75,324 @@ static int gen_random_num(const struct rohc_comp *const comp,
 }
 
 
+//names of the ROHC profiles that can be enabled on the compressor,
+//the decompressor always accepts all of them
+static const struct
+{
+    const char *name;
+    rohc_profile_t id;
+} profile_names[] =
+{
+    { "uncompressed", ROHC_PROFILE_UNCOMPRESSED },
+    { "rtp",          ROHC_PROFILE_RTP },
+    { "udp",          ROHC_PROFILE_UDP },
+    { "esp",          ROHC_PROFILE_ESP },
+    { "ip",           ROHC_PROFILE_IP },
+    { "tcp",          ROHC_PROFILE_TCP },
+    { "udplite",      ROHC_PROFILE_UDPLITE },
+};
+
+
+//called by the decompressor, hand a copy of the feedback over to the
+//thread that runs the compressor
+static void queue_feedback(struct comp *c, const struct rohc_buf fb)
+{
+    struct feedback *f;
+
+    f = xmalloc(sizeof(*f) + fb.len);
+    f->len = fb.len;
+    memcpy(f->data, rohc_buf_data(fb), fb.len);
+    if(!ring_push(&c->feedback, (void **) &f, 1))
+    {
+        DBG("Feedback queue full, dropping feedback");
+        xfree(f);
+    }
+}
+
+
+//called by the compressor, deliver all feedback queued by the
+//decompressor
+static void deliver_feedback(struct comp *c)
+{
+    const struct rohc_ts arrival_time = { .sec = 0, .nsec = 0 };
+    struct feedback *f;
+
+    while(ring_pop(&c->feedback, (void **) &f, 1))
+    {
+        struct rohc_buf fb = rohc_buf_init_full(f->data, f->len, arrival_time);
+
+        if(!rohc_comp_deliver_feedback2(c->compressor, fb))
+        {
+            DBG("Feedback didn't work");
+        }
+        xfree(f);
+    }
+}
+
+
+//count a packet in the per IP version counters of one direction,
+//len is the size of the IP packet and clen its size after compression
+static void count_version(struct stats_dir *d, int version, size_t len, size_t clen)
+{
+    if(version == 4)
+    {
+        d->v4_packets++;
+        d->v4_bytes += len;
+        d->v4_comp_bytes += clen;
+    }
+    else if(version == 6)
+    {
+        d->v6_packets++;
+        d->v6_bytes += len;
+        d->v6_comp_bytes += clen;
+    }
+}
+
+
 /*
  * This function is invoked whenever a packet that needs to be
- * compressed is received over the TUN interface. Argument packet
- * points to a buffer that contains the whole packet (starting with
- * the IP header). Argument contains the size of the packet in bytes.
- *
- * Use the return arguments dst and dlen to return a compressed
- * version of the packet to the caller. The buffer pointed to by dst
- * should be either global buffer or a static buffer allocated in the
- * body of this function.
+ * compressed is received over the TUN interface. Argument p points to
+ * a buffer that contains the whole packet (starting with the IP
+ * header).
  *
- * The default (null) implementation does not perform any compression.
- * Hence, it just copies the pointers and lengths.
+ * The buffer is replaced with a compressed version of the packet. A
+ * packet sent uncompressed stays in its buffer, the protocol
+ * identifier goes into the headroom. A compressed packet is written
+ * to a new buffer from the same pool and the original buffer is freed.
+ * On error the buffer is left alone.
  *
- * Return value 0 indicates success. A negative value indicates
- * serious compression error. If the function returns a negative
- * value, the program terminates.
+ * Return value 0 indicates that the packet was compressed and 2 that
+ * it is sent uncompressed, e.g., because compression is disabled or
+ * none of the enabled profiles can compress it. A negative value
+ * indicates serious compression error. If the function returns a
+ * negative value, the program terminates.
  */
     int
-comp_shrink(char **dst, size_t *dlen, char *packet, size_t len)
+comp_shrink(struct comp *c, struct pbuf **p)
 {
+    struct pbuf *out;
+    char *packet = (*p)->data;
+    size_t len = (*p)->len;
 
     if(!len) //empty packet
         return 1;
 
-    //this section is to check if we are dealing with ICMP packets
-    bool isICMP;
+    if(c->defer_feedback)
+        deliver_feedback(c);
+
+    //the decompressor of the peer lost its contexts, start over with
+    //IR packets
+    if(__atomic_exchange_n(&c->resync, 0, __ATOMIC_ACQ_REL))
+    {
+        INF("Restarting the ROHC compressor");
+        if(!rohc_comp_force_contexts_reinit(c->compressor))
+            WRN("failed to restart the ROHC compressor");
+    }
+
+    //classify the packet, for IPv6 the upper-layer protocol is found
+    //behind the extension headers
     rohc_status_t rohc_status;
-    /* the header of the IPv4 packet */
-    static struct iphdr *ip_header;     //IP header struct, not from ROHC
-    ip_header = (struct iphdr *) (packet); 
-    isICMP = (ip_header->protocol == 1); //1 is the protocol number of ICMP
-    if(!isICMP) //only working with ICMP protocol for now
-    { 
-        fprintf(stderr, "Packet is not ICMP\n");
-        *dst = packet;
-        *dlen = len;
-        return 2;
+    struct ip_info ip;
+    if(ip_parse(packet, len, &ip) < 0)
+    {
+        DBG("Packet is not IPv4 or IPv6");
+        ip.version = ((uint8_t) packet[0]) >> 4;
+        goto passthrough;
     }
+    //the enabled profiles decide which packets are compressed, see
+    //below
+    if(!c->enabled)
+        goto passthrough;
 
-    /* the buffer that will contain the IPv4 packet to compress */
-    static uint8_t ip_buffer[MAX_PACKET_SIZE]; 
-    /* the packet that will contain the IPv4 packet to compress */
-    struct rohc_buf ip_packet = rohc_buf_init_empty(ip_buffer, MAX_PACKET_SIZE); 
-    //make the struct rohc_buf which will contain all the informaton about the packet including ip_buffer which will be stored in the structs data field
+    //without a buffer for the result the packet can still go out as is
+    if((out = pbuf_alloc((*p)->pool)) == NULL)
+    {
+        DBG("No buffer for the compressed packet");
+        goto passthrough;
+    }
 
-    /* the buffer that will contain the resulting ROHC packet */
-    static uint8_t rohc_buffer[MAX_PACKET_SIZE];
-    /* the packet that will contain the resulting ROHC packet */
-    struct rohc_buf rohc_packet = rohc_buf_init_empty(rohc_buffer, MAX_PACKET_SIZE); //initialize to an empty struct
+    /* the IP packet to compress, used in place */
+    const struct rohc_ts arrival_time = { .sec = 0, .nsec = 0 };
+    struct rohc_buf ip_packet = rohc_buf_init_full((uint8_t *) packet, len, arrival_time);
 
-    /* copy the given packet to the IP packet */
-    rohc_buf_append(&ip_packet, (uint8_t *) packet, len);
+    /* the packet that will contain the resulting ROHC packet, it is
+     * built right after the protocol identifier */
+    struct rohc_buf rohc_packet = rohc_buf_init_empty((uint8_t *) out->data + 1, pbuf_room(out) - 1); //initialize to an empty struct
 
     //compress the packet
-    rohc_status = rohc_compress4(compressor, ip_packet, &rohc_packet);
+    rohc_status = rohc_compress4(c->compressor, ip_packet, &rohc_packet);
 
+    //the enabled profiles may not cover the packet, which the library
+    //reports as a generic error, send it as is. Anything else, e.g., a
+    //packet too large for the output, is a compression error, the
+    //packet still goes out as is.
     if(rohc_status != ROHC_STATUS_OK)
     {
-        fprintf(stderr, "compression of IP packet failed: ROHC_strerror: %s, rohc_status: %d\n",
-                rohc_strerror(rohc_status), rohc_status);
-        return -6;
+        DBG("compression of IP packet failed: %s (%d)",
+            rohc_strerror(rohc_status), rohc_status);
+        if(rohc_status != ROHC_STATUS_ERROR)
+            c->stats->tx.comp_errors++;
+        pbuf_free(out);
+        goto passthrough;
+    }
+    c->stats->tx.compressed++;
+    count_version(&c->stats->tx, ip.version, len, rohc_packet.len + 1);
+    c->last_profile = 0;
+
+    //hand the compressed packet back in place of the original
+    out->data[0] = PROTO_ROHC;
+    out->len = rohc_packet.len + 1;
+    out->ts = (*p)->ts;
+    pbuf_free(*p);
+    *p = out;
+    return 0;
+
+passthrough:
+    //prefix the packet with its protocol identifier
+    if(pbuf_prepend(*p, 1) == NULL)
+    {
+        ERR("No headroom for the protocol identifier");
+        return -1;
     }
+    (*p)->data[0] = (ip.version == 6) ? PROTO_IPV6 : PROTO_IP;
+    c->stats->tx.passthrough++;
+    count_version(&c->stats->tx, ip.version, len, len + 1);
+    c->last_profile = -1;
+    return 2;
+}
 
-    //move data to return locations
-    memcpy(compressedPacket, rohc_buf_data(rohc_packet), rohc_packet.len); //copy the packet from the stack into static memory for access outside functin
-    *dst = compressedPacket;
-    *dlen = rohc_packet.len;
 
-    return 0;
+/*
+ * Return the ROHC profile used to compress the last packet passed to
+ * comp_shrink, or -1 if the packet was sent uncompressed. This is
+ * meant for offline analysis (it queries the compressor) and should
+ * not be used on the data path.
+ */
+    int
+comp_last_profile(struct comp *c)
+{
+    rohc_comp_last_packet_info2_t info;
+
+    if(c->last_profile < 0)
+        return -1;
+
+    memset(&info, 0, sizeof(info));
+    info.version_major = 0;
+    info.version_minor = 0;
+    if(!rohc_comp_get_last_packet_info2(c->compressor, &info))
+        return -1;
+    return info.profile_id;
 }
 
 
 /*
  * This function is invoked whenever a packet that needs to be
  * decompressed is received over the serial port. The compressed
- * packet will be in the buffer pointed to by argument packet.
- * Argument len contains the size of the compressed packet.
+ * packet will be in the buffer pointed to by argument p.
  *
- * Return the decompressed version via return arguments dst and dlen.
- * Argument dst should point to a statically allocated buffer so that
- * it remains valid after this function has returned.
- *
- * The default (null) implementation does not perform any
- * decompression and just copies the pointers and lengths.
+ * The buffer is replaced with the decompressed packet. A packet sent
+ * uncompressed stays in its buffer, only the protocol identifier is
+ * stripped. A decompressed packet is written to a new buffer from the
+ * same pool and the original buffer is freed. On error the buffer is
+ * left alone.
  *
  * Return 0 on success and a negative value on error. The program
  * terminates if the function returns a negative value.
  */
     int
-comp_expand(char **dst, size_t *dlen, char *packet, size_t len)
+comp_expand(struct comp *c, struct pbuf **p)
 {
-    /* the buffer that will contain the ROHC packet to decompress */
-    static unsigned char rohc_buffer[BUFFER_SIZE];
-    /* the packet that will contain the ROHC packet to decompress */
-    struct rohc_buf rohc_packet = rohc_buf_init_empty(rohc_buffer, BUFFER_SIZE);
+    struct pbuf *out;
+    char *packet = (*p)->data;
+    size_t len = (*p)->len;
+
+    if(len < 2) //a protocol identifier and at least one byte
+    {
+        c->stats->rx.frame_errors++;
+        return -8;
+    }
 
-    /* the buffer that will contain the resulting IPv4 packet */
-    static unsigned char ip_buffer[BUFFER_SIZE];
-    /* the packet that will contain the resulting IPv4 packet */
-    struct rohc_buf ip_packet = rohc_buf_init_empty(ip_buffer, BUFFER_SIZE); //initialize to an empty struct
+    //packets sent uncompressed only need the identifier stripped
+    switch((uint8_t) packet[0])
+    {
+    case PROTO_IP:
+    case PROTO_IPV6:
+        c->stats->rx.passthrough++;
+        count_version(&c->stats->rx, (uint8_t) packet[0] == PROTO_IPV6 ? 6 : 4, len - 1, len);
+        pbuf_pull(*p, 1);
+        return 1;
+
+    case PROTO_ROHC:
+        break;
+
+    default:
+        DBG("Unknown protocol identifier 0x%02x", (uint8_t) packet[0]);
+        c->stats->rx.frame_errors++;
+        return -8;
+    }
+
+    /* the packet that will contain the ROHC packet to decompress, the
+     * ROHC packet is used in place */
+    const struct rohc_ts arrival_time = { .sec = 0, .nsec = 0 };
+    struct rohc_buf rohc_packet = rohc_buf_init_full((uint8_t *) packet + 1, len - 1, arrival_time);
+
+    if((out = pbuf_alloc((*p)->pool)) == NULL)
+    {
+        DBG("No buffer for the decompressed packet");
+        return -9;
+    }
 
+    /* the packet that will contain the resulting IP packet */
+    struct rohc_buf ip_packet = rohc_buf_init_empty((uint8_t *) out->data, pbuf_room(out)); //initialize to an empty struct
 
-    /* copy the given packet to the ROHC packet */
-    rohc_buf_append(&rohc_packet, (uint8_t *) packet, len);
  
-    static unsigned char rcvd_feedback_buffer[BUFFER_SIZE];
-    struct rohc_buf rcvd_feedback = rohc_buf_init_empty(rcvd_feedback_buffer, BUFFER_SIZE); //initialize to an empty struct
+    struct rohc_buf rcvd_feedback = rohc_buf_init_empty(c->rcvd_feedback_buffer, BUFFER_SIZE); //initialize to an empty struct
     //struct rohc_buf *feedback_send = NULL;
-    static unsigned char feedback_send_buffer[BUFFER_SIZE];
-    struct rohc_buf feedback_send = rohc_buf_init_empty(feedback_send_buffer, BUFFER_SIZE); //initialize to an empty struct
+    struct rohc_buf feedback_send = rohc_buf_init_empty(c->feedback_send_buffer, BUFFER_SIZE); //initialize to an empty struct
 
 
     rohc_status_t status;
 
-    status = rohc_decompress3(decompressor, rohc_packet, &ip_packet, &rcvd_feedback, &feedback_send); //decompress the packet
-    
-    printf("rcvd_feedback:\n");
-    //if(rcvd_feedback)
-    dump_packet(rcvd_feedback);
-
-    printf("\nfeedback_send:\n");
-    //if(feedback_send)
-        dump_packet(feedback_send);
-    printf("\nfinished printing feedback packets\n");
+    status = rohc_decompress3(c->decompressor, rohc_packet, &ip_packet, &rcvd_feedback, &feedback_send); //decompress the packet
     
-    if(status == ROHC_STATUS_NO_CONTEXT)
+    //dumping the feedback packets is expensive, only do it when debugging
+    if(DEBUGGING)
     {
-        fprintf(stderr, "No context yet\n");
-        *dst = packet;
-        *dlen = len;
-        return 1;
+        DBG("rcvd_feedback:");
+        dump_packet(rcvd_feedback);
+        DBG("feedback_send:");
+        dump_packet(feedback_send);
     }
+
     if(status != ROHC_STATUS_OK)
     {
-        fprintf(stderr, "decompression of ROHC packet failed\n");
-        fprintf(stderr, "\trohc_status: %d\n", status);
-        fprintf(stderr, "\tstrerror: %s\n", strerror(status));
+        DBG("decompression of ROHC packet failed: %s (%d)",
+            rohc_strerror(status), status);
+        c->stats->rx.comp_errors++;
+        pbuf_free(out);
         return -7;
     }
-
-     if(!(rohc_comp_deliver_feedback2(compressor, feedback_send)))
+    c->stats->rx.compressed++;
+    //the decompressor produces IPv4 as well as IPv6 packets
+    if(ip_packet.len)
+        count_version(&c->stats->rx, rohc_buf_byte_at(ip_packet, 0) >> 4, ip_packet.len, len);
+
+    //feedback piggybacked on the received packet is meant for our
+    //compressor, feedback_send would have to go to the remote peer
+    if(rcvd_feedback.len && c->defer_feedback)
     {
-        fprintf(stderr, "Feedback didn't work");
+        queue_feedback(c, rcvd_feedback);
+    }
+    else if(rcvd_feedback.len && !(rohc_comp_deliver_feedback2(c->compressor, rcvd_feedback)))
+    {
+        DBG("Feedback didn't work");
     }
 
-    memcpy(unCompressedPacket, rohc_buf_data(ip_packet), ip_packet.len); //copy uncompressed data into static memory for return
-    *dst = unCompressedPacket;
-    *dlen = ip_packet.len;
+    out->data = (char *) rohc_buf_data(ip_packet);
+    out->len = ip_packet.len;
+    out->ts = (*p)->ts;
+    pbuf_free(*p);
+    *p = out;
 
 
     return 0;
@@ -201,63 +400,174 @@ comp_expand(char **dst, size_t *dlen, char *packet, size_t len)
 
 
 /*
- * Perform one-time initialization. This function will be called once
- * when the program is starting up. You can perform any necessary
- * initializations of the RoHC library here. Return 0 to indicate that
- * everything went well and a negative value to indicate an error. If
- * the function returns a negative value, the program will terminate.
+ * Create the compressor and the decompressor of one link. This
+ * function is called once for every link when it is starting up. The
+ * counters of the link are updated in stats. Return NULL on error.
  */
-    int
-comp_init()
+    struct comp *
+comp_new(struct stats *stats)
 {
+    static int seeded = 0;
+    struct comp *c;
+    size_t i;
+
+    if(!seeded++)
+        srand((unsigned int) time(NULL));
+
+    c = xcalloc(1, sizeof(*c));
+    ring_init(&c->feedback, FEEDBACK_RING_SIZE);
+    c->stats = stats;
+    c->enabled = 1;
+    c->last_profile = -1;
+
     //compressor section
-    srand((unsigned int) time(NULL));
-    compressor = rohc_comp_new2(ROHC_LARGE_CID, ROHC_LARGE_CID_MAX, gen_random_num, NULL); //constructor for compressor
-    if(compressor == NULL)
+    c->compressor = rohc_comp_new2(ROHC_LARGE_CID, ROHC_LARGE_CID_MAX, gen_random_num, NULL); //constructor for compressor
+    if(c->compressor == NULL)
     {
-        fprintf(stderr, "failed create the ROHC compressor\n");
-        return -1;
+        ERR("failed create the ROHC compressor");
+        goto error;
     }
     /*"The ROHC compressor does not use the compression profiles that are not enabled. Thus not enabling a profile might affect compression performances."*/
-    if(!rohc_comp_enable_profile(compressor, ROHC_PROFILE_IP)) //only compress the IP header section of the packet
-    {
-        fprintf(stderr, "failed to enable the IP-only profile\n");
-        return -2;
-    }
+    if(comp_set_profiles(c, COMP_PROFILE(ROHC_PROFILE_IP)) < 0) //only compress the IP header section of the packet
+        goto error;
 
 
     //decompressor section
-    decompressor = rohc_decomp_new2(ROHC_LARGE_CID, ROHC_LARGE_CID_MAX, ROHC_U_MODE); //constructor for decompressor
-    if(decompressor == NULL)
+    c->decompressor = rohc_decomp_new2(ROHC_LARGE_CID, ROHC_LARGE_CID_MAX, ROHC_U_MODE); //constructor for decompressor
+    if(c->decompressor == NULL)
     {
-        fprintf(stderr, "failed create the ROHC decompressor\n");
-        return -3;
+        ERR("failed create the ROHC decompressor");
+        goto error;
     }
-    if(!rohc_decomp_enable_profile(decompressor, ROHC_PROFILE_IP)) //only compress the IP header section of the packet
+    //the peer may enable any profile at runtime, accept all of them
+    for(i = 0; i < sizeof(profile_names) / sizeof(profile_names[0]); i++)
     {
-        fprintf(stderr, "failed to enable the IP-only profile\n");
-        return -4;
+        if(!rohc_decomp_enable_profile(c->decompressor, profile_names[i].id))
+        {
+            ERR("failed to enable the %s profile", profile_names[i].name);
+            goto error;
+        }
     }
-    if(!rohc_decomp_enable_profile(decompressor, ROHC_PROFILE_UNCOMPRESSED)) //testing
+    return c;
+
+error:
+    comp_free(c);
+    return NULL;
+}
+
+
+/*
+ * Enable (on != 0) or disable compression. While compression is
+ * disabled all packets are sent uncompressed, but the contexts of the
+ * compressor are kept so that compression can resume where it left
+ * off. The decompressor is not affected.
+ */
+    void
+comp_set_enabled(struct comp *c, int on)
+{
+    c->enabled = !!on;
+}
+
+
+/*
+ * Enable the ROHC profiles in the bit mask (see COMP_PROFILE) on the
+ * compressor and disable all others. Return 0 on success and a
+ * negative value if a profile could not be changed.
+ */
+    int
+comp_set_profiles(struct comp *c, unsigned int mask)
+{
+    size_t i;
+    unsigned int bit;
+    bool ok;
+
+    for(i = 0; i < sizeof(profile_names) / sizeof(profile_names[0]); i++)
     {
-        fprintf(stderr, "failed to enable the Uncompressed profile\n");
-        return -5;
+        bit = COMP_PROFILE(profile_names[i].id);
+        if((c->profiles & bit) == (mask & bit))
+            continue;
+
+        if(mask & bit)
+            ok = rohc_comp_enable_profile(c->compressor, profile_names[i].id);
+        else
+            ok = rohc_comp_disable_profile(c->compressor, profile_names[i].id);
+
+        if(!ok)
+        {
+            ERR("failed to %s the %s profile", (mask & bit) ? "enable" : "disable",
+                profile_names[i].name);
+            return -1;
+        }
+        c->profiles ^= bit;
     }
     return 0;
 }
 
 
 /*
- * Perform one-time innitialization just before the program
- * terminates. This function can be used to perform any necessary
- * cleanup before the program terminates, e.g., to free allocated
- * memory.
+ * By default feedback received by the decompressor is delivered to
+ * the compressor right away. If the compressor and the decompressor
+ * run in different threads (on != 0), the feedback is queued instead
+ * and delivered by the next call to comp_shrink. Must be set before
+ * the first packet is processed.
+ */
+    void
+comp_defer_feedback(struct comp *c, int on)
+{
+    c->defer_feedback = !!on;
+}
+
+
+/*
+ * The decompressor of the peer has lost its contexts, e.g., because
+ * the peer was upgraded. The contexts of the compressor are
+ * reinitialized before the next packet is compressed, so that it
+ * starts over with IR packets. This function can be called from any
+ * thread.
  */
     void
-comp_cleanup()
+comp_resync(struct comp *c)
 {
-    rohc_comp_free(compressor);
-    rohc_decomp_free(decompressor);
+    __atomic_store_n(&c->resync, 1, __ATOMIC_RELEASE);
 }
 
 
+/*
+ * Return the ROHC profile id of the profile with the given name or -1
+ * if the name is not known.
+ */
+    int
+comp_profile_id(const char *name)
+{
+    size_t i;
+
+    for(i = 0; i < sizeof(profile_names) / sizeof(profile_names[0]); i++)
+    {
+        if(!strcmp(profile_names[i].name, name))
+            return profile_names[i].id;
+    }
+    return -1;
+}
+
+
+/*
+ * Release the ROHC contexts of a link and the memory held by the
+ * compressor. This function can be called with a partially
+ * initialized compressor.
+ */
+    void
+comp_free(struct comp *c)
+{
+    struct feedback *f;
+
+    if(c == NULL)
+        return;
+    if(c->compressor)
+        rohc_comp_free(c->compressor);
+    if(c->decompressor)
+        rohc_decomp_free(c->decompressor);
+    while(ring_pop(&c->feedback, (void **) &f, 1))
+        xfree(f);
+    ring_free(&c->feedback);
+    xfree(c);
+}
@@ -2,13 +2,47 @@
 #define _COMP_H_
 
 #include <stdlib.h>
+#include "stats.h"
+#include "pbuf.h"
 
-int comp_shrink(char **dst, size_t *dlen, char *packet, size_t len);
+/* Every packet produced by comp_shrink starts with a one-byte protocol
+ * identifier so that comp_expand can tell ROHC packets from packets
+ * sent uncompressed. The values are compressed PPP protocol numbers
+ * (RFC 1661, RFC 3241). */
+#define PROTO_IP   0x21 /* Uncompressed IPv4 */
+#define PROTO_IPV6 0x57 /* Uncompressed IPv6 */
+#define PROTO_ROHC 0x05 /* ROHC with large CIDs */
+#define PROTO_ETH  0x31 /* Non-IP payload of an Ethernet frame (TAP mode) */
 
-int comp_expand(char **dst, size_t *dlen, char *packet, size_t len);
+/* A frame that consists of nothing but this byte asks the peer to
+ * restart its compressor, see comp_resync. It is not a PPP protocol
+ * number and never starts a packet from comp_shrink. */
+#define PROTO_RESYNC 0x0f
 
-int comp_init();
+/* Bit of a ROHC profile id in the profile mask of comp_set_profiles */
+#define COMP_PROFILE(id) (1U << (id))
 
-void comp_cleanup();
+/* The ROHC compressor and decompressor of one link */
+struct comp;
+
+int comp_shrink(struct comp *c, struct pbuf **p);
+
+int comp_expand(struct comp *c, struct pbuf **p);
+
+int comp_last_profile(struct comp *c);
+
+void comp_set_enabled(struct comp *c, int on);
+
+int comp_set_profiles(struct comp *c, unsigned int mask);
+
+int comp_profile_id(const char *name);
+
+void comp_defer_feedback(struct comp *c, int on);
+
+void comp_resync(struct comp *c);
+
+struct comp *comp_new(struct stats *stats);
+
+void comp_free(struct comp *c);
 
 #endif /* _COMP_H_ */
@@ -0,0 +1,296 @@
+#include "chord.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "log.h"
+#include "utils.h"
+#include "str.h"
+#include "comp.h"
+
+/* Configuration files consist of lines of the form key = value. Empty
+ * lines and everything after a # character are ignored. Values can be
+ * enclosed in double quotes. The keys are named after the members of
+ * struct chord_conf, except for hub links which are given one per line
+ * with the key "link". */
+
+
+void
+chord_conf_init(struct chord_conf *conf)
+{
+    memset(conf, 0, sizeof(*conf));
+    conf->baud = 9600;
+    conf->packetfd = -1;
+    conf->sigfd = -1;
+    conf->handover = -1;
+    conf->compression = 1;
+    conf->tun_batch = 8;
+    conf->tty_batch = 8;
+    conf->io_profile = CHORD_IO_DEFAULT;
+    conf->framing = CHORD_FRAMING_HDLC;
+    conf->cpus[0] = conf->cpus[1] = conf->cpus[2] = -1;
+}
+
+
+void
+chord_conf_free(struct chord_conf *conf)
+{
+    if (conf->text) str_free(conf->text);
+    conf->text = NULL;
+}
+
+
+static int
+parse_int(int *dst, const char *val, int min)
+{
+    char *end;
+    long v;
+
+    errno = 0;
+    v = strtol(val, &end, 10);
+    if (errno || end == val || *end || v < min || v > 0x7fffffff)
+        return -1;
+    *dst = v;
+    return 0;
+}
+
+
+static int
+parse_bool(int *dst, const char *val)
+{
+    if (!strcmp(val, "on") || !strcmp(val, "yes") || !strcmp(val, "1")) {
+        *dst = 1;
+        return 0;
+    }
+    if (!strcmp(val, "off") || !strcmp(val, "no") || !strcmp(val, "0")) {
+        *dst = 0;
+        return 0;
+    }
+    return -1;
+}
+
+
+/* Parse a comma-separated list of ROHC profile names, e.g., "ip, udp". */
+static int
+parse_profiles(unsigned int *dst, char *val)
+{
+    unsigned int mask = 0;
+    char *name, *save;
+    str s;
+    int id;
+
+    for(name = strtok_r(val, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+        str_trim(str_wrap(&s, name));
+        s.s[s.len] = '\0';
+        if ((id = comp_profile_id(s.s)) < 0) {
+            ERR("Unknown ROHC profile '%s'", s.s);
+            return -1;
+        }
+        mask |= COMP_PROFILE(id);
+    }
+
+    if (!mask) return -1;
+    *dst = mask;
+    return 0;
+}
+
+
+/* Parse a comma-separated list of up to three CPU numbers for the
+ * event loop, tx and rx threads, -1 leaves a thread unpinned. */
+static int
+parse_cpus(int *dst, char *val)
+{
+    int cpus[3] = {-1, -1, -1};
+    char *num, *save;
+    str s;
+    int n = 0;
+
+    for(num = strtok_r(val, ",", &save); num; num = strtok_r(NULL, ",", &save)) {
+        str_trim(str_wrap(&s, num));
+        s.s[s.len] = '\0';
+        if (n == ARRAY_SIZE(cpus) || parse_int(&cpus[n++], s.s, -1) < 0)
+            return -1;
+    }
+
+    if (!n) return -1;
+    memcpy(dst, cpus, sizeof(cpus));
+    return 0;
+}
+
+
+static int
+parse_framing(int *dst, const char *val)
+{
+    int id;
+
+    if ((id = chord_framing_id(val)) < 0) {
+        ERR("Unknown framing '%s'", val);
+        return -1;
+    }
+    *dst = id;
+    return 0;
+}
+
+
+static int
+parse_io_profile(int *dst, const char *val)
+{
+    int id;
+
+    if ((id = chord_io_profile_id(val)) < 0) {
+        ERR("Unknown serial I/O profile '%s'", val);
+        return -1;
+    }
+    *dst = id;
+    return 0;
+}
+
+
+int
+chord_conf_add_link(struct chord_conf *conf, char *spec)
+{
+    str s, serial, routes;
+    char *sp, *io;
+    int profile = -1;
+
+    if (conf->nlinks == CHORD_MAX_LINKS) {
+        ERR("Too many links, at most %d are supported", CHORD_MAX_LINKS);
+        return -1;
+    }
+
+    str_trim(str_wrap(&s, spec));
+    sp = s.s + strcspn(s.s, " \t");
+    if (sp >= s.s + s.len) {
+        ERR("Link '%s' has no routes", spec);
+        return -1;
+    }
+    serial.s = s.s;
+    serial.len = sp - s.s;
+    routes.s = sp + 1;
+    routes.len = s.s + s.len - routes.s;
+    str_trim(&routes);
+
+    /* An I/O profile can follow the prefixes as the last word */
+    for(io = routes.s + routes.len; io > routes.s && io[-1] != ' ' && io[-1] != '\t'; io--);
+    if (!strncmp(io, "io=", 3)) {
+        routes.s[routes.len] = '\0';
+        if (parse_io_profile(&profile, io + 3) < 0) return -1;
+        routes.len = io - routes.s;
+        str_trim(&routes);
+    }
+    if (!routes.len) return -1;
+
+    serial.s[serial.len] = '\0';
+    routes.s[routes.len] = '\0';
+    conf->links[conf->nlinks].serial = serial.s;
+    conf->links[conf->nlinks].routes = routes.s;
+    conf->links[conf->nlinks].io_profile = profile;
+    conf->nlinks++;
+    return 0;
+}
+
+
+static int
+set_key(struct chord_conf *conf, const char *key, char *val)
+{
+    if (!strcmp(key, "tap"))         return parse_bool(&conf->tap, val);
+    if (!strcmp(key, "ifname")) {
+        conf->ifname = val;
+        return 0;
+    }
+    if (!strcmp(key, "serial")) {
+        conf->serial = val;
+        return 0;
+    }
+    if (!strcmp(key, "link"))        return chord_conf_add_link(conf, val);
+    if (!strcmp(key, "baud"))        return parse_int(&conf->baud, val, 1);
+    if (!strcmp(key, "io_profile"))  return parse_io_profile(&conf->io_profile, val);
+    if (!strcmp(key, "framing"))     return parse_framing(&conf->framing, val);
+    if (!strcmp(key, "arq"))         return parse_int(&conf->arq, val, 0);
+    if (!strcmp(key, "fec"))         return parse_bool(&conf->fec, val);
+    if (!strcmp(key, "dedup"))       return parse_bool(&conf->dedup, val);
+    if (!strcmp(key, "agg"))         return parse_int(&conf->agg, val, 0);
+    if (!strcmp(key, "agg_delay"))   return parse_int(&conf->agg_delay, val, 1);
+    if (!strcmp(key, "bql"))         return parse_bool(&conf->bql, val);
+    if (!strcmp(key, "ack_filter"))  return parse_bool(&conf->ack_filter, val);
+    if (!strcmp(key, "mru"))         return parse_int(&conf->mru, val, 0);
+    if (!strcmp(key, "flows"))       return parse_int(&conf->flows, val, 0);
+    if (!strcmp(key, "compression")) return parse_bool(&conf->compression, val);
+    if (!strcmp(key, "profiles"))    return parse_profiles(&conf->profiles, val);
+    if (!strcmp(key, "tun_batch"))   return parse_int(&conf->tun_batch, val, 1);
+    if (!strcmp(key, "tty_batch"))   return parse_int(&conf->tty_batch, val, 1);
+    if (!strcmp(key, "pipeline"))    return parse_bool(&conf->pipeline, val);
+    if (!strcmp(key, "cpus"))        return parse_cpus(conf->cpus, val);
+    if (!strcmp(key, "hugepages"))   return parse_bool(&conf->hugepages, val);
+    if (!strcmp(key, "mlock"))       return parse_bool(&conf->mlock, val);
+
+    ERR("Unknown configuration key '%s'", key);
+    return -1;
+}
+
+
+int
+chord_conf_load(struct chord_conf *conf, const char *fn)
+{
+    sbuf *buf;
+    str line, key, val;
+    char *p, *end, *nl, *c;
+    int n = 0;
+
+    if (conf->text) {
+        ERR("Only one configuration file can be loaded");
+        return -1;
+    }
+
+    buf = str_new(256);
+    if (load_text_file(buf, fn) < 0) {
+        ERR("Error while reading %s: %s", fn, strerror(errno));
+        str_free(buf);
+        return -1;
+    }
+
+    /* The file is parsed in place, string values point into the buffer
+     * which is kept until chord_conf_free. */
+    p = str_get(buf);
+    end = p + str_len(buf);
+
+    for(; p < end; p = nl + 1) {
+        n++;
+        if ((nl = memchr(p, '\n', end - p)) == NULL) nl = end;
+        line.s = p;
+        line.len = nl - p;
+
+        if ((c = memchr(line.s, '#', line.len)) != NULL)
+            line.len = c - line.s;
+        str_trim(&line);
+        if (!line.len) continue;
+
+        if ((c = memchr(line.s, '=', line.len)) == NULL) {
+            ERR("%s:%d: Missing '='", fn, n);
+            goto error;
+        }
+        key.s = line.s;
+        key.len = c - line.s;
+        str_trim(&key);
+        val.s = c + 1;
+        val.len = line.s + line.len - val.s;
+        str_unquote(&val);
+
+        key.s[key.len] = '\0';
+        val.s[val.len] = '\0';
+
+        if (!key.len || set_key(conf, key.s, val.s) < 0) {
+            ERR("%s:%d: Invalid setting '%s'", fn, n, key.s);
+            goto error;
+        }
+    }
+
+    conf->text = buf;
+    conf->config = fn;
+    return 0;
+
+error:
+    str_free(buf);
+    return -1;
+}
@@ -1,9 +1,13 @@
-#define _POSIX_C_SOURCE 2 /* getopt */
+#define _GNU_SOURCE /* getopt, SOCK_CLOEXEC */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
 #include <libdaemon/daemon.h>
 
 #include "log.h"
@@ -11,6 +15,11 @@
 #include "chord.h"
 
 static int fg;
+static struct chord_conf conf;
+
+/* The program and its arguments, to start a new instance on SIGUSR2 */
+static char *self;
+static char **args;
 
 static void
 print_help(void)
@@ -22,34 +31,141 @@ Options:\n\
     -v  Increase verbosity (Use repeatedly to increase more)\n\
     -E  Write log messages to standard output instead of syslog\n\
     -i  TUN/TAP network interface name\n\
-    -s  Serial port special file\n\
+    -T  Bridge Ethernet frames over a TAP interface instead of TUN\n\
+    -s  Serial port special file or transport URI, e.g., udp://host:port\n\
+    -b  Baud rate of the serial port (default 9600)\n\
+    -l  Hub link: a serial port and the prefixes routed over it, e.g.,\n\
+        -l \"/dev/ttyUSB1 10.1.0.0/16,fd00:1::/48\" (repeat for more links)\n\
+    -c  Load settings from the given configuration file\n\
     -f  Stay in foreground\n\
+    -U  Take the link over from a running instance through the Unix\n\
+        socket with the given file descriptor (used by upgrades)\n\
+\n\
+Options are processed in order, later options override settings from\n\
+earlier options and from the configuration file. On SIGHUP the\n\
+configuration file is reloaded without resetting the link, SIGUSR1\n\
+logs a summary of the link statistics. SIGUSR2 upgrades the program:\n\
+a new instance is started from the same file, which takes the link\n\
+over without resetting it. Use absolute paths for the configuration\n\
+file with upgrades.\n\
 ";
 
     fprintf(stdout, "%s", help_msg);
     exit(EXIT_SUCCESS);
 }
 
+/* Remember how the program was started. The daemon changes to the root
+ * directory, a relative path to the program is resolved now. A -U
+ * option of an instance that was started by an upgrade is left out. */
+static void
+save_args(int argc, char **argv)
+{
+    int i, n = 0;
+
+    if (strchr(argv[0], '/') == NULL || (self = realpath(argv[0], NULL)) == NULL)
+        self = argv[0];
+
+    args = xcalloc(argc + 3, sizeof(*args));
+    for(i = 0; i < argc; i++) {
+        if (i && !strcmp(argv[i], "-U")) {
+            i++;
+            continue;
+        }
+        if (i && !strncmp(argv[i], "-U", 2)) continue;
+        args[n++] = argv[i];
+    }
+}
+
+
+/* Start a new instance of the program on the other end of a Unix socket
+ * and hand the link over to it. Returns 0 if the new instance took the
+ * link over, the socket stays open until this process exits. Returns
+ * -1 if the link stays with this process. */
+static int
+upgrade(chord_t *link)
+{
+    char arg[16];
+    int sv[2], n;
+    pid_t pid;
+
+    INF("Upgrading to %s", self);
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        ERR("socketpair: %s", strerror(errno));
+        return -1;
+    }
+
+    if ((pid = fork()) < 0) {
+        ERR("fork: %s", strerror(errno));
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    } else if (pid == 0) {
+        fcntl(sv[1], F_SETFD, 0);
+        snprintf(arg, sizeof(arg), "%d", sv[1]);
+        for(n = 0; args[n]; n++);
+        args[n] = "-U";
+        args[n + 1] = arg;
+        execvp(self, args);
+        ERR("Could not execute %s: %s", self, strerror(errno));
+        _exit(EXIT_FAILURE);
+    }
+
+    close(sv[1]);
+    if (chord_handover(link, sv[0]) == 0) return 0;
+
+    close(sv[0]);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    WRN("Upgrade failed, the link stays with process %d", getpid());
+    return -1;
+}
+
+
+/* The old instance exits once the link has been taken over, it closes
+ * the socket and removes its pid file. */
+static void
+wait_old(int sock)
+{
+    char c;
+
+    while (safe_read(sock, &c, 1) > 0);
+    close(sock);
+}
+
+
 int
 main(int argc, char **argv)
 {
     pid_t pid;
     int rv = EXIT_FAILURE;
-    int opt, rc, sigfd = -1;
+    int opt, rc, sigfd = -1, handover = -1, notify;
+    chord_t *link = NULL;
 
-    while((opt = getopt(argc, argv, "hvEfi:s:")) != -1) {
+    chord_conf_init(&conf);
+    save_args(argc, argv);
+
+    while((opt = getopt(argc, argv, "hvEfTi:s:b:c:l:U:")) != -1) {
         switch(opt) {
         case 'h': print_help();             break;
         case 'v': log_threshold--;          break;
         case 'E': log_syslog = 0;           break;
         case 'f': fg++;                     break;
-        case 'i':
-            if (ifname) xfree(ifname);
-            ifname = xstrdup(optarg);
+        case 'T': conf.tap = 1;             break;
+        case 'i': conf.ifname = optarg;     break;
+        case 's': conf.serial = optarg;     break;
+        case 'b': conf.baud = atoi(optarg); break;
+        case 'U': handover = atoi(optarg);  break;
+        case 'l':
+            if (chord_conf_add_link(&conf, optarg) < 0) {
+                fprintf(stderr, "Invalid link %s\n", optarg);
+                exit(rv);
+            }
             break;
-        case 's':
-            if (serial) xfree(serial);
-            serial = xstrdup(optarg);
+        case 'c':
+            if (chord_conf_load(&conf, optarg) < 0) {
+                fprintf(stderr, "Could not load configuration file %s\n", optarg);
+                exit(rv);
+            }
             break;
         default:
             fprintf(stderr, "Use the -h option for list of supported "
@@ -80,13 +196,17 @@ main(int argc, char **argv)
         }
     }
 
+    /* An instance started by an upgrade runs in place of the old one,
+     * it does not fork and nobody waits for it to start */
+    notify = !fg && handover < 0;
+
     daemon_pid_file_ident = daemon_ident_from_argv0(argv[0]);
-    if ((pid = daemon_pid_file_is_running()) >= 0) {
+    if (handover < 0 && (pid = daemon_pid_file_is_running()) >= 0) {
         fprintf(stderr, "Daemon already running, PID %u\n", pid);
         exit(rv);
     }
 
-    if (!fg && (daemon_retval_init() < 0)) {
+    if (notify && (daemon_retval_init() < 0)) {
         fprintf(stderr, "Failed to create a pipe.\n");
         exit(rv);
     }
@@ -96,7 +216,7 @@ main(int argc, char **argv)
      * logging facilities. That may be syslog if we start a daemon or
      * standard output if we run in foreground mode. */
 
-    if (!fg) {
+    if (notify) {
         if ((pid = daemon_fork()) < 0) {
             daemon_retval_done();
             exit(rv);
@@ -111,7 +231,12 @@ main(int argc, char **argv)
     }
 
     start_logger(daemon_pid_file_ident);
-    if (!fg) {
+    if (handover >= 0) {
+        if (daemon_close_all(handover, -1) < 0) {
+            ERR("Failed to close file descriptors: %s", strerror(errno));
+            goto out;
+        }
+    } else if (!fg) {
         if (daemon_close_all(-1) < 0) {
             daemon_retval_send(__LINE__);
             ERR("Failed to close file descriptors: %s", strerror(errno));
@@ -124,8 +249,8 @@ main(int argc, char **argv)
         }
     }
 
-    if (daemon_signal_init(SIGINT, SIGTERM, SIGQUIT, 0) < 0) {
-        if (!fg) daemon_retval_send(__LINE__);
+    if (daemon_signal_init(SIGINT, SIGTERM, SIGQUIT, SIGHUP, SIGUSR1, SIGUSR2, 0) < 0) {
+        if (notify) daemon_retval_send(__LINE__);
         ERR("Could not register signal handlers (%s).", strerror(errno));
         goto out;
     }
@@ -138,20 +263,31 @@ main(int argc, char **argv)
     /* Continue with initialization within the daemon process with
      * dropped privileges. */
 
-    if (chord_init(sigfd) < 0) {
-        if (!fg) daemon_retval_send(__LINE__);
+    conf.sigfd = sigfd;
+    conf.handover = handover;
+    if ((link = chord_new(&conf)) == NULL) {
+        if (notify) daemon_retval_send(__LINE__);
         goto out;
     }
-    if (!fg) daemon_retval_send(0);
+    if (notify) daemon_retval_send(0);
+
+    if (handover >= 0) {
+        wait_old(handover);
+        if (!fg && daemon_pid_file_create() < 0)
+            WRN("Could not create a pid file: %s", strerror(errno));
+    }
 
-    if (chord_run() < 0) goto out;
+    while ((rc = chord_run(link)) == CHORD_UPGRADE)
+        if (upgrade(link) == 0) break;
+    if (rc < 0) goto out;
 
     /* If we get here than the daemon was asked to shut down gracefully with a
      * signal or the user pressed ctrl-c while we were running in foreground
      * mode. In either case terminate the process and report EXIT_SUCCESS. */
     rv = EXIT_SUCCESS;
 out:
-    chord_cleanup();
+    chord_free(link);
+    chord_conf_free(&conf);
     daemon_signal_done();
     if (!fg) daemon_pid_file_remove();
     stop_logger();
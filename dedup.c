@@ -0,0 +1,538 @@
+#include "dedup.h"
+#include <string.h>
+#include <pthread.h>
+
+#include "log.h"
+#include "utils.h"
+#include "handover.h"
+
+/* Header bytes */
+#define RAW       0x00
+#define CODED     0x01
+#define NACK      0x02
+
+/* Segments */
+#define REF_FLAG  0x8000
+#define LIT_MAX   0x7fff
+#define REF_LEN   6
+
+/* Chunk sizes. A boundary is placed where the upper CUT_BITS bits of
+ * the rolling hash are zero, which depend on the last 64 bytes, so
+ * chunks are MIN_CHUNK + 2^CUT_BITS bytes long on average. Chunks
+ * shorter than MIN_CHUNK, at the end of a packet, are not cached. */
+#define MIN_CHUNK 32
+#define MAX_CHUNK 256
+#define CUT_BITS  6
+#define CUT_MASK  (~0ULL << (64 - CUT_BITS))
+
+/* Slots of the cache, a power of two of at most 2^15 */
+#define SLOTS     4096
+
+/* A chunk is sent in full again after this many references */
+#define REFRESH   32
+
+/* The most misses reported in one packet */
+#define NACK_MAX  ((DEDUP_MAX_GROWTH - 3) / 2)
+
+#define WORDS     (SLOTS / 64)
+
+struct slot {
+    uint64_t fp;    /* Fingerprint, 0 if the slot is empty */
+    uint16_t len;
+    uint16_t refs;  /* References sent since it was last sent in full */
+    uint8_t  data[MAX_CHUNK];
+};
+
+/* A slot as it was before a chunk was stored in it */
+struct undo {
+    uint16_t    index;
+    struct slot old;
+};
+
+struct dedup {
+    struct stats *stats;
+    size_t   mtu;
+    struct slot *tx; /* Chunks sent     */
+    struct slot *rx; /* Chunks received */
+    uint8_t *out;
+
+    /* Chunks stored by dedup_encode since the last dedup_commit. Every
+     * chunk stored goes out in full, so a frame of mtu bytes stores at
+     * most mtu / MIN_CHUNK of them. */
+    struct undo *undo;
+    size_t   nundo;
+    size_t   max_undo;
+
+    /* Slots of the peer that references were not found in, to be
+     * reported, and slots of ours that the peer reported. Set by the
+     * decoder, taken by the encoder, which may run in another thread. */
+    uint64_t missed[WORDS];
+    uint64_t nacked[WORDS];
+    int      any_missed;
+    int      any_nacked;
+};
+
+static uint64_t gear[256];
+
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+
+/* The gear table must be the same on both ends of a link: fixed
+ * pseudo-random numbers from splitmix64. */
+static void
+init_gear(void)
+{
+    uint64_t x = 0, z;
+    int i;
+
+    for(i = 0; i < 256; i++) {
+        z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+
+struct dedup *
+dedup_new(struct stats *stats, size_t mtu)
+{
+    struct dedup *d;
+
+    pthread_once(&gear_once, init_gear);
+    d = xcalloc(1, sizeof(*d));
+    d->stats = stats;
+    d->mtu = mtu;
+    d->tx = xcalloc(SLOTS, sizeof(*d->tx));
+    d->rx = xcalloc(SLOTS, sizeof(*d->rx));
+    d->out = xmalloc(mtu);
+    d->max_undo = mtu / MIN_CHUNK + 1;
+    d->undo = xmalloc(d->max_undo * sizeof(*d->undo));
+    return d;
+}
+
+
+void
+dedup_free(struct dedup *d)
+{
+    if (d == NULL) return;
+    xfree(d->tx);
+    xfree(d->rx);
+    xfree(d->out);
+    xfree(d->undo);
+    xfree(d);
+}
+
+
+/* The length of the chunk at the start of p */
+static size_t
+cut(const uint8_t *p, size_t len)
+{
+    uint64_t h = 0;
+    size_t i;
+
+    if (len > MAX_CHUNK) len = MAX_CHUNK;
+    for(i = MIN_CHUNK; i < len; i++) {
+        h = (h << 1) + gear[p[i]];
+        if (!(h & CUT_MASK)) return i + 1;
+    }
+    return len;
+}
+
+
+/* FNV-1a, never 0 */
+static uint64_t
+fingerprint(const uint8_t *p, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for(i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h ? h : 1;
+}
+
+
+static inline struct slot *
+lookup(struct slot *cache, uint64_t fp)
+{
+    return &cache[(fp >> 32) & (SLOTS - 1)];
+}
+
+
+static void
+store(struct slot *s, uint64_t fp, const uint8_t *data, size_t len)
+{
+    s->fp = fp;
+    s->len = len;
+    s->refs = 0;
+    memcpy(s->data, data, len);
+}
+
+
+static inline uint8_t *
+put16(uint8_t *o, unsigned int v)
+{
+    o[0] = v >> 8;
+    o[1] = v;
+    return o + 2;
+}
+
+
+/* Store a chunk in the cache of chunks sent, so that it can be taken
+ * back if the frame does not go out. Should the log ever run full, the
+ * chunks stored so far stay. */
+static void
+store_tx(struct dedup *d, struct slot *s, uint64_t fp, const uint8_t *data, size_t len)
+{
+    struct undo *u;
+
+    if (d->nundo == d->max_undo) d->nundo = 0;
+    u = &d->undo[d->nundo++];
+    u->index = s - d->tx;
+    u->old.fp = s->fp;
+    u->old.len = s->len;
+    u->old.refs = s->refs;
+    memcpy(u->old.data, s->data, s->len);
+    store(s, fp, data, len);
+}
+
+
+/* Take back the chunks stored since the log held n of them, the most
+ * recent first */
+static void
+rollback(struct dedup *d, size_t n)
+{
+    struct undo *u;
+
+    while (d->nundo > n) {
+        u = &d->undo[--d->nundo];
+        store(&d->tx[u->index], u->old.fp, u->old.data, u->old.len);
+        d->tx[u->index].refs = u->old.refs;
+    }
+}
+
+
+/* Forget the chunks in the slots the peer reported, once nothing can
+ * be taken back anymore */
+static void
+take_nacks(struct dedup *d)
+{
+    uint64_t w;
+    int i, b;
+
+    if (d->nundo || !__atomic_exchange_n(&d->any_nacked, 0, __ATOMIC_ACQUIRE)) return;
+    for(i = 0; i < WORDS; i++) {
+        if ((w = __atomic_exchange_n(&d->nacked[i], 0, __ATOMIC_RELAXED)) == 0) continue;
+        for(b = 0; b < 64; b++)
+            if (w & (1ULL << b)) d->tx[i * 64 + b].fp = 0;
+    }
+}
+
+
+/* Put up to NACK_MAX of the misses to report in front of the packet in
+ * p. Misses that do not fit wait for the next packet. */
+static void
+put_nacks(struct dedup *d, struct pbuf *p)
+{
+    uint16_t slots[NACK_MAX];
+    uint64_t w;
+    uint8_t *o;
+    int i, b, n = 0;
+
+    if (!__atomic_exchange_n(&d->any_missed, 0, __ATOMIC_ACQUIRE)) return;
+    if (pbuf_headroom(p) < DEDUP_MAX_GROWTH) {
+        __atomic_store_n(&d->any_missed, 1, __ATOMIC_RELEASE);
+        return;
+    }
+
+    for(i = 0; i < WORDS && n < NACK_MAX; i++) {
+        if ((w = __atomic_exchange_n(&d->missed[i], 0, __ATOMIC_RELAXED)) == 0) continue;
+        for(b = 0; b < 64; b++) {
+            if (!(w & (1ULL << b))) continue;
+            if (n < NACK_MAX) {
+                slots[n++] = i * 64 + b;
+                w &= ~(1ULL << b);
+            }
+        }
+        if (w) {
+            __atomic_fetch_or(&d->missed[i], w, __ATOMIC_RELAXED);
+            __atomic_store_n(&d->any_missed, 1, __ATOMIC_RELEASE);
+        }
+    }
+
+    o = (uint8_t *)pbuf_prepend(p, 2 + 2 * n);
+    o[0] = NACK;
+    o[1] = n;
+    for(i = 0; i < n; i++) {
+        o[2 + 2 * i] = slots[i] >> 8;
+        o[3 + 2 * i] = slots[i];
+    }
+}
+
+
+/* Write the literal bytes lit..end, in segments of at most LIT_MAX */
+static uint8_t *
+put_literal(uint8_t *o, const uint8_t *lit, const uint8_t *end)
+{
+    size_t n;
+
+    while (lit < end) {
+        n = end - lit > LIT_MAX ? LIT_MAX : end - lit;
+        o = put16(o, n);
+        memcpy(o, lit, n);
+        o += n;
+        lit += n;
+    }
+    return o;
+}
+
+
+/* Put the chunks of a packet received into the cache, as the sender
+ * did when it sent them in full. The sender puts every chunk into its
+ * cache as it goes, so p must start at a chunk boundary and end at one
+ * or at the end of the packet. */
+static void
+learn(struct dedup *d, const uint8_t *p, size_t len)
+{
+    struct slot *s;
+    size_t off, n;
+    uint64_t fp;
+
+    for(off = 0; off < len; off += n) {
+        n = cut(p + off, len - off);
+        if (n < MIN_CHUNK) break;
+        fp = fingerprint(p + off, n);
+        s = lookup(d->rx, fp);
+        if (s->fp != fp) store(s, fp, p + off, n);
+    }
+}
+
+
+int
+dedup_encode(struct dedup *d, struct pbuf *p)
+{
+    const uint8_t *in = (const uint8_t *)p->data, *lit = in;
+    uint8_t *o = d->out;
+    struct slot *s;
+    size_t off, n, saved = 0, mark;
+    uint64_t fp;
+
+    take_nacks(d);
+    mark = d->nundo;
+    *o++ = CODED;
+    for(off = 0; off < p->len; off += n) {
+        n = cut(in + off, p->len - off);
+        if (n < MIN_CHUNK) break;
+        fp = fingerprint(in + off, n);
+        s = lookup(d->tx, fp);
+
+        if (s->fp == fp && s->len == n && s->refs < REFRESH
+            && !memcmp(s->data, in + off, n)) {
+            o = put_literal(o, lit, in + off);
+            o = put16(o, REF_FLAG | (s - d->tx));
+            o = put16(o, fp >> 16);
+            o = put16(o, fp);
+            lit = in + off + n;
+            s->refs++;
+            saved += n - REF_LEN;
+        } else {
+            store_tx(d, s, fp, in + off, n);
+        }
+    }
+
+    /* Without a reference, the packet is sent as it is. Either way, the
+     * cache of the peer learns the same chunks. */
+    if (saved == 0) {
+        if (pbuf_prepend(p, 1) == NULL) {
+            rollback(d, mark);
+            return -1;
+        }
+        p->data[0] = RAW;
+        put_nacks(d, p);
+        return 0;
+    }
+
+    o = put_literal(o, lit, in + p->len);
+    p->len = o - d->out;
+    memcpy(p->data, d->out, p->len);
+    d->stats->tx.dedup_bytes += saved;
+    put_nacks(d, p);
+    return 0;
+}
+
+
+void
+dedup_commit(struct dedup *d)
+{
+    d->nundo = 0;
+    take_nacks(d);
+}
+
+
+void
+dedup_abort(struct dedup *d)
+{
+    rollback(d, 0);
+    take_nacks(d);
+}
+
+
+int
+dedup_nack_pending(struct dedup *d)
+{
+    return __atomic_load_n(&d->any_missed, __ATOMIC_ACQUIRE);
+}
+
+
+/* Note the misses the peer reported at the start of the packet in p
+ * and take them off */
+static int
+get_nacks(struct dedup *d, struct pbuf *p)
+{
+    const uint8_t *in = (const uint8_t *)p->data;
+    unsigned int i, n, slot;
+
+    if (p->len < 2 || p->len < 2 + 2 * (size_t)in[1]) return -1;
+    n = in[1];
+    for(i = 0; i < n; i++) {
+        slot = in[2 + 2 * i] << 8 | in[3 + 2 * i];
+        if (slot >= SLOTS) return -1;
+        __atomic_fetch_or(&d->nacked[slot / 64], 1ULL << (slot % 64), __ATOMIC_RELAXED);
+    }
+    if (n) __atomic_store_n(&d->any_nacked, 1, __ATOMIC_RELEASE);
+    pbuf_pull(p, 2 + 2 * n);
+    return 0;
+}
+
+
+int
+dedup_decode(struct dedup *d, struct pbuf *p)
+{
+    const uint8_t *in = (const uint8_t *)p->data, *end = in + p->len;
+    uint8_t *o = d->out, *oend = d->out + d->mtu, *learned = d->out;
+    struct slot *s;
+    unsigned int w;
+    uint32_t check;
+
+    if (p->len >= 1 && in[0] == NACK) {
+        if (get_nacks(d, p) < 0) return -1;
+        in = (const uint8_t *)p->data;
+        end = in + p->len;
+    }
+    if (p->len < 1) return -1;
+
+    if (in[0] == RAW) {
+        pbuf_pull(p, 1);
+        learn(d, (const uint8_t *)p->data, p->len);
+        return 0;
+    }
+    if (in[0] != CODED) {
+        DBG("Unknown deduplication header 0x%02x", in[0]);
+        return -1;
+    }
+
+    for(in++; in < end; ) {
+        if (end - in < 2) return -1;
+        w = in[0] << 8 | in[1];
+        in += 2;
+
+        if (!(w & REF_FLAG)) {
+            if (w > end - in || w > oend - o) return -1;
+            memcpy(o, in, w);
+            o += w;
+            in += w;
+            continue;
+        }
+
+        /* A reference may be to a chunk sent in full earlier in the
+         * same packet, the chunks up to here must be known */
+        learn(d, learned, o - learned);
+
+        if (end - in < 4) return -1;
+        check = (uint32_t)in[0] << 24 | in[1] << 16 | in[2] << 8 | in[3];
+        in += 4;
+        if ((w & ~REF_FLAG) >= SLOTS) return -1;
+        s = &d->rx[w & ~REF_FLAG];
+        if (s->fp == 0 || (uint32_t)s->fp != check) {
+            DBG("Chunk %u not in the deduplication cache", w & ~REF_FLAG);
+            d->stats->rx.dedup_misses++;
+            __atomic_fetch_or(&d->missed[(w & ~REF_FLAG) / 64],
+                              1ULL << ((w & ~REF_FLAG) % 64), __ATOMIC_RELAXED);
+            __atomic_store_n(&d->any_missed, 1, __ATOMIC_RELEASE);
+            return -1;
+        }
+        if (s->len > oend - o) return -1;
+        memcpy(o, s->data, s->len);
+        o += s->len;
+        learned = o;
+        d->stats->rx.dedup_bytes += s->len - REF_LEN;
+    }
+
+    if (o - d->out > pbuf_room(p)) return -1;
+    p->data = p->buf + PBUF_HEADROOM;
+    p->len = o - d->out;
+    memcpy(p->data, d->out, p->len);
+    learn(d, learned, o - learned);
+    return 0;
+}
+
+
+/* Only the slots in use are saved, each behind its index */
+static void
+save_cache(const struct slot *cache, sbuf *b)
+{
+    uint32_t i, n = 0;
+
+    for(i = 0; i < SLOTS; i++)
+        if (cache[i].fp) n++;
+    HANDOVER_PUT(b, n);
+
+    for(i = 0; i < SLOTS; i++) {
+        if (cache[i].fp == 0) continue;
+        HANDOVER_PUT(b, i);
+        HANDOVER_PUT(b, cache[i].fp);
+        HANDOVER_PUT(b, cache[i].len);
+        HANDOVER_PUT(b, cache[i].refs);
+        handover_put(b, cache[i].data, cache[i].len);
+    }
+}
+
+
+static int
+restore_cache(struct slot *cache, str *s)
+{
+    struct slot *x;
+    uint32_t i, k, n;
+
+    if (HANDOVER_GET(s, n) < 0 || n > SLOTS) return -1;
+    for(k = 0; k < n; k++) {
+        if (HANDOVER_GET(s, i) < 0 || i >= SLOTS) return -1;
+        x = &cache[i];
+        if (HANDOVER_GET(s, x->fp) < 0 || HANDOVER_GET(s, x->len) < 0
+            || HANDOVER_GET(s, x->refs) < 0 || x->len > MAX_CHUNK
+            || handover_get(s, x->data, x->len) < 0) {
+            x->fp = 0;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+void
+dedup_save(const struct dedup *d, sbuf *b)
+{
+    save_cache(d->tx, b);
+    save_cache(d->rx, b);
+}
+
+
+int
+dedup_load(struct dedup *d, str *s)
+{
+    if (restore_cache(d->tx, s) < 0 || restore_cache(d->rx, s) < 0) return -1;
+    return 0;
+}
@@ -0,0 +1,88 @@
+#ifndef _DEDUP_H_
+#define _DEDUP_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "stats.h"
+#include "pbuf.h"
+#include "str.h"
+
+/* Payload deduplication for links that carry the same blocks of data
+ * over and over, e.g., status reports or firmware images. It sits
+ * between compression and ARQ, FEC and framing. Packets are cut into
+ * chunks at content-defined boundaries (a gear rolling hash), so that a
+ * block that moves within a packet still yields the same chunks. Each
+ * end keeps a cache of the chunks it has sent or received, indexed by
+ * their fingerprint, and a chunk found in the cache of the sender goes
+ * over the link as a reference to its slot instead.
+ *
+ * A packet starts with a header byte: either the packet follows as it
+ * is, or a sequence of segments, each with a 16-bit word in front:
+ *
+ *   0LLLLLLL LLLLLLLL              Literal bytes, L of them follow
+ *   1SSSSSSS SSSSSSSS + 4 bytes    The chunk in slot S, with the lower
+ *                                  32 bits of its fingerprint
+ *
+ * The caches stay in step without any messages of their own: the
+ * receiver chunks every packet it reassembles the way the sender did
+ * and puts the chunks in the same slots. The sender stores the chunks
+ * of a packet for good only once the frame that carries it has been
+ * sent (dedup_commit), a frame dropped before it goes out takes them
+ * back (dedup_abort).
+ *
+ * A reference to a chunk whose frame was lost on the way does not match
+ * the fingerprint and the packet is dropped. The receiver reports the
+ * slot in front of the next packet it sends, which may be empty:
+ *
+ *   0x02 N + N 16-bit slots         The peer did not find these slots
+ *
+ * and the sender empties the slots, so that the chunks go in full once
+ * more. A chunk is also sent in full again after it has been referenced
+ * a number of times. Both ends of a link must enable deduplication. */
+struct dedup;
+
+/* The most bytes dedup_encode adds to a packet: a header byte and the
+ * misses to report */
+#define DEDUP_MAX_GROWTH 19
+
+/* A new deduplication state for one link, for packets of up to mtu
+ * bytes. Bytes saved and references not found are counted in the
+ * statistics. */
+struct dedup *dedup_new(struct stats *stats, size_t mtu);
+
+void dedup_free(struct dedup *d);
+
+/* Replace the chunks of the packet in p that the peer has in its cache
+ * with references. Returns 0 on success and -1 if there is no room for
+ * the header. The chunks of the packet are stored until the next
+ * dedup_commit or dedup_abort, which must come before a packet is
+ * encoded that does not go out in the same frame. */
+int dedup_encode(struct dedup *d, struct pbuf *p);
+
+/* The frame with the packets encoded since the last call has been sent
+ * (or handed to ARQ), keep their chunks. */
+void dedup_commit(struct dedup *d);
+
+/* The frame with the packets encoded since the last call was dropped,
+ * take their chunks back. */
+void dedup_abort(struct dedup *d);
+
+/* Whether misses wait to be reported to the peer */
+int dedup_nack_pending(struct dedup *d);
+
+/* The reverse of dedup_encode, in place. Returns 0 on success and -1 if
+ * the packet is malformed or refers to a chunk that is not in the
+ * cache, which is then reported to the peer. A packet that only carried
+ * misses reported by the peer ends up empty. */
+int dedup_decode(struct dedup *d, struct pbuf *p);
+
+/* Save both caches for a hitless upgrade (see handover.h), they must
+ * stay in step with those of the peer. */
+void dedup_save(const struct dedup *d, sbuf *b);
+
+/* Restore the caches saved with dedup_save. Returns 0 on success and -1
+ * if the state is malformed. */
+int dedup_load(struct dedup *d, str *s);
+
+#endif /* _DEDUP_H_ */
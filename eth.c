@@ -0,0 +1,202 @@
+#include "eth.h"
+#include <string.h>
+
+#include "log.h"
+#include "utils.h"
+#include "handover.h"
+
+#define FULL  0x80
+#define GEN   0x40
+#define INDEX 0x3f
+
+/* A header is sent in full with the first REPEAT frames after it has
+ * been learned and then with every REFRESH-th frame. A header that
+ * replaces another one is sent in full up to its first refresh. */
+#define REPEAT  3
+#define REFRESH 64
+
+/* Slots probed for a header, starting at the slot given by its hash.
+ * Headers are never removed, only replaced, so a probe sequence has no
+ * holes. */
+#define PROBES  8
+
+struct entry {
+    uint8_t  hdr[ETH_HDR_LEN];
+    uint8_t  valid;
+    uint8_t  gen;   /* Flipped whenever the header is replaced */
+    uint8_t  full;  /* Frames left to send the header in full */
+    uint32_t uses;  /* Frames sent with the header            */
+    uint64_t last;  /* Clock of the last use, for replacement */
+};
+
+struct eth {
+    struct entry tx[ETH_TABLE_SIZE];
+    struct entry rx[ETH_TABLE_SIZE];
+    uint64_t clock;
+};
+
+
+struct eth *
+eth_new(void)
+{
+    return xcalloc(1, sizeof(struct eth));
+}
+
+
+void
+eth_free(struct eth *e)
+{
+    if (e) xfree(e);
+}
+
+
+/* FNV-1a */
+static unsigned int
+hash(const uint8_t *hdr)
+{
+    uint32_t h = 2166136261U;
+    int i;
+
+    for(i = 0; i < ETH_HDR_LEN; i++)
+        h = (h ^ hdr[i]) * 16777619U;
+    return h ^ (h >> 16);
+}
+
+
+/* Find the header in the table or learn it, replacing the least
+ * recently used header among the probed slots if they are all taken.
+ * Until the receiver has the new header, it may hold the old one in the
+ * slot, the generation tells them apart. */
+static int
+lookup(struct eth *e, const uint8_t *hdr)
+{
+    struct entry *x;
+    unsigned int h = hash(hdr);
+    int i, idx, victim = -1;
+
+    for(i = 0; i < PROBES; i++) {
+        idx = (h + i) % ETH_TABLE_SIZE;
+        x = &e->tx[idx];
+        if (!x->valid) {
+            victim = idx;
+            break;
+        }
+        if (!memcmp(x->hdr, hdr, ETH_HDR_LEN)) return idx;
+        if (victim < 0 || x->last < e->tx[victim].last) victim = idx;
+    }
+
+    x = &e->tx[victim];
+    if (x->valid) {
+        x->gen ^= 1;
+        x->full = REFRESH;
+    } else {
+        x->valid = 1;
+        x->full = REPEAT;
+    }
+    memcpy(x->hdr, hdr, ETH_HDR_LEN);
+    x->uses = 0;
+    DBG("Ethernet header %02x:%02x:%02x:%02x:%02x:%02x > %02x:%02x:%02x:%02x:%02x:%02x "
+        "type 0x%02x%02x is number %d (generation %d)", hdr[6], hdr[7], hdr[8], hdr[9], hdr[10],
+        hdr[11], hdr[0], hdr[1], hdr[2], hdr[3], hdr[4], hdr[5], hdr[12], hdr[13], victim, x->gen);
+    return victim;
+}
+
+
+int
+eth_strip(struct eth *e, struct pbuf *p, uint16_t *type)
+{
+    const uint8_t *hdr = (const uint8_t *)p->data;
+    int idx;
+
+    if (p->len < ETH_HDR_LEN) return -1;
+    idx = lookup(e, hdr);
+    e->tx[idx].last = ++e->clock;
+    *type = hdr[12] << 8 | hdr[13];
+    pbuf_pull(p, ETH_HDR_LEN);
+    return idx;
+}
+
+
+int
+eth_tag(struct eth *e, struct pbuf *p, int idx)
+{
+    struct entry *x = &e->tx[idx];
+    char *d;
+
+    if (x->full || x->uses % REFRESH == 0) {
+        if ((d = pbuf_prepend(p, 1 + ETH_HDR_LEN)) == NULL) return -1;
+        d[0] = FULL | (x->gen ? GEN : 0) | idx;
+        memcpy(d + 1, x->hdr, ETH_HDR_LEN);
+        if (x->full) x->full--;
+    } else {
+        if ((d = pbuf_prepend(p, 1)) == NULL) return -1;
+        d[0] = (x->gen ? GEN : 0) | idx;
+    }
+    x->uses++;
+    return 0;
+}
+
+
+int
+eth_untag(struct eth *e, struct pbuf *p)
+{
+    struct entry *x;
+    uint8_t b, gen;
+    int idx;
+
+    if (p->len < 1) return -1;
+    b = p->data[0];
+    idx = b & INDEX;
+    gen = (b & GEN) != 0;
+    x = &e->rx[idx];
+
+    if (b & FULL) {
+        if (p->len < 1 + ETH_HDR_LEN) return -1;
+        memcpy(x->hdr, p->data + 1, ETH_HDR_LEN);
+        x->valid = 1;
+        x->gen = gen;
+        pbuf_pull(p, 1 + ETH_HDR_LEN);
+        return idx;
+    }
+
+    if (!x->valid) {
+        DBG("Unknown Ethernet header number %d", idx);
+        return -1;
+    }
+    if (x->gen != gen) {
+        DBG("Ethernet header number %d of generation %d not known yet", idx, gen);
+        return -1;
+    }
+    pbuf_pull(p, 1);
+    return idx;
+}
+
+
+int
+eth_restore(struct eth *e, struct pbuf *p, int idx)
+{
+    char *d;
+
+    if ((d = pbuf_prepend(p, ETH_HDR_LEN)) == NULL) return -1;
+    memcpy(d, e->rx[idx].hdr, ETH_HDR_LEN);
+    return 0;
+}
+
+
+void
+eth_save(const struct eth *e, sbuf *b)
+{
+    handover_put(b, e->tx, sizeof(e->tx));
+    handover_put(b, e->rx, sizeof(e->rx));
+    HANDOVER_PUT(b, e->clock);
+}
+
+
+int
+eth_load(struct eth *e, str *s)
+{
+    if (handover_get(s, e->tx, sizeof(e->tx)) < 0 || handover_get(s, e->rx, sizeof(e->rx)) < 0
+        || HANDOVER_GET(s, e->clock) < 0)
+        return -1;
+    return 0;
+}
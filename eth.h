@@ -0,0 +1,64 @@
+#ifndef _ETH_H_
+#define _ETH_H_
+
+#include <stdint.h>
+
+#include "pbuf.h"
+#include "str.h"
+
+#define ETH_HDR_LEN    14
+
+/* Number of Ethernet headers a link keeps track of */
+#define ETH_TABLE_SIZE 64
+
+/* Ethernet header elision for TAP mode. Both ends of a link keep a
+ * table of Ethernet headers (destination and source MAC addresses and
+ * EtherType). The sender learns the headers of the frames it sends and
+ * replaces each header with a one-byte index into the table:
+ *
+ *   0gxxxxxx                 Header number x, generation g
+ *   1gxxxxxx <14 bytes>      Header number x is <14 bytes> from
+ *                            generation g on, which the receiver
+ *                            stores in its table
+ *
+ * A newly learned header is sent in full with the first few frames that
+ * use it and then again every now and then, so that the receiver
+ * recovers from lost frames. A header that replaces another one in the
+ * table flips the generation of its slot and is sent in full until its
+ * first refresh. The receiver drops frames that refer to a header it
+ * does not know (yet), or to a generation other than the one it has,
+ * rather than rebuild them with the header it replaced. */
+struct eth;
+
+struct eth *eth_new(void);
+
+void eth_free(struct eth *e);
+
+/* Remove the Ethernet header from the front of a frame read from the
+ * TAP interface and store its EtherType (host order) in *type. Returns
+ * the table index of the header, to be passed to eth_tag once the
+ * payload has been compressed, or -1 if the frame is too short. */
+int eth_strip(struct eth *e, struct pbuf *p, uint16_t *type);
+
+/* Put the compressed form of header number idx in front of p. Returns
+ * 0 on success and -1 if there is not enough headroom. */
+int eth_tag(struct eth *e, struct pbuf *p, int idx);
+
+/* Remove the compressed header from the front of a received frame.
+ * Returns the table index of the header, to be passed to eth_restore,
+ * or -1 if the frame is malformed or the header is unknown. */
+int eth_untag(struct eth *e, struct pbuf *p);
+
+/* Put the Ethernet header number idx back in front of p. Returns 0 on
+ * success and -1 if there is not enough headroom. */
+int eth_restore(struct eth *e, struct pbuf *p, int idx);
+
+/* Save both header tables for a hitless upgrade (see handover.h), they
+ * must stay in step with those of the peer. */
+void eth_save(const struct eth *e, sbuf *b);
+
+/* Restore the tables saved with eth_save. Returns 0 on success and -1
+ * if the state is malformed. */
+int eth_load(struct eth *e, str *s);
+
+#endif /* _ETH_H_ */
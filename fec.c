@@ -0,0 +1,443 @@
+#include "fec.h"
+#include <string.h>
+#include <pthread.h>
+
+#include "log.h"
+#include "utils.h"
+#include "handover.h"
+
+/* GF(2^8) with the primitive polynomial x^8 + x^4 + x^3 + x^2 + 1. The
+ * roots of the generator polynomial are alpha^0 .. alpha^(r-1). */
+#define GF_POLY 0x11d
+#define NN      255
+#define A0      NN   /* log of zero */
+#define MAX_ROOTS 32
+
+/* Parity bytes per block of each level */
+static const int roots[FEC_LEVELS] = {0, 8, 16, 32};
+
+/* The byte error rate up to which a level copes. A level is left for a
+ * weaker one only once the rate is below half the limit of the latter,
+ * so that the level does not flap. */
+static const double limits[FEC_LEVELS] = {1e-4, 3e-3, 1.2e-2, 1.0};
+
+/* Weight of the past in the error rate, per frame, and the bytes
+ * (decayed) to be seen before the level is lowered */
+#define DECAY      0.98
+#define MIN_SAMPLE 2000
+
+/* Level both ends start with, until the peer has told us */
+#define INITIAL_LEVEL 1
+
+static uint8_t alpha_to[256];
+static uint8_t index_of[256];
+static uint8_t unhamming[256];
+
+/* Encoder tables: for each level and feedback byte, the bytes added to
+ * the parity, see encode */
+static uint8_t enc[FEC_LEVELS][256][MAX_ROOTS];
+
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+struct fec {
+    struct stats *stats;
+    size_t   mtu;
+    int      want;      /* Level we ask the peer for             */
+    int      peer;      /* Level the peer asks for               */
+    int      rx_level;  /* Level of the last frame received      */
+    double   errors;    /* Decayed byte errors and bytes         */
+    double   bytes;
+    char    *out;
+};
+
+
+static inline int
+modnn(int x)
+{
+    while (x >= NN) {
+        x -= NN;
+        x = (x >> 8) + (x & NN);
+    }
+    return x;
+}
+
+
+static inline uint8_t
+gf_mul(uint8_t a, uint8_t b)
+{
+    if (a == 0 || b == 0) return 0;
+    return alpha_to[modnn(index_of[a] + index_of[b])];
+}
+
+
+/* Extended Hamming (8,4) code of the 4-bit number n */
+static uint8_t
+hamming(int n)
+{
+    int d0 = n & 1, d1 = n >> 1 & 1, d2 = n >> 2 & 1, d3 = n >> 3 & 1;
+    int b;
+
+    b = n | (d0 ^ d1 ^ d3) << 4 | (d0 ^ d2 ^ d3) << 5 | (d1 ^ d2 ^ d3) << 6;
+    return b | __builtin_parity(b) << 7;
+}
+
+
+static void
+init_tables(void)
+{
+    uint8_t g[MAX_ROOTS + 1];
+    int i, j, l, r, v, x = 1;
+
+    for(i = 0; i < NN; i++) {
+        alpha_to[i] = x;
+        index_of[x] = i;
+        x <<= 1;
+        if (x & 0x100) x ^= GF_POLY;
+    }
+    alpha_to[A0] = 0;
+    index_of[0] = A0;
+
+    for(l = 1; l < FEC_LEVELS; l++) {
+        /* g(x) = (x - alpha^0) (x - alpha^1) ... (x - alpha^(r-1)) */
+        r = roots[l];
+        memset(g, 0, sizeof(g));
+        g[0] = 1;
+        for(i = 0; i < r; i++) {
+            g[i + 1] = 1;
+            for(j = i; j > 0; j--)
+                g[j] = g[j - 1] ^ gf_mul(g[j], alpha_to[i]);
+            g[0] = gf_mul(g[0], alpha_to[i]);
+        }
+        for(v = 0; v < 256; v++)
+            for(j = 0; j < r; j++)
+                enc[l][v][j] = gf_mul(v, g[r - 1 - j]);
+    }
+
+    for(i = 0; i < 256; i++) {
+        unhamming[i] = 0xff;
+        for(v = 0; v < 16; v++)
+            if (__builtin_popcount(i ^ hamming(v)) <= 1) unhamming[i] = v;
+    }
+}
+
+
+struct fec *
+fec_new(struct stats *stats, size_t mtu)
+{
+    struct fec *f;
+
+    pthread_once(&tables_once, init_tables);
+    f = xcalloc(1, sizeof(*f));
+    f->stats = stats;
+    f->mtu = mtu;
+    f->want = f->peer = INITIAL_LEVEL;
+    f->out = xmalloc(FEC_MAX_ENCODED(mtu));
+    return f;
+}
+
+
+void
+fec_free(struct fec *f)
+{
+    if (f == NULL) return;
+    xfree(f->out);
+    xfree(f);
+}
+
+
+/* Append the r parity bytes of the k bytes in data. The parity is
+ * shifted by one byte per data byte, two buffers take turns so that
+ * the inner loop has no dependencies between bytes. */
+static void
+encode(int level, const uint8_t *data, size_t k, uint8_t *parity)
+{
+    uint8_t buf[2][MAX_ROOTS + 1];
+    const uint8_t *row;
+    uint8_t *cur = buf[0], *nxt = buf[1], *t;
+    int r = roots[level], j;
+    size_t i;
+
+    memset(cur, 0, sizeof(buf[0]));
+    nxt[r] = 0;
+    for(i = 0; i < k; i++) {
+        row = enc[level][data[i] ^ cur[0]];
+        for(j = 0; j < r; j++)
+            nxt[j] = cur[j + 1] ^ row[j];
+        t = cur;
+        cur = nxt;
+        nxt = t;
+    }
+    memcpy(parity, cur, r);
+}
+
+
+/* Decode the shortened codeword of n bytes in data with r parity bytes
+ * (Berlekamp-Massey, Chien search and Forney). Returns the number of
+ * bytes corrected or -1 if there are too many errors. */
+static int
+decode(uint8_t *data, int n, int r)
+{
+    uint8_t s[MAX_ROOTS], lambda[MAX_ROOTS + 1], b[MAX_ROOTS + 1], t[MAX_ROOTS + 1];
+    uint8_t omega[MAX_ROOTS + 1], reg[MAX_ROOTS + 1], root[MAX_ROOTS], loc[MAX_ROOTS];
+    int pad = NN - n, i, j, k, step, el, deg_lambda, deg_omega, count, errors = 0;
+    uint8_t discr, q, num1, num2, den, tmp;
+
+    /* Syndromes, in index form */
+    for(i = 0; i < r; i++) s[i] = data[0];
+    for(j = 1; j < n; j++) {
+        for(i = 0; i < r; i++) {
+            if (s[i] == 0) s[i] = data[j];
+            else s[i] = data[j] ^ alpha_to[modnn(index_of[s[i]] + i)];
+        }
+    }
+    for(i = 0; i < r; i++) {
+        errors |= s[i];
+        s[i] = index_of[s[i]];
+    }
+    if (!errors) return 0;
+
+    /* Error locator polynomial lambda */
+    memset(lambda, 0, sizeof(lambda));
+    lambda[0] = 1;
+    for(i = 0; i <= r; i++) b[i] = index_of[lambda[i]];
+
+    for(step = 1, el = 0; step <= r; step++) {
+        discr = 0;
+        for(i = 0; i < step; i++)
+            if (lambda[i] != 0 && s[step - i - 1] != A0)
+                discr ^= alpha_to[modnn(index_of[lambda[i]] + s[step - i - 1])];
+        discr = index_of[discr];
+
+        if (discr == A0) {
+            memmove(&b[1], b, r);
+            b[0] = A0;
+            continue;
+        }
+        t[0] = lambda[0];
+        for(i = 0; i < r; i++)
+            t[i + 1] = b[i] != A0 ? lambda[i + 1] ^ alpha_to[modnn(discr + b[i])]
+                : lambda[i + 1];
+        if (2 * el <= step - 1) {
+            el = step - el;
+            for(i = 0; i <= r; i++)
+                b[i] = lambda[i] == 0 ? A0 : modnn(index_of[lambda[i]] - discr + NN);
+        } else {
+            memmove(&b[1], b, r);
+            b[0] = A0;
+        }
+        memcpy(lambda, t, r + 1);
+    }
+
+    deg_lambda = 0;
+    for(i = 0; i <= r; i++) {
+        lambda[i] = index_of[lambda[i]];
+        if (lambda[i] != A0) deg_lambda = i;
+    }
+    if (deg_lambda == 0 || deg_lambda > r / 2) return -1;
+
+    /* Chien search for the roots of lambda */
+    memcpy(&reg[1], &lambda[1], r);
+    for(i = 1, k = 0, count = 0; i <= NN; i++, k = modnn(k + 1)) {
+        q = 1;
+        for(j = deg_lambda; j > 0; j--) {
+            if (reg[j] != A0) {
+                reg[j] = modnn(reg[j] + j);
+                q ^= alpha_to[reg[j]];
+            }
+        }
+        if (q != 0) continue;
+        root[count] = i;
+        loc[count] = k;
+        if (++count == deg_lambda) break;
+    }
+    if (count != deg_lambda) return -1;
+
+    /* Error evaluator polynomial omega, in index form */
+    deg_omega = deg_lambda - 1;
+    for(i = 0; i <= deg_omega; i++) {
+        tmp = 0;
+        for(j = i; j >= 0; j--)
+            if (s[i - j] != A0 && lambda[j] != A0)
+                tmp ^= alpha_to[modnn(s[i - j] + lambda[j])];
+        omega[i] = index_of[tmp];
+    }
+
+    /* Forney: error values, X^(1-fcr) omega(X^-1) / lambda'(X^-1) */
+    for(j = count - 1; j >= 0; j--) {
+        if (loc[j] < pad) return -1;
+
+        num1 = 0;
+        for(i = deg_omega; i >= 0; i--)
+            if (omega[i] != A0)
+                num1 ^= alpha_to[modnn(omega[i] + i * root[j])];
+        num2 = alpha_to[modnn(NN - root[j])];
+        den = 0;
+        for(i = (deg_lambda < r - 1 ? deg_lambda : r - 1) & ~1; i >= 0; i -= 2)
+            if (lambda[i + 1] != A0)
+                den ^= alpha_to[modnn(lambda[i + 1] + i * root[j])];
+        if (den == 0) return -1;
+
+        if (num1 != 0)
+            data[loc[j] - pad] ^= alpha_to[modnn(index_of[num1] + index_of[num2]
+                                                 + NN - index_of[den])];
+    }
+    return count;
+}
+
+
+/* Cut len bytes into the fewest blocks that fit into codewords with r
+ * parity bytes, of nearly equal size. */
+static int
+blocks(size_t len, int r)
+{
+    return (len + (NN - r) - 1) / (NN - r);
+}
+
+
+static inline size_t
+block_len(size_t len, int nb, int i)
+{
+    return len / nb + (i < len % nb);
+}
+
+
+char *
+fec_encode(struct fec *f, const char *data, size_t len, size_t *olen)
+{
+    int level = __atomic_load_n(&f->peer, __ATOMIC_RELAXED), r = roots[level];
+    int want = __atomic_load_n(&f->want, __ATOMIC_RELAXED);
+    uint8_t *o = (uint8_t *)f->out;
+    size_t k;
+    int nb, i;
+
+    *o++ = hamming(level << 2 | want);
+
+    if (r == 0 || len == 0) {
+        memcpy(o, data, len);
+        *olen = len + 1;
+        return f->out;
+    }
+
+    nb = blocks(len, r);
+    for(i = 0; i < nb; i++) {
+        k = block_len(len, nb, i);
+        memcpy(o, data, k);
+        encode(level, o, k, o + k);
+        data += k;
+        o += k + r;
+    }
+    *olen = (char *)o - f->out;
+    f->stats->tx.fec_bytes += *olen - len;
+    return f->out;
+}
+
+
+/* Account for a received frame and pick the level to ask the peer for */
+static void
+measure(struct fec *f, double errors, double bytes)
+{
+    int level, cur = f->want;
+
+    f->errors = f->errors * DECAY + errors;
+    f->bytes = f->bytes * DECAY + bytes;
+    if (f->bytes <= 0) return;
+
+    for(level = 0; level < FEC_LEVELS - 1; level++) {
+        if (level < cur && f->bytes < MIN_SAMPLE) continue;
+        if (f->errors / f->bytes < limits[level] / (level < cur ? 2 : 1)) break;
+    }
+    if (level != cur) {
+        DBG("Byte error rate %.2g, asking for FEC level %d", f->errors / f->bytes, level);
+        __atomic_store_n(&f->want, level, __ATOMIC_RELAXED);
+    }
+}
+
+
+int
+fec_decode(struct fec *f, struct pbuf *p)
+{
+    uint8_t *d = (uint8_t *)p->data, *o;
+    int h, level, r, nb, i, rv, fixed = 0, failed = 0;
+    size_t n, len;
+
+    if (p->len < 1 || (h = unhamming[d[0]]) == 0xff) goto malformed;
+    level = h >> 2;
+    __atomic_store_n(&f->peer, h & 3, __ATOMIC_RELAXED);
+    f->rx_level = level;
+    r = roots[level];
+    pbuf_pull(p, 1);
+    f->stats->rx.fec_bytes++;
+    if (r == 0) {
+        measure(f, 0, p->len);
+        return 0;
+    }
+
+    /* The data of the blocks is moved together behind the first */
+    d = o = (uint8_t *)p->data;
+    nb = (p->len + NN - 1) / NN;
+    if (p->len < (size_t)nb * (r + 1)) goto malformed;
+    len = p->len - nb * r;
+    for(i = 0; i < nb; i++) {
+        n = block_len(len, nb, i) + r;
+        if ((rv = decode(d, n, r)) < 0) failed++;
+        else fixed += rv;
+        memmove(o, d, n - r);
+        o += n - r;
+        d += n;
+    }
+    p->len = len;
+    f->stats->rx.fec_bytes += nb * r;
+
+    measure(f, fixed + failed * (r / 2 + 1), len + nb * r);
+    if (failed) {
+        DBG("FEC could not repair %d of %d blocks", failed, nb);
+        f->stats->rx.frame_errors++;
+        return -1;
+    }
+    f->stats->rx.fec_corrected += fixed;
+    return fixed;
+
+malformed:
+    f->stats->rx.frame_errors++;
+    measure(f, 1, p->len);
+    return -1;
+}
+
+
+void
+fec_damaged(struct fec *f)
+{
+    measure(f, roots[f->rx_level] / 2 + 1, 0);
+}
+
+
+int
+fec_level(const struct fec *f)
+{
+    return __atomic_load_n(&f->peer, __ATOMIC_RELAXED);
+}
+
+
+void
+fec_save(const struct fec *f, sbuf *b)
+{
+    HANDOVER_PUT(b, f->want);
+    HANDOVER_PUT(b, f->peer);
+    HANDOVER_PUT(b, f->rx_level);
+    HANDOVER_PUT(b, f->errors);
+    HANDOVER_PUT(b, f->bytes);
+}
+
+
+int
+fec_load(struct fec *f, str *s)
+{
+    if (HANDOVER_GET(s, f->want) < 0 || HANDOVER_GET(s, f->peer) < 0
+        || HANDOVER_GET(s, f->rx_level) < 0 || HANDOVER_GET(s, f->errors) < 0
+        || HANDOVER_GET(s, f->bytes) < 0)
+        return -1;
+    if (f->want < 0 || f->want >= FEC_LEVELS || f->peer < 0 || f->peer >= FEC_LEVELS
+        || f->rx_level < 0 || f->rx_level >= FEC_LEVELS)
+        return -1;
+    return 0;
+}
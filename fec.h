@@ -0,0 +1,68 @@
+#ifndef _FEC_H_
+#define _FEC_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "stats.h"
+#include "pbuf.h"
+#include "str.h"
+
+/* Number of FEC strengths, see fec_level */
+#define FEC_LEVELS 4
+
+/* The most bytes fec_encode turns n bytes into */
+#define FEC_MAX_ENCODED(n) (1 + (n) + ((n) / 223 + 1) * 32)
+
+/* Reed-Solomon forward error correction for links with steady bit
+ * errors. FEC sits between compression (and ARQ) and framing. A frame
+ * starts with a header byte, followed by the frame cut into blocks of
+ * up to 255 bytes, each a shortened RS codeword over GF(2^8) with its
+ * parity bytes at the end:
+ *
+ *   Level 0   no parity
+ *   Level 1    8 parity bytes per block, corrects 4 bytes
+ *   Level 2   16 parity bytes per block, corrects 8 bytes
+ *   Level 3   32 parity bytes per block, RS(255,223), corrects 16 bytes
+ *
+ * The header byte carries the level of the frame and the level the
+ * sender wants the peer to use, as a 4-bit number in an extended
+ * Hamming (8,4) code so that a single bit error in it is corrected.
+ * Each end measures the byte error rate of the frames it receives from
+ * the corrected bytes and the frames that could not be repaired, and
+ * asks the peer for the weakest level that copes with it. */
+struct fec;
+
+/* A new FEC state for one link, for frames of up to mtu bytes. Bytes
+ * corrected and frames that could not be repaired are counted in the
+ * statistics. */
+struct fec *fec_new(struct stats *stats, size_t mtu);
+
+void fec_free(struct fec *f);
+
+/* Encode a frame of len (at most mtu) bytes at the level the peer asked
+ * for. The result is kept in a buffer of the FEC state that remains
+ * valid until the next call, its length is stored in *olen. */
+char *fec_encode(struct fec *f, const char *data, size_t len, size_t *olen);
+
+/* Decode and repair a received frame in place. Returns the number of
+ * bytes corrected, or -1 if the frame is malformed or cannot be
+ * repaired. */
+int fec_decode(struct fec *f, struct pbuf *p);
+
+/* Report a frame that fec_decode passed but that turned out to be
+ * damaged, e.g., by its FCS. */
+void fec_damaged(struct fec *f);
+
+/* The level frames are sent with */
+int fec_level(const struct fec *f);
+
+/* Save the levels and the error rate measured for a hitless upgrade,
+ * see handover.h. */
+void fec_save(const struct fec *f, sbuf *b);
+
+/* Restore the state saved with fec_save. Returns 0 on success and -1
+ * if the state is malformed. */
+int fec_load(struct fec *f, str *s);
+
+#endif /* _FEC_H_ */
@@ -0,0 +1,347 @@
+#include "flows.h"
+#include <string.h>
+#include <netinet/in.h>
+#include <linux/if_ether.h>
+
+#include "utils.h"
+#include "eth.h"
+#include "ip.h"
+
+#ifndef IPPROTO_UDPLITE
+#define IPPROTO_UDPLITE 136
+#endif
+
+/* Slots a flow may be found in, starting at its home slot */
+#define WINDOW    8
+
+/* The most flows a table holds */
+#define MAX_SIZE  (1U << 20)
+
+/* Flows idle for longer (seconds) are not published */
+#define IDLE      60
+
+/* Active flows are counted by the second they were last seen in, in a
+ * ring that covers IDLE seconds */
+#define SECONDS   (IDLE + 1)
+
+#define NS_PER_S  1000000000ULL
+
+/* The part of a slot that a lookup looks at, 8 tags to a cache line */
+struct tag {
+    uint32_t hash;  /* Upper half of the hash of the key, 0 if empty */
+    uint32_t last;  /* Last packet, in seconds since the table was made */
+};
+
+struct entry {
+    struct flow_key key;
+    uint32_t first;
+    uint32_t ranked;  /* In the top set */
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t comp_bytes;
+    uint64_t wire_bytes;
+    uint64_t drops;
+};
+
+struct flows {
+    unsigned int  mask;
+    struct tag   *tags;
+    struct entry *entries;
+    uint64_t      start;
+    uint32_t      published;
+    uint32_t      tracked;
+    uint64_t      evicted;
+    uint32_t      seen[SECONDS];
+
+    /* The flows with the most wire bytes, kept up to date as flows are
+     * counted, in no particular order. top_min is at most the fewest
+     * wire bytes among them, flows grow after they get in. */
+    uint32_t      top_set[STATS_FLOWS];
+    unsigned int  ntop;
+    uint64_t      top_min;
+
+    const struct stats_dir *dir;
+    struct stats_flows     *top;
+};
+
+
+struct flows *
+flows_new(unsigned int size, const struct stats_dir *dir, struct stats_flows *top)
+{
+    struct flows *f;
+    unsigned int n = WINDOW;
+
+    if (size > MAX_SIZE) size = MAX_SIZE;
+    while (n < size) n <<= 1;
+
+    f = xcalloc(1, sizeof(*f));
+    f->mask = n - 1;
+    f->tags = xcalloc(n, sizeof(*f->tags));
+    f->entries = xcalloc(n, sizeof(*f->entries));
+    f->start = now_ns();
+    f->dir = dir;
+    f->top = top;
+    memset(top, 0, sizeof(*top));
+    return f;
+}
+
+
+void
+flows_free(struct flows *f)
+{
+    if (f == NULL) return;
+    xfree(f->tags);
+    xfree(f->entries);
+    xfree(f);
+}
+
+
+static int
+has_ports(int proto)
+{
+    switch(proto) {
+    case IPPROTO_TCP:
+    case IPPROTO_UDP:
+    case IPPROTO_UDPLITE:
+    case IPPROTO_DCCP:
+    case IPPROTO_SCTP:
+        return 1;
+    }
+    return 0;
+}
+
+
+void
+flows_key(const void *pkt, size_t len, int eth, struct flow_key *key)
+{
+    const uint8_t *p = pkt;
+    struct ip_info ip;
+    size_t alen;
+
+    memset(key, 0, sizeof(*key));
+    if (eth) {
+        if (len < ETH_HDR_LEN) return;
+        switch((p[12] << 8) | p[13]) {
+        case ETH_P_IP:
+        case ETH_P_IPV6:
+            break;
+        default:
+            return;
+        }
+        p += ETH_HDR_LEN;
+        len -= ETH_HDR_LEN;
+    }
+
+    if (ip_parse(p, len, &ip) < 0) return;
+    alen = ip.version == 4 ? 4 : 16;
+    key->version = ip.version;
+    memcpy(key->src, ip.src, alen);
+    memcpy(key->dst, ip.dst, alen);
+    if (ip.proto < 0) return;
+    key->proto = ip.proto;
+
+    if (ip.fragment || !has_ports(ip.proto) || ip.hlen + 4 > len) return;
+    key->sport = p[ip.hlen] << 8 | p[ip.hlen + 1];
+    key->dport = p[ip.hlen + 2] << 8 | p[ip.hlen + 3];
+}
+
+
+/* Keys are zero-padded, so they can be hashed and compared as words */
+static uint64_t
+hash(const struct flow_key *key)
+{
+    uint64_t w[sizeof(*key) / 8], h = 0;
+    unsigned int i;
+
+    memcpy(w, key, sizeof(w));
+    for(i = 0; i < sizeof(w) / 8; i++) {
+        h = (h ^ w[i]) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+
+/* The flow in slot k was seen at second now. A flow that is new to the
+ * slot (fresh) was not counted before. */
+static void
+touch(struct flows *f, unsigned int k, int fresh, uint32_t now)
+{
+    struct tag *t = &f->tags[k];
+
+    if (!fresh && t->last == now) return;
+    if (!fresh && now - t->last <= IDLE) f->seen[t->last % SECONDS]--;
+    f->seen[now % SECONDS]++;
+    t->last = now;
+}
+
+
+static void
+unrank(struct flows *f, unsigned int k)
+{
+    unsigned int i;
+
+    for(i = 0; i < f->ntop && f->top_set[i] != k; i++);
+    if (i == f->ntop) return;
+    f->top_set[i] = f->top_set[--f->ntop];
+    f->entries[k].ranked = 0;
+    f->top_min = 0;
+}
+
+
+/* Let the flow in slot k into the top set if it has more wire bytes
+ * than the least of them. Most flows are turned away by top_min, the
+ * set is searched only if they might get in. */
+static void
+rank(struct flows *f, unsigned int k)
+{
+    struct entry *e = &f->entries[k], *x;
+    unsigned int i, least = 0;
+
+    if (e->ranked) return;
+    if (f->ntop < STATS_FLOWS) {
+        f->top_set[f->ntop++] = k;
+        e->ranked = 1;
+        return;
+    }
+    if (e->wire_bytes <= f->top_min) return;
+
+    for(i = 1; i < STATS_FLOWS; i++)
+        if (f->entries[f->top_set[i]].wire_bytes < f->entries[f->top_set[least]].wire_bytes)
+            least = i;
+    x = &f->entries[f->top_set[least]];
+    if (e->wire_bytes > x->wire_bytes) {
+        x->ranked = 0;
+        f->top_set[least] = k;
+        e->ranked = 1;
+    }
+
+    f->top_min = UINT64_MAX;
+    for(i = 0; i < STATS_FLOWS; i++)
+        if (f->entries[f->top_set[i]].wire_bytes < f->top_min)
+            f->top_min = f->entries[f->top_set[i]].wire_bytes;
+}
+
+
+/* The entry of a flow, a new one if the flow is not in the table. A new
+ * flow takes the first empty slot in the window, or the slot of the
+ * flow that has been idle longest. Slots are never emptied, so a lookup
+ * stops at the first empty slot. The slot is stored in *slot. */
+static struct entry *
+lookup(struct flows *f, const struct flow_key *key, uint32_t now, unsigned int *slot)
+{
+    uint64_t h = hash(key);
+    uint32_t tag = (h >> 32) ? (h >> 32) : 1;
+    unsigned int i, k = 0, victim = h & f->mask;
+    struct tag *t;
+    struct entry *e;
+
+    for(i = 0; i < WINDOW; i++) {
+        k = (h + i) & f->mask;
+        t = &f->tags[k];
+        if (t->hash == 0) break;
+        if (t->hash == tag && !memcmp(&f->entries[k].key, key, sizeof(*key))) {
+            touch(f, k, 0, now);
+            *slot = k;
+            return &f->entries[k];
+        }
+        if (t->last < f->tags[victim].last) victim = k;
+    }
+
+    if (i == WINDOW) {
+        k = victim;
+        f->evicted++;
+        if (now - f->tags[k].last <= IDLE) f->seen[f->tags[k].last % SECONDS]--;
+        if (f->entries[k].ranked) unrank(f, k);
+    } else {
+        f->tracked++;
+    }
+
+    f->tags[k].hash = tag;
+    touch(f, k, 1, now);
+    *slot = k;
+    e = &f->entries[k];
+    memset(e, 0, sizeof(*e));
+    e->key = *key;
+    e->first = now;
+    return e;
+}
+
+
+/* Put the flows of the top set that were active within the last IDLE
+ * seconds in the statistics, the most wire bytes first. Called at the
+ * start of a new second, which leaves the ring of active flows. */
+static void
+publish(struct flows *f, uint32_t now)
+{
+    struct stats_flows *top = f->top;
+    struct stats_flow *sf;
+    struct entry *e, *best[STATS_FLOWS];
+    unsigned int i, j, n = 0, active = 0;
+    uint32_t t;
+
+    for(t = f->published + 1; t <= now && t - f->published <= SECONDS; t++)
+        f->seen[t % SECONDS] = 0;
+    for(i = 0; i < SECONDS; i++)
+        active += f->seen[i];
+
+    for(i = 0; i < f->ntop; ) {
+        if (now - f->tags[f->top_set[i]].last > IDLE) {
+            unrank(f, f->top_set[i]);
+            continue;
+        }
+        e = &f->entries[f->top_set[i++]];
+        for(j = n++; j > 0 && best[j - 1]->wire_bytes < e->wire_bytes; j--)
+            best[j] = best[j - 1];
+        best[j] = e;
+    }
+
+    __atomic_store_n(&top->seq, top->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    top->count = n;
+    top->active = active;
+    top->tracked = f->tracked;
+    top->evicted = f->evicted;
+    for(i = 0; i < n; i++) {
+        e = best[i];
+        sf = &top->flow[i];
+        sf->key = e->key;
+        sf->idle = now - f->tags[e - f->entries].last;
+        sf->age = now - e->first;
+        sf->packets = e->packets;
+        sf->bytes = e->bytes;
+        sf->comp_bytes = e->comp_bytes;
+        sf->wire_bytes = e->wire_bytes;
+        sf->drops = e->drops;
+    }
+    __atomic_store_n(&top->seq, top->seq + 1, __ATOMIC_RELEASE);
+    f->published = now;
+}
+
+
+void
+flows_add(struct flows *f, const struct flow_key *key, size_t bytes,
+          size_t comp_bytes, int drop, uint64_t now)
+{
+    struct entry *e;
+    unsigned int k;
+    uint32_t sec = now > f->start ? (now - f->start) / NS_PER_S : 0;
+
+    /* Before the lookup, which counts the flow in the ring of this second */
+    if (sec > f->published) publish(f, sec);
+
+    e = lookup(f, key, sec, &k);
+    e->packets++;
+    e->bytes += bytes;
+    if (drop) {
+        e->drops++;
+    } else {
+        e->comp_bytes += comp_bytes;
+        /* The share of the link overhead, see flows.h */
+        if (f->dir->comp_bytes && f->dir->wire_bytes)
+            e->wire_bytes += (double)comp_bytes * f->dir->wire_bytes / f->dir->comp_bytes;
+        else
+            e->wire_bytes += comp_bytes;
+    }
+    rank(f, k);
+}
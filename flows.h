@@ -0,0 +1,50 @@
+#ifndef _FLOWS_H_
+#define _FLOWS_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "stats.h"
+
+/* Per-flow accounting of one direction of a link, to find the flows
+ * that use up the link. Flows are kept in an open addressing hash table
+ * with a compact array of hash tags and last-seen times, so that a
+ * lookup touches one or two cache lines. A flow is looked for in a
+ * window of slots after its home slot. When the window is full, the
+ * flow that was idle longest in it is evicted (an approximate LRU).
+ *
+ * The bytes on the wire of a packet cannot be told apart once packets
+ * share frames, ARQ retransmissions and FEC parity. Every flow is
+ * charged its compressed bytes times the ratio of wire bytes to
+ * compressed bytes of the direction so far, i.e., the overhead of the
+ * link is shared out among the flows by the bytes they put on it.
+ * Drops are counted for packets whose flow is known: those dropped
+ * before or after compression on the way out, and those that cannot be
+ * written to the TUN interface on the way in.
+ *
+ * The flows with the most wire bytes are kept in a small set as they
+ * are counted: a flow gets in on its next packet once it has more wire
+ * bytes than the least of the set. Flows seen within the last minute are
+ * counted per second they were last seen in. Once per second the set,
+ * less the flows idle for a minute, is published in the statistics,
+ * without a walk of the table. A table is updated by a single thread,
+ * the writer of its direction. */
+struct flows;
+
+/* A new table of at least size flows (rounded up to a power of two).
+ * dir holds the counters of the direction, the top talkers go to top. */
+struct flows *flows_new(unsigned int size, const struct stats_dir *dir,
+                        struct stats_flows *top);
+
+void flows_free(struct flows *f);
+
+/* The flow of the packet of len bytes at pkt. In TAP mode (eth set),
+ * the packet starts with an Ethernet header. */
+void flows_key(const void *pkt, size_t len, int eth, struct flow_key *key);
+
+/* Count a packet of the flow key at time now (see now_ns): bytes before
+ * and comp_bytes after compression, or a drop. */
+void flows_add(struct flows *f, const struct flow_key *key, size_t bytes,
+               size_t comp_bytes, int drop, uint64_t now);
+
+#endif /* _FLOWS_H_ */
@@ -0,0 +1,255 @@
+#include "handover.h"
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "log.h"
+#include "utils.h"
+
+#define MAGIC     0x43484f48 /* "CHOH" */
+#define ACK       'K'
+
+/* Anything larger is not a state */
+#define MAX_STATE (256 * 1024 * 1024)
+
+/* The message that carries the file descriptors */
+struct hello {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nfds;
+    uint32_t pad;
+    uint64_t len;  /* Bytes of state that follow */
+};
+
+/* Saved in front of a packet buffer */
+struct saved_pbuf {
+    uint32_t len;  /* UINT32_MAX for NULL */
+    uint32_t off;  /* Headroom            */
+    uint64_t ts;
+};
+
+
+int
+handover_send(int sock, const int *fds, int nfds, sbuf *b)
+{
+    char control[CMSG_SPACE(sizeof(int) * HANDOVER_MAX_FDS)];
+    struct hello h;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cm;
+
+    if (nfds > HANDOVER_MAX_FDS) return -1;
+
+    memset(&h, 0, sizeof(h));
+    h.magic = MAGIC;
+    h.version = HANDOVER_VERSION;
+    h.nfds = nfds;
+    h.len = str_len(b);
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &h;
+    iov.iov_len = sizeof(h);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (nfds) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+        cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+        memcpy(CMSG_DATA(cm), fds, sizeof(int) * nfds);
+    }
+
+    if (sendmsg(sock, &msg, 0) != sizeof(h)) {
+        ERR("Could not hand the link over: %s", strerror(errno));
+        return -1;
+    }
+
+    iov.iov_base = b->data.s;
+    iov.iov_len = b->data.len;
+    if (iov.iov_len && safe_writev(sock, &iov, 1) < 0) {
+        ERR("Could not hand the link state over: %s", strerror(errno));
+        return -1;
+    }
+    DBG("Handed over %d file descriptors and %lu bytes of state", nfds,
+        (unsigned long)h.len);
+    return 0;
+}
+
+
+int
+handover_recv(int sock, int *fds, int *nfds, sbuf **b)
+{
+    char control[CMSG_SPACE(sizeof(int) * HANDOVER_MAX_FDS)];
+    struct hello h;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cm;
+    ssize_t rv;
+    int i, k, fd, n = 0, extra = 0;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &h;
+    iov.iov_len = sizeof(h);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    do {
+        rv = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (rv < 0 && errno == EINTR);
+    if (rv < 0) {
+        ERR("Could not take the link over: %s", strerror(errno));
+        return -1;
+    }
+
+    /* The control buffer is rounded up and may hold more descriptors
+     * than fds, those are closed */
+    for(cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) continue;
+        k = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for(i = 0; i < k; i++) {
+            memcpy(&fd, CMSG_DATA(cm) + sizeof(int) * i, sizeof(int));
+            if (n < HANDOVER_MAX_FDS) {
+                fds[n++] = fd;
+            } else {
+                close(fd);
+                extra++;
+            }
+        }
+    }
+
+    if (msg.msg_flags & MSG_CTRUNC) {
+        ERR("Handover message with too many file descriptors");
+        goto error;
+    }
+    if (rv != sizeof(h) || h.magic != MAGIC || extra) {
+        ERR("Malformed handover message");
+        goto error;
+    }
+    if (h.version != HANDOVER_VERSION) {
+        ERR("Cannot take over state of version %u, expected %u", h.version,
+            HANDOVER_VERSION);
+        goto error;
+    }
+    if (h.nfds != n || h.len > MAX_STATE) {
+        ERR("Malformed handover message");
+        goto error;
+    }
+
+    *b = str_new(h.len);
+    if (h.len && readn(sock, *b, h.len) != h.len) {
+        ERR("Could not receive the link state");
+        str_free(*b);
+        goto error;
+    }
+    *nfds = n;
+    DBG("Took over %d file descriptors and %lu bytes of state", n,
+        (unsigned long)h.len);
+    return 0;
+
+error:
+    for(i = 0; i < n; i++)
+        close(fds[i]);
+    return -1;
+}
+
+
+int
+handover_ack(int sock)
+{
+    char c = ACK;
+
+    if (write(sock, &c, 1) != 1) {
+        ERR("Could not acknowledge the handover: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+
+int
+handover_wait(int sock, int timeout)
+{
+    struct pollfd pfd = { .fd = sock, .events = POLLIN };
+    char c;
+    int rv;
+
+    do {
+        rv = poll(&pfd, 1, timeout * 1000);
+    } while (rv < 0 && errno == EINTR);
+    if (rv <= 0) {
+        ERR("The new process did not take the link over");
+        return -1;
+    }
+    if (safe_read(sock, &c, 1) != 1 || c != ACK) {
+        ERR("The new process could not take the link over");
+        return -1;
+    }
+    return 0;
+}
+
+
+void
+handover_put(sbuf *b, const void *data, size_t len)
+{
+    str_addl(b, data, len);
+}
+
+
+int
+handover_get(str *s, void *data, size_t len)
+{
+    if (s->len < len) return -1;
+    memcpy(data, s->s, len);
+    s->s += len;
+    s->len -= len;
+    return 0;
+}
+
+
+void
+handover_put_pbuf(sbuf *b, const struct pbuf *p)
+{
+    struct saved_pbuf sp;
+
+    memset(&sp, 0, sizeof(sp));
+    sp.len = UINT32_MAX;
+    if (p) {
+        sp.len = p->len;
+        sp.off = pbuf_headroom(p);
+        sp.ts = p->ts;
+    }
+    HANDOVER_PUT(b, sp);
+    if (p) handover_put(b, p->data, p->len);
+}
+
+
+int
+handover_get_pbuf(str *s, struct pbuf_pool *pool, struct pbuf **p)
+{
+    struct saved_pbuf sp;
+
+    *p = NULL;
+    if (HANDOVER_GET(s, sp) < 0) return -1;
+    if (sp.len == UINT32_MAX) return 0;
+    if (s->len < sp.len) return -1;
+
+    if ((*p = pbuf_alloc(pool)) == NULL) {
+        ERR("Out of packet buffers for the link state");
+        return -1;
+    }
+    if ((size_t)sp.off + sp.len > (*p)->size) {
+        pbuf_free(*p);
+        *p = NULL;
+        return -1;
+    }
+    (*p)->data = (*p)->buf + sp.off;
+    (*p)->len = sp.len;
+    (*p)->ts = sp.ts;
+    return handover_get(s, (*p)->data, sp.len);
+}
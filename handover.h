@@ -0,0 +1,69 @@
+#ifndef _HANDOVER_H_
+#define _HANDOVER_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "chord.h"
+#include "str.h"
+#include "pbuf.h"
+
+/* Version of the state format, to be bumped whenever the state of any
+ * module changes. A new process refuses state of another version and
+ * the old process keeps running the link. */
+#define HANDOVER_VERSION 2
+
+/* The TUN interface and a data and a listening socket per link */
+#define HANDOVER_MAX_FDS (1 + 2 * CHORD_MAX_LINKS)
+
+/* Hitless upgrades. A running link hands its file descriptors (the TUN
+ * interface and the serial ports or sockets) over to a new process
+ * through a Unix socket, with SCM_RIGHTS, together with the state of
+ * the link. The state covers what both ends of a link have to agree on
+ * and what is in flight: the ARQ sequence numbers and the frames not
+ * yet acknowledged, the deduplication caches, the Ethernet header
+ * tables, a frame half decoded and the packets in the transmit queue.
+ * Both processes run on the same host, the state is written in host
+ * byte order.
+ *
+ * The old process sends one message with the file descriptors and the
+ * length of the state, followed by the state. The new process answers
+ * with a single byte once it has taken over the link, the old process
+ * then lets go of the link without touching it. */
+
+/* Send nfds file descriptors and the state in b to the process on the
+ * other end of sock. Returns 0 on success and -1 on error. */
+int handover_send(int sock, const int *fds, int nfds, sbuf *b);
+
+/* Receive what handover_send sent: up to HANDOVER_MAX_FDS file
+ * descriptors into fds and the state into a new buffer. Returns 0 on
+ * success and -1 on error. */
+int handover_recv(int sock, int *fds, int *nfds, sbuf **b);
+
+/* Tell the old process that the link has been taken over. */
+int handover_ack(int sock);
+
+/* Wait up to timeout seconds for handover_ack. Returns 0 if the link
+ * has been taken over and -1 otherwise. */
+int handover_wait(int sock, int timeout);
+
+/* Append len bytes of state */
+void handover_put(sbuf *b, const void *data, size_t len);
+
+/* Take len bytes of state off the front of s. Returns 0 on success and
+ * -1 if s is too short. */
+int handover_get(str *s, void *data, size_t len);
+
+#define HANDOVER_PUT(b, v) handover_put((b), &(v), sizeof(v))
+#define HANDOVER_GET(s, v) handover_get((s), &(v), sizeof(v))
+
+/* Append a packet buffer, which may be NULL. */
+void handover_put_pbuf(sbuf *b, const struct pbuf *p);
+
+/* Take a packet buffer saved with handover_put_pbuf off the front of s
+ * into a new buffer from pool, or NULL if a NULL buffer was saved.
+ * Returns 0 on success and -1 if s is malformed or the pool is
+ * exhausted. */
+int handover_get_pbuf(str *s, struct pbuf_pool *pool, struct pbuf **p);
+
+#endif /* _HANDOVER_H_ */
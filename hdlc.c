@@ -0,0 +1,298 @@
+#include "hdlc.h"
+#include <stdint.h>
+
+#include "chord.h"
+#include "utils.h"
+#include "handover.h"
+
+
+#define ABORT          0x7D 0x7E
+#define INVERT_BIT5(v) ((v) ^ (uint8_t)(1UL << 5))
+
+
+typedef enum hdlc_state {
+    HDLC_START = 0,
+    HDLC_DATA = 1,
+    HDLC_ESCAPE = 2
+} hdlc_state_t;
+
+
+/* RFC 1662, appendix C.2 */
+static const uint16_t fcstab[256] = {
+    0x0000, 0x1189, 0x2312, 0x329b, 0x4624, 0x57ad, 0x6536, 0x74bf,
+    0x8c48, 0x9dc1, 0xaf5a, 0xbed3, 0xca6c, 0xdbe5, 0xe97e, 0xf8f7,
+    0x1081, 0x0108, 0x3393, 0x221a, 0x56a5, 0x472c, 0x75b7, 0x643e,
+    0x9cc9, 0x8d40, 0xbfdb, 0xae52, 0xdaed, 0xcb64, 0xf9ff, 0xe876,
+    0x2102, 0x308b, 0x0210, 0x1399, 0x6726, 0x76af, 0x4434, 0x55bd,
+    0xad4a, 0xbcc3, 0x8e58, 0x9fd1, 0xeb6e, 0xfae7, 0xc87c, 0xd9f5,
+    0x3183, 0x200a, 0x1291, 0x0318, 0x77a7, 0x662e, 0x54b5, 0x453c,
+    0xbdcb, 0xac42, 0x9ed9, 0x8f50, 0xfbef, 0xea66, 0xd8fd, 0xc974,
+    0x4204, 0x538d, 0x6116, 0x709f, 0x0420, 0x15a9, 0x2732, 0x36bb,
+    0xce4c, 0xdfc5, 0xed5e, 0xfcd7, 0x8868, 0x99e1, 0xab7a, 0xbaf3,
+    0x5285, 0x430c, 0x7197, 0x601e, 0x14a1, 0x0528, 0x37b3, 0x263a,
+    0xdecd, 0xcf44, 0xfddf, 0xec56, 0x98e9, 0x8960, 0xbbfb, 0xaa72,
+    0x6306, 0x728f, 0x4014, 0x519d, 0x2522, 0x34ab, 0x0630, 0x17b9,
+    0xef4e, 0xfec7, 0xcc5c, 0xddd5, 0xa96a, 0xb8e3, 0x8a78, 0x9bf1,
+    0x7387, 0x620e, 0x5095, 0x411c, 0x35a3, 0x242a, 0x16b1, 0x0738,
+    0xffcf, 0xee46, 0xdcdd, 0xcd54, 0xb9eb, 0xa862, 0x9af9, 0x8b70,
+    0x8408, 0x9581, 0xa71a, 0xb693, 0xc22c, 0xd3a5, 0xe13e, 0xf0b7,
+    0x0840, 0x19c9, 0x2b52, 0x3adb, 0x4e64, 0x5fed, 0x6d76, 0x7cff,
+    0x9489, 0x8500, 0xb79b, 0xa612, 0xd2ad, 0xc324, 0xf1bf, 0xe036,
+    0x18c1, 0x0948, 0x3bd3, 0x2a5a, 0x5ee5, 0x4f6c, 0x7df7, 0x6c7e,
+    0xa50a, 0xb483, 0x8618, 0x9791, 0xe32e, 0xf2a7, 0xc03c, 0xd1b5,
+    0x2942, 0x38cb, 0x0a50, 0x1bd9, 0x6f66, 0x7eef, 0x4c74, 0x5dfd,
+    0xb58b, 0xa402, 0x9699, 0x8710, 0xf3af, 0xe226, 0xd0bd, 0xc134,
+    0x39c3, 0x284a, 0x1ad1, 0x0b58, 0x7fe7, 0x6e6e, 0x5cf5, 0x4d7c,
+    0xc60c, 0xd785, 0xe51e, 0xf497, 0x8028, 0x91a1, 0xa33a, 0xb2b3,
+    0x4a44, 0x5bcd, 0x6956, 0x78df, 0x0c60, 0x1de9, 0x2f72, 0x3efb,
+    0xd68d, 0xc704, 0xf59f, 0xe416, 0x90a9, 0x8120, 0xb3bb, 0xa232,
+    0x5ac5, 0x4b4c, 0x79d7, 0x685e, 0x1ce1, 0x0d68, 0x3ff3, 0x2e7a,
+    0xe70e, 0xf687, 0xc41c, 0xd595, 0xa12a, 0xb0a3, 0x8238, 0x93b1,
+    0x6b46, 0x7acf, 0x4854, 0x59dd, 0x2d62, 0x3ceb, 0x0e70, 0x1ff9,
+    0xf78f, 0xe606, 0xd49d, 0xc514, 0xb1ab, 0xa022, 0x92b9, 0x8330,
+    0x7bc7, 0x6a4e, 0x58d5, 0x495c, 0x3de3, 0x2c6a, 0x1ef1, 0x0f78
+};
+
+
+struct hdlc {
+    hdlc_state_t  state;
+    size_t        len;   /* Bytes in the frame being decoded */
+    struct stats *stats;
+    struct pbuf_pool *pool;
+    struct pbuf  *rx;    /* The frame being decoded, or NULL */
+    size_t        mtu;   /* The largest payload tx has room for  */
+    char         *tx;
+};
+
+
+struct hdlc *
+hdlc_new(struct stats *stats, struct pbuf_pool *pool, size_t mtu)
+{
+    struct hdlc *h;
+
+    h = xmalloc(sizeof(*h));
+    h->state = HDLC_START;
+    h->len = 0;
+    h->stats = stats;
+    h->pool = pool;
+    h->rx = NULL;
+    h->mtu = mtu;
+    h->tx = xmalloc(HDLC_MAX_FRAME(mtu));
+    return h;
+}
+
+
+void
+hdlc_free(struct hdlc *h)
+{
+    if (h == NULL) return;
+    if (h->rx) pbuf_free(h->rx);
+    xfree(h->tx);
+    xfree(h);
+}
+
+
+/* Decode HDLC frames from the byte stream in data. The function
+ * returns the number of bytes consumed. If a complete frame was found,
+ * frame is set to a buffer with its payload which then belongs to the
+ * caller, otherwise frame is set to NULL. A flag closing one frame also
+ * opens the next one, so that the decoder does not lose synchronization
+ * after a garbled frame. Empty frames (back-to-back flags) are skipped.
+ * A frame is dropped if there is no buffer for it. */
+int
+decode_hdlc_frame(struct hdlc *h, struct pbuf **frame, char *data, size_t len)
+{
+    int i;
+    hdlc_state_t state = h->state;
+    char *buf = h->rx ? h->rx->data : NULL;
+    size_t l = h->len, room = h->pool->room;
+
+    for(i = 0; i < len; i++) {
+        switch(state) {
+        case HDLC_START:
+            switch(data[i]) {
+            case FRAME_BOUNDARY:
+                if (h->rx == NULL && (h->rx = pbuf_alloc(h->pool)) == NULL) {
+                    h->stats->rx.drops++;
+                    break;
+                }
+                buf = h->rx->data;
+                state = HDLC_DATA;
+                l = 0;
+                break;
+            default:
+                break;
+            }
+            break;
+
+        case HDLC_DATA:
+            switch(data[i]) {
+            case CONTROL_ESCAPE:
+                state = HDLC_ESCAPE;
+                break;
+
+            case FRAME_BOUNDARY:
+                if (l == 0) break;
+                h->rx->len = l;
+                *frame = h->rx;
+                /* The flag also opens the next frame, which needs a new
+                 * buffer */
+                if ((h->rx = pbuf_alloc(h->pool)) == NULL) {
+                    h->stats->rx.drops++;
+                    state = HDLC_START;
+                }
+                h->state = state;
+                h->len = 0;
+                return i + 1;
+
+            default:
+                if (l == room) goto overflow;
+                buf[l++] = data[i];
+                break;
+            }
+            break;
+
+        case HDLC_ESCAPE:
+            if (data[i] == FRAME_BOUNDARY) {
+                /* Abort sequence, discard the frame. */
+                h->stats->rx.frame_errors++;
+                state = HDLC_DATA;
+                l = 0;
+                break;
+            }
+            if (l == room) goto overflow;
+            buf[l++] = INVERT_BIT5(data[i]);
+            state = HDLC_DATA;
+            break;
+        }
+        continue;
+
+    overflow:
+        /* The frame does not fit into the buffer. Discard it and wait
+         * for the next flag. */
+        h->stats->rx.frame_errors++;
+        state = HDLC_START;
+        l = 0;
+    }
+
+    h->state = state;
+    h->len = l;
+    *frame = NULL;
+    return i;
+}
+
+
+int
+build_hdlc_frame(struct hdlc *h, char **frame, size_t *flen,
+                 char *packet, size_t plen)
+{
+    char *buf = h->tx;
+    int j;
+
+    if (plen > h->mtu) return -1;
+
+    j = 0;
+    buf[j++] = FRAME_BOUNDARY;
+
+    for(int i = 0; i < plen; i++) {
+        switch(packet[i]) {
+        case FRAME_BOUNDARY:
+        case CONTROL_ESCAPE:
+            buf[j++] = CONTROL_ESCAPE;
+            buf[j++] = INVERT_BIT5(packet[i]);
+            break;
+
+        default:
+            buf[j++] = packet[i];
+            break;
+        }
+    }
+
+    buf[j++] = FRAME_BOUNDARY;
+    *frame = buf;
+    *flen = j;
+    return 0;
+}
+
+
+/* Build the frame in place if there is room for the flags and the
+ * escaped bytes around the payload, which is the case for all but the
+ * largest packets. The payload is escaped back to front, so that no
+ * byte is overwritten before it has been moved. Otherwise the frame is
+ * built in the buffer of the framer. In either case, the frame remains
+ * valid until p is freed or until the next call. Returns 0 on success
+ * and -1 if the frame does not fit either way. */
+int
+build_hdlc_frame_pbuf(struct hdlc *h, struct pbuf *p, char **frame, size_t *flen)
+{
+    uint8_t *s = (uint8_t *)p->data, b;
+    size_t n = 0, esc, i, j;
+
+    for(i = 0; i < p->len; i++)
+        n += (s[i] == FRAME_BOUNDARY || s[i] == CONTROL_ESCAPE);
+
+    if (pbuf_headroom(p) < 1 || pbuf_tailroom(p) < n + 1)
+        return build_hdlc_frame(h, frame, flen, p->data, p->len);
+
+    i = p->len;
+    j = p->len + n;
+    s[j] = FRAME_BOUNDARY;
+    for(esc = n; esc; ) {
+        b = s[--i];
+        if (b == FRAME_BOUNDARY || b == CONTROL_ESCAPE) {
+            s[--j] = INVERT_BIT5(b);
+            s[--j] = CONTROL_ESCAPE;
+            esc--;
+        } else {
+            s[--j] = b;
+        }
+    }
+    pbuf_append(p, n + 1);
+    *pbuf_prepend(p, 1) = FRAME_BOUNDARY;
+    *frame = p->data;
+    *flen = p->len;
+    return 0;
+}
+
+
+uint16_t
+hdlc_fcs16(uint16_t fcs, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+
+    while (len--)
+        fcs = (fcs >> 8) ^ fcstab[(fcs ^ *p++) & 0xff];
+    return fcs;
+}
+
+
+void
+hdlc_save(const struct hdlc *h, sbuf *b)
+{
+    uint32_t state = h->state;
+    uint64_t len = h->len;
+
+    HANDOVER_PUT(b, state);
+    HANDOVER_PUT(b, len);
+    if (state != HDLC_START) handover_put(b, h->rx->data, len);
+}
+
+
+int
+hdlc_load(struct hdlc *h, str *s)
+{
+    uint32_t state;
+    uint64_t len;
+
+    if (HANDOVER_GET(s, state) < 0 || HANDOVER_GET(s, len) < 0
+        || state > HDLC_ESCAPE || len > h->pool->room)
+        return -1;
+
+    if (state != HDLC_START) {
+        if (h->rx == NULL && (h->rx = pbuf_alloc(h->pool)) == NULL) return -1;
+        if (handover_get(s, h->rx->data, len) < 0) return -1;
+    }
+    h->state = state;
+    h->len = state == HDLC_START ? 0 : len;
+    return 0;
+}
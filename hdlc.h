@@ -0,0 +1,59 @@
+#ifndef _HDLC_H_
+#define _HDLC_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+#include "stats.h"
+#include "pbuf.h"
+#include "str.h"
+
+#define FRAME_BOUNDARY 0x7E
+#define CONTROL_ESCAPE 0x7D
+
+/* The size of the largest frame that can be built from a payload of n
+ * bytes: every byte escaped plus the opening and closing flags. */
+#define HDLC_MAX_FRAME(n) (1 + (n) * 2 + 1)
+
+/* Frame check sequence (FCS-16) of RFC 1662: start with HDLC_FCS_INIT,
+ * send the complement of the result least significant byte first. The
+ * FCS computed over data followed by its FCS is HDLC_FCS_GOOD. */
+#define HDLC_FCS_INIT 0xffff
+#define HDLC_FCS_GOOD 0xf0b8
+
+/* State of the HDLC framer of one link: the decoder state machine, the
+ * buffer of the frame being decoded and a buffer for frames that cannot
+ * be built in place. */
+struct hdlc;
+
+/* Allocate a new framer for payloads of up to mtu bytes. Decoded
+ * frames are stored in buffers from the given pool. Frame errors are
+ * counted in the statistics given in argument. */
+struct hdlc *hdlc_new(struct stats *stats, struct pbuf_pool *pool, size_t mtu);
+
+void hdlc_free(struct hdlc *h);
+
+/* Decode HDLC frames from the byte stream in data. See hdlc.c */
+int decode_hdlc_frame(struct hdlc *h, struct pbuf **frame, char *data, size_t len);
+
+/* Build an HDLC frame with the payload in packet. The frame is returned
+ * in a buffer owned by the framer that remains valid until the next
+ * call. Returns 0 on success and -1 if the payload is larger than the
+ * mtu of the framer. */
+int build_hdlc_frame(struct hdlc *h, char **frame, size_t *flen,
+                     char *packet, size_t plen);
+
+/* Build an HDLC frame with the payload in p. See hdlc.c */
+int build_hdlc_frame_pbuf(struct hdlc *h, struct pbuf *p, char **frame, size_t *flen);
+
+/* Save the state of the decoder, with the frame being decoded, for a
+ * hitless upgrade, see handover.h. */
+void hdlc_save(const struct hdlc *h, sbuf *b);
+
+/* Restore the state saved with hdlc_save. Returns 0 on success and -1
+ * if the state is malformed. */
+int hdlc_load(struct hdlc *h, str *s);
+
+/* Update the FCS-16 fcs with len bytes of data. */
+uint16_t hdlc_fcs16(uint16_t fcs, const void *data, size_t len);
+
+#endif /* _HDLC_H_ */
@@ -0,0 +1,63 @@
+#include "hist.h"
+
+
+/* The lowest value counted in bucket i. */
+static uint64_t
+bucket_min(unsigned int i)
+{
+    unsigned int shift;
+
+    if (i < HIST_SUB) return i;
+    shift = i / HIST_SUB - 1;
+    return (uint64_t)(HIST_SUB + i % HIST_SUB) << shift;
+}
+
+
+/* The number of distinct values counted in bucket i. */
+static uint64_t
+bucket_width(unsigned int i)
+{
+    if (i < HIST_SUB) return 1;
+    return 1ULL << (i / HIST_SUB - 1);
+}
+
+
+uint64_t
+hist_percentile(const struct hist *h, double p)
+{
+    uint64_t want, seen, v;
+    unsigned int i;
+
+    if (h->count == 0) return 0;
+    if (p < 0) p = 0;
+    if (p > 100) p = 100;
+
+    want = (uint64_t)(p / 100.0 * h->count + 0.5);
+    if (want == 0) want = 1;
+
+    seen = 0;
+    for(i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= want) {
+            v = bucket_min(i) + bucket_width(i) / 2;
+            return (h->max && v > h->max) ? h->max : v;
+        }
+    }
+    return h->max;
+}
+
+
+void
+hist_sub(struct hist *dst, const struct hist *a, const struct hist *b)
+{
+    unsigned int i, top = 0;
+
+    dst->count = a->count - b->count;
+    dst->sum = a->sum - b->sum;
+    for(i = 0; i < HIST_BUCKETS; i++) {
+        dst->buckets[i] = a->buckets[i] - b->buckets[i];
+        if (dst->buckets[i]) top = i;
+    }
+    dst->max = dst->count ? bucket_min(top) + bucket_width(top) - 1 : 0;
+    if (dst->max > a->max) dst->max = a->max;
+}
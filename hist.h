@@ -0,0 +1,56 @@
+#ifndef _HIST_H_
+#define _HIST_H_
+
+#include <stdint.h>
+
+/* Log-bucketed latency histogram in the style of HdrHistogram. Values
+ * below 2^HIST_SUB_BITS are counted exactly. Larger values are bucketed
+ * by the position of their most significant bit, and each power-of-two
+ * range is split linearly into 2^HIST_SUB_BITS sub-buckets. This gives
+ * a relative error below 1/2^HIST_SUB_BITS over the whole 64-bit range
+ * in a fixed amount of memory. Recording a value takes a handful of
+ * instructions and no locks; a histogram has a single writer. */
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB      (1U << HIST_SUB_BITS)
+#define HIST_BUCKETS  ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+
+static inline unsigned int
+hist_index(uint64_t v)
+{
+    unsigned int shift;
+
+    if (v < HIST_SUB) return v;
+    shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + ((v >> shift) & (HIST_SUB - 1));
+}
+
+
+static inline void
+hist_record(struct hist *h, uint64_t v)
+{
+    h->buckets[hist_index(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v > h->max) h->max = v;
+}
+
+/* Return the value at the given percentile (0 - 100). The value is the
+ * midpoint of the bucket the percentile falls into. Returns 0 for an
+ * empty histogram. */
+uint64_t hist_percentile(const struct hist *h, double p);
+
+/* Store the difference a - b in dst. This can be used to obtain the
+ * distribution of values recorded over an interval. The maximum of dst
+ * is approximated by the upper bound of the highest non-empty bucket. */
+void hist_sub(struct hist *dst, const struct hist *a, const struct hist *b);
+
+#endif /* _HIST_H_ */
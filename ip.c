@@ -0,0 +1,167 @@
+#include "ip.h"
+#include <string.h>
+#include <netinet/in.h>
+
+#ifndef IPPROTO_MH
+#define IPPROTO_MH 135
+#endif
+#define IPPROTO_HIP   139
+#define IPPROTO_SHIM6 140
+
+#define TCP_SYN       0x02
+#define TCPOPT_EOL    0
+#define TCPOPT_NOP    1
+#define TCPOPT_MSS    2
+
+
+static int
+parse_ipv4(const uint8_t *p, size_t len, struct ip_info *ip)
+{
+    size_t hl;
+
+    if (len < 20) return -1;
+    hl = (p[0] & 0x0f) * 4;
+    if (hl < 20 || hl > len) return -1;
+
+    ip->proto = p[9];
+    ip->hlen = hl;
+    ip->fragment = ((p[6] & 0x1f) << 8 | p[7]) != 0;
+    ip->src = p + 12;
+    ip->dst = p + 16;
+    return 0;
+}
+
+
+static int
+parse_ipv6(const uint8_t *p, size_t len, struct ip_info *ip)
+{
+    size_t off = 40, ext;
+    int next, i;
+
+    if (len < 40) return -1;
+    ip->src = p + 8;
+    ip->dst = p + 24;
+
+    next = p[6];
+    for(i = 0; i <= IP_MAX_EXT; i++) {
+        switch(next) {
+        case IPPROTO_HOPOPTS:
+        case IPPROTO_ROUTING:
+        case IPPROTO_DSTOPTS:
+        case IPPROTO_MH:
+        case IPPROTO_HIP:
+        case IPPROTO_SHIM6:
+            if (off + 8 > len) goto unknown;
+            ext = (p[off + 1] + 1) * 8;
+            break;
+
+        case IPPROTO_FRAGMENT:
+            if (off + 8 > len) goto unknown;
+            if ((p[off + 2] << 8 | (p[off + 3] & 0xf8)) != 0) {
+                ip->fragment = 1;
+                goto unknown;
+            }
+            ext = 8;
+            break;
+
+        case IPPROTO_AH:
+            if (off + 8 > len) goto unknown;
+            ext = (p[off + 1] + 2) * 4;
+            break;
+
+        default:
+            ip->proto = next;
+            ip->hlen = off;
+            return 0;
+        }
+
+        next = p[off];
+        off += ext;
+        if (off > len) goto unknown;
+    }
+
+unknown:
+    ip->proto = -1;
+    ip->hlen = 40;
+    return 0;
+}
+
+
+/* Update the one's complement checksum at sum for a 16-bit word that
+ * changes from old to new (RFC 1624, eqn. 3). A word at an odd offset
+ * from the start of the checksummed data enters the sum with its bytes
+ * swapped. */
+static void
+update_csum(uint8_t *sum, uint16_t old, uint16_t new, int odd)
+{
+    uint32_t c;
+
+    if (odd) {
+        old = old >> 8 | old << 8;
+        new = new >> 8 | new << 8;
+    }
+    c = (uint16_t)~(sum[0] << 8 | sum[1]);
+    c += (uint16_t)~old;
+    c += new;
+    c = (c & 0xffff) + (c >> 16);
+    c = (c & 0xffff) + (c >> 16);
+    c = ~c & 0xffff;
+    sum[0] = c >> 8;
+    sum[1] = c;
+}
+
+
+int
+ip_clamp_mss(void *packet, size_t len, unsigned int mtu)
+{
+    struct ip_info ip;
+    uint8_t *th;
+    size_t doff, i, tlen;
+    unsigned int mss, max;
+
+    if (ip_parse(packet, len, &ip) < 0 || ip.proto != IPPROTO_TCP || ip.fragment)
+        return 0;
+    tlen = len - ip.hlen;
+    if (tlen < 20) return 0;
+
+    th = (uint8_t *)packet + ip.hlen;
+    if (!(th[13] & TCP_SYN)) return 0;
+    doff = (th[12] >> 4) * 4;
+    if (doff < 20 || doff > tlen) return 0;
+
+    max = IP_MSS(ip.version, mtu);
+    for(i = 20; i < doff && th[i] != TCPOPT_EOL; ) {
+        if (th[i] == TCPOPT_NOP) {
+            i++;
+            continue;
+        }
+        if (i + 1 >= doff || th[i + 1] < 2 || i + th[i + 1] > doff) return 0;
+        if (th[i] == TCPOPT_MSS && th[i + 1] == 4) {
+            mss = th[i + 2] << 8 | th[i + 3];
+            if (mss <= max) return 0;
+            update_csum(th + 16, mss, max, i & 1);
+            th[i + 2] = max >> 8;
+            th[i + 3] = max;
+            return 1;
+        }
+        i += th[i + 1];
+    }
+    return 0;
+}
+
+
+int
+ip_parse(const void *packet, size_t len, struct ip_info *ip)
+{
+    const uint8_t *p = packet;
+
+    memset(ip, 0, sizeof(*ip));
+    if (len < 1) return -1;
+
+    ip->version = p[0] >> 4;
+    switch(ip->version) {
+    case 4:  return parse_ipv4(p, len, ip);
+    case 6:  return parse_ipv6(p, len, ip);
+    default: return -1;
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef _IP_H_
+#define _IP_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+
+/* The most IPv6 extension headers ip_parse walks before it gives up */
+#define IP_MAX_EXT 8
+
+/* Where things are in an IP packet, see ip_parse */
+struct ip_info {
+    int      version;  /* 4 or 6                                       */
+    int      proto;    /* Upper-layer protocol, -1 if unknown           */
+    size_t   hlen;     /* Offset of the upper-layer header, i.e., the IP
+                        * header plus any IPv6 extension headers        */
+    int      fragment; /* Not the first fragment, there is no upper-layer
+                        * header                                       */
+    const uint8_t *src;
+    const uint8_t *dst;
+};
+
+/* Parse the IP header of a packet. For IPv6, the chain of extension
+ * headers (hop-by-hop, routing, fragment, destination options, AH,
+ * mobility, HIP and shim6) is walked to the upper-layer header. ESP is
+ * treated as an upper-layer protocol since what follows is encrypted.
+ * The upper-layer protocol is unknown if the chain is truncated or
+ * longer than IP_MAX_EXT headers. Returns 0 on success and -1 if the
+ * packet does not start with a valid IPv4 or IPv6 header. */
+int ip_parse(const void *packet, size_t len, struct ip_info *ip);
+
+/* The largest TCP MSS that fits into a link MTU of mtu bytes, for IP
+ * version 4 or 6 */
+#define IP_MSS(version, mtu) ((mtu) - ((version) == 4 ? 40 : 60))
+
+/* Lower the MSS option of a TCP SYN (or SYN-ACK) in the IP packet to
+ * what fits into an MTU of mtu bytes. The TCP checksum is updated
+ * incrementally (RFC 1624). Returns 1 if the packet was changed and 0
+ * if it was left alone. */
+int ip_clamp_mss(void *packet, size_t len, unsigned int mtu);
+
+#endif /* _IP_H_ */
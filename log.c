@@ -1,11 +1,41 @@
+#define _GNU_SOURCE
 #include "log.h"
 #include <syslog.h>
 #include <time.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#ifdef __PLATFORM_android
+#  include <android/log.h>
+#endif
+
+#include "stats.h" /* CACHE_LINE */
 
 /* Format of timestamps printed to standard or error outputs. */
 #define TIME_FMT        "%b-%d %H:%M:%S"
 #define TIME_FMT_MAXLEN 15 /* The length of the resulting string */
 
+/* Messages queued for the logger thread, a power of two, and the
+ * longest message. Longer messages are cut short. */
+#define QUEUE_SIZE      256
+#define LINE_SIZE       512
+
+/* Rate limits: at most BURST messages with the same format per second
+ * from up to SITES different formats. Formats beyond that are not
+ * limited. */
+#define BURST           5
+#define SITES           128
+
+/* The logger thread reports suppressed and dropped messages at least
+ * this often (ms) */
+#define REPORT_INTERVAL 1000
+
 /* If set to 1 write messages to syslog. If 0 write them to standard and error
  * outputs. */
 int log_syslog = 1;
@@ -14,35 +44,409 @@ int log_syslog = 1;
  * log_threshold will be logged. */
 int log_threshold = L_INF;
 
+/* A formatted message. The producer that claimed a record publishes it
+ * by setting seq to its position plus one, the consumer hands it back
+ * by setting seq to the position of the next round. */
+struct record {
+    unsigned long seq;
+    int   pri;
+    FILE *f;
+    char  line[LINE_SIZE];
+};
+
+/* A bounded multi-producer single-consumer queue (after Dmitry Vyukov)
+ * between the threads that log and the logger thread. The logger
+ * thread sleeps on an eventfd, a producer writes to it only if it finds
+ * "sleeping" set after publishing a record, see run_stage in chord.c
+ * for the same handshake. */
+static struct {
+    unsigned long tail __attribute__((aligned(CACHE_LINE)));
+    unsigned long dropped;
+
+    unsigned long head __attribute__((aligned(CACHE_LINE)));
+    int   sleeping;
+
+    struct record *records __attribute__((aligned(CACHE_LINE)));
+    int   running;
+    int   stop;
+    int   efd;
+    pthread_t thread;
+} queue = { .efd = -1 };
+
+/* Rate limits per message format */
+struct site {
+    const char *m;
+    int      pri;
+    FILE    *f;
+    time_t   sec;        /* The second counted */
+    unsigned count;      /* Messages in that second */
+    unsigned suppressed; /* Messages not logged, not reported yet */
+};
+
+static struct site sites[SITES];
+
+/* Cached pid of the process, 0 before start_logger */
+static pid_t log_pid;
+
+/* Each thread formats the time of its messages at most once per second */
+static __thread time_t ltime_sec = -1;
+static __thread char ltime_buf[TIME_FMT_MAXLEN + 1];
+
+
+static const char *
+format_time(time_t t)
+{
+    struct tm tm;
+
+    if (t == ltime_sec) return ltime_buf;
+    if (!localtime_r(&t, &tm)
+        || strftime(ltime_buf, TIME_FMT_MAXLEN + 1, TIME_FMT, &tm) != TIME_FMT_MAXLEN)
+        *ltime_buf = '\0';
+    ltime_sec = t;
+    return ltime_buf;
+}
+
+
 /* Returns text representation of current date and time. Only current month,
  * day and time down to a second are printed. This is used when logging to the
  * standard output. Returns empty string on error. */
 const char *
 __ltime(void)
 {
-    time_t t;
-    struct tm *tmp;
-    static char buf[TIME_FMT_MAXLEN + 1];
+    return format_time(time(NULL));
+}
+
+
+static void
+output(int pri, FILE *f, const char *line)
+{
+    if (log_syslog) {
+#ifdef __PLATFORM_android
+        __android_log_print(pri + ANDROID_LOG_DEBUG, NAME, "%s", line);
+#else
+        syslog(__p2s(pri), "%s", line);
+#endif
+    } else {
+        fputs(line, f);
+        putc('\n', f);
+    }
+}
+
+
+/* Hand a record over to the logger thread, or NULL if the queue is
+ * full */
+static struct record *
+claim(void)
+{
+    unsigned long pos = __atomic_load_n(&queue.tail, __ATOMIC_RELAXED);
+    struct record *r;
+    long diff;
+
+    for(;;) {
+        r = &queue.records[pos & (QUEUE_SIZE - 1)];
+        diff = (long)(__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&queue.tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                return r;
+        } else if (diff < 0) {
+            __atomic_add_fetch(&queue.dropped, 1, __ATOMIC_RELAXED);
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&queue.tail, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+
+static void
+publish(struct record *r)
+{
+    uint64_t one = 1;
 
-    t = time(NULL);
-    if (!(tmp = localtime(&t))
-        || strftime(buf, TIME_FMT_MAXLEN + 1, TIME_FMT, tmp) != TIME_FMT_MAXLEN)
-        *buf = '\0';
-    return buf;
+    __atomic_store_n(&r->seq, __atomic_load_n(&r->seq, __ATOMIC_RELAXED) + 1,
+                     __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&queue.sleeping, 0, __ATOMIC_SEQ_CST)) {
+        /* The eventfd does not block, a failure leaves the record to
+         * the next wakeup */
+        if (write(queue.efd, &one, sizeof(one)) < 0) {}
+    }
+}
+
+
+/* Format a message with the time and the pid in front and queue it for
+ * the logger thread, or write it out if the thread does not run */
+static void
+vlog(int pri, FILE *f, time_t now, const char *fmt, va_list ap)
+{
+    char buf[LINE_SIZE], *line = buf;
+    struct record *r = NULL;
+    int n;
+
+    if (__atomic_load_n(&queue.running, __ATOMIC_ACQUIRE)) {
+        if ((r = claim()) == NULL) return;
+        line = r->line;
+        r->pri = pri;
+        r->f = f;
+    }
+
+    if (log_syslog)
+        n = snprintf(line, LINE_SIZE, "[%d", log_pid ? log_pid : getpid());
+    else
+        n = snprintf(line, LINE_SIZE, "%s [%d", format_time(now),
+                     log_pid ? log_pid : getpid());
+    if (n < 0) n = 0;
+    if (n < LINE_SIZE) vsnprintf(line + n, LINE_SIZE - n, fmt, ap);
+
+    if (r) publish(r);
+    else output(pri, f, line);
+}
+
+
+static void
+say(int pri, FILE *f, time_t now, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vlog(pri, f, now, fmt, ap);
+    va_end(ap);
+}
+
+
+/* The rate limits of the messages with format m, or NULL if there is
+ * no room for another format. Formats are told apart by their address,
+ * a format used in several places may be limited as one. */
+static struct site *
+find_site(const char *m, int pri, FILE *f)
+{
+    unsigned int h = ((uintptr_t)m >> 3) * 0x9e3779b1U, i;
+    const char *cur;
+    struct site *s;
+
+    for(i = 0; i < SITES; i++) {
+        s = &sites[(h + i) & (SITES - 1)];
+        cur = __atomic_load_n(&s->m, __ATOMIC_ACQUIRE);
+        if (cur == NULL) {
+            s->pri = pri;
+            s->f = f;
+            if (__atomic_compare_exchange_n(&s->m, &cur, m, 0, __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE))
+                return s;
+        }
+        if (cur == m) return s;
+    }
+    return NULL;
+}
+
+
+/* Report the messages of a site suppressed before the current second */
+static void
+report_site(struct site *s, time_t now)
+{
+    unsigned int n;
+
+    if (__atomic_load_n(&s->sec, __ATOMIC_RELAXED) == now) return;
+    if ((n = __atomic_exchange_n(&s->suppressed, 0, __ATOMIC_RELAXED)) == 0) return;
+    say(s->pri, s->f, now, "] Suppressed %u messages like \"%s\"", n, s->m);
+}
+
+
+/* Whether a message with format m may be logged at time now. The first
+ * message of a second starts the count over and reports what was
+ * suppressed before. Races between threads make the limit approximate,
+ * which is good enough. */
+static int
+allow(const char *m, int pri, FILE *f, time_t now)
+{
+    struct site *s;
+    time_t sec;
+
+    if ((s = find_site(m, pri, f)) == NULL) return 1;
+
+    sec = __atomic_load_n(&s->sec, __ATOMIC_RELAXED);
+    if (sec != now && __atomic_compare_exchange_n(&s->sec, &sec, now, 0,
+                                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&s->count, 0, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&s->suppressed, __ATOMIC_RELAXED)) {
+            /* Not reported by report_site, the second has changed */
+            unsigned int n = __atomic_exchange_n(&s->suppressed, 0, __ATOMIC_RELAXED);
+            if (n) say(pri, f, now, "] Suppressed %u messages like \"%s\"", n, m);
+        }
+    }
+
+    if (__atomic_add_fetch(&s->count, 1, __ATOMIC_RELAXED) <= BURST) return 1;
+    __atomic_add_fetch(&s->suppressed, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+
+void
+__log(int pri, FILE *f, const char *m, const char *fmt, ...)
+{
+    time_t now = time(NULL);
+    va_list ap;
+
+    if (!allow(m, pri, f, now)) return;
+
+    va_start(ap, fmt);
+    vlog(pri, f, now, fmt, ap);
+    va_end(ap);
+}
+
+
+/* Write out the records published so far. Returns the number of
+ * records written. */
+static int
+drain(void)
+{
+    struct record *r;
+    unsigned long head = queue.head;
+    int n = 0;
+
+    for(;;) {
+        r = &queue.records[head & (QUEUE_SIZE - 1)];
+        if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != head + 1) break;
+        output(r->pri, r->f, r->line);
+        __atomic_store_n(&r->seq, head + QUEUE_SIZE, __ATOMIC_RELEASE);
+        head++;
+        n++;
+    }
+    queue.head = head;
+    if (n && !log_syslog) {
+        fflush(stdout);
+        fflush(stderr);
+    }
+    return n;
+}
+
+
+/* Report what was suppressed or dropped. Dropped messages are reported
+ * directly, the queue may still be full. */
+static void
+report(void)
+{
+    time_t now = time(NULL);
+    char line[LINE_SIZE];
+    unsigned long n;
+    int i;
+
+    for(i = 0; i < SITES; i++)
+        if (__atomic_load_n(&sites[i].m, __ATOMIC_ACQUIRE)) report_site(&sites[i], now);
+
+    if ((n = __atomic_exchange_n(&queue.dropped, 0, __ATOMIC_RELAXED)) == 0) return;
+    if (log_syslog)
+        snprintf(line, sizeof(line), "[%d] WARNING: Log queue full, %lu messages dropped",
+                 log_pid, n);
+    else
+        snprintf(line, sizeof(line), "%s [%d] WARNING: Log queue full, %lu messages dropped",
+                 format_time(now), log_pid, n);
+    output(L_WRN, stderr, line);
+}
+
+
+static int
+pending(void)
+{
+    struct record *r = &queue.records[queue.head & (QUEUE_SIZE - 1)];
+
+    return __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) == queue.head + 1;
+}
+
+
+static void *
+run_logger(void *arg)
+{
+    struct pollfd pfd = { .fd = queue.efd, .events = POLLIN };
+    uint64_t v;
+
+    for(;;) {
+        if (drain()) continue;
+        report();
+        if (__atomic_load_n(&queue.stop, __ATOMIC_ACQUIRE)) break;
+
+        __atomic_store_n(&queue.sleeping, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!pending() && !__atomic_load_n(&queue.stop, __ATOMIC_ACQUIRE)
+            && poll(&pfd, 1, REPORT_INTERVAL) > 0
+            && read(queue.efd, &v, sizeof(v)) < 0) {}
+        __atomic_store_n(&queue.sleeping, 0, __ATOMIC_RELAXED);
+    }
+    drain();
+    return NULL;
+}
+
+
+/* A child process does not inherit the logger thread, it writes its
+ * messages out itself */
+static void
+forked(void)
+{
+    queue.running = 0;
+    log_pid = getpid();
+}
+
+
+static void
+watch_fork(void)
+{
+    pthread_atfork(NULL, NULL, forked);
 }
 
 
 void
 start_logger(const char *name)
 {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    unsigned long i;
+    int rv;
+
     if (log_syslog)
         openlog(name, LOG_CONS, LOG_DAEMON);
+    log_pid = getpid();
+
+    if (queue.running) return;
+    if (queue.records == NULL) {
+        if ((queue.records = calloc(QUEUE_SIZE, sizeof(*queue.records))) == NULL)
+            return;
+        for(i = 0; i < QUEUE_SIZE; i++)
+            queue.records[i].seq = i;
+    }
+    if ((queue.efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0) {
+        WRN("Could not create eventfd, logging synchronously: %s", strerror(errno));
+        return;
+    }
+    queue.stop = 0;
+    if ((rv = pthread_create(&queue.thread, NULL, run_logger, NULL)) != 0) {
+        WRN("Could not start logger thread, logging synchronously: %s", strerror(rv));
+        close(queue.efd);
+        queue.efd = -1;
+        return;
+    }
+    pthread_once(&once, watch_fork);
+    __atomic_store_n(&queue.running, 1, __ATOMIC_RELEASE);
 }
 
 
 void
 stop_logger(void)
 {
+    uint64_t one = 1;
+
+    if (queue.running) {
+        __atomic_store_n(&queue.running, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&queue.stop, 1, __ATOMIC_RELEASE);
+        if (write(queue.efd, &one, sizeof(one)) < 0) {}
+        pthread_join(queue.thread, NULL);
+        /* Producers that claimed a record before running was cleared
+         * may publish it after the last drain of the logger thread */
+        while (queue.head != __atomic_load_n(&queue.tail, __ATOMIC_ACQUIRE))
+            if (!drain()) sched_yield();
+        report();
+        close(queue.efd);
+        queue.efd = -1;
+    }
     if (log_syslog)
         closelog();
 }
@@ -13,9 +13,9 @@ enum log_priority {
     L_ERR
 };
 
-/* Format of location information. Includes the pid of the process, filename,
- * function name, and line number. */
-#define LOC_FMT     "[%d:%s:%s:%d]"
+/* Format of location information that follows the pid of the process:
+ * filename, function name, and line number. */
+#define LOC_FMT     ":%s:%s:%d]"
 #define LOC_FMT_LEN (sizeof(LOC_FMT) - 1)
 
 #define DEBUGGING (log_threshold <= L_DBG)
@@ -30,42 +30,20 @@ enum log_priority {
 #  endif
 #endif
 
-#ifdef __PLATFORM_android
-#  include <android/log.h>
-#  define _SYSLOG(pri, pfx, m, a...)                                    \
-    if (DEBUGGING) {                                                    \
-        __android_log_print(pri + ANDROID_LOG_DEBUG, NAME, "[%s:%s:%d] "\
-                            m, __FILE__, __func__, __LINE__, ## a);     \
-    } else {                                                            \
-        __android_log_print(pri + ANDROID_LOG_DEBUG, NAME, m, ## a);    \
-    }
-#else
-#  define _SYSLOG(pri, pfx, m, a...)                                    \
-    if (DEBUGGING) {                                                    \
-        syslog(__p2s(pri), LOC_FMT pfx m, getpid(), __FILE__, __func__, \
-               __LINE__, ## a);                                         \
-    } else {                                                            \
-        syslog(__p2s(pri), "[%d]" pfx m, getpid(), ## a);               \
-    }
-#endif
-
 /* Define NO_LOG globally if you want to compile the program without any
- * logging code. This is useful for profiling. */
+ * logging code. This is useful for profiling. The message format m also
+ * identifies the message for rate limiting, see __log. */
 #ifdef NO_LOG
 #  define _LOG(pri, f, pfx, m, a...)
 #else
 #  define _LOG(pri, f, pfx, m, a...)                                    \
 do {                                                                    \
     if (log_threshold > (pri)) break;                                   \
-    if (log_syslog) {                                                   \
-        _SYSLOG(pri, pfx, m, ## a);                                     \
+    if (DEBUGGING) {                                                    \
+        __log((pri), (f), m, LOC_FMT pfx m, __FILE__, __func__,         \
+              __LINE__, ## a);                                          \
     } else {                                                            \
-        if (DEBUGGING) {                                                \
-            fprintf(f, "%s " LOC_FMT pfx m "\n", __ltime(), getpid(),   \
-                    __FILE__, __func__, __LINE__, ## a);                \
-        } else {                                                        \
-            fprintf(f, "%s [%d]" pfx m "\n", __ltime(), getpid(), ## a);\
-        }                                                               \
+        __log((pri), (f), m, "]" pfx m, ## a);                          \
     }                                                                   \
 } while(0)
 #endif
@@ -79,9 +57,23 @@ do {                                                                    \
 extern int log_syslog;
 extern int log_threshold;
 
+/* Start the logger thread. Until it runs, and after stop_logger, the
+ * messages are written out by the thread that logs them. */
 void start_logger(const char *name);
+
+/* Write out the messages still queued and stop the logger thread. */
 void stop_logger (void);
 
+/* Log a message with the given priority to syslog or, without syslog,
+ * to f. The time (without syslog) and the pid go in front of fmt. The
+ * message is formatted into a lock-free ring that the logger thread
+ * drains, so that a slow syslog daemon or terminal never holds up the
+ * data path: a message that finds the ring full is dropped and
+ * counted. At most a few messages with the same format m are logged
+ * per second, the rest are counted and reported as suppressed. */
+void __log(int pri, FILE *f, const char *m, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+
 /* Convert message priority to syslog priority */
 int __p2s(enum log_priority pri);
 const char *__ltime(void);
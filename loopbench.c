@@ -0,0 +1,571 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/udp.h>
+#include <netinet/tcp.h>
+
+#include "chord.h"
+#include "log.h"
+#include "utils.h"
+#include "stats.h"
+#include "hist.h"
+
+/* Loopback benchmark. Two chord instances are connected back to back
+ * over a pair of pseudo terminals. The harness relays the bytes between
+ * the two pty masters (optionally paced to emulate a baud rate) and
+ * attaches an in-process packet source and sink to each instance in
+ * place of a TUN interface. This makes it possible to measure the whole
+ * data path without serial hardware and without root privileges. */
+
+#define MAGIC 0x43424e48 /* "CBNH" */
+
+/* Marker placed at the beginning of the payload of every packet that
+ * is tracked for latency and loss. */
+struct mark {
+    uint32_t magic;
+    uint32_t seq;
+    uint64_t ts;
+} __attribute__((packed));
+
+enum mix {
+    MIX_ICMP = 0,
+    MIX_UDP,
+    MIX_BULK,
+    MIX_INTERACTIVE,
+    MIX_MAX
+};
+
+static const char *mix_names[MIX_MAX] = {
+    "icmp", "udp", "bulk", "interactive"
+};
+
+/* Relative frequency of each traffic type in the mix. */
+static int weights[MIX_MAX];
+
+/* One direction of the link. Instance a sends to instance b. */
+struct dir {
+    const char *name;
+    int src;             /* Packet source (our end of the socket pair)  */
+    int dst;             /* Packet sink on the other side               */
+    int from, to;        /* pty masters to relay between                */
+
+    char buf[65536];     /* Relay buffer                                */
+    size_t head, len;
+    double tokens;       /* Token bucket for pacing, in bytes           */
+
+    uint32_t seq;
+    uint32_t tcp_seq;
+    uint64_t sent, sent_bytes, dropped;
+    uint64_t rcvd, rcvd_bytes, acks;
+    uint64_t relayed;    /* Bytes relayed over the emulated wire        */
+    struct hist lat;
+};
+
+static struct dir dirs[2];
+
+static int    rate = 100;     /* Offered load in packets per second */
+static int    pace = 115200;  /* Emulated baud rate, 0 to disable   */
+static int    duration = 10;
+static int    chord_baud = 115200;
+
+
+static void
+print_help(void)
+{
+    static char help_msg[] = "\
+Usage: loopbench [options]\n\
+Options:\n\
+    -h  This help text\n\
+    -v  Increase verbosity of the chord instances\n\
+    -b  Emulated baud rate of the link, 0 disables pacing (default 115200)\n\
+    -r  Offered load in packets per second (default 100)\n\
+    -t  Duration of the test in seconds (default 10)\n\
+    -m  Traffic mix, e.g., icmp=1,udp=4,bulk=1,interactive=2\n\
+        (default: equal share of all traffic types)\n\
+";
+
+    fprintf(stdout, "%s", help_msg);
+    exit(EXIT_SUCCESS);
+}
+
+
+static int
+parse_mix(char *arg)
+{
+    char *tok, *val, *save;
+    int i;
+
+    memset(weights, 0, sizeof(weights));
+    for(tok = strtok_r(arg, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        val = strchr(tok, '=');
+        if (val) *val++ = '\0';
+        for(i = 0; i < MIX_MAX; i++)
+            if (!strcmp(tok, mix_names[i])) break;
+        if (i == MIX_MAX) {
+            fprintf(stderr, "Unknown traffic type '%s'\n", tok);
+            return -1;
+        }
+        weights[i] = val ? atoi(val) : 1;
+    }
+    return 0;
+}
+
+
+static uint16_t
+checksum(const void *data, size_t len, uint32_t sum)
+{
+    const uint8_t *p = data;
+
+    while (len > 1) {
+        sum += (p[0] << 8) | p[1];
+        p += 2;
+        len -= 2;
+    }
+    if (len) sum += p[0] << 8;
+    while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+    return htons(~sum);
+}
+
+
+/* Checksum of the TCP/UDP pseudo header, not yet folded or inverted. */
+static uint32_t
+pseudo_sum(struct iphdr *ip, size_t len)
+{
+    uint32_t sum = 0;
+
+    sum += ntohl(ip->saddr) >> 16;
+    sum += ntohl(ip->saddr) & 0xffff;
+    sum += ntohl(ip->daddr) >> 16;
+    sum += ntohl(ip->daddr) & 0xffff;
+    sum += ip->protocol;
+    sum += len;
+    return sum;
+}
+
+
+/* Build an IPv4 packet of the given traffic type into buf. Returns the
+ * length of the packet. The payload starts with a mark unless the
+ * packet is a pure TCP ACK. */
+static size_t
+build_packet(char *buf, struct dir *d, int dir, enum mix type, int ack)
+{
+    struct iphdr *ip = (struct iphdr *)buf;
+    struct icmphdr *icmp;
+    struct udphdr *udp;
+    struct tcphdr *tcp;
+    struct mark *m;
+    char *payload;
+    size_t hlen, plen, i;
+
+    memset(buf, 0, 60);
+    ip->version = 4;
+    ip->ihl = 5;
+    ip->ttl = 64;
+    ip->id = htons(d->seq);
+    ip->saddr = htonl(dir ? 0x0a000002 : 0x0a000001);
+    ip->daddr = htonl(dir ? 0x0a000001 : 0x0a000002);
+
+    switch(type) {
+    case MIX_ICMP:
+        ip->protocol = IPPROTO_ICMP;
+        hlen = sizeof(struct icmphdr);
+        plen = 56;
+        break;
+
+    case MIX_UDP:
+        ip->protocol = IPPROTO_UDP;
+        hlen = sizeof(struct udphdr);
+        plen = 32 + (d->seq % 4) * 8;
+        break;
+
+    case MIX_BULK:
+        ip->protocol = IPPROTO_TCP;
+        hlen = sizeof(struct tcphdr);
+        plen = ack ? 0 : 1460;
+        break;
+
+    case MIX_INTERACTIVE:
+    default:
+        ip->protocol = IPPROTO_TCP;
+        hlen = sizeof(struct tcphdr);
+        plen = sizeof(struct mark) + d->seq % 24;
+        break;
+    }
+
+    payload = buf + sizeof(*ip) + hlen;
+    if (plen) {
+        /* Telemetry-like payload: a mark followed by mostly repeating
+         * text, with the sequence number mixed in. */
+        m = (struct mark *)payload;
+        m->magic = MAGIC;
+        m->seq = d->seq++;
+        m->ts = now_ns();
+        for(i = sizeof(*m); i < plen; i++)
+            payload[i] = "status=ok temp=21.5 volt=12.1 "[i % 30] ^ (i == sizeof(*m) ? m->seq : 0);
+    }
+
+    ip->tot_len = htons(sizeof(*ip) + hlen + plen);
+    ip->check = checksum(ip, sizeof(*ip), 0);
+
+    switch(ip->protocol) {
+    case IPPROTO_ICMP:
+        icmp = (struct icmphdr *)(ip + 1);
+        icmp->type = ICMP_ECHO;
+        icmp->un.echo.id = htons(getpid() & 0xffff);
+        icmp->un.echo.sequence = htons(d->seq & 0xffff);
+        icmp->checksum = checksum(icmp, hlen + plen, 0);
+        break;
+
+    case IPPROTO_UDP:
+        udp = (struct udphdr *)(ip + 1);
+        udp->source = htons(5000);
+        udp->dest = htons(5001);
+        udp->len = htons(hlen + plen);
+        udp->check = checksum(udp, hlen + plen, pseudo_sum(ip, hlen + plen));
+        break;
+
+    case IPPROTO_TCP:
+        tcp = (struct tcphdr *)(ip + 1);
+        tcp->source = htons(type == MIX_BULK ? 20 : 22);
+        tcp->dest = htons(type == MIX_BULK ? 40000 : 40001);
+        tcp->seq = htonl(d->tcp_seq);
+        tcp->ack_seq = htonl(dirs[!dir].tcp_seq);
+        tcp->doff = 5;
+        tcp->ack = 1;
+        tcp->psh = plen ? 1 : 0;
+        tcp->window = htons(65535);
+        d->tcp_seq += plen;
+        tcp->check = checksum(tcp, hlen + plen, pseudo_sum(ip, hlen + plen));
+        break;
+    }
+
+    return sizeof(*ip) + hlen + plen;
+}
+
+
+static enum mix
+pick_type(void)
+{
+    int i, total = 0, r;
+
+    for(i = 0; i < MIX_MAX; i++) total += weights[i];
+    r = rand() % total;
+    for(i = 0; i < MIX_MAX; i++) {
+        if (r < weights[i]) return i;
+        r -= weights[i];
+    }
+    return MIX_ICMP;
+}
+
+
+static void
+send_packet(struct dir *d, int dir, enum mix type, int ack)
+{
+    char buf[1600];
+    size_t len;
+
+    len = build_packet(buf, d, dir, type, ack);
+    if (send(d->src, buf, len, MSG_DONTWAIT) < 0) {
+        d->dropped++;
+        return;
+    }
+    d->sent++;
+    d->sent_bytes += len;
+}
+
+
+/* Generate one unit of traffic. Bulk transfers flow from a to b and
+ * are acknowledged by every other segment, the remaining traffic types
+ * are spread evenly over both directions. */
+static void
+generate(void)
+{
+    static uint64_t n;
+    enum mix type;
+    int dir;
+
+    type = pick_type();
+    dir = type == MIX_BULK ? 0 : n % 2;
+    send_packet(&dirs[dir], dir, type, 0);
+    if (type == MIX_BULK && n % 2)
+        send_packet(&dirs[1], 1, MIX_BULK, 1);
+    n++;
+}
+
+
+static void
+receive(struct dir *d)
+{
+    char buf[65536];
+    struct iphdr *ip = (struct iphdr *)buf;
+    struct mark m;
+    ssize_t rv;
+    size_t off;
+
+    while ((rv = recv(d->dst, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+        d->rcvd++;
+        d->rcvd_bytes += rv;
+
+        off = ip->ihl * 4;
+        switch(ip->protocol) {
+        case IPPROTO_ICMP: off += sizeof(struct icmphdr); break;
+        case IPPROTO_UDP:  off += sizeof(struct udphdr);  break;
+        case IPPROTO_TCP:  off += sizeof(struct tcphdr);  break;
+        }
+        if (off + sizeof(m) > rv) {
+            d->acks++;
+            continue;
+        }
+        memcpy(&m, buf + off, sizeof(m));
+        if (m.magic != MAGIC) continue;
+        hist_record(&d->lat, now_ns() - m.ts);
+    }
+}
+
+
+/* Move bytes from one pty master to the other, subject to the token
+ * bucket of the direction. */
+static void
+relay(struct dir *d, int readable, int writable)
+{
+    ssize_t rv;
+    size_t n, tail;
+
+    if (readable && d->len < sizeof(d->buf)) {
+        tail = (d->head + d->len) % sizeof(d->buf);
+        n = tail >= d->head ? sizeof(d->buf) - tail : d->head - tail;
+        rv = read(d->from, d->buf + tail, n);
+        if (rv > 0) d->len += rv;
+    }
+
+    if (writable && d->len) {
+        n = d->len;
+        if (d->head + n > sizeof(d->buf)) n = sizeof(d->buf) - d->head;
+        if (pace && n > d->tokens) n = d->tokens;
+        if (n == 0) return;
+        rv = write(d->to, d->buf + d->head, n);
+        if (rv > 0) {
+            d->head = (d->head + rv) % sizeof(d->buf);
+            d->len -= rv;
+            d->relayed += rv;
+            if (pace) d->tokens -= rv;
+        }
+    }
+}
+
+
+static pid_t
+start_instance(const char *name, const char *tty, int fd, int *stop)
+{
+    struct chord_conf conf;
+    chord_t *c;
+    int p[2], i, rv;
+    pid_t pid;
+
+    if (pipe(p) < 0) return -1;
+
+    if ((pid = fork()) < 0) return -1;
+    if (pid) {
+        close(p[0]);
+        close(fd);
+        *stop = p[1];
+        return pid;
+    }
+
+    /* Close everything that belongs to the harness or to the other
+     * instance. */
+    for(i = 3; i < 1024; i++)
+        if (i != p[0] && i != fd) close(i);
+
+    chord_conf_init(&conf);
+    conf.ifname = name;
+    conf.serial = tty;
+    conf.baud = chord_baud;
+    conf.packetfd = fd;
+    conf.sigfd = p[0];
+
+    if ((c = chord_new(&conf)) == NULL) _exit(EXIT_FAILURE);
+    rv = chord_run(c);
+    chord_free(c);
+    _exit(rv < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+
+static const struct stats *
+wait_stats(const char *name)
+{
+    const struct stats *s;
+    int i;
+
+    for(i = 0; i < 100; i++) {
+        if ((s = stats_map(name)) != NULL) return s;
+        usleep(20000);
+    }
+    return NULL;
+}
+
+
+static void
+report(struct dir *d, const struct stats *tx, double secs)
+{
+    uint64_t lost = d->sent > d->rcvd ? d->sent - d->rcvd : 0;
+
+    printf("%s:\n", d->name);
+    printf("  offered     %10llu packets %12llu bytes (%llu refused)\n",
+           (unsigned long long)d->sent, (unsigned long long)d->sent_bytes,
+           (unsigned long long)d->dropped);
+    printf("  delivered   %10llu packets %12llu bytes (%llu lost, %.2f%%)\n",
+           (unsigned long long)d->rcvd, (unsigned long long)d->rcvd_bytes,
+           (unsigned long long)lost, d->sent ? 100.0 * lost / d->sent : 0.0);
+    printf("  goodput     %10.0f bit/s\n", d->rcvd_bytes * 8 / secs);
+    printf("  wire        %10llu bytes %10.0f bit/s\n",
+           (unsigned long long)d->relayed, d->relayed * 8 / secs);
+    if (tx && tx->tx.bytes) {
+        printf("  comp ratio  %10.3f\n", (double)tx->tx.comp_bytes / tx->tx.bytes);
+        printf("  framing     %10.3f\n", tx->tx.comp_bytes ?
+               (double)tx->tx.wire_bytes / tx->tx.comp_bytes : 0.0);
+    }
+    printf("  latency us  p50 %.1f p99 %.1f p999 %.1f max %.1f (%llu samples)\n",
+           hist_percentile(&d->lat, 50) / 1000.0,
+           hist_percentile(&d->lat, 99) / 1000.0,
+           hist_percentile(&d->lat, 99.9) / 1000.0,
+           d->lat.max / 1000.0, (unsigned long long)d->lat.count);
+}
+
+
+int
+main(int argc, char **argv)
+{
+    int opt, i, sa[2], sb[2], stop[2];
+    int ma, sla, mb, slb;
+    char na[64], nb[64];
+    pid_t pid[2];
+    const struct stats *st[2];
+    struct pollfd pfd[6];
+    uint64_t start, end, last, next, t;
+    double secs;
+
+    for(i = 0; i < MIX_MAX; i++) weights[i] = 1;
+    log_syslog = 0;
+    log_threshold = L_WRN;
+
+    while((opt = getopt(argc, argv, "hvb:r:t:m:")) != -1) {
+        switch(opt) {
+        case 'h': print_help();             break;
+        case 'v': log_threshold--;          break;
+        case 'b': pace = atoi(optarg);      break;
+        case 'r': rate = atoi(optarg);      break;
+        case 't': duration = atoi(optarg);  break;
+        case 'm':
+            if (parse_mix(optarg) < 0) exit(EXIT_FAILURE);
+            break;
+        default:
+            fprintf(stderr, "Use the -h option for list of supported "
+                    "program arguments.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (rate <= 0) rate = 1;
+    if (pace) chord_baud = pace;
+
+    if (openpty(&ma, &sla, na, NULL, NULL) < 0
+        || openpty(&mb, &slb, nb, NULL, NULL) < 0) {
+        fprintf(stderr, "openpty: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sa) < 0
+        || socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sb) < 0) {
+        fprintf(stderr, "socketpair: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    fflush(stdout);
+
+    if ((pid[0] = start_instance("loopa", na, sa[1], &stop[0])) < 0
+        || (pid[1] = start_instance("loopb", nb, sb[1], &stop[1])) < 0) {
+        fprintf(stderr, "fork: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    /* Keep the slave sides open so that the masters do not see a hangup
+     * before the instances have opened the ptys. */
+    st[0] = wait_stats("loopa");
+    st[1] = wait_stats("loopb");
+    close(sla);
+    close(slb);
+
+    make_nonblocking(ma);
+    make_nonblocking(mb);
+
+    dirs[0].name = "a -> b";
+    dirs[0].src = sa[0]; dirs[0].dst = sb[0];
+    dirs[0].from = ma;   dirs[0].to = mb;
+    dirs[1].name = "b -> a";
+    dirs[1].src = sb[0]; dirs[1].dst = sa[0];
+    dirs[1].from = mb;   dirs[1].to = ma;
+
+    start = last = next = now_ns();
+    end = start + duration * 1000000000ULL;
+
+    /* Run for the configured duration, then keep relaying for another
+     * second to let queued packets drain. */
+    while ((t = now_ns()) < end + 1000000000ULL) {
+        if (pace) {
+            for(i = 0; i < 2; i++) {
+                dirs[i].tokens += (t - last) * (pace / 10.0) / 1e9;
+                if (dirs[i].tokens > pace / 100.0 + 64)
+                    dirs[i].tokens = pace / 100.0 + 64;
+            }
+        }
+        last = t;
+
+        while (t < end && t >= next) {
+            generate();
+            next += 1000000000ULL / rate;
+        }
+
+        pfd[0].fd = ma; pfd[0].events = POLLIN | (dirs[1].len ? POLLOUT : 0);
+        pfd[1].fd = mb; pfd[1].events = POLLIN | (dirs[0].len ? POLLOUT : 0);
+        pfd[2].fd = sa[0]; pfd[2].events = POLLIN;
+        pfd[3].fd = sb[0]; pfd[3].events = POLLIN;
+
+        if (poll(pfd, 4, 1) < 0 && errno != EINTR) break;
+
+        relay(&dirs[0], pfd[0].revents & POLLIN, pfd[1].revents & POLLOUT);
+        relay(&dirs[1], pfd[1].revents & POLLIN, pfd[0].revents & POLLOUT);
+        if (pfd[3].revents & POLLIN) receive(&dirs[0]);
+        if (pfd[2].revents & POLLIN) receive(&dirs[1]);
+    }
+    secs = duration;
+
+    printf("mix:");
+    for(i = 0; i < MIX_MAX; i++)
+        if (weights[i]) printf(" %s=%d", mix_names[i], weights[i]);
+    printf(", %d packets/s, %d s, link %d baud%s\n", rate, duration,
+           pace, pace ? "" : " (unpaced)");
+    report(&dirs[0], st[0], secs);
+    report(&dirs[1], st[1], secs);
+
+    for(i = 0; i < 2; i++) {
+        int sig = SIGTERM;
+        if (write(stop[i], &sig, sizeof(sig)) < 0)
+            kill(pid[i], SIGTERM);
+        waitpid(pid[i], NULL, 0);
+        stats_unmap(st[i]);
+    }
+    return 0;
+}
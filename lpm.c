@@ -0,0 +1,155 @@
+#include "lpm.h"
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "utils.h"
+
+
+struct entry {
+    uint32_t child; /* Index of the next node, 0 if none        */
+    int32_t  value; /* -1 if no prefix ends at this entry       */
+    uint32_t depth; /* Length of the prefix that set the value  */
+};
+
+struct node {
+    struct entry e[256];
+};
+
+/* Node 0 is the root, it is never anybody's child. */
+struct lpm {
+    unsigned int keylen;
+    struct node *nodes;
+    uint32_t     count;
+    uint32_t     size;
+};
+
+
+static uint32_t
+new_node(struct lpm *t)
+{
+    int i;
+
+    if (t->count == t->size) {
+        t->size = t->size ? t->size * 2 : 16;
+        t->nodes = xrealloc(t->nodes, t->size * sizeof(*t->nodes));
+    }
+    for(i = 0; i < 256; i++) {
+        t->nodes[t->count].e[i].child = 0;
+        t->nodes[t->count].e[i].value = -1;
+        t->nodes[t->count].e[i].depth = 0;
+    }
+    return t->count++;
+}
+
+
+struct lpm *
+lpm_new(unsigned int keylen)
+{
+    struct lpm *t;
+
+    t = xcalloc(1, sizeof(*t));
+    t->keylen = keylen;
+    new_node(t);
+    return t;
+}
+
+
+void
+lpm_free(struct lpm *t)
+{
+    if (t == NULL) return;
+    if (t->nodes) xfree(t->nodes);
+    xfree(t);
+}
+
+
+int
+lpm_insert(struct lpm *t, const uint8_t *prefix, unsigned int len, int value)
+{
+    struct entry *e;
+    uint32_t n = 0, child;
+    unsigned int i, bits, first, last, j;
+
+    if (len > t->keylen * 8 || value < 0) return -1;
+
+    /* Walk (and build) the full bytes of the prefix */
+    for(i = 0; len > 8 * (i + 1); i++) {
+        if ((child = t->nodes[n].e[prefix[i]].child) == 0) {
+            child = new_node(t);
+            t->nodes[n].e[prefix[i]].child = child;
+        }
+        n = child;
+    }
+
+    /* The remaining 0 to 8 bits cover a range of entries of the node */
+    bits = len - 8 * i;
+    first = bits ? prefix[i] & (0xff00 >> bits) : 0;
+    last = first + (0xff >> bits);
+
+    for(j = first; j <= last; j++) {
+        e = &t->nodes[n].e[j];
+        if (e->value >= 0 && e->depth > len) continue;
+        e->value = value;
+        e->depth = len;
+    }
+    return 0;
+}
+
+
+/* Entries deeper in the trie always belong to longer prefixes, so the
+ * last value seen on the way down is the longest match. */
+int
+lpm_lookup(const struct lpm *t, const uint8_t *key)
+{
+    const struct entry *e;
+    uint32_t n = 0;
+    unsigned int i;
+    int best = -1;
+
+    for(i = 0; i < t->keylen; i++) {
+        e = &t->nodes[n].e[key[i]];
+        if (e->value >= 0) best = e->value;
+        if ((n = e->child) == 0) break;
+    }
+    return best;
+}
+
+
+int
+lpm_parse_prefix(const char *str, uint8_t *addr, unsigned int *len)
+{
+    char buf[INET6_ADDRSTRLEN];
+    const char *slash;
+    char *end;
+    unsigned long l;
+    size_t n;
+    int af, max;
+
+    slash = strchr(str, '/');
+    n = slash ? (size_t)(slash - str) : strlen(str);
+    if (n >= sizeof(buf)) return -1;
+    memcpy(buf, str, n);
+    buf[n] = '\0';
+
+    if (inet_pton(AF_INET, buf, addr) == 1) {
+        af = AF_INET;
+        max = 32;
+    } else if (inet_pton(AF_INET6, buf, addr) == 1) {
+        af = AF_INET6;
+        max = 128;
+    } else {
+        return -1;
+    }
+
+    if (slash == NULL) {
+        *len = max;
+        return af;
+    }
+
+    l = strtoul(slash + 1, &end, 10);
+    if (end == slash + 1 || *end || l > max) return -1;
+    *len = l;
+    return af;
+}
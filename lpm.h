@@ -0,0 +1,33 @@
+#ifndef _LPM_H_
+#define _LPM_H_
+
+#include <stdint.h>
+
+/* Longest prefix match table for keys of a fixed number of bytes, e.g.,
+ * 4 for IPv4 and 16 for IPv6 addresses. The table is a multibit trie
+ * with a stride of 8 bits: every node is an array of 256 entries
+ * indexed by one byte of the key, so a lookup takes at most one memory
+ * access per byte of the key and no comparisons. Prefixes whose length
+ * is not a multiple of 8 are expanded into all the entries they cover
+ * at their last level. */
+struct lpm;
+
+struct lpm *lpm_new(unsigned int keylen);
+
+void lpm_free(struct lpm *t);
+
+/* Map the first len bits of prefix to value (non-negative). A longer
+ * prefix takes precedence over a shorter one regardless of the order in
+ * which they are inserted. Returns 0 on success and -1 if len is out of
+ * range. */
+int lpm_insert(struct lpm *t, const uint8_t *prefix, unsigned int len, int value);
+
+/* Return the value of the longest prefix matching key, or -1. */
+int lpm_lookup(const struct lpm *t, const uint8_t *key);
+
+/* Parse an IPv4 or IPv6 prefix such as 10.1.0.0/16 or fd00::/8 into
+ * addr (4 or 16 bytes) and len. A missing length means a host route.
+ * Returns the address family or -1 if the prefix is malformed. */
+int lpm_parse_prefix(const char *str, uint8_t *addr, unsigned int *len);
+
+#endif /* _LPM_H_ */
@@ -0,0 +1,678 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/ip6.h>
+#include <netinet/udp.h>
+#if defined(__CPU_x86_64) || defined(__CPU_i386)
+#  include <x86intrin.h>
+#endif
+
+#include "chord.h"
+#include "log.h"
+#include "utils.h"
+#include "hdlc.h"
+#include "cobs.h"
+#include "comp.h"
+#include "trace.h"
+
+/* Microbenchmarks of the framing and compression kernels. Each
+ * benchmark reports the time per packet, the number of input bytes
+ * processed per CPU cycle and the number of heap allocations per
+ * packet. Results are written in a tab-separated format that can be
+ * stored and later passed back with -b to detect regressions. */
+
+#define MAX_RESULTS 128
+#define MAX_PACKETS 4096
+
+struct result {
+    char name[64];
+    double ns;       /* Nanoseconds per packet */
+    double bpc;      /* Input bytes per cycle  */
+    double allocs;   /* Allocations per packet */
+};
+
+struct corpus {
+    char *pkt[MAX_PACKETS];
+    size_t len[MAX_PACKETS];
+    size_t n;
+    size_t bytes;
+};
+
+static struct result results[MAX_RESULTS];
+static int nresults;
+
+/* The framers and the compressor under test, and their counters */
+static struct stats link_stats;
+static struct pbuf_pool *pool;
+static struct hdlc *framer;
+static struct cobs *cobs_framer;
+static struct comp *compressor;
+
+static double min_time = 0.2; /* Minimum duration of a benchmark in s */
+static double threshold = 10; /* Regression threshold in percent      */
+
+
+/* Count heap allocations by interposing the allocator. The counter also
+ * sees allocations made by shared libraries such as librohc. */
+static uint64_t allocs;
+
+#ifdef __PLATFORM_gnu
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *
+malloc(size_t size)
+{
+    allocs++;
+    return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+    allocs++;
+    return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+    allocs++;
+    return __libc_realloc(ptr, size);
+}
+#endif
+
+
+static inline uint64_t
+cycles(void)
+{
+#if defined(__CPU_x86_64) || defined(__CPU_i386)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+
+static void
+print_help(void)
+{
+    static char help_msg[] = "\
+Usage: microbench [options]\n\
+Options:\n\
+    -h  This help text\n\
+    -p  Use IP packets from a pcap or pcapng file as an additional corpus\n\
+    -o  Write results to the given file (default standard output)\n\
+    -b  Compare with results stored in the given baseline file\n\
+    -T  Regression threshold in percent (default 10)\n\
+    -t  Minimum duration of each benchmark in seconds (default 0.2)\n\
+\n\
+The program exits with status 2 if a benchmark is slower than the\n\
+baseline by more than the threshold.\n\
+";
+
+    fprintf(stdout, "%s", help_msg);
+    exit(EXIT_SUCCESS);
+}
+
+
+static void
+add_packet(struct corpus *c, const void *data, size_t len)
+{
+    if (c->n == MAX_PACKETS) return;
+    c->pkt[c->n] = xmalloc(len);
+    memcpy(c->pkt[c->n], data, len);
+    c->len[c->n] = len;
+    c->bytes += len;
+    c->n++;
+}
+
+
+static void
+free_corpus(struct corpus *c)
+{
+    size_t i;
+
+    for(i = 0; i < c->n; i++) xfree(c->pkt[i]);
+    memset(c, 0, sizeof(*c));
+}
+
+
+/* Random payloads of the given size where the given fraction (in
+ * percent) of bytes needs to be escaped by the framer. */
+static void
+byte_corpus(struct corpus *c, size_t size, int density)
+{
+    char buf[MAX_PACKET_SIZE];
+    size_t i, j;
+
+    for(i = 0; i < 256; i++) {
+        for(j = 0; j < size; j++) {
+            if (rand() % 100 < density) {
+                buf[j] = rand() % 2 ? FRAME_BOUNDARY : CONTROL_ESCAPE;
+            } else {
+                do buf[j] = rand(); while (buf[j] == (char)FRAME_BOUNDARY
+                                           || buf[j] == (char)CONTROL_ESCAPE);
+            }
+        }
+        add_packet(c, buf, size);
+    }
+}
+
+
+static uint16_t
+checksum(const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    uint32_t sum = 0;
+
+    for(; len > 1; p += 2, len -= 2) sum += (p[0] << 8) | p[1];
+    if (len) sum += p[0] << 8;
+    while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+    return htons(~sum);
+}
+
+
+/* A flow of ICMP echo requests and UDP telemetry datagrams, used when
+ * no trace file is given. */
+static void
+ip_corpus(struct corpus *c)
+{
+    char buf[256];
+    struct iphdr *ip = (struct iphdr *)buf;
+    struct icmphdr *icmp = (struct icmphdr *)(ip + 1);
+    struct udphdr *udp = (struct udphdr *)(ip + 1);
+    size_t i, len;
+
+    for(i = 0; i < 1024; i++) {
+        memset(buf, 0, sizeof(buf));
+        ip->version = 4;
+        ip->ihl = 5;
+        ip->ttl = 64;
+        ip->id = htons(i);
+        ip->saddr = htonl(0x0a000001);
+        ip->daddr = htonl(0x0a000002);
+
+        if (i % 2) {
+            ip->protocol = IPPROTO_ICMP;
+            len = sizeof(*ip) + sizeof(*icmp) + 56;
+            icmp->type = ICMP_ECHO;
+            icmp->un.echo.id = htons(1);
+            icmp->un.echo.sequence = htons(i / 2);
+            memset(icmp + 1, 'a' + i % 26, 56);
+            icmp->checksum = checksum(icmp, len - sizeof(*ip));
+        } else {
+            ip->protocol = IPPROTO_UDP;
+            len = sizeof(*ip) + sizeof(*udp) + 48;
+            udp->source = htons(5000);
+            udp->dest = htons(5001);
+            udp->len = htons(len - sizeof(*ip));
+            snprintf((char *)(udp + 1), 48, "seq=%06zu temp=21.5 volt=12.1", i);
+        }
+        ip->tot_len = htons(len);
+        ip->check = checksum(ip, sizeof(*ip));
+        add_packet(c, buf, len);
+    }
+}
+
+
+/* The UDP telemetry datagrams over IPv6, the upper-layer checksum
+ * covers the pseudo header. */
+static void
+ip6_corpus(struct corpus *c)
+{
+    char buf[256], pseudo[256];
+    struct ip6_hdr *ip6 = (struct ip6_hdr *)buf;
+    struct udphdr *udp = (struct udphdr *)(ip6 + 1);
+    size_t i, len, plen;
+
+    for(i = 0; i < 1024; i++) {
+        memset(buf, 0, sizeof(buf));
+        plen = sizeof(*udp) + 48;
+        ip6->ip6_flow = htonl(6U << 28);
+        ip6->ip6_plen = htons(plen);
+        ip6->ip6_nxt = IPPROTO_UDP;
+        ip6->ip6_hlim = 64;
+        inet_pton(AF_INET6, "fd00::1", &ip6->ip6_src);
+        inet_pton(AF_INET6, "fd00::2", &ip6->ip6_dst);
+        udp->source = htons(5000);
+        udp->dest = htons(5001);
+        udp->len = htons(plen);
+        snprintf((char *)(udp + 1), 48, "seq=%06zu temp=21.5 volt=12.1", i);
+
+        /* source and destination, length, zeros and next header */
+        memset(pseudo, 0, 40);
+        memcpy(pseudo, &ip6->ip6_src, 32);
+        pseudo[35] = plen;
+        pseudo[39] = IPPROTO_UDP;
+        memcpy(pseudo + 40, udp, plen);
+        udp->check = checksum(pseudo, 40 + plen);
+
+        len = sizeof(*ip6) + plen;
+        add_packet(c, buf, len);
+    }
+}
+
+
+static int
+pcap_corpus(struct corpus *c, const char *fn)
+{
+    struct trace t;
+    const uint8_t *p;
+    size_t len;
+    uint64_t ts;
+    int rv;
+
+    if (trace_open(&t, fn) < 0) return -1;
+    while ((rv = trace_next(&t, &p, &len, &ts)) > 0) {
+        if (len > MAX_PACKET_SIZE) continue;
+        add_packet(c, p, len);
+    }
+    trace_close(&t);
+    if (rv < 0 || c->n == 0) {
+        fprintf(stderr, "No usable packets in %s\n", fn);
+        return -1;
+    }
+    return 0;
+}
+
+
+static struct result *
+new_result(const char *fmt, const char *corpus)
+{
+    struct result *r;
+
+    if (nresults == MAX_RESULTS) {
+        fprintf(stderr, "Too many benchmarks\n");
+        exit(EXIT_FAILURE);
+    }
+    r = &results[nresults++];
+    snprintf(r->name, sizeof(r->name), fmt, corpus);
+    return r;
+}
+
+
+static void
+finish(struct result *r, uint64_t ns, uint64_t cyc, uint64_t a,
+       uint64_t packets, uint64_t bytes)
+{
+    r->ns = (double)ns / packets;
+    r->bpc = cyc ? (double)bytes / cyc : 0;
+    r->allocs = (double)a / packets;
+}
+
+
+static void
+bench_encode(const char *name, struct corpus *c)
+{
+    struct result *r = new_result("hdlc_encode/%s", name);
+    uint64_t t0, c0, a0, packets = 0, bytes = 0;
+    char *frame;
+    size_t flen, i;
+
+    t0 = now_ns(); c0 = cycles(); a0 = allocs;
+    do {
+        for(i = 0; i < c->n; i++) {
+            build_hdlc_frame(framer, &frame, &flen, c->pkt[i], c->len[i]);
+            __asm__ volatile("" : : "r"(frame) : "memory");
+        }
+        packets += c->n;
+        bytes += c->bytes;
+    } while (now_ns() - t0 < min_time * 1e9);
+    finish(r, now_ns() - t0, cycles() - c0, allocs - a0, packets, bytes);
+}
+
+
+static void
+bench_decode(const char *name, struct corpus *c)
+{
+    struct result *r = new_result("hdlc_decode/%s", name);
+    uint64_t t0, c0, a0, packets = 0, bytes = 0;
+    struct pbuf *pkt;
+    char *stream, *frame;
+    size_t len = 0, flen, i, off;
+    int rv;
+
+    /* Encode the whole corpus into one byte stream first, the decoder
+     * is then run over the stream in chunks as read(2) would return. */
+    stream = xmalloc(HDLC_MAX_FRAME(c->bytes) + c->n * 2);
+    for(i = 0; i < c->n; i++) {
+        build_hdlc_frame(framer, &frame, &flen, c->pkt[i], c->len[i]);
+        memcpy(stream + len, frame, flen);
+        len += flen;
+    }
+
+    t0 = now_ns(); c0 = cycles(); a0 = allocs;
+    do {
+        for(off = 0; off < len; off += rv) {
+            rv = decode_hdlc_frame(framer, &pkt, stream + off, len - off);
+            if (pkt) {
+                packets++;
+                pbuf_free(pkt);
+            }
+        }
+        bytes += len;
+    } while (now_ns() - t0 < min_time * 1e9);
+    finish(r, now_ns() - t0, cycles() - c0, allocs - a0, packets, bytes);
+    xfree(stream);
+}
+
+
+static void
+bench_cobs_encode(const char *name, struct corpus *c)
+{
+    struct result *r = new_result("cobs_encode/%s", name);
+    uint64_t t0, c0, a0, packets = 0, bytes = 0;
+    char *frame;
+    size_t flen, i;
+
+    t0 = now_ns(); c0 = cycles(); a0 = allocs;
+    do {
+        for(i = 0; i < c->n; i++) {
+            build_cobs_frame(cobs_framer, &frame, &flen, c->pkt[i], c->len[i]);
+            __asm__ volatile("" : : "r"(frame) : "memory");
+        }
+        packets += c->n;
+        bytes += c->bytes;
+    } while (now_ns() - t0 < min_time * 1e9);
+    finish(r, now_ns() - t0, cycles() - c0, allocs - a0, packets, bytes);
+}
+
+
+static void
+bench_cobs_decode(const char *name, struct corpus *c)
+{
+    struct result *r = new_result("cobs_decode/%s", name);
+    uint64_t t0, c0, a0, packets = 0, bytes = 0;
+    struct pbuf *pkt;
+    char *stream, *frame;
+    size_t len = 0, flen, i, off;
+    int rv;
+
+    stream = xmalloc(COBS_MAX_FRAME(c->bytes) + c->n * 3);
+    for(i = 0; i < c->n; i++) {
+        build_cobs_frame(cobs_framer, &frame, &flen, c->pkt[i], c->len[i]);
+        memcpy(stream + len, frame, flen);
+        len += flen;
+    }
+
+    t0 = now_ns(); c0 = cycles(); a0 = allocs;
+    do {
+        for(off = 0; off < len; off += rv) {
+            rv = decode_cobs_frame(cobs_framer, &pkt, stream + off, len - off);
+            if (pkt) {
+                packets++;
+                pbuf_free(pkt);
+            }
+        }
+        bytes += len;
+    } while (now_ns() - t0 < min_time * 1e9);
+    finish(r, now_ns() - t0, cycles() - c0, allocs - a0, packets, bytes);
+    xfree(stream);
+}
+
+
+/* Copy a packet of the corpus into a buffer, as read(2) would. */
+static struct pbuf *
+load(const char *pkt, size_t len)
+{
+    struct pbuf *p;
+
+    if ((p = pbuf_alloc(pool)) == NULL) {
+        fprintf(stderr, "Out of packet buffers\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(p->data, pkt, len);
+    p->len = len;
+    return p;
+}
+
+
+/* The copy into the packet buffer is part of the measurement, it
+ * stands in for the read from the TUN interface. */
+static void
+bench_shrink(const char *name, struct corpus *c)
+{
+    struct result *r = new_result("comp_shrink/%s", name);
+    uint64_t t0, c0, a0, packets = 0, bytes = 0;
+    struct pbuf *p;
+    size_t i;
+
+    t0 = now_ns(); c0 = cycles(); a0 = allocs;
+    do {
+        for(i = 0; i < c->n; i++) {
+            p = load(c->pkt[i], c->len[i]);
+            if (comp_shrink(compressor, &p) < 0) {
+                fprintf(stderr, "comp_shrink failed\n");
+                exit(EXIT_FAILURE);
+            }
+            pbuf_free(p);
+        }
+        packets += c->n;
+        bytes += c->bytes;
+    } while (now_ns() - t0 < min_time * 1e9);
+    finish(r, now_ns() - t0, cycles() - c0, allocs - a0, packets, bytes);
+}
+
+
+/* The decompressor depends on the context established by preceding
+ * packets, so every packet is compressed first (untimed) and only the
+ * decompression is measured. */
+static void
+bench_expand(const char *name, struct corpus *c)
+{
+    struct result *r = new_result("comp_expand/%s", name);
+    uint64_t t0, t, ns = 0, cyc = 0, c0, a = 0, a0, packets = 0, bytes = 0;
+    struct pbuf *p;
+    size_t clen, i;
+
+    t0 = now_ns();
+    do {
+        for(i = 0; i < c->n; i++) {
+            p = load(c->pkt[i], c->len[i]);
+            if (comp_shrink(compressor, &p) < 0) {
+                fprintf(stderr, "comp_shrink failed\n");
+                exit(EXIT_FAILURE);
+            }
+            clen = p->len;
+
+            t = now_ns(); c0 = cycles(); a0 = allocs;
+            comp_expand(compressor, &p);
+            cyc += cycles() - c0;
+            ns += now_ns() - t;
+            a += allocs - a0;
+            bytes += clen;
+            pbuf_free(p);
+        }
+        packets += c->n;
+    } while (now_ns() - t0 < min_time * 1e9);
+    finish(r, ns, cyc, a, packets, bytes);
+}
+
+
+/* Every packet must come out of the decompressor as it went into the
+ * compressor. With strict set, every packet must also be compressed,
+ * none sent as is. Exits on failure. */
+static void
+check_comp(const char *name, struct corpus *c, int strict)
+{
+    struct pbuf *p;
+    size_t i;
+    int rv;
+
+    for(i = 0; i < c->n; i++) {
+        p = load(c->pkt[i], c->len[i]);
+        if ((rv = comp_shrink(compressor, &p)) < 0 || (strict && rv != 0)) {
+            fprintf(stderr, "%s: packet %zu %s\n", name, i,
+                    rv < 0 ? "could not be compressed" : "was sent uncompressed");
+            exit(EXIT_FAILURE);
+        }
+        if (comp_expand(compressor, &p) < 0 || p->len != c->len[i]
+            || memcmp(p->data, c->pkt[i], p->len)) {
+            fprintf(stderr, "%s: packet %zu changed on the way through the compressor\n",
+                    name, i);
+            exit(EXIT_FAILURE);
+        }
+        pbuf_free(p);
+    }
+}
+
+
+/* comp is 0 to leave out the compressor, 1 to benchmark it and 2 if
+ * the enabled profiles must also compress every packet. */
+static void
+run_all(const char *name, struct corpus *c, int comp)
+{
+    bench_encode(name, c);
+    bench_decode(name, c);
+    bench_cobs_encode(name, c);
+    bench_cobs_decode(name, c);
+    if (!comp) return;
+    check_comp(name, c, comp == 2);
+    bench_shrink(name, c);
+    bench_expand(name, c);
+}
+
+
+static int
+write_results(const char *fn)
+{
+    FILE *f = stdout;
+    int i;
+
+    if (fn && (f = fopen(fn, "w")) == NULL) {
+        fprintf(stderr, "Cannot open %s: %s\n", fn, strerror(errno));
+        return -1;
+    }
+
+    fprintf(f, "# benchmark\tns/packet\tbytes/cycle\tallocs/packet\n");
+    for(i = 0; i < nresults; i++)
+        fprintf(f, "%s\t%.2f\t%.4f\t%.3f\n", results[i].name,
+                results[i].ns, results[i].bpc, results[i].allocs);
+
+    if (f != stdout) fclose(f);
+    return 0;
+}
+
+
+/* Compare results with a baseline file. Returns the number of
+ * benchmarks that regressed or a negative number on error. */
+static int
+compare(const char *fn)
+{
+    FILE *f;
+    char line[256], name[64];
+    double ns, bpc, al, d;
+    int i, bad = 0;
+
+    if ((f = fopen(fn, "r")) == NULL) {
+        fprintf(stderr, "Cannot open %s: %s\n", fn, strerror(errno));
+        return -1;
+    }
+
+    fprintf(stderr, "%-32s %12s %12s %8s\n", "benchmark", "baseline", "current", "change");
+    while (fgets(line, sizeof(line), f)) {
+        if (*line == '#') continue;
+        if (sscanf(line, "%63s %lf %lf %lf", name, &ns, &bpc, &al) != 4) continue;
+
+        for(i = 0; i < nresults; i++)
+            if (!strcmp(results[i].name, name)) break;
+        if (i == nresults) continue;
+
+        d = ns > 0 ? (results[i].ns - ns) / ns * 100 : 0;
+        fprintf(stderr, "%-32s %12.2f %12.2f %+7.1f%%%s\n", name, ns,
+                results[i].ns, d, d > threshold ? " REGRESSION" : "");
+        if (d > threshold) bad++;
+        if (results[i].allocs > al) {
+            fprintf(stderr, "%-32s allocations per packet went up from %.3f to %.3f\n",
+                    name, al, results[i].allocs);
+            bad++;
+        }
+    }
+    fclose(f);
+    return bad;
+}
+
+
+int
+main(int argc, char **argv)
+{
+    static const size_t sizes[] = { 64, 512, 1400 };
+    static const int densities[] = { 0, 1, 10, 50 };
+    char *out = NULL, *base = NULL, *pcap = NULL, name[32];
+    struct corpus c;
+    int opt, rv = 0;
+    size_t i, j;
+
+    log_syslog = 0;
+    log_threshold = L_ERR;
+
+    while((opt = getopt(argc, argv, "hp:o:b:T:t:")) != -1) {
+        switch(opt) {
+        case 'h': print_help();                 break;
+        case 'p': pcap = optarg;                break;
+        case 'o': out = optarg;                 break;
+        case 'b': base = optarg;                break;
+        case 'T': threshold = atof(optarg);     break;
+        case 't': min_time = atof(optarg);      break;
+        default:
+            fprintf(stderr, "Use the -h option for list of supported "
+                    "program arguments.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    srand(1);
+    memset(&c, 0, sizeof(c));
+
+    if ((pool = pbuf_pool_new(8, MAX_PACKET_SIZE + 1, 0)) == NULL)
+        exit(EXIT_FAILURE);
+    framer = hdlc_new(&link_stats, pool, MAX_PACKET_SIZE + 1);
+    cobs_framer = cobs_new(&link_stats, pool, MAX_PACKET_SIZE + 1);
+    if ((compressor = comp_new(&link_stats)) == NULL) {
+        fprintf(stderr, "Could not initialize the compressor\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for(i = 0; i < ARRAY_SIZE(sizes); i++) {
+        for(j = 0; j < ARRAY_SIZE(densities); j++) {
+            snprintf(name, sizeof(name), "%zu-esc%d", sizes[i], densities[j]);
+            byte_corpus(&c, sizes[i], densities[j]);
+            run_all(name, &c, 0);
+            free_corpus(&c);
+        }
+    }
+
+    ip_corpus(&c);
+    run_all("ip", &c, 2);
+    free_corpus(&c);
+
+    ip6_corpus(&c);
+    run_all("ip6", &c, 2);
+    free_corpus(&c);
+
+    if (pcap) {
+        if (pcap_corpus(&c, pcap) < 0) exit(EXIT_FAILURE);
+        run_all("pcap", &c, 1);
+        free_corpus(&c);
+    }
+
+    comp_free(compressor);
+    hdlc_free(framer);
+    cobs_free(cobs_framer);
+    pbuf_pool_free(pool);
+
+    if (write_results(out) < 0) exit(EXIT_FAILURE);
+    if (base && (rv = compare(base)) != 0) {
+        if (rv > 0) fprintf(stderr, "%d benchmark(s) regressed\n", rv);
+        exit(rv > 0 ? 2 : EXIT_FAILURE);
+    }
+    return 0;
+}
@@ -0,0 +1,149 @@
+#include "pbuf.h"
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "log.h"
+#include "utils.h"
+
+/* Size of the huge pages requested with PBUF_HUGEPAGES. The mapping is
+ * rounded up to a multiple of it. */
+#define HUGEPAGE_SIZE (2UL * 1024 * 1024)
+
+
+static inline struct pbuf *
+nth(struct pbuf_pool *pool, uint32_t i)
+{
+    return (struct pbuf *)(pool->mem + (size_t)i * pool->stride);
+}
+
+
+static void
+push(struct pbuf_pool *pool, struct pbuf *p)
+{
+    uint64_t head, new;
+    uint32_t i = ((char *)p - pool->mem) / pool->stride;
+
+    head = __atomic_load_n(&pool->head, __ATOMIC_RELAXED);
+    do {
+        __atomic_store_n(&p->next, (uint32_t)head, __ATOMIC_RELAXED);
+        new = ((head >> 32) + 1) << 32 | (i + 1);
+    } while (!__atomic_compare_exchange_n(&pool->head, &head, new, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+
+static void *
+map(size_t size, int huge)
+{
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    void *mem;
+
+#ifdef MAP_HUGETLB
+    if (huge) flags |= MAP_HUGETLB;
+#else
+    if (huge) return MAP_FAILED;
+#endif
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    return mem;
+}
+
+
+struct pbuf_pool *
+pbuf_pool_new(unsigned int count, size_t size, int flags)
+{
+    struct pbuf_pool *pool;
+    unsigned int i;
+
+    pool = xcalloc(1, sizeof(*pool));
+    pool->count = count;
+    pool->room = size;
+    pool->stride = sizeof(struct pbuf) + PBUF_HEADROOM + size + PBUF_TAILROOM;
+    pool->stride = (pool->stride + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+    pool->memsize = pool->stride * count;
+    pool->mem = MAP_FAILED;
+
+    if (flags & PBUF_HUGEPAGES) {
+        pool->memsize = (pool->memsize + HUGEPAGE_SIZE - 1) & ~(HUGEPAGE_SIZE - 1);
+        if ((pool->mem = map(pool->memsize, 1)) != MAP_FAILED) {
+            pool->flags |= PBUF_HUGEPAGES;
+        } else {
+            WRN("No huge pages for the packet buffers: %s", strerror(errno));
+            pool->memsize = pool->stride * count;
+        }
+    }
+
+    if (pool->mem == MAP_FAILED && (pool->mem = map(pool->memsize, 0)) == MAP_FAILED) {
+        ERR("Could not allocate %zu bytes of packet buffers: %s", pool->memsize,
+            strerror(errno));
+        xfree(pool);
+        return NULL;
+    }
+
+    if (flags & PBUF_MLOCK) {
+        if (mlock(pool->mem, pool->memsize) < 0)
+            WRN("Could not lock the packet buffers into memory: %s", strerror(errno));
+        else
+            pool->flags |= PBUF_MLOCK;
+    }
+
+    /* Push in reverse so that the buffers are handed out in address
+     * order, which is friendlier to the prefetcher. */
+    for(i = count; i > 0; i--) {
+        nth(pool, i - 1)->pool = pool;
+        nth(pool, i - 1)->size = PBUF_HEADROOM + size + PBUF_TAILROOM;
+        push(pool, nth(pool, i - 1));
+    }
+
+    DBG("Allocated %u packet buffers of %zu bytes%s%s", count, size,
+        pool->flags & PBUF_HUGEPAGES ? ", huge pages" : "",
+        pool->flags & PBUF_MLOCK ? ", locked" : "");
+    return pool;
+}
+
+
+void
+pbuf_pool_free(struct pbuf_pool *pool)
+{
+    if (pool == NULL) return;
+    munmap(pool->mem, pool->memsize);
+    xfree(pool);
+}
+
+
+/* Another thread may pop and even reuse the buffer at the top of the
+ * stack between our reading its next field and the compare and swap.
+ * The next field read is then stale, but the tag has changed in the
+ * meantime, so the compare and swap fails and we start over. */
+struct pbuf *
+pbuf_alloc(struct pbuf_pool *pool)
+{
+    uint64_t head, new;
+    struct pbuf *p;
+
+    head = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+    do {
+        if ((uint32_t)head == 0) return NULL;
+        p = nth(pool, (uint32_t)head - 1);
+        new = ((head >> 32) + 1) << 32
+            | __atomic_load_n(&p->next, __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&pool->head, &head, new, 1,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+    p->refcnt = 1;
+    p->data = p->buf + PBUF_HEADROOM;
+    p->len = 0;
+    p->ts = 0;
+    return p;
+}
+
+
+void
+pbuf_free(struct pbuf *p)
+{
+    /* The common case of a single reference needs no atomic update */
+    if (__atomic_load_n(&p->refcnt, __ATOMIC_ACQUIRE) != 1
+        && __atomic_sub_fetch(&p->refcnt, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+    push(p->pool, p);
+}
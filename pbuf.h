@@ -0,0 +1,132 @@
+#ifndef _PBUF_H_
+#define _PBUF_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "stats.h" /* CACHE_LINE */
+
+/* Space reserved in front of and behind the data of a freshly allocated
+ * buffer, for the protocol identifier, frame flags, checksums and the
+ * like to be added without moving the data. */
+#define PBUF_HEADROOM 64
+#define PBUF_TAILROOM 64
+
+/* Flags of pbuf_pool_new */
+#define PBUF_HUGEPAGES 0x1 /* Back the pool with huge pages if possible */
+#define PBUF_MLOCK     0x2 /* Lock the pool into memory                 */
+
+/* A packet buffer. The data of the buffer is kept in buf, starting at
+ * data and running for len bytes. Buffers are reference counted, the
+ * buffer goes back to its pool when the last reference is dropped with
+ * pbuf_free. A buffer with more than one reference must not be
+ * modified. */
+struct pbuf {
+    struct pbuf_pool *pool;
+    uint32_t next;   /* Index + 1 of the next free buffer in the pool */
+    uint32_t refcnt;
+    uint64_t ts;     /* When the data was received, see now_ns */
+    char    *data;
+    size_t   len;
+    size_t   size;   /* Size of buf */
+    char     buf[] __attribute__((aligned(16)));
+};
+
+/* A fixed number of buffers in one memory mapping. Buffers can be
+ * allocated and freed from any thread, the free buffers are kept on a
+ * lock-free stack. The top of the stack is tagged with a counter that
+ * is incremented on every change, so that a buffer that is allocated
+ * and freed again while another thread is about to pop it (the ABA
+ * problem) is detected. */
+struct pbuf_pool {
+    uint64_t     head __attribute__((aligned(CACHE_LINE))); /* Tag << 32 | index + 1 */
+    char        *mem __attribute__((aligned(CACHE_LINE)));
+    size_t       memsize;
+    size_t       stride;
+    size_t       room;
+    unsigned int count;
+    int          flags; /* The flags in effect */
+};
+
+/* Create a pool of count buffers with room for size bytes of data in
+ * addition to the headroom and tailroom. Returns NULL on error. */
+struct pbuf_pool *pbuf_pool_new(unsigned int count, size_t size, int flags);
+
+/* Release the pool. All buffers must have been freed. */
+void pbuf_pool_free(struct pbuf_pool *pool);
+
+/* Get an empty buffer with one reference, or NULL if the pool is
+ * exhausted. */
+struct pbuf *pbuf_alloc(struct pbuf_pool *pool);
+
+/* Drop a reference to the buffer. */
+void pbuf_free(struct pbuf *p);
+
+
+static inline struct pbuf *
+pbuf_ref(struct pbuf *p)
+{
+    __atomic_add_fetch(&p->refcnt, 1, __ATOMIC_RELAXED);
+    return p;
+}
+
+
+static inline size_t
+pbuf_headroom(const struct pbuf *p)
+{
+    return p->data - p->buf;
+}
+
+
+static inline size_t
+pbuf_tailroom(const struct pbuf *p)
+{
+    return p->buf + p->size - (p->data + p->len);
+}
+
+
+/* Room for data to be read into an empty buffer, leaving the tailroom
+ * alone. */
+static inline size_t
+pbuf_room(const struct pbuf *p)
+{
+    return p->pool->room;
+}
+
+
+/* Add n bytes in front of the data. Returns a pointer to the new first
+ * byte or NULL if there is not enough headroom. */
+static inline char *
+pbuf_prepend(struct pbuf *p, size_t n)
+{
+    if (pbuf_headroom(p) < n) return NULL;
+    p->data -= n;
+    p->len += n;
+    return p->data;
+}
+
+
+/* Add n bytes behind the data. Returns a pointer to the first added
+ * byte or NULL if there is not enough tailroom. */
+static inline char *
+pbuf_append(struct pbuf *p, size_t n)
+{
+    char *end = p->data + p->len;
+
+    if (pbuf_tailroom(p) < n) return NULL;
+    p->len += n;
+    return end;
+}
+
+
+/* Remove n bytes from the front of the data. */
+static inline char *
+pbuf_pull(struct pbuf *p, size_t n)
+{
+    if (p->len < n) return NULL;
+    p->data += n;
+    p->len -= n;
+    return p->data;
+}
+
+#endif /* _PBUF_H_ */
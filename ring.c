@@ -0,0 +1,24 @@
+#include "ring.h"
+#include <assert.h>
+
+#include "utils.h"
+
+
+void
+ring_init(struct ring *r, unsigned long size)
+{
+    assert(size && !(size & (size - 1)));
+
+    r->slots = xcalloc(size, sizeof(*r->slots));
+    r->mask = size - 1;
+    r->head = r->tail = 0;
+    r->head_cache = r->tail_cache = 0;
+}
+
+
+void
+ring_free(struct ring *r)
+{
+    if (r->slots) xfree(r->slots);
+    r->slots = NULL;
+}
@@ -0,0 +1,91 @@
+#ifndef _RING_H_
+#define _RING_H_
+
+#include "stats.h" /* CACHE_LINE */
+
+/* A lock-free single-producer single-consumer ring of pointers. The
+ * producer and the consumer each keep a cached copy of the other
+ * side's index, so that they only touch the other side's cache line
+ * when the cached copy says the ring is full (or empty). Elements are
+ * moved in bulk to amortize the cost of the memory barriers. */
+struct ring {
+    /* Written by the consumer */
+    unsigned long head __attribute__((aligned(CACHE_LINE)));
+    unsigned long tail_cache;
+
+    /* Written by the producer */
+    unsigned long tail __attribute__((aligned(CACHE_LINE)));
+    unsigned long head_cache;
+
+    unsigned long mask __attribute__((aligned(CACHE_LINE)));
+    void        **slots;
+};
+
+/* Initialize the ring with room for size elements. The size must be a
+ * power of two. */
+void ring_init(struct ring *r, unsigned long size);
+
+void ring_free(struct ring *r);
+
+
+/* Number of elements the producer can push without blocking. */
+static inline unsigned long
+ring_room(struct ring *r)
+{
+    r->head_cache = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    return r->mask + 1 - (r->tail - r->head_cache);
+}
+
+
+/* Number of elements the consumer can pop. */
+static inline unsigned long
+ring_count(struct ring *r)
+{
+    r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    return r->tail_cache - r->head;
+}
+
+
+/* Push up to n elements from v. Returns the number of elements pushed.
+ * Must only be called by the producer. */
+static inline unsigned int
+ring_push(struct ring *r, void **v, unsigned int n)
+{
+    unsigned long tail = r->tail, room, i;
+
+    room = r->mask + 1 - (tail - r->head_cache);
+    if (room < n) room = ring_room(r);
+    if (n > room) n = room;
+
+    if (!n) return 0;
+
+    for(i = 0; i < n; i++)
+        r->slots[(tail + i) & r->mask] = v[i];
+    __atomic_store_n(&r->tail, tail + n, __ATOMIC_RELEASE);
+    return n;
+}
+
+
+/* Pop up to n elements into v. Returns the number of elements popped.
+ * Must only be called by the consumer. */
+static inline unsigned int
+ring_pop(struct ring *r, void **v, unsigned int n)
+{
+    unsigned long head = r->head, avail, i;
+
+    avail = r->tail_cache - head;
+    if (avail < n) {
+        r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        avail = r->tail_cache - head;
+    }
+    if (n > avail) n = avail;
+
+    if (!n) return 0;
+
+    for(i = 0; i < n; i++)
+        v[i] = r->slots[(head + i) & r->mask];
+    __atomic_store_n(&r->head, head + n, __ATOMIC_RELEASE);
+    return n;
+}
+
+#endif /* _RING_H_ */
@@ -0,0 +1,139 @@
+#include "stats.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "utils.h"
+
+
+static int
+segment_name(char *buf, size_t size, const char *name)
+{
+    int rv;
+
+    rv = snprintf(buf, size, "%s%s", STATS_PREFIX, name ? name : "");
+    if (rv < 0 || rv >= size) {
+        ERR("Statistics segment name too long");
+        return -1;
+    }
+    return 0;
+}
+
+
+struct stats *
+stats_open(const char *name, const char *serial)
+{
+    char segment[64];
+    struct stats *s;
+    int fd;
+
+    /* The name is stored in the segment, stats_close derives the name
+     * of the segment from it. */
+    if (name && strlen(name) >= sizeof(s->ifname)) {
+        ERR("Interface name %s too long for statistics", name);
+        return NULL;
+    }
+
+    if (segment_name(segment, sizeof(segment), name) < 0)
+        return NULL;
+
+    /* Remove any stale segment left behind by a previous instance that
+     * did not terminate cleanly. */
+    shm_unlink(segment);
+
+    fd = shm_open(segment, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        ERR("Error while creating %s: %s", segment, strerror(errno));
+        return NULL;
+    }
+
+    if (ftruncate(fd, sizeof(struct stats)) < 0) {
+        ERR("Error while resizing %s: %s", segment, strerror(errno));
+        close(fd);
+        shm_unlink(segment);
+        return NULL;
+    }
+
+    s = mmap(NULL, sizeof(struct stats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (s == MAP_FAILED) {
+        ERR("Error while mapping %s: %s", segment, strerror(errno));
+        shm_unlink(segment);
+        return NULL;
+    }
+
+    memset(s, 0, sizeof(*s));
+    s->version = STATS_VERSION;
+    s->size = sizeof(struct stats);
+    s->pid = getpid();
+    s->started = now();
+    if (name) strncpy(s->ifname, name, sizeof(s->ifname) - 1);
+    if (serial) strncpy(s->serial, serial, sizeof(s->serial) - 1);
+
+    /* Write the magic number last so that readers do not pick up a
+     * partially initialized segment. */
+    __sync_synchronize();
+    s->magic = STATS_MAGIC;
+
+    DBG("Created statistics segment %s", segment);
+    return s;
+}
+
+
+void
+stats_close(struct stats *s)
+{
+    char segment[64];
+
+    if (s == NULL) return;
+
+    if (segment_name(segment, sizeof(segment), s->ifname) == 0)
+        shm_unlink(segment);
+    munmap(s, sizeof(struct stats));
+}
+
+
+const struct stats *
+stats_map(const char *name)
+{
+    char buf[64];
+    struct stat st;
+    struct stats *s;
+    int fd;
+
+    if (segment_name(buf, sizeof(buf), name) < 0)
+        return NULL;
+
+    fd = shm_open(buf, O_RDONLY, 0);
+    if (fd < 0) return NULL;
+
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct stats)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    s = mmap(NULL, sizeof(struct stats), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (s == MAP_FAILED) return NULL;
+
+    if (s->magic != STATS_MAGIC || s->version != STATS_VERSION
+        || s->size != sizeof(struct stats)) {
+        munmap(s, sizeof(struct stats));
+        errno = EPROTO;
+        return NULL;
+    }
+    return s;
+}
+
+
+void
+stats_unmap(const struct stats *s)
+{
+    if (s) munmap((void *)s, sizeof(struct stats));
+}
@@ -0,0 +1,147 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "hist.h"
+
+/* Live statistics of a running daemon. The counters are kept in a
+ * memory-mapped segment under /dev/shm so that external tools (see
+ * chordstat) can read them while the daemon is running. Every link has
+ * its own segment. Each direction of a link is updated by a single
+ * writer, hence the counters are updated with plain (non-atomic)
+ * increments. Readers must be prepared to see a slightly inconsistent
+ * snapshot. */
+
+#define STATS_MAGIC   0x43484f52 /* "CHOR" */
+#define STATS_VERSION 8
+
+/* Prefix of the shared memory segment name. The name of the TUN
+ * interface is appended to the prefix. */
+#define STATS_PREFIX  "/chord."
+
+#define CACHE_LINE    64
+
+struct stats_dir {
+    uint64_t packets;      /* IP packets read from or written to TUN    */
+    uint64_t bytes;        /* Bytes of IP packets (before compression)  */
+    uint64_t comp_bytes;   /* Bytes after compression, before framing   */
+    uint64_t wire_bytes;   /* Bytes on the serial line, with framing    */
+    uint64_t frames;       /* Frames sent or received                   */
+    uint64_t compressed;   /* Packets processed by the ROHC (de)compressor */
+    uint64_t passthrough;  /* Packets sent or received uncompressed     */
+    uint64_t comp_errors;  /* Compression or decompression failures     */
+    uint64_t frame_errors; /* Malformed or oversized frames             */
+    uint64_t drops;        /* Packets or frames dropped                 */
+    uint64_t retransmits;  /* ARQ frames sent again, or received again  */
+    uint64_t fec_bytes;    /* FEC headers and parity                    */
+    uint64_t fec_corrected;/* Bytes repaired by FEC                     */
+    uint64_t acks_filtered;/* TCP ACKs made redundant by a newer one    */
+    uint64_t dedup_bytes;  /* Bytes saved by references to cached chunks */
+    uint64_t dedup_misses; /* References to chunks not in the cache     */
+
+    /* The packets that went through the (de)compressor, compressed or
+     * not, by IP version */
+    uint64_t v4_packets;
+    uint64_t v4_bytes;     /* Bytes of IPv4 packets                     */
+    uint64_t v4_comp_bytes;/* The same packets after compression        */
+    uint64_t v6_packets;
+    uint64_t v6_bytes;
+    uint64_t v6_comp_bytes;
+} __attribute__((aligned(CACHE_LINE)));
+
+
+/* Latency histograms of one direction, all values in nanoseconds. In
+ * the tx direction the clock starts when a packet is read from the TUN
+ * interface, in the rx direction when a chunk of bytes is read from the
+ * serial port. */
+struct stats_lat {
+    struct hist comp;  /* Time spent in the (de)compressor           */
+    struct hist frame; /* Time spent building or decoding the frame  */
+    struct hist write; /* Time spent in write(2) of the frame/packet */
+    struct hist total; /* tx: until the UART has (by estimate) sent the
+                        * last bit of the frame. rx: until the packet
+                        * has been written to the TUN interface.     */
+} __attribute__((aligned(CACHE_LINE)));
+
+
+/* The flows with the most wire bytes, see flows.h */
+#define STATS_FLOWS   10
+
+/* A flow: the packets of one direction of a connection. Packets other
+ * than IP are all counted in a single flow of version 0. Addresses are
+ * in network byte order, IPv4 addresses take the first 4 bytes. Ports
+ * are in host byte order, 0 for protocols without ports and for
+ * fragments other than the first. */
+struct flow_key {
+    uint8_t  src[16];
+    uint8_t  dst[16];
+    uint16_t sport;
+    uint16_t dport;
+    uint8_t  version;      /* IP version, 4 or 6, 0 if not IP           */
+    uint8_t  proto;
+    uint8_t  pad[2];
+};
+
+struct stats_flow {
+    struct flow_key key;
+    uint32_t idle;         /* Seconds since the last packet             */
+    uint32_t age;          /* Seconds since the first packet            */
+    uint64_t packets;
+    uint64_t bytes;        /* Bytes before compression                  */
+    uint64_t comp_bytes;   /* Bytes after compression and deduplication */
+    uint64_t wire_bytes;   /* Share of the bytes on the serial line     */
+    uint64_t drops;
+};
+
+/* The top talkers of one direction, updated once per second. The
+ * writer makes seq odd while it updates the list, a reader retries
+ * until it sees the same even seq before and after a copy. */
+struct stats_flows {
+    uint32_t seq;
+    uint32_t count;        /* Flows in the list                         */
+    uint32_t active;       /* Flows seen within the last minute         */
+    uint32_t tracked;      /* Flows in the table                        */
+    uint64_t evicted;      /* Flows pushed out of a full table          */
+    struct stats_flow flow[STATS_FLOWS];
+} __attribute__((aligned(CACHE_LINE)));
+
+struct stats {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;         /* sizeof(struct stats) of the writer        */
+    pid_t    pid;          /* Process id of the writer                  */
+    int64_t  started;      /* Start time in ms since the Epoch          */
+    char     ifname[32];
+    char     serial[64];
+    int32_t  baud;         /* Configured baud rate of the serial port   */
+
+    /* Each direction is updated from a different code path, keep them
+     * on separate cache lines so that they do not share a line with
+     * the read-mostly header above. */
+    struct stats_dir tx;
+    struct stats_dir rx;
+
+    struct stats_lat tx_lat;
+    struct stats_lat rx_lat;
+
+    /* Empty unless flow accounting is enabled */
+    struct stats_flows tx_flows;
+    struct stats_flows rx_flows;
+};
+
+/* Create (or re-create) the shared memory segment for the interface
+ * name given in argument. Returns a pointer to the zeroed segment on
+ * success and NULL on error. */
+struct stats *stats_open(const char *name, const char *serial);
+
+/* Unmap and remove a segment created with stats_open. */
+void stats_close(struct stats *s);
+
+/* Map an existing segment read-only. Returns NULL on error. The
+ * segment must be released with stats_unmap. */
+const struct stats *stats_map(const char *name);
+
+void stats_unmap(const struct stats *s);
+
+#endif /* _STATS_H_ */
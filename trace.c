@@ -0,0 +1,345 @@
+#include "trace.h"
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <byteswap.h>
+
+#include "log.h"
+
+#define PCAP_MAGIC      0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+#define PCAPNG_SHB      0x0a0d0d0a
+#define PCAPNG_BOM      0x1a2b3c4d
+#define PCAPNG_IDB      0x00000001
+#define PCAPNG_SPB      0x00000003
+#define PCAPNG_EPB      0x00000006
+
+#define PCAP_HDR_LEN    24
+#define PCAP_REC_LEN    16
+
+/* Link types, see https://www.tcpdump.org/linktypes.html */
+#define LINKTYPE_NULL      0
+#define LINKTYPE_ETHERNET  1
+#define LINKTYPE_RAW       101
+#define LINKTYPE_LOOP      108
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_IPV4      228
+#define LINKTYPE_IPV6      229
+#define LINKTYPE_LINUX_SLL2 276
+
+#define ETHERTYPE_IP    0x0800
+#define ETHERTYPE_IPV6  0x86dd
+#define ETHERTYPE_VLAN  0x8100
+#define ETHERTYPE_QINQ  0x88a8
+
+
+static uint32_t
+get32(struct trace *t, size_t off)
+{
+    uint32_t v;
+
+    memcpy(&v, t->data + off, sizeof(v));
+    return t->swap ? bswap_32(v) : v;
+}
+
+
+static uint16_t
+get16(struct trace *t, size_t off)
+{
+    uint16_t v;
+
+    memcpy(&v, t->data + off, sizeof(v));
+    return t->swap ? bswap_16(v) : v;
+}
+
+
+static uint16_t
+be16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+
+/* Strip the link-layer header. Returns the offset of the IP header or
+ * a negative number if the frame does not carry an IP packet. */
+static int
+strip_link(uint32_t linktype, const uint8_t *p, size_t len)
+{
+    size_t off;
+    uint16_t type;
+
+    switch(linktype) {
+    case LINKTYPE_RAW:
+    case LINKTYPE_IPV4:
+    case LINKTYPE_IPV6:
+        off = 0;
+        break;
+
+    case LINKTYPE_NULL:
+    case LINKTYPE_LOOP:
+        off = 4;
+        break;
+
+    case LINKTYPE_ETHERNET:
+        off = 12;
+        if (len < off + 2) return -1;
+        type = be16(p + off);
+        while ((type == ETHERTYPE_VLAN || type == ETHERTYPE_QINQ) && len >= off + 6) {
+            off += 4;
+            type = be16(p + off);
+        }
+        if (type != ETHERTYPE_IP && type != ETHERTYPE_IPV6) return -1;
+        off += 2;
+        break;
+
+    case LINKTYPE_LINUX_SLL:
+        off = 16;
+        if (len < off) return -1;
+        type = be16(p + 14);
+        if (type != ETHERTYPE_IP && type != ETHERTYPE_IPV6) return -1;
+        break;
+
+    case LINKTYPE_LINUX_SLL2:
+        off = 20;
+        if (len < off) return -1;
+        type = be16(p);
+        if (type != ETHERTYPE_IP && type != ETHERTYPE_IPV6) return -1;
+        break;
+
+    default:
+        return -1;
+    }
+
+    if (len <= off) return -1;
+    if ((p[off] >> 4) != 4 && (p[off] >> 4) != 6) return -1;
+    return off;
+}
+
+
+/* Parse the options of an interface description block and extract the
+ * timestamp resolution (if_tsresol). */
+static uint64_t
+idb_tsdiv(struct trace *t, size_t off, size_t end)
+{
+    uint16_t code, len;
+    uint8_t res;
+    uint64_t div = 1000000;
+
+    while (off + 4 <= end) {
+        code = get16(t, off);
+        len = get16(t, off + 2);
+        if (code == 0 || off + 4 + len > end) break;
+        if (code == 9 && len >= 1) {
+            res = t->data[off + 4];
+            div = 1;
+            if (res & 0x80) {
+                if ((res & 0x7f) < 64) div = 1ULL << (res & 0x7f);
+            } else {
+                while (res--) div *= 10;
+            }
+        }
+        off += 4 + ((len + 3) & ~3U);
+    }
+    return div;
+}
+
+
+static uint64_t
+to_ns(uint64_t ticks, uint64_t div)
+{
+    if (div == 0) return ticks;
+    return ticks / div * 1000000000ULL + ticks % div * 1000000000ULL / div;
+}
+
+
+static int
+next_pcap(struct trace *t, const uint8_t **pkt, size_t *len, uint64_t *ts)
+{
+    uint32_t caplen, sec, frac;
+    const uint8_t *p;
+    int off;
+
+    while (t->off + PCAP_REC_LEN <= t->size) {
+        sec = get32(t, t->off);
+        frac = get32(t, t->off + 4);
+        caplen = get32(t, t->off + 8);
+        if (t->off + PCAP_REC_LEN + caplen > t->size) {
+            ERR("Truncated pcap record at offset %zu", t->off);
+            return -1;
+        }
+        p = t->data + t->off + PCAP_REC_LEN;
+        t->off += PCAP_REC_LEN + caplen;
+
+        if ((off = strip_link(t->linktype, p, caplen)) < 0) {
+            t->skipped++;
+            continue;
+        }
+        *pkt = p + off;
+        *len = caplen - off;
+        *ts = (uint64_t)sec * 1000000000ULL + (t->nsec ? frac : frac * 1000ULL);
+        return 1;
+    }
+    return 0;
+}
+
+
+static int
+next_pcapng(struct trace *t, const uint8_t **pkt, size_t *len, uint64_t *ts)
+{
+    uint32_t type, blen, ifid, caplen, bom;
+    uint64_t ticks;
+    const uint8_t *p;
+    size_t b;
+    int off;
+
+    while (t->off + 12 <= t->size) {
+        b = t->off;
+        type = get32(t, b);
+
+        /* A new section may have a different byte order. */
+        if (type == PCAPNG_SHB) {
+            memcpy(&bom, t->data + b + 8, sizeof(bom));
+            if (bom == PCAPNG_BOM) t->swap = 0;
+            else if (bswap_32(bom) == PCAPNG_BOM) t->swap = 1;
+            else {
+                ERR("Malformed pcapng section header at offset %zu", b);
+                return -1;
+            }
+            t->nifs = 0;
+        }
+
+        blen = get32(t, b + 4);
+        if (blen < 12 || b + blen > t->size) {
+            ERR("Malformed pcapng block at offset %zu", b);
+            return -1;
+        }
+        t->off += blen;
+
+        switch(type) {
+        case PCAPNG_IDB:
+            if (blen < 20 || t->nifs >= sizeof(t->if_linktype) / sizeof(t->if_linktype[0]))
+                break;
+            t->if_linktype[t->nifs] = get16(t, b + 8);
+            t->if_tsdiv[t->nifs] = idb_tsdiv(t, b + 16, b + blen - 4);
+            t->nifs++;
+            break;
+
+        case PCAPNG_EPB:
+            if (blen < 32) break;
+            ifid = get32(t, b + 8);
+            ticks = ((uint64_t)get32(t, b + 12) << 32) | get32(t, b + 16);
+            caplen = get32(t, b + 20);
+            if (ifid >= t->nifs || 28 + caplen > blen) {
+                t->skipped++;
+                break;
+            }
+            p = t->data + b + 28;
+            if ((off = strip_link(t->if_linktype[ifid], p, caplen)) < 0) {
+                t->skipped++;
+                break;
+            }
+            *pkt = p + off;
+            *len = caplen - off;
+            *ts = to_ns(ticks, t->if_tsdiv[ifid]);
+            return 1;
+
+        case PCAPNG_SPB:
+            if (blen < 16 || t->nifs == 0) break;
+            caplen = blen - 16;
+            p = t->data + b + 12;
+            if ((off = strip_link(t->if_linktype[0], p, caplen)) < 0) {
+                t->skipped++;
+                break;
+            }
+            /* Simple packet blocks are padded to 32 bits, use the
+             * original length if it is smaller. */
+            if (get32(t, b + 8) < caplen) caplen = get32(t, b + 8);
+            *pkt = p + off;
+            *len = caplen - off;
+            *ts = 0;
+            return 1;
+
+        default:
+            break;
+        }
+    }
+    return 0;
+}
+
+
+int
+trace_open(struct trace *t, const char *fn)
+{
+    struct stat st;
+    uint32_t magic;
+    void *p;
+    int fd;
+
+    memset(t, 0, sizeof(*t));
+
+    if ((fd = open(fn, O_RDONLY)) < 0) {
+        ERR("Error while opening %s: %s", fn, strerror(errno));
+        return -1;
+    }
+
+    if (fstat(fd, &st) < 0 || st.st_size < PCAP_HDR_LEN) {
+        ERR("%s is not a packet trace", fn);
+        close(fd);
+        return -1;
+    }
+
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        ERR("Error while mapping %s: %s", fn, strerror(errno));
+        return -1;
+    }
+    madvise(p, st.st_size, MADV_SEQUENTIAL);
+
+    t->data = p;
+    t->size = st.st_size;
+
+    memcpy(&magic, t->data, sizeof(magic));
+    if (magic == PCAP_MAGIC || magic == PCAP_MAGIC_NSEC) {
+        t->nsec = magic == PCAP_MAGIC_NSEC;
+    } else if (bswap_32(magic) == PCAP_MAGIC || bswap_32(magic) == PCAP_MAGIC_NSEC) {
+        t->swap = 1;
+        t->nsec = bswap_32(magic) == PCAP_MAGIC_NSEC;
+    } else if (magic == PCAPNG_SHB) {
+        t->pcapng = 1;
+    } else {
+        ERR("%s: Unsupported trace file format", fn);
+        trace_close(t);
+        return -1;
+    }
+
+    if (!t->pcapng) t->linktype = get32(t, 20) & 0x0fffffff;
+    trace_rewind(t);
+    return 0;
+}
+
+
+int
+trace_next(struct trace *t, const uint8_t **pkt, size_t *len, uint64_t *ts)
+{
+    if (t->pcapng) return next_pcapng(t, pkt, len, ts);
+    return next_pcap(t, pkt, len, ts);
+}
+
+
+void
+trace_rewind(struct trace *t)
+{
+    t->off = t->pcapng ? 0 : PCAP_HDR_LEN;
+}
+
+
+void
+trace_close(struct trace *t)
+{
+    if (t->data) munmap((void *)t->data, t->size);
+    t->data = NULL;
+}
@@ -0,0 +1,45 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Reader for packet traces in the pcap and pcapng formats. The file is
+ * memory-mapped and packets are returned in place, without copying.
+ * Link-layer headers (Ethernet, VLAN, Linux cooked capture, BSD
+ * loopback) are stripped so that the returned packets start with the
+ * IP header, like the packets read from a TUN interface. Non-IP packets
+ * are skipped. */
+
+struct trace {
+    const uint8_t *data;
+    size_t size;
+    size_t off;
+    int pcapng;        /* 1 for pcapng, 0 for pcap                     */
+    int swap;          /* The file has the opposite byte order         */
+    int nsec;          /* pcap timestamps are in nanoseconds           */
+    uint32_t linktype; /* pcap link type                               */
+
+    /* pcapng interfaces (link type and timestamp resolution) */
+    uint32_t nifs;
+    uint32_t if_linktype[16];
+    uint64_t if_tsdiv[16];
+
+    uint64_t skipped;  /* Non-IP or truncated packets skipped          */
+};
+
+/* Map the trace file fn and parse its header. Returns 0 on success and
+ * a negative number on error. */
+int trace_open(struct trace *t, const char *fn);
+
+/* Return the next IP packet in pkt and len and its timestamp (in ns
+ * since the Epoch) in ts. Returns 1 if a packet was found, 0 at the end
+ * of the trace and a negative number if the trace is malformed. */
+int trace_next(struct trace *t, const uint8_t **pkt, size_t *len, uint64_t *ts);
+
+/* Start again from the first packet. */
+void trace_rewind(struct trace *t);
+
+void trace_close(struct trace *t);
+
+#endif /* _TRACE_H_ */
@@ -0,0 +1,502 @@
+#define _GNU_SOURCE /* recvmmsg, sendmmsg, accept4 */
+#include "transport.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "log.h"
+#include "utils.h"
+
+/* Room for the frames of one UDP batch. A frame that does not fit into
+ * an empty staging buffer is sent on its own. */
+#define STAGE_SIZE (64 * 1024)
+
+
+/* Split "host:port", "[host]:port" or ":port" in place. The host is
+ * empty if not given. */
+static int
+split_hostport(char *str, char **host, char **port)
+{
+    char *p;
+
+    if (*str == '[') {
+        if ((p = strchr(str, ']')) == NULL || p[1] != ':') return -1;
+        *p = '\0';
+        *host = str + 1;
+        *port = p + 2;
+    } else {
+        if ((p = strrchr(str, ':')) == NULL) return -1;
+        *p = '\0';
+        *host = str;
+        *port = p + 1;
+    }
+    return **port ? 0 : -1;
+}
+
+
+/* Resolve an address for a socket of the given type and family
+ * (AF_UNSPEC for any). An empty host means the wildcard address. */
+static int
+resolve(char *hostport, int type, int family, struct sockaddr_storage *sa,
+        socklen_t *salen)
+{
+    struct addrinfo hints, *res;
+    char *host, *port;
+    int rv;
+
+    if (split_hostport(hostport, &host, &port) < 0) {
+        ERR("Invalid address '%s', expected host:port", hostport);
+        return -1;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = family;
+    hints.ai_socktype = type;
+    hints.ai_flags = AI_NUMERICSERV | (*host ? 0 : AI_PASSIVE);
+    if ((rv = getaddrinfo(*host ? host : NULL, port, &hints, &res)) != 0) {
+        ERR("Could not resolve %s:%s: %s", host, port, gai_strerror(rv));
+        return -1;
+    }
+    memcpy(sa, res->ai_addr, res->ai_addrlen);
+    *salen = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+
+static int
+unix_addr(const char *path, struct sockaddr_un *sa)
+{
+    memset(sa, 0, sizeof(*sa));
+    sa->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sa->sun_path)) {
+        ERR("Unix socket path %s too long", path);
+        return -1;
+    }
+    strcpy(sa->sun_path, path);
+    return 0;
+}
+
+
+static void
+nodelay(int fd)
+{
+    int on = 1;
+
+    /* Fails harmlessly on Unix sockets */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+
+/* Stream transports share their open code: connect or listen to a TCP
+ * address or a Unix socket path. */
+static int
+stream_open(struct transport *t, const struct sockaddr *sa, socklen_t salen, const char *addr)
+{
+    int fd, on = 1;
+
+    if ((fd = socket(sa->sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        ERR("socket: %s", strerror(errno));
+        return -1;
+    }
+
+    if (t->ops->listen) {
+        if (sa->sa_family != AF_UNIX)
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (bind(fd, sa, salen) < 0 || listen(fd, 1) < 0) {
+            ERR("Could not listen on %s: %s", addr, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        make_nonblocking(fd);
+        t->lfd = fd;
+        DBG("Listening on %s", addr);
+        return 0;
+    }
+
+    /* Like opening a serial port, connecting blocks */
+    if (connect(fd, sa, salen) < 0) {
+        ERR("Could not connect to %s: %s", addr, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    make_nonblocking(fd);
+    nodelay(fd);
+    t->fd = fd;
+    DBG("Connected to %s", addr);
+    return 0;
+}
+
+
+static int
+serial_open(struct transport *t, char *addr)
+{
+    if ((t->fd = open(addr, O_RDWR | O_NOCTTY | O_NONBLOCK | O_NDELAY)) < 0) {
+        ERR("Could not open serial port %s: %s", addr, strerror(errno));
+        return -1;
+    }
+    t->tty = isatty(t->fd);
+    DBG("Opened serial port %s", addr);
+    return 0;
+}
+
+
+static int
+tcp_open(struct transport *t, char *addr)
+{
+    struct sockaddr_storage sa;
+    socklen_t salen;
+
+    if (resolve(addr, SOCK_STREAM, AF_UNSPEC, &sa, &salen) < 0) return -1;
+    return stream_open(t, (struct sockaddr *)&sa, salen, addr);
+}
+
+
+static int
+unix_open(struct transport *t, char *addr)
+{
+    struct sockaddr_un sa;
+
+    if (unix_addr(addr, &sa) < 0) return -1;
+    /* A socket left behind by an earlier run would make bind fail */
+    if (t->ops->listen) unlink(addr);
+    if (stream_open(t, (struct sockaddr *)&sa, sizeof(sa), addr) < 0) return -1;
+    if (t->ops->listen) t->path = xstrdup(addr);
+    return 0;
+}
+
+
+static int
+stream_read(struct transport *t, struct pbuf **p, int n)
+{
+    ssize_t rv;
+
+    if (t->fd < 0) return 0;
+    rv = read(t->fd, p[0]->data, pbuf_room(p[0]));
+    if (rv < 0) return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    if (rv == 0) {
+        errno = ECONNRESET;
+        return -1;
+    }
+    p[0]->len = rv;
+    return 1;
+}
+
+
+static ssize_t
+stream_write(struct transport *t, const char *buf, size_t len)
+{
+    if (t->fd < 0) {
+        errno = ENOTCONN;
+        return -1;
+    }
+    return write(t->fd, buf, len);
+}
+
+
+static void
+udp_buffers(struct transport *t)
+{
+    t->msgs = xcalloc(TRANSPORT_BATCH, sizeof(*t->msgs));
+    t->iov = xcalloc(TRANSPORT_BATCH, sizeof(*t->iov));
+    t->stage = xmalloc(STAGE_SIZE);
+    t->rmsgs = xcalloc(TRANSPORT_BATCH, sizeof(*t->rmsgs));
+    t->riov = xcalloc(TRANSPORT_BATCH, sizeof(*t->riov));
+}
+
+
+/* A UDP transport is a connected socket, so that only datagrams from
+ * the peer are received and the plain stream functions could be used.
+ * The local port is the port of the peer unless given with bind=. */
+static int
+udp_open(struct transport *t, char *addr)
+{
+    struct sockaddr_storage sa, la;
+    socklen_t salen, lalen;
+    char *bind_addr, def[16];
+    int fd;
+
+    if ((bind_addr = strstr(addr, "?bind=")) != NULL) {
+        *bind_addr = '\0';
+        bind_addr += 6;
+    }
+    if (resolve(addr, SOCK_DGRAM, AF_UNSPEC, &sa, &salen) < 0) return -1;
+
+    if (bind_addr == NULL) {
+        snprintf(def, sizeof(def), ":%u", ntohs(sa.ss_family == AF_INET
+                                                ? ((struct sockaddr_in *)&sa)->sin_port
+                                                : ((struct sockaddr_in6 *)&sa)->sin6_port));
+        bind_addr = def;
+    }
+    if (resolve(bind_addr, SOCK_DGRAM, sa.ss_family, &la, &lalen) < 0) return -1;
+
+    if ((fd = socket(sa.ss_family, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0)) < 0) {
+        ERR("socket: %s", strerror(errno));
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&la, lalen) < 0
+        || connect(fd, (struct sockaddr *)&sa, salen) < 0) {
+        ERR("Could not set up UDP socket for %s: %s", addr, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    t->fd = fd;
+    udp_buffers(t);
+    DBG("UDP transport to %s", addr);
+    return 0;
+}
+
+
+/* ICMP errors from a peer that is not up yet are reported on the next
+ * call on a connected UDP socket, they are no reason to stop. */
+static int
+udp_transient(int err)
+{
+    return err == EAGAIN || err == EINTR || err == ECONNREFUSED
+        || err == ENOBUFS || err == EHOSTUNREACH || err == ENETUNREACH;
+}
+
+
+static int
+udp_read(struct transport *t, struct pbuf **p, int n)
+{
+    int i, rv;
+
+    for(i = 0; i < n; i++) {
+        t->riov[i].iov_base = p[i]->data;
+        t->riov[i].iov_len = pbuf_room(p[i]);
+        memset(&t->rmsgs[i].msg_hdr, 0, sizeof(t->rmsgs[i].msg_hdr));
+        t->rmsgs[i].msg_hdr.msg_iov = &t->riov[i];
+        t->rmsgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    if ((rv = recvmmsg(t->fd, t->rmsgs, n, MSG_DONTWAIT, NULL)) < 0)
+        return udp_transient(errno) ? 0 : -1;
+
+    for(i = 0; i < rv; i++)
+        p[i]->len = t->rmsgs[i].msg_len;
+    return rv;
+}
+
+
+static ssize_t
+udp_write(struct transport *t, const char *buf, size_t len)
+{
+    ssize_t rv;
+
+    /* A frame too large for a datagram is dropped like one that finds
+     * the socket buffer full, the link goes on */
+    if (len > STAGE_SIZE) {
+        rv = send(t->fd, buf, len, 0);
+        if (rv < 0 && errno == EMSGSIZE) DBG("Frame of %zu bytes too large for a datagram", len);
+        if (rv < 0 && (udp_transient(errno) || errno == EMSGSIZE)) errno = EAGAIN;
+        return rv;
+    }
+
+    if (t->nmsgs == TRANSPORT_BATCH || t->staged + len > STAGE_SIZE)
+        t->dropped += t->ops->flush(t);
+
+    memcpy(t->stage + t->staged, buf, len);
+    t->iov[t->nmsgs].iov_base = t->stage + t->staged;
+    t->iov[t->nmsgs].iov_len = len;
+    t->staged += len;
+    t->nmsgs++;
+    return len;
+}
+
+
+static int
+udp_flush(struct transport *t)
+{
+    int i, rv, sent = 0, dropped = 0;
+
+    for(i = 0; i < t->nmsgs; i++) {
+        memset(&t->msgs[i].msg_hdr, 0, sizeof(t->msgs[i].msg_hdr));
+        t->msgs[i].msg_hdr.msg_iov = &t->iov[i];
+        t->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    /* sendmmsg stops at the first datagram that cannot be sent. One
+     * that is too large is skipped, the rest of the batch goes on. */
+    while (sent < t->nmsgs) {
+        rv = sendmmsg(t->fd, t->msgs + sent, t->nmsgs - sent, MSG_DONTWAIT);
+        if (rv > 0) {
+            sent += rv;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EMSGSIZE) {
+            DBG("Frame of %zu bytes too large for a datagram", t->iov[sent].iov_len);
+            sent++;
+            dropped++;
+        } else {
+            if (!udp_transient(errno))
+                WRN("Error while sending UDP datagrams: %s", strerror(errno));
+            break;
+        }
+    }
+
+    rv = t->nmsgs - sent + dropped;
+    t->nmsgs = 0;
+    t->staged = 0;
+    return rv;
+}
+
+
+static const struct transport_ops transports[] = {
+    {"serial",      0, 0, serial_open, stream_read, stream_write, NULL},
+    {"udp",         0, 1, udp_open,    udp_read,    udp_write,    udp_flush},
+    {"tcp",         0, 0, tcp_open,    stream_read, stream_write, NULL},
+    {"tcp-listen",  1, 0, tcp_open,    stream_read, stream_write, NULL},
+    {"unix",        0, 0, unix_open,   stream_read, stream_write, NULL},
+    {"unix-listen", 1, 0, unix_open,   stream_read, stream_write, NULL}
+};
+
+
+/* A new transport for uri with its address in *addr, which the caller
+ * frees, or NULL if the scheme is not known */
+static struct transport *
+transport_new(const char *uri, char **addr)
+{
+    struct transport *t;
+    const char *sep;
+    size_t n;
+    int i;
+
+    t = xcalloc(1, sizeof(*t));
+    t->fd = t->lfd = -1;
+
+    /* A plain path is a serial port */
+    if ((sep = strstr(uri, "://")) == NULL) {
+        t->ops = &transports[0];
+        *addr = xstrdup(uri);
+        return t;
+    }
+
+    n = sep - uri;
+    for(i = 0; i < ARRAY_SIZE(transports); i++)
+        if (strlen(transports[i].scheme) == n && !strncmp(transports[i].scheme, uri, n))
+            break;
+    if (i == ARRAY_SIZE(transports)) {
+        ERR("Unknown transport in %s", uri);
+        xfree(t);
+        return NULL;
+    }
+    t->ops = &transports[i];
+    *addr = xstrdup(sep + 3);
+    return t;
+}
+
+
+struct transport *
+transport_open(const char *uri)
+{
+    struct transport *t;
+    char *addr;
+
+    if ((t = transport_new(uri, &addr)) == NULL) return NULL;
+
+    if (t->ops->open(t, addr) < 0) {
+        xfree(addr);
+        transport_close(t);
+        return NULL;
+    }
+    xfree(addr);
+    return t;
+}
+
+
+struct transport *
+transport_adopt(const char *uri, int fd, int lfd)
+{
+    struct transport *t;
+    char *addr;
+
+    if ((t = transport_new(uri, &addr)) == NULL) return NULL;
+
+    t->fd = fd;
+    t->lfd = lfd;
+    if (t->ops->open == serial_open) t->tty = isatty(fd);
+    if (t->ops->open == udp_open) udp_buffers(t);
+    if (t->ops->listen && t->ops->open == unix_open) t->path = addr;
+    else xfree(addr);
+    DBG("Took over transport %s", uri);
+    return t;
+}
+
+
+void
+transport_close(struct transport *t)
+{
+    if (t == NULL) return;
+    if (t->fd >= 0) close(t->fd);
+    if (t->lfd >= 0) close(t->lfd);
+    if (t->path) {
+        unlink(t->path);
+        xfree(t->path);
+    }
+    if (t->msgs) xfree(t->msgs);
+    if (t->iov) xfree(t->iov);
+    if (t->stage) xfree(t->stage);
+    if (t->rmsgs) xfree(t->rmsgs);
+    if (t->riov) xfree(t->riov);
+    xfree(t);
+}
+
+
+int
+transport_read(struct transport *t, struct pbuf **p, int n)
+{
+    if (n > TRANSPORT_BATCH) n = TRANSPORT_BATCH;
+    return t->ops->read(t, p, n);
+}
+
+
+ssize_t
+transport_write(struct transport *t, const char *buf, size_t len)
+{
+    return t->ops->write(t, buf, len);
+}
+
+
+int
+transport_flush(struct transport *t)
+{
+    int dropped = t->dropped;
+
+    if (t->ops->flush == NULL) return 0;
+    t->dropped = 0;
+    return t->nmsgs ? dropped + t->ops->flush(t) : dropped;
+}
+
+
+int
+transport_accept(struct transport *t)
+{
+    int fd;
+
+    if ((fd = accept4(t->lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0) {
+        if (errno != EAGAIN && errno != EINTR)
+            WRN("accept: %s", strerror(errno));
+        return -1;
+    }
+    transport_hangup(t);
+    nodelay(fd);
+    t->fd = fd;
+    return 0;
+}
+
+
+void
+transport_hangup(struct transport *t)
+{
+    if (t->fd < 0 || t->lfd < 0) return;
+    close(t->fd);
+    t->fd = -1;
+}
@@ -0,0 +1,98 @@
+#ifndef _TRANSPORT_H_
+#define _TRANSPORT_H_
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "pbuf.h"
+
+/* The most buffers filled by one call to transport_read and the most
+ * datagrams sent together by a UDP transport. */
+#define TRANSPORT_BATCH 32
+
+/* A transport carries the framed and compressed link. All transports
+ * share the framing (HDLC or COBS), a transport only moves bytes. A
+ * transport is selected by an URI:
+ *
+ *   /dev/ttyUSB0, serial:///dev/ttyUSB0  Serial port
+ *   udp://host:port[?bind=[host]:port]   UDP, one frame per datagram.
+ *                                        The local port is the remote
+ *                                        port by default.
+ *   tcp://host:port                      TCP client
+ *   tcp-listen://[host]:port             TCP server, one peer at a time
+ *   unix:///path                         Unix stream socket client
+ *   unix-listen:///path                  Unix stream socket server
+ *
+ * IPv6 addresses are given in brackets, e.g., udp://[fd00::1]:5000. A
+ * listening transport has no data file descriptor until a peer has
+ * connected, see transport_accept. */
+struct transport;
+
+struct transport_ops {
+    const char *scheme;
+    int     listen;
+    int     dgram;  /* One buffer per datagram, see transport_read */
+    int     (*open)(struct transport *t, char *addr);
+    int     (*read)(struct transport *t, struct pbuf **p, int n);
+    ssize_t (*write)(struct transport *t, const char *buf, size_t len);
+    int     (*flush)(struct transport *t); /* NULL if writes are not batched */
+};
+
+struct transport {
+    const struct transport_ops *ops;
+    int    fd;   /* Data, -1 while a listening transport has no peer */
+    int    lfd;  /* Listening socket or -1                          */
+    int    tty;  /* fd is a tty that needs to be configured         */
+    char  *path; /* Unix socket to remove when the transport closes */
+
+    /* Frames written to a UDP transport are copied to the staging
+     * buffer and sent with a single sendmmsg on flush. Reads have their
+     * own headers, in pipeline mode the rx and tx sides run in
+     * different threads. */
+    struct mmsghdr *msgs;
+    struct iovec   *iov;
+    char  *stage;
+    size_t staged;
+    int    nmsgs;
+    int    dropped; /* Not sent when the staging buffer ran full */
+    struct mmsghdr *rmsgs;
+    struct iovec   *riov;
+};
+
+/* Open the transport given by uri. Returns NULL on error. */
+struct transport *transport_open(const char *uri);
+
+/* A transport for uri on file descriptors that are already open and
+ * set up, handed over by an earlier process (see handover.h): fd for
+ * data and lfd for a listening transport, each -1 if there is none.
+ * The address in uri is not resolved. Returns NULL if the scheme is not
+ * known. */
+struct transport *transport_adopt(const char *uri, int fd, int lfd);
+
+void transport_close(struct transport *t);
+
+/* Read into up to n (at most TRANSPORT_BATCH) empty buffers. Stream
+ * transports fill one buffer with whatever is available, a UDP
+ * transport fills one buffer per datagram. Returns the number of
+ * buffers filled, 0 if there was nothing to read and -1 on error,
+ * including the end of the stream. The buffers that were not filled
+ * are left alone. */
+int transport_read(struct transport *t, struct pbuf **p, int n);
+
+/* Write a frame. Returns the number of bytes written or queued, or -1
+ * with errno set, ENOTCONN if a listening transport has no peer. */
+ssize_t transport_write(struct transport *t, const char *buf, size_t len);
+
+/* Send the frames queued by transport_write. Returns the number of
+ * frames that could not be sent, including those that transport_write
+ * had to send early since the last flush. */
+int transport_flush(struct transport *t);
+
+/* Accept a connection on a listening transport. A new peer replaces
+ * the current one. Returns 0 if a peer was accepted and -1 otherwise. */
+int transport_accept(struct transport *t);
+
+/* Drop the peer of a listening transport, e.g., after it went away. */
+void transport_hangup(struct transport *t);
+
+#endif /* _TRANSPORT_H_ */
@@ -0,0 +1,375 @@
+#include "txq.h"
+#include <string.h>
+#include <netinet/in.h>
+#include <linux/if_ether.h>
+
+#include "utils.h"
+#include "handover.h"
+#include "eth.h"
+#include "ip.h"
+
+
+/* Limits on the limit: the bytes sent in MIN_DRAIN seconds, but at least
+ * MIN_BYTES, and the bytes sent in MAX_DRAIN seconds, but at most
+ * MAX_BYTES (the size of the tty output buffer). A new queue starts
+ * with the bytes sent in INITIAL_DRAIN seconds. */
+#define MIN_DRAIN     0.001
+#define MIN_BYTES     32
+#define MAX_DRAIN     0.5
+#define MAX_BYTES     2048
+#define INITIAL_DRAIN 0.01
+
+/* The limit shrinks at most once per interval (ns) */
+#define INTERVAL      1000000000ULL
+
+/* Expedited forwarding, CS5 and up: voice and network control */
+#define DSCP_HIGH     40
+/* Lower effort (RFC 8622) and CS1 */
+#define DSCP_LE       1
+#define DSCP_CS1      8
+
+/* TCP flags and options */
+#define TCP_ACK       0x10
+#define TCPOPT_EOL    0
+#define TCPOPT_NOP    1
+#define TCPOPT_TS     8
+
+/* One FIFO per class. The classes share TXQ_LEN packets between them,
+ * so every FIFO has room for all of them. */
+struct fifo {
+    struct pbuf *pkt[TXQ_LEN];
+    unsigned int head;
+    unsigned int count;
+};
+
+/* What the ACK filter needs to know about a pure ACK */
+struct ack {
+    struct ip_info ip;
+    uint16_t sport;
+    uint16_t dport;
+    uint32_t ack;
+    int      plain;  /* Nothing but ACK, window and timestamp */
+};
+
+struct txq {
+    struct fifo  fifo[TXQ_CLASSES];
+    unsigned int count;
+    int          flags;
+    struct stats *stats;
+
+    int      limit;     /* Bytes allowed in the tty output queue  */
+    int      min_limit;
+    int      max_limit;
+    int      slack;     /* Smallest slack seen in this interval   */
+    uint64_t start;     /* Start of the interval, 0 before refill */
+};
+
+
+static int
+clamp(const struct txq *q, int limit)
+{
+    if (limit < q->min_limit) return q->min_limit;
+    if (limit > q->max_limit) return q->max_limit;
+    return limit;
+}
+
+
+struct txq *
+txq_new(int rate, int flags, struct stats *stats)
+{
+    struct txq *q;
+
+    q = xcalloc(1, sizeof(*q));
+    q->flags = flags;
+    q->stats = stats;
+    txq_set_rate(q, rate);
+    q->limit = clamp(q, rate * INITIAL_DRAIN);
+    q->slack = q->max_limit;
+    return q;
+}
+
+
+void
+txq_free(struct txq *q)
+{
+    struct pbuf *p;
+
+    if (q == NULL) return;
+    while ((p = txq_pop(q)) != NULL)
+        pbuf_free(p);
+    xfree(q);
+}
+
+
+void
+txq_set_rate(struct txq *q, int rate)
+{
+    q->min_limit = rate * MIN_DRAIN;
+    if (q->min_limit < MIN_BYTES) q->min_limit = MIN_BYTES;
+    q->max_limit = rate * MAX_DRAIN;
+    if (q->max_limit > MAX_BYTES) q->max_limit = MAX_BYTES;
+    if (q->max_limit < q->min_limit) q->max_limit = q->min_limit;
+    q->limit = clamp(q, q->limit);
+}
+
+
+/* The IP packet in p, after the Ethernet header in TAP mode, or NULL
+ * if an Ethernet frame does not carry IP */
+static const uint8_t *
+packet(const struct pbuf *p, int eth, size_t *len)
+{
+    const uint8_t *ip = (const uint8_t *)p->data;
+
+    *len = p->len;
+    if (!eth) return ip;
+    if (*len < ETH_HDR_LEN) return NULL;
+    switch((ip[12] << 8) | ip[13]) {
+    case ETH_P_IP:
+    case ETH_P_IPV6:
+        *len -= ETH_HDR_LEN;
+        return ip + ETH_HDR_LEN;
+    }
+    return NULL;
+}
+
+
+int
+txq_class(const struct pbuf *p, int eth)
+{
+    const uint8_t *ip;
+    size_t len;
+    int dscp;
+
+    if ((ip = packet(p, eth, &len)) == NULL || len < 2) return 1;
+
+    switch(ip[0] >> 4) {
+    case 4: dscp = ip[1] >> 2; break;
+    case 6: dscp = ((ip[0] & 0x0f) << 2) | (ip[1] >> 6); break;
+    default: return 1;
+    }
+
+    if (dscp >= DSCP_HIGH) return 0;
+    if (dscp == DSCP_LE || dscp == DSCP_CS1) return 2;
+    return 1;
+}
+
+
+/* Whether p is a TCP segment without payload with only the ACK flag
+ * set. A plain ACK carries no TCP options other than timestamps. The
+ * length of the payload is taken from the IP header, an Ethernet frame
+ * may have been padded. */
+static int
+parse_ack(const struct txq *q, const struct pbuf *p, struct ack *a)
+{
+    const uint8_t *ip, *th;
+    size_t len, tlen, doff, i;
+
+    if ((ip = packet(p, q->flags & TXQ_ETH, &len)) == NULL) return 0;
+    if (ip_parse(ip, len, &a->ip) < 0 || a->ip.proto != IPPROTO_TCP || a->ip.fragment)
+        return 0;
+
+    if (a->ip.version == 4) tlen = (ip[2] << 8 | ip[3]);
+    else tlen = 40 + (ip[4] << 8 | ip[5]);
+    if (tlen > len || tlen < a->ip.hlen + 20) return 0;
+
+    th = ip + a->ip.hlen;
+    doff = (th[12] >> 4) * 4;
+    if (th[13] != TCP_ACK || doff < 20 || a->ip.hlen + doff != tlen) return 0;
+
+    a->sport = th[0] << 8 | th[1];
+    a->dport = th[2] << 8 | th[3];
+    a->ack = (uint32_t)th[8] << 24 | th[9] << 16 | th[10] << 8 | th[11];
+
+    a->plain = 1;
+    for(i = 20; i < doff && th[i] != TCPOPT_EOL; ) {
+        if (th[i] == TCPOPT_NOP) {
+            i++;
+            continue;
+        }
+        if (th[i] != TCPOPT_TS || i + 1 >= doff || th[i + 1] < 2) {
+            a->plain = 0;
+            break;
+        }
+        i += th[i + 1];
+    }
+    return 1;
+}
+
+
+static int
+same_flow(const struct ack *a, const struct ack *b)
+{
+    size_t alen = a->ip.version == 4 ? 4 : 16;
+
+    return a->ip.version == b->ip.version
+        && a->sport == b->sport && a->dport == b->dport
+        && !memcmp(a->ip.src, b->ip.src, alen)
+        && !memcmp(a->ip.dst, b->ip.dst, alen);
+}
+
+
+/* Put the pure ACK p in the place of an older plain ACK of the same flow
+ * in the FIFO that it makes redundant. Returns 1 if it did. */
+static int
+filter_ack(struct txq *q, struct fifo *f, struct pbuf *p)
+{
+    struct ack new, old;
+    unsigned int i, k;
+
+    if (!parse_ack(q, p, &new)) return 0;
+
+    for(i = 0; i < f->count; i++) {
+        k = (f->head + i) % TXQ_LEN;
+        if (!parse_ack(q, f->pkt[k], &old) || !old.plain || !same_flow(&new, &old))
+            continue;
+        if ((int32_t)(new.ack - old.ack) <= 0) continue;
+
+        /* The older ACK waited longest, its successor goes out in its
+         * place */
+        pbuf_free(f->pkt[k]);
+        f->pkt[k] = p;
+        q->stats->tx.acks_filtered++;
+        return 1;
+    }
+    return 0;
+}
+
+
+struct pbuf *
+txq_push(struct txq *q, struct pbuf *p, int cls)
+{
+    struct fifo *f;
+    struct pbuf *drop = NULL;
+    int i;
+
+    if ((q->flags & TXQ_ACK_FILTER) && filter_ack(q, &q->fifo[cls], p))
+        return NULL;
+
+    if (q->count == TXQ_LEN) {
+        for(i = TXQ_CLASSES - 1; i > cls && q->fifo[i].count == 0; i--);
+        if (i == cls) return p;
+        f = &q->fifo[i];
+        f->count--;
+        drop = f->pkt[(f->head + f->count) % TXQ_LEN];
+        q->count--;
+    }
+
+    f = &q->fifo[cls];
+    f->pkt[(f->head + f->count) % TXQ_LEN] = p;
+    f->count++;
+    q->count++;
+    return drop;
+}
+
+
+struct pbuf *
+txq_pop(struct txq *q)
+{
+    struct fifo *f;
+    struct pbuf *p;
+    int i;
+
+    for(i = 0; i < TXQ_CLASSES; i++) {
+        f = &q->fifo[i];
+        if (f->count == 0) continue;
+        p = f->pkt[f->head];
+        f->head = (f->head + 1) % TXQ_LEN;
+        f->count--;
+        q->count--;
+        return p;
+    }
+    return NULL;
+}
+
+
+unsigned int
+txq_len(const struct txq *q)
+{
+    return q->count;
+}
+
+
+int
+txq_room(const struct txq *q, int outq)
+{
+    return outq < q->limit;
+}
+
+
+int
+txq_low(const struct txq *q)
+{
+    return q->limit / 2;
+}
+
+
+/* The output queue is expected to hold txq_low bytes when the link
+ * comes back. If it is empty, the link came back too late and the
+ * limit grows by half. What is left over (the slack) could have been
+ * held back, at the end of each interval the limit gives up half of
+ * the smallest slack of the interval. */
+void
+txq_refill(struct txq *q, int outq, uint64_t now)
+{
+    if (q->start == 0) q->start = now;
+
+    if (outq == 0) {
+        q->limit = clamp(q, q->limit + q->limit / 2);
+        q->slack = q->max_limit;
+        q->start = now;
+        return;
+    }
+
+    if (outq < q->slack) q->slack = outq;
+    if (now - q->start < INTERVAL) return;
+
+    q->limit = clamp(q, q->limit - q->slack / 2);
+    q->slack = q->max_limit;
+    q->start = now;
+}
+
+
+void
+txq_save(const struct txq *q, sbuf *b)
+{
+    const struct fifo *f;
+    unsigned int i;
+    int c;
+
+    HANDOVER_PUT(b, q->limit);
+    HANDOVER_PUT(b, q->slack);
+    HANDOVER_PUT(b, q->start);
+    for(c = 0; c < TXQ_CLASSES; c++) {
+        f = &q->fifo[c];
+        HANDOVER_PUT(b, f->count);
+        for(i = 0; i < f->count; i++)
+            handover_put_pbuf(b, f->pkt[(f->head + i) % TXQ_LEN]);
+    }
+}
+
+
+int
+txq_load(struct txq *q, str *s, struct pbuf_pool *pool)
+{
+    struct fifo *f;
+    struct pbuf *p;
+    unsigned int i, n;
+    int c;
+
+    if (HANDOVER_GET(s, q->limit) < 0 || HANDOVER_GET(s, q->slack) < 0
+        || HANDOVER_GET(s, q->start) < 0)
+        return -1;
+    q->limit = clamp(q, q->limit);
+
+    /* Packets restored before an error are released by txq_free */
+    for(c = 0; c < TXQ_CLASSES; c++) {
+        f = &q->fifo[c];
+        if (HANDOVER_GET(s, n) < 0 || q->count + n > TXQ_LEN) return -1;
+        for(i = 0; i < n; i++) {
+            if (handover_get_pbuf(s, pool, &p) < 0 || p == NULL) return -1;
+            f->pkt[(f->head + f->count++) % TXQ_LEN] = p;
+            q->count++;
+        }
+    }
+    return 0;
+}
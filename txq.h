@@ -0,0 +1,95 @@
+#ifndef _TXQ_H_
+#define _TXQ_H_
+
+#include <stdint.h>
+
+#include "stats.h"
+#include "pbuf.h"
+#include "str.h"
+
+/* Priority classes, highest first, see txq_class */
+#define TXQ_CLASSES 3
+
+/* The most packets a queue holds */
+#define TXQ_LEN     64
+
+/* Flags of txq_new */
+#define TXQ_ETH        0x01 /* Packets start with an Ethernet header */
+#define TXQ_ACK_FILTER 0x02 /* Thin out TCP ACKs, see txq_push       */
+
+/* Byte queue limits for serial ports. Whatever is written to a tty sits
+ * in the tty output queue until the UART gets to it, where it can no
+ * longer be reordered. A transmit queue in front of the port hands over
+ * only as many bytes as it takes to keep the UART busy and holds back
+ * the rest, so that packets of a higher priority class overtake those
+ * of a lower class. Packets are queued before compression, they are
+ * compressed in the order in which they leave the queue.
+ *
+ * The number of bytes allowed in the tty output queue (the limit)
+ * adapts in the style of the Linux byte queue limits: the link waits
+ * until the output queue has drained to half the limit before it
+ * writes again. If the output queue turns out to be empty by then, the
+ * UART ran dry and the limit grows. Otherwise, the limit shrinks by the
+ * smallest number of bytes left in the output queue (the slack) over
+ * an interval. */
+struct txq;
+
+/* A new transmit queue for a serial port that sends rate bytes per
+ * second. ACKs filtered out are counted in the statistics. */
+struct txq *txq_new(int rate, int flags, struct stats *stats);
+
+/* Release the queue and drop the packets in it. */
+void txq_free(struct txq *q);
+
+/* The byte rate of the port changed. */
+void txq_set_rate(struct txq *q, int rate);
+
+/* The priority class of a packet, from the DSCP in its IP header: 0 for
+ * expedited forwarding and network control (DSCP 40 and up), 2 for
+ * lower effort and CS1, 1 for everything else. In TAP mode (eth set),
+ * the packet starts with an Ethernet header. */
+int txq_class(const struct pbuf *p, int eth);
+
+/* Queue a packet of the given class. If the queue is full, the most
+ * recent packet of the lowest class is dropped, which may be p itself.
+ * Returns the dropped packet, or NULL.
+ *
+ * With the ACK filter, a pure TCP ACK takes the place of a pure ACK of
+ * the same flow still in the queue whose acknowledgement number it
+ * covers, and the older ACK is dropped, so that a bulk transfer in the
+ * other direction does not fill the link with ACKs. ACKs that carry
+ * anything besides the acknowledgement number, the window and a
+ * timestamp, such as SACK blocks or ECN flags, and duplicate ACKs are
+ * never dropped. */
+struct pbuf *txq_push(struct txq *q, struct pbuf *p, int cls);
+
+/* Take the next packet of the highest class off the queue, or NULL if
+ * the queue is empty. */
+struct pbuf *txq_pop(struct txq *q);
+
+/* The number of packets in the queue */
+unsigned int txq_len(const struct txq *q);
+
+/* Whether another frame may be written to a tty output queue that
+ * holds outq bytes */
+int txq_room(const struct txq *q, int outq);
+
+/* The number of bytes the tty output queue drains down to before the
+ * link writes again */
+int txq_low(const struct txq *q);
+
+/* The link came back to write after the tty output queue had drained
+ * down to txq_low, and found outq bytes in it at time now (see
+ * now_ns). Adjusts the limit. */
+void txq_refill(struct txq *q, int outq, uint64_t now);
+
+/* Save the packets in the queue and the limit for a hitless upgrade,
+ * see handover.h. */
+void txq_save(const struct txq *q, sbuf *b);
+
+/* Restore the state saved with txq_save into an empty queue. The
+ * packets go into buffers from pool. Returns 0 on success and -1 if
+ * the state is malformed. */
+int txq_load(struct txq *q, str *s, struct pbuf_pool *pool);
+
+#endif /* _TXQ_H_ */
@@ -142,6 +142,15 @@ now(void)
 }
 
 
+uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
 void *
 xcalloc(size_t nmemb, size_t size)
 {
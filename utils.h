@@ -25,6 +25,10 @@ typedef int64_t smtime;
 
 smtime now (void);
 
+/* Monotonic time in nanoseconds. The value is only useful for measuring
+ * time intervals, it has no relation to the wall clock time. */
+uint64_t now_ns(void);
+
 
 /* Read a line terminated by LF from the file descriptor fd into the buffer
  * 'dst' provided by the caller. The resulting string will contain the